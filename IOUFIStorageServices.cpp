@@ -52,13 +52,14 @@
 // plus 4 retries.
 #define kNumberRetries              4
 
-// Default I/O size values.
+// Default I/O size values. The device splits requests into commands it can
+// take, so these only bound how much one request ties up.
 enum
 {
-    kMaximumBlockCountRead      = 128,
-    kMaximumBlockCountWrite     = 128,
-    kMaximumByteCountRead       = 65536,
-    kMaximumByteCountWrite      = 65536
+    kMaximumBlockCountRead      = 2048,
+    kMaximumBlockCountWrite     = 2048,
+    kMaximumByteCountRead       = 1048576,
+    kMaximumByteCountWrite      = 1048576
 };
 
 // Structure for the asynch client data
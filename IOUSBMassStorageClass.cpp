@@ -32,12 +32,18 @@
 // Local includes
 #include "IOUSBMassStorageClass.h"
 #include "IOUSBMassStorageClassTimestamps.h"
+#include "IOUSBMassStorageClassUAS.h"
 #include "Debugging.h"
 
 // IOKit includes
 #include <IOKit/scsi/IOSCSIPeripheralDeviceNub.h>
+#include <IOKit/scsi/SCSICommandOperationCodes.h>
 #include <IOKit/IODeviceTreeSupport.h>
 #include <IOKit/IOKitKeys.h>
+#include <IOKit/IOSubMemoryDescriptor.h>
+
+// Kernel includes
+#include <kern/clock.h>
 
 //--------------------------------------------------------------------------------------------------
 //	Defines
@@ -66,6 +72,15 @@ enum
 	kMaxConsecutiveResets					=	5
 };
 
+// Storage for the latency histograms and the flight recorder, which is kept out of
+// ExpansionData so that the public header need not include the private definitions.
+struct USBMassStorageDiagnostics
+{
+	UInt32					latencyHistograms[kUSBLatencyPhaseCount][kUSBLatencyHistogramBuckets];
+	USBFlightRecord			flightRecords[kUSBFlightRecorderDepth];
+	UInt32					flightRecordCount;
+};
+
 
 //--------------------------------------------------------------------------------------------------
 //	Macros
@@ -98,9 +113,58 @@ class USBMassStorageClassGlobals
 
 
 UInt32								gUSBDebugFlags = 0; // Externally defined in IOUSBMassStorageClass.h
+UInt32								gUSBTraceCategories = 0;
+uintptr_t							gUSBTraceFilter = 0;
+
+// gUSBTraceCategories is this mask while gUSBDebugFlags is nonzero.
+static UInt32						gUSBTraceCategoryMask = kUSBTraceCategoryDefault;
+
+// Device picked with kUSBTraceFilterLocationID. gUSBTraceFilter is set to it when it starts,
+// and to kUSBTraceFilterNoDriver until then, which matches no driver.
+static UInt32						gUSBTraceFilterLocationID = 0;
+
+enum
+{
+	kUSBTraceFilterNoDriver				= 1
+};
+
+// Tuned maximum byte counts, keyed by "VID:PID:speed:serial", so a device which is unplugged and
+// plugged back in does not have to be measured again.
+static OSDictionary *				gAutoTuneResults = NULL;
+static IOLock *						gAutoTuneLock = NULL;
+
+// Started instances, looked up by index from the debug sysctl. An instance stays in the
+// table until free(), so it can be used while gInstanceLock is held.
+enum
+{
+	kMaxSysctlInstances					= 32
+};
+
+static IOUSBMassStorageClass *		gInstances[kMaxSysctlInstances];
+static IOLock *						gInstanceLock = NULL;
+
+// Keys of the Statistics dictionary, indexed by the kIOUSBMassStorageStatistic constants.
+static const char *					gStatisticKeys[kIOUSBMassStorageStatisticCount] =
+{
+	"Operations",
+	"Bytes Transferred",
+	"Queue Full Rejections",
+	"Endpoint Stalls",
+	"Class Resets",
+	"Device Resets",
+	"CSW Errors",
+	"Reconfiguration Latency (us)"
+};
+
 static USBMassStorageClassGlobals 	gUSBGlobals;
 
 static int USBMassStorageClassSysctl ( struct sysctl_oid * oidp, void * arg1, int arg2, struct sysctl_req * req );
+static int USBMassStorageClassInstanceSysctl ( USBSysctlArgs * usbArgs, struct sysctl_req * req );
+static int USBMassStorageClassTraceFilterSysctl ( USBSysctlArgs * usbArgs );
+static IOUSBMassStorageClass * FindSysctlInstance ( UInt32 instance, UInt32 * count );
+static void UpdateTraceCategories ( void );
+static void RegisterSysctlInstance ( IOUSBMassStorageClass * instance );
+static void UnregisterSysctlInstance ( IOUSBMassStorageClass * instance );
 SYSCTL_PROC ( _debug, OID_AUTO, USBMassStorageClass, CTLFLAG_RW, 0, 0, USBMassStorageClassSysctl, "USBMassStorageClass", "USBMassStorageClass debug interface" );
 
 
@@ -114,6 +178,8 @@ USBMassStorageClassSysctl ( struct sysctl_oid * oidp, void * arg1, int arg2, str
 	
 	int				error = 0;
 	USBSysctlArgs	usbArgs;
+	UInt32			count = 0;
+	UInt32			index;
 	
 	UNUSED ( oidp );
 	UNUSED ( arg1 );
@@ -121,21 +187,84 @@ USBMassStorageClassSysctl ( struct sysctl_oid * oidp, void * arg1, int arg2, str
 	
 	STATUS_LOG ( ( 1, "+USBMassStorageClassGlobals: gUSBDebugFlags = 0x%08X\n", ( unsigned int ) gUSBDebugFlags ) );
 	
-	error = SYSCTL_IN ( req, &usbArgs, sizeof ( usbArgs ) );
+	// Older tools pass, and expect back, only the fields ahead of instance.
+	bzero ( &usbArgs, sizeof ( usbArgs ) );
+	error = SYSCTL_IN ( req, &usbArgs, ( req->newlen < sizeof ( usbArgs ) ) ? req->newlen : sizeof ( usbArgs ) );
 	if ( ( error == 0 ) && ( usbArgs.type == kUSBTypeDebug ) )
 	{
 		
 		if ( usbArgs.operation == kUSBOperationGetFlags )
 		{
 			
-			usbArgs.debugFlags = gUSBDebugFlags;
-			error = SYSCTL_OUT ( req, &usbArgs, sizeof ( usbArgs ) );
+			usbArgs.debugFlags 		= gUSBDebugFlags;
+			usbArgs.traceCategories	= gUSBTraceCategoryMask;
+			usbArgs.locationID		= gUSBTraceFilterLocationID;
+			
+			if ( gUSBTraceFilterLocationID != 0 )
+			{
+				usbArgs.traceFilter = kUSBTraceFilterLocationID;
+			}
+			
+			else if ( gUSBTraceFilter != 0 )
+			{
+				
+				usbArgs.traceFilter = kUSBTraceFilterInstance;
+				
+				// Return the index kUSBOperationSetTraceFilter takes, so a tool can put the filter back.
+				if ( gInstanceLock != NULL )
+				{
+					
+					IOLockLock ( gInstanceLock );
+					
+					for ( index = 0; index < kMaxSysctlInstances; index++ )
+					{
+						
+						if ( gInstances[index] == NULL )
+						{
+							continue;
+						}
+						
+						if ( ( uintptr_t ) gInstances[index] == gUSBTraceFilter )
+						{
+							
+							usbArgs.instance = count;
+							break;
+							
+						}
+						
+						count++;
+						
+					}
+					
+					IOLockUnlock ( gInstanceLock );
+					
+				}
+				
+			}
+			
+			error = SYSCTL_OUT ( req, &usbArgs,
+								 ( ( req->oldptr != USER_ADDR_NULL ) && ( req->oldlen < sizeof ( usbArgs ) ) ) ? req->oldlen : sizeof ( usbArgs ) );
 			
 		}
 		
 		else if ( usbArgs.operation == kUSBOperationSetFlags )
 		{
-			gUSBDebugFlags = usbArgs.debugFlags;			
+			
+			gUSBDebugFlags = usbArgs.debugFlags;
+			UpdateTraceCategories ( );
+			
+		}
+		
+		else if ( usbArgs.operation == kUSBOperationSetTraceFilter )
+		{
+			error = USBMassStorageClassTraceFilterSysctl ( &usbArgs );
+		}
+		
+		else if ( ( usbArgs.operation == kUSBOperationGetLatencyHistograms ) ||
+				  ( usbArgs.operation == kUSBOperationResetLatencyHistograms ) ||
+				  ( usbArgs.operation == kUSBOperationGetFlightRecorder ) )
+		{
+			error = USBMassStorageClassInstanceSysctl ( &usbArgs, req );
 		}
 		
 	}
@@ -148,129 +277,509 @@ USBMassStorageClassSysctl ( struct sysctl_oid * oidp, void * arg1, int arg2, str
 
 
 //--------------------------------------------------------------------------------------------------
-//	USBMassStorageClassGlobals - Default Constructor				   						[PUBLIC]
+//	USBMassStorageClassInstanceSysctl - Runs the per device operations on the instance at
+//										usbArgs->instance.							[STATIC]
 //--------------------------------------------------------------------------------------------------
 
-USBMassStorageClassGlobals::USBMassStorageClassGlobals ( void )
+static int
+USBMassStorageClassInstanceSysctl ( USBSysctlArgs * usbArgs, struct sysctl_req * req )
 {
 	
-	int		debugFlags;
+	USBLatencyHistograms *		histograms	= NULL;
+	USBFlightRecorder *			recorder	= NULL;
+	IOUSBMassStorageClass *		instance	= NULL;
+	UInt32						count		= 0;
+	int							error		= ENOENT;
 	
-	STATUS_LOG ( ( 1, "+USBMassStorageClassGlobals::USBMassStorageClassGlobals\n" ) );
+	require_action ( ( gInstanceLock != NULL ), Exit, error = ENXIO );
 	
-	if ( PE_parse_boot_argn ( "USB-MassStorage", &debugFlags, sizeof ( debugFlags ) ) )
+	// Both copies are too large for the kernel stack.
+	if ( usbArgs->operation == kUSBOperationGetLatencyHistograms )
 	{
-		gUSBDebugFlags = debugFlags;
+		
+		histograms = ( USBLatencyHistograms * ) IOMalloc ( sizeof ( USBLatencyHistograms ) );
+		require_action ( ( histograms != NULL ), Exit, error = ENOMEM );
+		bzero ( histograms, sizeof ( USBLatencyHistograms ) );
+		
 	}
 	
-	// Register our sysctl interface
-	sysctl_register_oid ( &sysctl__debug_USBMassStorageClass );
+	else if ( usbArgs->operation == kUSBOperationGetFlightRecorder )
+	{
+		
+		recorder = ( USBFlightRecorder * ) IOMalloc ( sizeof ( USBFlightRecorder ) );
+		require_action ( ( recorder != NULL ), Exit, error = ENOMEM );
+		bzero ( recorder, sizeof ( USBFlightRecorder ) );
+		
+	}
+	
+	IOLockLock ( gInstanceLock );
+	
+	instance = FindSysctlInstance ( usbArgs->instance, &count );
+	if ( instance != NULL )
+	{
+		
+		if ( usbArgs->operation == kUSBOperationResetLatencyHistograms )
+		{
+			instance->ResetLatencyHistograms ( );
+		}
+		
+		else if ( usbArgs->operation == kUSBOperationGetFlightRecorder )
+		{
+			instance->CopyFlightRecorder ( recorder );
+		}
+		
+		else if ( usbArgs->operation == kUSBOperationGetLatencyHistograms )
+		{
+			instance->CopyLatencyHistograms ( histograms );
+		}
+		
+	}
+	
+	IOLockUnlock ( gInstanceLock );
+	
+	// The count is returned even for an index past the end, so callers can find out how
+	// many devices there are.
+	if ( usbArgs->operation == kUSBOperationGetLatencyHistograms )
+	{
+		
+		histograms->instance		= usbArgs->instance;
+		histograms->instanceCount	= count;
+		error = SYSCTL_OUT ( req, histograms, sizeof ( USBLatencyHistograms ) );
+		
+	}
+	
+	else if ( usbArgs->operation == kUSBOperationGetFlightRecorder )
+	{
+		
+		recorder->instance		= usbArgs->instance;
+		recorder->instanceCount	= count;
+		error = SYSCTL_OUT ( req, recorder, sizeof ( USBFlightRecorder ) );
+		
+	}
+	
+	else if ( instance != NULL )
+	{
+		error = 0;
+	}
 	
-	STATUS_LOG ( ( 1, "-USBMassStorageClassGlobals::USBMassStorageClassGlobals\n" ) );
+	
+Exit:
+	
+	
+	if ( histograms != NULL )
+	{
+		IOFree ( histograms, sizeof ( USBLatencyHistograms ) );
+	}
+	
+	if ( recorder != NULL )
+	{
+		IOFree ( recorder, sizeof ( USBFlightRecorder ) );
+	}
+	
+	return error;
 	
 }
 
 
 //--------------------------------------------------------------------------------------------------
-//	USBMassStorageClassGlobals - Destructor							   						[PUBLIC]
+//	USBMassStorageClassTraceFilterSysctl - Sets the traced categories, and which devices
+//										   are traced.								[STATIC]
 //--------------------------------------------------------------------------------------------------
 
-USBMassStorageClassGlobals::~USBMassStorageClassGlobals ( void )
+static int
+USBMassStorageClassTraceFilterSysctl ( USBSysctlArgs * usbArgs )
 {
 	
-	STATUS_LOG ( ( 1, "+~USBMassStorageClassGlobals::USBMassStorageClassGlobals\n" ) );
+	IOUSBMassStorageClass *		instance	= NULL;
+	UInt32						count		= 0;
+	UInt32						index;
+	int							error		= 0;
 	
-	// Unregister our sysctl interface
-	sysctl_unregister_oid ( &sysctl__debug_USBMassStorageClass );
+	require_action ( ( gInstanceLock != NULL ), Exit, error = ENXIO );
 	
-	STATUS_LOG ( ( 1, "-~USBMassStorageClassGlobals::USBMassStorageClassGlobals\n" ) );
+	IOLockLock ( gInstanceLock );
+	
+	switch ( usbArgs->traceFilter )
+	{
+		
+		case kUSBTraceFilterNone:
+		{
+			
+			gUSBTraceFilterLocationID	= 0;
+			gUSBTraceFilter 			= 0;
+			
+		}
+		break;
+		
+		case kUSBTraceFilterInstance:
+		{
+			
+			instance = FindSysctlInstance ( usbArgs->instance, &count );
+			if ( instance == NULL )
+			{
+				
+				error = ENOENT;
+				break;
+				
+			}
+			
+			gUSBTraceFilterLocationID	= 0;
+			gUSBTraceFilter				= ( uintptr_t ) instance;
+			
+		}
+		break;
+		
+		case kUSBTraceFilterLocationID:
+		{
+			
+			if ( usbArgs->locationID == 0 )
+			{
+				
+				error = EINVAL;
+				break;
+				
+			}
+			
+			gUSBTraceFilterLocationID	= usbArgs->locationID;
+			gUSBTraceFilter				= kUSBTraceFilterNoDriver;
+			
+			for ( index = 0; index < kMaxSysctlInstances; index++ )
+			{
+				
+				if ( ( gInstances[index] != NULL ) &&
+					 ( gInstances[index]->GetLocationID ( ) == gUSBTraceFilterLocationID ) )
+				{
+					
+					gUSBTraceFilter = ( uintptr_t ) gInstances[index];
+					break;
+					
+				}
+				
+			}
+			
+		}
+		break;
+		
+		default:
+		{
+			error = EINVAL;
+		}
+		break;
+		
+	}
+	
+	if ( error == 0 )
+	{
+		
+		gUSBTraceCategoryMask = usbArgs->traceCategories;
+		UpdateTraceCategories ( );
+		
+	}
+	
+	IOLockUnlock ( gInstanceLock );
+	
+	
+Exit:
+	
+	
+	return error;
 	
 }
 
 
 //--------------------------------------------------------------------------------------------------
-//	Declarations - IOUSBMassStorageClass
+//	FindSysctlInstance - Returns the started instance at index instance, and the number of
+//						 started instances. gInstanceLock must be held.				[STATIC]
 //--------------------------------------------------------------------------------------------------
 
-#define super IOSCSIProtocolServices
-
-OSDefineMetaClassAndStructors( IOUSBMassStorageClass, IOSCSIProtocolServices )
+static IOUSBMassStorageClass *
+FindSysctlInstance ( UInt32 instance, UInt32 * count )
+{
+	
+	IOUSBMassStorageClass *		found	= NULL;
+	UInt32						index;
+	
+	*count = 0;
+	
+	for ( index = 0; index < kMaxSysctlInstances; index++ )
+	{
+		
+		if ( gInstances[index] == NULL )
+		{
+			continue;
+		}
+		
+		if ( *count == instance )
+		{
+			found = gInstances[index];
+		}
+		
+		( *count )++;
+		
+	}
 	
+	return found;
+	
+}
+
 
 //--------------------------------------------------------------------------------------------------
-//	init - Called at initialization time							   						[PUBLIC]
+//	UpdateTraceCategories - Recomputes the categories RecordUSBTimeStamp emits.			[STATIC]
 //--------------------------------------------------------------------------------------------------
 
-bool 
-IOUSBMassStorageClass::init ( OSDictionary * propTable )
+static void
+UpdateTraceCategories ( void )
 {
-    if ( super::init( propTable ) == false)
-    {
-		return false;
-    }
-
-    return true;
+	
+	gUSBTraceCategories = ( gUSBDebugFlags != 0 ) ? gUSBTraceCategoryMask : 0;
 	
 }
 
+
 //--------------------------------------------------------------------------------------------------
-//	start - Called at services start time	(after successful matching)						[PUBLIC]
+//	RegisterSysctlInstance												   					[STATIC]
 //--------------------------------------------------------------------------------------------------
 
-bool 
-IOUSBMassStorageClass::start ( IOService * provider )
+static void
+RegisterSysctlInstance ( IOUSBMassStorageClass * instance )
 {
-    IOUSBFindEndpointRequest 	request;
-	OSDictionary * 				characterDict 	= NULL;
-	OSObject *					obj				= NULL;
-    IOReturn                    result          = kIOReturnError;
-	bool						retVal			= false;
-	OSNumber *					number			= NULL;
-	bool						success			= false;
 	
+	UInt32		index;
 	
-    if ( super::start( provider ) == false )
-    {
-    	STATUS_LOG(( 1, "%s[%p]: superclass start failure.", getName(), this));
-        return false;
-    }
-
-	RecordUSBTimeStamp (	UMC_TRACE ( kIOUSBMassStorageClassStart ),
-							( uintptr_t ) this, NULL,
-							NULL, NULL );
+	require_quiet ( ( gInstanceLock != NULL ), Exit );
 	
-#ifndef EMBEDDED
-	// Allocate data for our expansion data.
-	reserved = ( ExpansionData * ) IOMalloc ( sizeof ( ExpansionData ) );
-	bzero ( reserved, sizeof ( ExpansionData ) );
-#endif // EMBEDDED
-
-    // Save the reference to the interface on the device that will be
-    // the provider for this object.
-    SetInterfaceReference ( OSDynamicCast ( IOUSBInterface, provider ) );
-    if ( GetInterfaceReference ( ) == NULL )
-    {
+	IOLockLock ( gInstanceLock );
 	
-    	STATUS_LOG ( ( 1, "%s[%p]: the provider is not an IOUSBInterface object",
-    				getName(), this ) );
-    	// If our provider is not a IOUSBInterface object, return false
-    	// to indicate that the object could not be correctly 
-		// instantiated.
-    	// The USB Mass Storage Class specification requires that all 
-		// devices be a composite device with a Mass Storage interface
-		// so this object will always be an interface driver.
- 		goto Exit;
+	for ( index = 0; index < kMaxSysctlInstances; index++ )
+	{
 		
-    }
+		if ( gInstances[index] == NULL )
+		{
+			
+			gInstances[index] = instance;
+			break;
+			
+		}
+		
+	}
 	
-	// Check if a subclass has marked this device as not to be operated at all.
-	if ( provider->getProperty ( kIOUSBMassStorageDoNotMatch ) != NULL )
+	// Pick up the device being waited for by location, including after a re-enumeration.
+	if ( ( gUSBTraceFilterLocationID != 0 ) && ( instance->GetLocationID ( ) == gUSBTraceFilterLocationID ) )
 	{
-		goto abortStart;
+		gUSBTraceFilter = ( uintptr_t ) instance;
 	}
 	
-	RecordUSBTimeStamp (	UMC_TRACE ( kAtUSBAddress ),
-							( uintptr_t ) this, ( unsigned int ) GetInterfaceReference()->GetDevice()->GetAddress(),
+	IOLockUnlock ( gInstanceLock );
+	
+	
+Exit:
+	
+	
+	return;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	UnregisterSysctlInstance											   					[STATIC]
+//--------------------------------------------------------------------------------------------------
+
+static void
+UnregisterSysctlInstance ( IOUSBMassStorageClass * instance )
+{
+	
+	UInt32		index;
+	
+	require_quiet ( ( gInstanceLock != NULL ), Exit );
+	
+	IOLockLock ( gInstanceLock );
+	
+	for ( index = 0; index < kMaxSysctlInstances; index++ )
+	{
+		
+		if ( gInstances[index] == instance )
+		{
+			
+			gInstances[index] = NULL;
+			break;
+			
+		}
+		
+	}
+	
+	// Once the filtered driver is gone, a device picked by location is waited for again and a
+	// filter on the instance is dropped. Left alone, either would match whatever is allocated
+	// at the same address next.
+	if ( gUSBTraceFilter == ( uintptr_t ) instance )
+	{
+		gUSBTraceFilter = ( gUSBTraceFilterLocationID != 0 ) ? kUSBTraceFilterNoDriver : 0;
+	}
+	
+	IOLockUnlock ( gInstanceLock );
+	
+	
+Exit:
+	
+	
+	return;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	USBMassStorageClassGlobals - Default Constructor				   						[PUBLIC]
+//--------------------------------------------------------------------------------------------------
+
+USBMassStorageClassGlobals::USBMassStorageClassGlobals ( void )
+{
+	
+	int		debugFlags;
+	
+	STATUS_LOG ( ( 1, "+USBMassStorageClassGlobals::USBMassStorageClassGlobals\n" ) );
+	
+	if ( PE_parse_boot_argn ( "USB-MassStorage", &debugFlags, sizeof ( debugFlags ) ) )
+	{
+		gUSBDebugFlags = debugFlags;
+	}
+	
+	UpdateTraceCategories ( );
+	
+	gAutoTuneLock		= IOLockAlloc ( );
+	gAutoTuneResults	= OSDictionary::withCapacity ( 4 );
+	gInstanceLock		= IOLockAlloc ( );
+	
+	// Register our sysctl interface
+	sysctl_register_oid ( &sysctl__debug_USBMassStorageClass );
+	
+	STATUS_LOG ( ( 1, "-USBMassStorageClassGlobals::USBMassStorageClassGlobals\n" ) );
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	USBMassStorageClassGlobals - Destructor							   						[PUBLIC]
+//--------------------------------------------------------------------------------------------------
+
+USBMassStorageClassGlobals::~USBMassStorageClassGlobals ( void )
+{
+	
+	STATUS_LOG ( ( 1, "+~USBMassStorageClassGlobals::USBMassStorageClassGlobals\n" ) );
+	
+	// Unregister our sysctl interface
+	sysctl_unregister_oid ( &sysctl__debug_USBMassStorageClass );
+	
+	if ( gAutoTuneResults != NULL )
+	{
+		
+		gAutoTuneResults->release ( );
+		gAutoTuneResults = NULL;
+		
+	}
+	
+	if ( gAutoTuneLock != NULL )
+	{
+		
+		IOLockFree ( gAutoTuneLock );
+		gAutoTuneLock = NULL;
+		
+	}
+	
+	if ( gInstanceLock != NULL )
+	{
+		
+		IOLockFree ( gInstanceLock );
+		gInstanceLock = NULL;
+		
+	}
+	
+	STATUS_LOG ( ( 1, "-~USBMassStorageClassGlobals::USBMassStorageClassGlobals\n" ) );
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	Declarations - IOUSBMassStorageClass
+//--------------------------------------------------------------------------------------------------
+
+#define super IOSCSIProtocolServices
+
+OSDefineMetaClassAndStructors( IOUSBMassStorageClass, IOSCSIProtocolServices )
+	
+
+//--------------------------------------------------------------------------------------------------
+//	init - Called at initialization time							   						[PUBLIC]
+//--------------------------------------------------------------------------------------------------
+
+bool 
+IOUSBMassStorageClass::init ( OSDictionary * propTable )
+{
+    if ( super::init( propTable ) == false)
+    {
+		return false;
+    }
+
+    return true;
+	
+}
+
+//--------------------------------------------------------------------------------------------------
+//	start - Called at services start time	(after successful matching)						[PUBLIC]
+//--------------------------------------------------------------------------------------------------
+
+bool 
+IOUSBMassStorageClass::start ( IOService * provider )
+{
+    IOUSBFindEndpointRequest 	request;
+	OSDictionary * 				characterDict 	= NULL;
+	OSObject *					obj				= NULL;
+    IOReturn                    result          = kIOReturnError;
+	bool						retVal			= false;
+	OSNumber *					number			= NULL;
+	bool						success			= false;
+	
+	
+    if ( super::start( provider ) == false )
+    {
+    	STATUS_LOG(( 1, "%s[%p]: superclass start failure.", getName(), this));
+        return false;
+    }
+
+	RecordUSBTimeStamp (	UMC_TRACE ( kIOUSBMassStorageClassStart ),
+							( uintptr_t ) this, NULL,
+							NULL, NULL );
+	
+#ifndef EMBEDDED
+	// Allocate data for our expansion data.
+	reserved = ( ExpansionData * ) IOMalloc ( sizeof ( ExpansionData ) );
+	bzero ( reserved, sizeof ( ExpansionData ) );
+#endif // EMBEDDED
+
+    // Save the reference to the interface on the device that will be
+    // the provider for this object.
+    SetInterfaceReference ( OSDynamicCast ( IOUSBInterface, provider ) );
+    if ( GetInterfaceReference ( ) == NULL )
+    {
+	
+    	STATUS_LOG ( ( 1, "%s[%p]: the provider is not an IOUSBInterface object",
+    				getName(), this ) );
+    	// If our provider is not a IOUSBInterface object, return false
+    	// to indicate that the object could not be correctly 
+		// instantiated.
+    	// The USB Mass Storage Class specification requires that all 
+		// devices be a composite device with a Mass Storage interface
+		// so this object will always be an interface driver.
+ 		goto Exit;
+		
+    }
+	
+	// Check if a subclass has marked this device as not to be operated at all.
+	if ( provider->getProperty ( kIOUSBMassStorageDoNotMatch ) != NULL )
+	{
+		goto abortStart;
+	}
+	
+	RecordUSBTimeStamp (	UMC_TRACE ( kAtUSBAddress ),
+							( uintptr_t ) this, ( unsigned int ) GetInterfaceReference()->GetDevice()->GetAddress(),
 							NULL, NULL );
 
     STATUS_LOG ( ( 6, "%s[%p]: USB Mass Storage @ %d", 
@@ -312,6 +821,19 @@ IOUSBMassStorageClass::start ( IOService * provider )
     
     // Certain Bulk-Only device are subject to erroneous CSW tags.
     fKnownCSWTagMismatchIssues = false;
+    
+    // Bulk-Only data in commands queue their CSW read behind the data read unless the
+    // personality says the device can't cope with it.
+    fBulkOnlyPipelineCSW = true;
+    
+    // Large data phases are split into several outstanding transfers on SuperSpeed, where a
+    // single transfer per command leaves the bus idle between the controller's internal segments.
+    fDataSegmentSize		= 0;
+    fDataSegmentsInFlight	= kIOUSBMassStorageDefaultDataSegments;
+    if ( GetInterfaceReference()->GetDevice()->GetSpeed() >= kUSBDeviceSpeedSuper )
+    {
+        fDataSegmentSize = kIOUSBMassStorageDefaultDataSegmentSize;
+    }
 	
 	// Flag to let us know if we've seen the reconfiguration message following a device reset. 
 	// If we proceed with operations prior to receiving the message we may end up booting a 
@@ -390,6 +912,49 @@ IOUSBMassStorageClass::start ( IOService * provider )
         {
             fKnownCSWTagMismatchIssues = true;
         }
+        
+        // Does this device lose the CSW if its read is queued before the data phase ends?
+        if ( characterDict->getObject ( kIOUSBMassStorageDisableCSWPipelining ) != NULL )
+        {
+            fBulkOnlyPipelineCSW = false;
+        }
+        
+        // Override the data phase segmenting. A segment size of zero turns it off.
+        if ( characterDict->getObject ( kIOUSBMassStorageDataSegmentSize ) != NULL )
+        {
+            
+            OSNumber * segmentSize = OSDynamicCast ( OSNumber, characterDict->getObject ( kIOUSBMassStorageDataSegmentSize ) );
+            
+            if ( segmentSize != NULL )
+            {
+                
+                // Keep every segment but the last a whole number of max size packets so that
+                // only the device can end the data phase with a short packet.
+                fDataSegmentSize = segmentSize->unsigned32BitValue ( ) & ~1023;
+                if ( ( fDataSegmentSize != 0 ) && ( fDataSegmentSize < kIOUSBMassStorageMinDataSegmentSize ) )
+                {
+                    fDataSegmentSize = kIOUSBMassStorageMinDataSegmentSize;
+                }
+                
+            }
+            
+        }
+        
+        if ( characterDict->getObject ( kIOUSBMassStorageDataSegmentsInFlight ) != NULL )
+        {
+            
+            OSNumber * segmentsInFlight = OSDynamicCast ( OSNumber, characterDict->getObject ( kIOUSBMassStorageDataSegmentsInFlight ) );
+            
+            if ( segmentsInFlight != NULL )
+            {
+                
+                fDataSegmentsInFlight = segmentsInFlight->unsigned32BitValue ( );
+                fDataSegmentsInFlight = max ( fDataSegmentsInFlight, 2 );
+                fDataSegmentsInFlight = min ( fDataSegmentsInFlight, kIOUSBMassStorageMaxDataSegments );
+                
+            }
+            
+        }
 
         if ( characterDict->getObject( kIOUSBMassStorageEnableSuspendResumePM ) != NULL )
         {
@@ -457,6 +1022,28 @@ IOUSBMassStorageClass::start ( IOService * provider )
 	STATUS_LOG ( ( 6, "%s[%p]: Preferred Protocol is: %d", getName(), this, fPreferredProtocol ) );
     STATUS_LOG ( ( 6, "%s[%p]: Preferred Subclass is: %d", getName(), this, fPreferredSubclass ) );
 
+	// Pick up a previously tuned maximum byte count, or start measuring for one.
+	AutoTuneInitialize ( characterDict );
+
+	// UAS is opt in. A personality either prefers it outright, or lets a Bulk Only interface
+	// which also offers a UAS alternate setting use it with "Enable UAS". If that alternate
+	// setting cannot be configured a Bulk Only device stays with Bulk Only.
+	if ( ( fPreferredProtocol == kProtocolUSBAttachedSCSI ) ||
+		 ( ( fPreferredProtocol == kProtocolBulkOnly ) &&
+		   ( characterDict != NULL ) &&
+		   ( characterDict->getObject ( kIOUSBMassStorageEnableUAS ) != NULL ) ) )
+	{
+		
+		result = UASConfigureInterface ( );
+		if ( result == kIOReturnSuccess )
+		{
+			fPreferredProtocol = kProtocolUSBAttachedSCSI;
+		}
+		
+		require ( ( fPreferredProtocol == kProtocolBulkOnly ) || ( result == kIOReturnSuccess ), abortStart );
+		
+	}
+	
 	// Verify that the device has a supported interface type and configure that
 	// Interrupt pipe if the protocol requires one.
     STATUS_LOG ( ( 7, "%s[%p]: Configure the Storage interface", getName(), this ) );
@@ -478,13 +1065,8 @@ IOUSBMassStorageClass::start ( IOService * provider )
 	        STATUS_LOG ( ( 7, "%s[%p]: find interrupt pipe", getName(), this ) );
 	        require_nonzero ( fInterruptPipe, abortStart );
 			
-			fCBIMemoryDescriptor = IOMemoryDescriptor::withAddress (
-											&fCBICommandRequestBlock.cbiGetStatusBuffer, 
-											kUSBStorageAutoStatusSize, 
-											kIODirectionIn );
-            require_nonzero ( fCBIMemoryDescriptor, abortStart );
-
-            result = fCBIMemoryDescriptor->prepare();
+			// Allocate the request blocks and their status descriptors.
+			result = AllocateRequestPool ( );
             require_success ( result, abortStart );
 	    }
     	break;
@@ -500,24 +1082,24 @@ IOUSBMassStorageClass::start ( IOService * provider )
 			RecordUSBTimeStamp ( UMC_TRACE ( kBODeviceDetected ),
 								 ( uintptr_t ) this, NULL, NULL, NULL );
             
-            // Allocate the memory descriptor needed to send the CBW out.
-            fBulkOnlyCBWMemoryDescriptor = IOMemoryDescriptor::withAddress ( 
-                                                &fBulkOnlyCommandRequestBlock.boCBW, 
-                                                kByteCountOfCBW, 
-                                                kIODirectionOut );
-            require_nonzero ( fBulkOnlyCBWMemoryDescriptor, abortStart );
-            
-            result = fBulkOnlyCBWMemoryDescriptor->prepare();
+            // Allocate the request blocks and the memory descriptors needed
+            // to send each CBW out and retrieve each CSW.
+            result = AllocateRequestPool ( );
             require_success ( result, abortStart );
             
-            // Allocate the memory descriptor needed to retrieve the CSW.
-            fBulkOnlyCSWMemoryDescriptor = IOMemoryDescriptor::withAddress ( 
-                                                &fBulkOnlyCommandRequestBlock.boCSW, 
-                                                kByteCountOfCSW, 
-                                                kIODirectionIn );
-            require_nonzero ( fBulkOnlyCSWMemoryDescriptor, abortStart );
-
-            result = fBulkOnlyCSWMemoryDescriptor->prepare();
+	    }
+	    break;
+	    
+	    case kProtocolUSBAttachedSCSI:
+	    {
+	    	
+	        STATUS_LOG ( ( 7, "%s[%p]: USB Attached SCSI - pipes configured", getName(), this ) );
+			
+			RecordUSBTimeStamp ( UMC_TRACE ( kUASDeviceDetected ),
+								 ( uintptr_t ) this, fUASAlternateSetting, fUASStreamsEnabled, fUASQueueDepth );
+            
+            // Allocate the request blocks along with the command and status IU descriptors.
+            result = AllocateRequestPool ( );
             require_success ( result, abortStart );
             
 	    }
@@ -536,19 +1118,42 @@ IOUSBMassStorageClass::start ( IOService * provider )
 	    break;
     }
 
-	// Find the Bulk In pipe for the device
-    STATUS_LOG ( ( 7, "%s[%p]: find bulk in pipe", getName(), this ) );
-	request.type = kUSBBulk;
-	request.direction = kUSBIn;
-	fBulkInPipe = GetInterfaceReference()->FindNextPipe ( NULL, &request, true );
-	require_nonzero ( fBulkInPipe, abortStart );
+	// Stall clearing and USB device resets run in order on one long lived thread.
+	result = StartRecoveryWorker ( );
+	require_success ( result, abortStart );
+	
+	fDiagnostics = ( USBMassStorageDiagnostics * ) IOMalloc ( sizeof ( USBMassStorageDiagnostics ) );
+	require_nonzero ( fDiagnostics, abortStart );
+	bzero ( fDiagnostics, sizeof ( USBMassStorageDiagnostics ) );
 	
-	// Find the Bulk Out pipe for the device
-    STATUS_LOG ( ( 7, "%s[%p]: find bulk out pipe", getName(), this ) );
-	request.type = kUSBBulk;
-	request.direction = kUSBOut;
-	fBulkOutPipe = GetInterfaceReference()->FindNextPipe ( NULL, &request, true );
-	require_nonzero ( fBulkOutPipe, abortStart );
+	RegisterSysctlInstance ( this );
+	
+	fStatisticsThread = thread_call_allocate ( 
+							( thread_call_func_t ) IOUSBMassStorageClass::sPublishStatistics,
+							( thread_call_param_t ) this );
+	require_nonzero ( fStatisticsThread, abortStart );
+	
+	PublishStatistics ( );
+	
+	// UAS identifies its data pipes from the Pipe Usage descriptors, and has already found them.
+	if ( GetInterfaceProtocol() != kProtocolUSBAttachedSCSI )
+	{
+		
+		// Find the Bulk In pipe for the device
+		STATUS_LOG ( ( 7, "%s[%p]: find bulk in pipe", getName(), this ) );
+		request.type = kUSBBulk;
+		request.direction = kUSBIn;
+		fBulkInPipe = GetInterfaceReference()->FindNextPipe ( NULL, &request, true );
+		require_nonzero ( fBulkInPipe, abortStart );
+		
+		// Find the Bulk Out pipe for the device
+		STATUS_LOG ( ( 7, "%s[%p]: find bulk out pipe", getName(), this ) );
+		request.type = kUSBBulk;
+		request.direction = kUSBOut;
+		fBulkOutPipe = GetInterfaceReference()->FindNextPipe ( NULL, &request, true );
+		require_nonzero ( fBulkOutPipe, abortStart );
+		
+	}
 	
 	// Build the Protocol Characteristics dictionary since not all devices will have a 
 	// SCSI Peripheral Device Nub to guarantee its existance.
@@ -704,26 +1309,7 @@ abortStart:
 	
 	}
 
-	if ( fCBIMemoryDescriptor != NULL )
-	{
-		fCBIMemoryDescriptor->complete();
-		fCBIMemoryDescriptor->release();
-        fCBIMemoryDescriptor = NULL;
-	}
-	
-	if ( fBulkOnlyCBWMemoryDescriptor != NULL )
-	{
-		fBulkOnlyCBWMemoryDescriptor->complete();
-		fBulkOnlyCBWMemoryDescriptor->release();
-        fBulkOnlyCBWMemoryDescriptor = NULL;
-	}
-	
-	if ( fBulkOnlyCSWMemoryDescriptor != NULL )
-	{
-		fBulkOnlyCSWMemoryDescriptor->complete();
-		fBulkOnlyCSWMemoryDescriptor->release();
-        fBulkOnlyCSWMemoryDescriptor = NULL;
-	}
+	FreeRequestPool ( );
 
 	// Call the stop method to clean up any allocated resources.
     stop ( provider );
@@ -775,6 +1361,19 @@ IOUSBMassStorageClass::stop ( IOService * provider )
 		fInterruptPipe = NULL;
 		
 	}
+	
+	UASReleasePipes ( );
+	
+	// Queued jobs still run, the worker exits after the last one.
+	StopRecoveryWorker ( );
+	
+	if ( ( fStatisticsThread != NULL ) && thread_call_cancel ( fStatisticsThread ) )
+	{
+		
+		// It was scheduled, so balance out its retain.
+		release ( );
+		
+	}
 
 	//	Release our retain on the provider's workLoop.
 	
@@ -806,30 +1405,41 @@ require_nonzero ( reserved, Exit );
 		
     }
     
-    if ( fCBIMemoryDescriptor != NULL )
+    UnregisterSysctlInstance ( this );
+    
+    if ( fStatisticsDictionary != NULL )
     {
-		
-        fCBIMemoryDescriptor->complete ( );
-        fCBIMemoryDescriptor->release ( );
-        fCBIMemoryDescriptor = NULL;
+        
+		fStatisticsDictionary->release ( );
+        fStatisticsDictionary = NULL;
 		
     }
     
-    if ( fBulkOnlyCBWMemoryDescriptor != NULL )
+    FreeRequestPool ( );
+    
+    if ( fStatisticsThread != NULL )
     {
-		
-        fBulkOnlyCBWMemoryDescriptor->complete ( );
-        fBulkOnlyCBWMemoryDescriptor->release ( );
-        fBulkOnlyCBWMemoryDescriptor = NULL;
+        
+		thread_call_free ( fStatisticsThread );
+        fStatisticsThread = NULL;
 		
     }
     
-    if ( fBulkOnlyCSWMemoryDescriptor != NULL )
+    // stop() told the worker to exit, and its retain kept us alive until it had.
+    if ( fRecoveryLock != NULL )
     {
+        
+		IOLockFree ( fRecoveryLock );
+        fRecoveryLock = NULL;
 		
-        fBulkOnlyCSWMemoryDescriptor->complete ( );
-        fBulkOnlyCSWMemoryDescriptor->release ( );
-        fBulkOnlyCSWMemoryDescriptor = NULL; 
+    }
+    
+    // The sysctl instance is gone, so nothing can copy the diagnostics out any more.
+    if ( fDiagnostics != NULL )
+    {
+        
+		IOFree ( fDiagnostics, sizeof ( USBMassStorageDiagnostics ) );
+        fDiagnostics = NULL;
 		
     }
     
@@ -880,7 +1490,23 @@ IOUSBMassStorageClass::message ( UInt32 type, IOService * provider, void * argum
 			
 		case kIOUSBMessageCompositeDriverReconfigured:
 		{
-			fWaitingForReconfigurationMessage = false;
+			
+			// Wake the recovery worker if it is waiting on this in sResetDevice().
+			if ( fRecoveryLock != NULL )
+			{
+				
+				IOLockLock ( fRecoveryLock );
+				fWaitingForReconfigurationMessage = false;
+				IOLockWakeup ( fRecoveryLock, &fWaitingForReconfigurationMessage, true );
+				IOLockUnlock ( fRecoveryLock );
+				
+			}
+			
+			else
+			{
+				fWaitingForReconfigurationMessage = false;
+			}
+			
 		}
 		break;
 					
@@ -960,9 +1586,24 @@ IOUSBMassStorageClass::didTerminate ( IOService * provider, IOOptionBits options
 		fInterruptPipe->Abort ( );
 	}
 	
+	if ( fUASCommandPipe != NULL )
+	{
+		fUASCommandPipe->Abort ( );
+	}
+	
+	if ( fUASStatusPipe != NULL )
+	{
+		fUASStatusPipe->Abort ( );
+	}
+	
+	//	Fail any SCSI tasks which are still waiting in the admission queue. They will never be sent.
+	fCommandGate->runAction ( OSMemberFunctionCast (	IOCommandGate::Action,
+														this,
+														&IOUSBMassStorageClass::FlushQueuedSCSITasks ) );
+	
 	//	If we have a SCSI task outstanding, we will block here until it completes.
 	//	This ensures that we don't try to send requests to our provider after we have closed it.
-	fTerminationDeferred = fBulkOnlyCommandStructInUse | fCBICommandStructInUse;
+	fTerminationDeferred = fBulkOnlyCommandStructInUse | fCBICommandStructInUse | ( fUASOutstandingCount != 0 );
     
 	RecordUSBTimeStamp (	UMC_TRACE ( kDidTerminateCalled ),
 						( uintptr_t ) this, ( unsigned int ) fTerminationDeferred, NULL, NULL );
@@ -1050,9 +1691,9 @@ bool
 IOUSBMassStorageClass::BeginProvidedServices ( void )
 {
     
- 	// If this is a BO device that supports multiple LUNs, we will need 
-	// to spawn off a nub for each valid LUN.  If this is a CBI/CB
-	// device or a BO device that only supports LUN 0, this object can
+ 	// If this is a BO or UAS device that supports multiple LUNs, we will
+	// need to spawn off a nub for each valid LUN.  If this is a CBI/CB
+	// device or a device that only supports LUN 0, this object can
 	// register itself as the nub.  
     STATUS_LOG ( ( 7, "%s[%p]: Determine the maximum LUN", getName(), this ) );
 	
@@ -1159,6 +1800,39 @@ IOUSBMassStorageClass::BeginProvidedServices ( void )
 		}
 			
     }
+	else if ( GetInterfaceProtocol() == kProtocolUSBAttachedSCSI )
+	{
+		
+		OSDictionary *	characterDict	= NULL;
+		OSNumber *		maxLUN			= NULL;
+		UInt8			reportedMaxLUN	= 0;
+		
+		// UAS addresses LUNs in each Command IU. A personality can still fix the count.
+		characterDict = OSDynamicCast (	OSDictionary, getProperty ( kIOUSBMassStorageCharacteristics ) );
+		if ( characterDict != NULL )
+		{
+			maxLUN = OSDynamicCast ( OSNumber, characterDict->getObject ( kIOUSBMassStorageMaxLogicalUnitNumber ) );
+		}
+		
+		if ( maxLUN != NULL )
+		{
+			reportedMaxLUN = maxLUN->unsigned8BitValue ( );
+		}
+		
+		// A device which fails REPORT LUNS is left with LUN 0, after a reset to clear
+		// whatever state the failed command left behind.
+		else if ( UASReportLUNs ( &reportedMaxLUN ) != kIOReturnSuccess )
+		{
+			
+			STATUS_LOG ( ( 4, "%s[%p]: BeginProvidedServices: REPORT LUNS failed, resetting.", getName(), this ) );
+			ResetDeviceNow ( true );
+			
+		}
+		
+		// The admission queues only have room for this many LUNs.
+		SetMaxLogicalUnitNumber ( min ( reportedMaxLUN, ( UInt8 ) ( kIOUSBMassStorageMaxLogicalUnits - 1 ) ) );
+		
+	}
     else
     {
     	// CBI and CB protocols do not support LUNs so for these the 
@@ -1272,19 +1946,21 @@ IOUSBMassStorageClass::SendSCSICommand (
 {
 
 	IOReturn					status;
-	SCSICommandDescriptorBlock	cdbData;
 	bool						accepted = false;
+	bool						queued = false;
 	
    	STATUS_LOG ( ( 6, "%s[%p]: SendSCSICommand Entered with request=%p", getName ( ), this, request ) );
 
 	//	Close the commandGate, then check whether we can accept this new SCSI task.
-	//	If so, then atomically set the commandStructInUse flag.
+	//	If so, then atomically set the commandStructInUse flag, or place the task
+	//	in the admission queue if another command currently owns the transport.
 	
 	fCommandGate->runAction (	OSMemberFunctionCast (	IOCommandGate::Action,
 														this,
 														&IOUSBMassStorageClass::AcceptSCSITask ),
 								request,
-								&accepted );
+								&accepted,
+								&queued );
 	
 	require_quiet ( accepted, Exit );
 
@@ -1293,6 +1969,60 @@ IOUSBMassStorageClass::SendSCSICommand (
 	
 	*taskStatus =		kSCSITaskStatus_No_Status;
 	*serviceResponse =  kSCSIServiceResponse_Request_In_Process;
+	
+	//	A queued task is sent from the completion path of the command ahead of it.
+	require_quiet ( ( queued == false ), Exit );
+	
+	status = DispatchSCSITask ( request );
+	
+	//	A nonzero status indicates that we could not post the USB CBW request to the device, probably due to termination.
+	//	In that case, we fail this task via a call to CommandCompleted().
+	//	We never fail a task with an immediate serviceResponse, because the retain which ExecuteTask() took on us on
+	//	behalf of the SCSI task would never be released, preventing us from being freed.
+
+	if ( status != kIOReturnSuccess )
+	{
+		
+		SCSIServiceResponse	localServiceResponse 	= kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+		SCSITaskStatus		localTaskStatus			= kSCSITaskStatus_DeliveryFailure;
+		
+		STATUS_LOG ( ( 5, "%s[%p]: Failing immediately due to status=0x%x", getName ( ), this, status ) );
+		
+		//	An error was seen which prevented the command from being sent. Fail the SCSI task.
+		fCommandGate->runAction (
+			OSMemberFunctionCast (	IOCommandGate::Action,
+									this,
+									&IOUSBMassStorageClass::GatedCompleteSCSICommand ),
+									request,
+									( void * ) &localServiceResponse,
+									( void * ) &localTaskStatus );
+		
+	}
+
+
+Exit:
+
+
+	STATUS_LOG ( ( 6, "%s[%p]: SendSCSICommand returning accepted=%d queued=%d", getName ( ), this, accepted, queued ) );
+	
+	return accepted;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	DispatchSCSITask																	   [PRIVATE]
+//
+//		Logs the CDB and hands the task to the transport. The caller must already own the command
+//		structure for the current protocol. Does not complete the task on failure.
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageClass::DispatchSCSITask ( SCSITaskIdentifier request )
+{
+	
+	IOReturn					status;
+	SCSICommandDescriptorBlock	cdbData;
     
 	GetCommandDescriptorBlock( request, &cdbData );
 	
@@ -1334,7 +2064,13 @@ IOUSBMassStorageClass::SendSCSICommand (
                     cdbData[14], cdbData[15] ) );
 #endif
 	
-	require_action ( ( isInactive ( ) == false ), ErrorExit, status = kIOReturnNoDevice );
+	require_action ( ( isInactive ( ) == false ), Exit, status = kIOReturnNoDevice );
+	
+	//	UAS keeps several commands in flight, which the flight recorder does not follow.
+	if ( GetInterfaceProtocol ( ) != kProtocolUSBAttachedSCSI )
+	{
+		BeginFlightRecord ( request );
+	}
     
    	if ( GetInterfaceProtocol() == kProtocolBulkOnly )
 	{
@@ -1348,9 +2084,23 @@ IOUSBMassStorageClass::SendSCSICommand (
         
 	}
 	
+	else if ( GetInterfaceProtocol() == kProtocolUSBAttachedSCSI )
+	{
+	
+		status = SendSCSICommandForUASProtocol ( request );
+		
+		RecordUSBTimeStamp (	UMC_TRACE ( kUASSendSCSICommandReturned ),
+								( uintptr_t ) this, ( uintptr_t ) request, status, NULL );
+									
+   		STATUS_LOG ( ( 5, "%s[%p]: SendSCSICommandForUASProtocol returned %x", getName ( ), this, status ) );
+        
+	}
+	
 	else
 	{
 	
+		RecordCommandStartTrace ( request, 0 );
+		
 		status = SendSCSICommandForCBIProtocol ( request );
 		
 		RecordUSBTimeStamp (	UMC_TRACE ( kCBISendSCSICommandReturned ),
@@ -1360,41 +2110,11 @@ IOUSBMassStorageClass::SendSCSICommand (
 		
 	}
 	
-	//	A nonzero status indicates that we could not post the USB CBW request to the device, probably due to termination.
-	//	In that case, we fail this task via a call to CommandCompleted().
-	//	We never fail a task with an immediate serviceResponse, because the retain which ExecuteTask() took on us on
-	//	behalf of the SCSI task would never be released, preventing us from being freed.
-
-
-ErrorExit:
-
-
-	if ( status != kIOReturnSuccess )
-	{
-		
-		SCSIServiceResponse	localServiceResponse 	= kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
-		SCSITaskStatus		localTaskStatus			= kSCSITaskStatus_DeliveryFailure;
-		
-		STATUS_LOG ( ( 5, "%s[%p]: Failing immediately due to status=0x%x", getName ( ), this, status ) );
-		
-		//	An error was seen which prevented the command from being sent. Fail the SCSI task.
-		fCommandGate->runAction (
-			OSMemberFunctionCast (	IOCommandGate::Action,
-									this,
-									&IOUSBMassStorageClass::GatedCompleteSCSICommand ),
-									request,
-									( void * ) &localServiceResponse,
-									( void * ) &localTaskStatus );
-		
-	}
-
-
+	
 Exit:
-
-
-	STATUS_LOG ( ( 6, "%s[%p]: SendSCSICommand returning accepted=%d", getName ( ), this, accepted ) );
 	
-	return accepted;
+	
+	return status;
 	
 }
 
@@ -1408,11 +2128,39 @@ IOUSBMassStorageClass::CompleteSCSICommand ( SCSITaskIdentifier request, IORetur
 {
 
 	SCSITaskStatus			taskStatus;
+	UInt64					now;
 
 	check ( fWorkLoop->inGate ( ) == true );
+	
+	// One clock read serves every measurement of this completion.
+	clock_get_uptime ( &now );
 
-	fBulkOnlyCommandStructInUse = false;
-	fCBICommandStructInUse = false;
+	AutoTuneRecordSample ( request, fTransportClaimTime, now, false );
+	
+	switch ( GetInterfaceProtocol ( ) )
+	{
+		
+		case kProtocolBulkOnly:
+			RecordLatencyUntil ( kUSBLatencyPhaseBOTotal, fTransportClaimTime, now );
+			break;
+		
+		case kProtocolUSBAttachedSCSI:
+			RecordLatencyUntil ( kUSBLatencyPhaseUASTotal, fTransportClaimTime, now );
+			break;
+		
+		default:
+			RecordLatencyUntil ( kUSBLatencyPhaseCBITotal, fTransportClaimTime, now );
+			break;
+		
+	}
+	
+	fStatistics[kIOUSBMassStorageStatisticOperations]++;
+	fStatistics[kIOUSBMassStorageStatisticBytesTransferred] += GetRealizedDataTransferCount ( request );
+	SchedulePublishStatistics ( );
+	
+	EndFlightRecord ( status );
+	
+	ReleaseTransport ( );
     
 	//	Clear the count of consecutive I/Os which required a USB Device Reset.
 	fConsecutiveResetCount = 0;
@@ -1437,6 +2185,13 @@ IOUSBMassStorageClass::CompleteSCSICommand ( SCSITaskIdentifier request, IORetur
 						( uintptr_t ) this, ( uintptr_t ) request,
 						kSCSIServiceResponse_TASK_COMPLETE, taskStatus );
 	
+	RecordCommandEndTrace (	request, fTransportClaimTime, now,
+							( GetInterfaceProtocol ( ) == kProtocolBulkOnly ) ? fBulkOnlyCommandTag : 0,
+							kSCSIServiceResponse_TASK_COMPLETE, taskStatus );
+	
+	//	Put the next queued task on the wire before handing this one back up the stack.
+	StartNextQueuedSCSITask ( );
+	
 	CommandCompleted ( request, kSCSIServiceResponse_TASK_COMPLETE, taskStatus );
 	
 	//	If didTerminate() was called while this SCSI task was outstanding, then termination would
@@ -1475,20 +2230,117 @@ IOUSBMassStorageClass::AbortSCSICommand ( SCSITaskIdentifier abortTask )
 	RecordUSBTimeStamp (	UMC_TRACE( kAbortedTask ),
 							( uintptr_t ) this, ( uintptr_t ) abortTask, NULL, NULL );
 	
-	if ( GetInterfaceReference()->GetInterfaceProtocol() == kProtocolBulkOnly )
+	status = fCommandGate->runAction ( OSMemberFunctionCast (	IOCommandGate::Action,
+																this,
+																&IOUSBMassStorageClass::GatedAbortSCSICommand ),
+										abortTask );
+	
+	STATUS_LOG ( ( 5, "%s[%p]: GatedAbortSCSICommand returned %x", getName(), this, status ) );
+	
+	//	The aborted task itself is completed separately, with kSCSITaskStatus_TASK_ABORTED, once
+	//	the device has been brought back to a known state.
+	if ( status == kIOReturnSuccess )
+	{
+		return kSCSIServiceResponse_FUNCTION_COMPLETE;
+	}
+	
+	return kSCSIServiceResponse_FUNCTION_REJECTED;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	GatedAbortSCSICommand																   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageClass::GatedAbortSCSICommand ( SCSITaskIdentifier abortTask )
+{
+	
+	IOReturn	status = kIOReturnUnsupported;
+	
+	check ( fWorkLoop->inGate ( ) == true );
+	
+	//	A task still waiting in the admission queue never reached the device.
+	if ( RemoveQueuedSCSITask ( abortTask ) == true )
+	{
+		
+		RecordUSBTimeStamp (	UMC_TRACE ( kCompleteSCSICommand ),
+							( uintptr_t ) this, ( uintptr_t ) abortTask,
+							kSCSIServiceResponse_TASK_COMPLETE, kSCSITaskStatus_TASK_ABORTED );
+		
+		CommandCompleted ( abortTask, kSCSIServiceResponse_TASK_COMPLETE, kSCSITaskStatus_TASK_ABORTED );
+		status = kIOReturnSuccess;
+		goto Exit;
+		
+	}
+	
+	if ( GetInterfaceProtocol ( ) == kProtocolBulkOnly )
 	{
-		status = AbortSCSICommandForBulkOnlyProtocol( abortTask );
+		status = AbortSCSICommandForBulkOnlyProtocol ( abortTask );
    		STATUS_LOG ( ( 5, "%s[%p]: abortCDBforBulkOnlyProtocol returned %x", getName(), this, status ) );
     }
-    
+	
+	//	Only the aborted UAS command is stopped, with an ABORT TASK to the device.
+	else if ( GetInterfaceProtocol ( ) == kProtocolUSBAttachedSCSI )
+	{
+		status = UASAbortTask ( abortTask );
+   		STATUS_LOG ( ( 5, "%s[%p]: UASAbortTask returned %x", getName(), this, status ) );
+	}
+	
 	else
 	{
-		status = AbortSCSICommandForCBIProtocol( abortTask );
+		status = AbortSCSICommandForCBIProtocol ( abortTask );
    		STATUS_LOG ( ( 5, "%s[%p]: abortCDBforCBIProtocol returned %x", getName(), this, status ) );
 	}
+	
+	
+Exit:
+	
+	
+	return status;
+	
+}
 
-	// Since the driver currently does not support abort, return an error	
-	return kSCSIServiceResponse_FUNCTION_REJECTED;
+
+//--------------------------------------------------------------------------------------------------
+//	CompleteAbortedSCSITask - Completes a task dropped by AbortSCSICommand once the transport has
+//							  been recovered. Unlike AbortCurrentSCSITask() this does not count
+//							  towards escalating the next reset.						   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::CompleteAbortedSCSITask ( SCSITaskIdentifier request )
+{
+	
+	UInt64		now;
+	
+	check ( fWorkLoop->inGate ( ) == true );
+	
+	clock_get_uptime ( &now );
+	
+	AutoTuneRecordSample ( request, fTransportClaimTime, now, true );
+	
+	NoteFlightRecovery ( kUSBFlightRecoveryAborted );
+	EndFlightRecord ( kIOReturnAborted );
+	
+	ReleaseTransport ( );
+	
+	STATUS_LOG ( ( 4, "%s[%p]: CompleteAbortedSCSITask request=%p", getName(), this, request ) );
+	
+	RecordUSBTimeStamp (	UMC_TRACE ( kCompleteSCSICommand ),
+						( uintptr_t ) this, ( uintptr_t ) request,
+						kSCSIServiceResponse_TASK_COMPLETE, kSCSITaskStatus_TASK_ABORTED );
+	
+	RecordCommandEndTrace (	request, fTransportClaimTime, now,
+							( GetInterfaceProtocol ( ) == kProtocolBulkOnly ) ? fBulkOnlyCommandTag : 0,
+							kSCSIServiceResponse_TASK_COMPLETE, kSCSITaskStatus_TASK_ABORTED );
+	
+	StartNextQueuedSCSITask ( );
+	
+	CommandCompleted ( request, kSCSIServiceResponse_TASK_COMPLETE, kSCSITaskStatus_TASK_ABORTED );
+	
+	CheckDeferredTermination ( );
 	
 }
 
@@ -1553,6 +2405,23 @@ IOUSBMassStorageClass::IsProtocolServiceSupported (
                 maxByteCount = kDefaultMaximumByteCountReadUSB3;
             }
             
+            // A tuned size replaces the default. While measuring, allow the largest candidate
+            // so that every size gets used. Full and low speed devices are never tuned and
+            // keep the default.
+            if ( deviceSpeed >= kUSBDeviceSpeedHigh )
+            {
+                
+                if ( fAutoTunedMaxByteCount != 0 )
+                {
+                    maxByteCount = fAutoTunedMaxByteCount;
+                }
+                else if ( fAutoTuneActive == true )
+                {
+                    maxByteCount = kIOUSBMassStorageAutoTuneMinByteCount << ( kIOUSBMassStorageAutoTuneSizes - 1 );
+                }
+                
+            }
+            
 			if ( characterDict != NULL )
 			{
 				
@@ -1581,6 +2450,23 @@ IOUSBMassStorageClass::IsProtocolServiceSupported (
             if ( deviceSpeed >= kUSBDeviceSpeedSuper )
             {
                 maxByteCount = kDefaultMaximumByteCountWriteUSB3;
+            }
+            
+            // A tuned size replaces the default. While measuring, allow the largest candidate
+            // so that every size gets used. Full and low speed devices are never tuned and
+            // keep the default.
+            if ( deviceSpeed >= kUSBDeviceSpeedHigh )
+            {
+                
+                if ( fAutoTunedMaxByteCount != 0 )
+                {
+                    maxByteCount = fAutoTunedMaxByteCount;
+                }
+                else if ( fAutoTuneActive == true )
+                {
+                    maxByteCount = kIOUSBMassStorageAutoTuneMinByteCount << ( kIOUSBMassStorageAutoTuneSizes - 1 );
+                }
+                
             }
 			
 			if ( characterDict != NULL )
@@ -1801,7 +2687,6 @@ IOUSBMassStorageClass::ClearFeatureEndpointStall (
 {
 
 	IOReturn			status = kIOReturnInternalError;
-	thread_t			thread = NULL;
 	
 	STATUS_LOG((5, "%s[%p]: ClearFeatureEndpointStall Entered with thePipe=%p", getName(), this, thePipe ));
 	
@@ -1814,41 +2699,51 @@ IOUSBMassStorageClass::ClearFeatureEndpointStall (
 		goto Exit;
 	}
 
-	//	Use the fPotentiallyStalledPipe iVar to pass the stalled pipe to the spawned thread.
+	//	Timed until the CLEAR_FEATURE completes back in the protocol state machine.
+	clock_get_uptime ( &fRecoveryStartTime );
+	fStatistics[kIOUSBMassStorageStatisticEndpointStalls]++;
+	NoteFlightRecovery ( kUSBFlightRecoveryClearStall );
+	
+	//	Use the fPotentiallyStalledPipe iVar to pass the stalled pipe to the recovery worker.
 	fPotentiallyStalledPipe = thePipe;
 	
-	//	Verify the assumptions that the helper thread will make when finding the completion structure.
+	//	Verify the assumptions that the recovery worker will make when finding the completion structure.
 	if ( GetInterfaceProtocol() == kProtocolBulkOnly )
 	{
-		require ( completion == &GetBulkOnlyRequestBlock()->boCompletion, Exit );
+		
+		BulkOnlyRequestBlock *	boRequestBlock = GetBulkOnlyRequestBlock ( );
+		
+		require ( ( boRequestBlock != NULL ) && ( completion == &boRequestBlock->boCompletion ), Exit );
+		
 	}
 
 	else
     {
-		require ( completion == &GetCBIRequestBlock()->cbiCompletion, Exit );
+		
+		CBIRequestBlock *		cbiRequestBlock = GetCBIRequestBlock ( );
+		
+		require ( ( cbiRequestBlock != NULL ) && ( completion == &cbiRequestBlock->cbiCompletion ), Exit );
+		
 	}
 	
-	//	Increment the retain count here, in order to keep our object around while the spawned thread executes.
-	//	This retain will be balanced by a release in the spawned thread when it exits.
+	//	Increment the retain count here, in order to keep our object around until the job has run.
+	//	This retain will be balanced by a release in ClearPipeStall().
 	retain();
 
-	//	Spawn a helper thread to actually clear the pipe stall, because some methods
+	//	Hand the stall to the recovery worker, because some methods
 	//	may not be called from the USB completion thread.
-	status = kernel_thread_start (
-					OSMemberFunctionCast ( thread_continue_t, this, &IOUSBMassStorageClass::ClearPipeStall ),
-								  this,
-								  &thread );
+	status = EnqueueRecoveryJob ( kIOUSBMassStorageRecoveryJobClearStall );
 	if ( status != kIOReturnSuccess )
 	{
 
-		//	The thread won't run, so restore the state that it was supposed to do.
+		//	The job won't run, so restore the state that it was supposed to do.
 		release();
 
 	}
 	
 Exit:
 	
-   	STATUS_LOG ( ( 5, "%s[%p]: ClearFeatureEndpointStall returning status=0x%x thread=%p", getName(), this, status, thread ) );
+   	STATUS_LOG ( ( 5, "%s[%p]: ClearFeatureEndpointStall returning status=0x%x", getName(), this, status ) );
 	
 	return status;
 	
@@ -2048,34 +2943,92 @@ IOUSBMassStorageClass::SetMaxLogicalUnitNumber ( UInt8 maxLUN )
 
 //--------------------------------------------------------------------------------------------------
 //	GetCBIRequestBlock																	 [PROTECTED]
+//
+//		Returns the request block of the command currently owning the transport, or NULL
+//		when no command does.
 //--------------------------------------------------------------------------------------------------
 
 CBIRequestBlock *	
 IOUSBMassStorageClass::GetCBIRequestBlock ( void )
 {
-
-	// Return a pointer to the CBIRequestBlock
-	return &fCBICommandRequestBlock;
-	
+	return fCBICurrentRequestBlock;
 }
 
 
 //--------------------------------------------------------------------------------------------------
-//	ReleaseCBIRequestBlock																 [PROTECTED]
+//	AllocateCBIRequestBlock																   [PRIVATE]
 //--------------------------------------------------------------------------------------------------
 
-void	
-IOUSBMassStorageClass::ReleaseCBIRequestBlock ( CBIRequestBlock * cbiRequestBlock )
+CBIRequestBlock *	
+IOUSBMassStorageClass::AllocateCBIRequestBlock ( void )
 {
-
-	// Clear the request and completion to avoid possible double callbacks.
-	cbiRequestBlock->request = NULL;
-
-	// Since we only allow one command and the CBIRequestBlock is
-	// a member variable, no need to do anything.
-	return;
 	
-}
+	CBIRequestSlot *	slot = NULL;
+	int					slotIndex;
+	
+	require_nonzero ( fCBIRequestPool, Exit );
+	
+	slotIndex = AllocateRequestSlot ( );
+	require ( ( slotIndex >= 0 ), Exit );
+	
+	slot = &fCBIRequestPool[slotIndex];
+	
+	bzero ( &slot->block, sizeof ( CBIRequestBlock ) );
+	slot->releaseDeferred = false;
+	slot->abortRequested = false;
+	slot->block.cbiPhaseDesc = slot->statusDescriptor;
+	
+	fCBICurrentRequestBlock = &slot->block;
+	
+	
+Exit:
+	
+	
+	return ( slot != NULL ) ? &slot->block : NULL;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	ReleaseCBIRequestBlock																 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void	
+IOUSBMassStorageClass::ReleaseCBIRequestBlock ( CBIRequestBlock * cbiRequestBlock )
+{
+
+	CBIRequestSlot *	slot;
+	
+	// Clear the request and completion to avoid possible double callbacks.
+	cbiRequestBlock->request = NULL;
+	
+	if ( fCBICurrentRequestBlock == cbiRequestBlock )
+	{
+		fCBICurrentRequestBlock = NULL;
+	}
+	
+	// Return the block to the pool. The block is the first member of its slot.
+	slot = ( CBIRequestSlot * ) cbiRequestBlock;
+	if ( ( fCBIRequestPool != NULL ) &&
+		 ( slot >= fCBIRequestPool ) &&
+		 ( slot < &fCBIRequestPool[kIOUSBMassStorageRequestPoolSize] ) )
+	{
+		
+		// Data segments still on the bus point into this slot. It goes back to the pool
+		// when the last of them returns.
+		if ( slot->segmentedData.segmentsInFlight != 0 )
+		{
+			
+			slot->releaseDeferred = true;
+			return;
+			
+		}
+		
+		ReleaseRequestSlot ( ( int ) ( slot - fCBIRequestPool ) );
+		
+	}
+	
+}
 
 #pragma mark -
 #pragma mark *** Accessor Methods For Bulk Only Protocol Variables ***
@@ -2084,14 +3037,48 @@ IOUSBMassStorageClass::ReleaseCBIRequestBlock ( CBIRequestBlock * cbiRequestBloc
 
 //--------------------------------------------------------------------------------------------------
 //	GetBulkOnlyRequestBlock															 	 [PROTECTED]
+//
+//		Returns the request block of the command currently owning the transport, or NULL
+//		when no command does.
 //--------------------------------------------------------------------------------------------------
 
 BulkOnlyRequestBlock *	
 IOUSBMassStorageClass::GetBulkOnlyRequestBlock ( void )
 {
+	return fBulkOnlyCurrentRequestBlock;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	AllocateBulkOnlyRequestBlock														   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
 
-	// Return a pointer to the BulkOnlyRequestBlock
-	return &fBulkOnlyCommandRequestBlock;
+BulkOnlyRequestBlock *	
+IOUSBMassStorageClass::AllocateBulkOnlyRequestBlock ( void )
+{
+	
+	BulkOnlyRequestSlot *	slot = NULL;
+	int						slotIndex;
+	
+	require_nonzero ( fBulkOnlyRequestPool, Exit );
+	
+	slotIndex = AllocateRequestSlot ( );
+	require ( ( slotIndex >= 0 ), Exit );
+	
+	slot = &fBulkOnlyRequestPool[slotIndex];
+	
+	bzero ( &slot->block, sizeof ( BulkOnlyRequestBlock ) );
+	slot->cswReadState 		= kBulkOnlyCSWReadIdle;
+	slot->releaseDeferred 	= false;
+	slot->abortRequested	= false;
+	
+	fBulkOnlyCurrentRequestBlock = &slot->block;
+	
+	
+Exit:
+	
+	
+	return ( slot != NULL ) ? &slot->block : NULL;
 	
 }
 
@@ -2104,12 +3091,39 @@ void
 IOUSBMassStorageClass::ReleaseBulkOnlyRequestBlock ( BulkOnlyRequestBlock * boRequestBlock )
 {
 
+	BulkOnlyRequestSlot *	slot;
+	
 	// Clear the request and completion to avoid possible double callbacks.
 	boRequestBlock->request = NULL;
-
-	// Since we only allow one command and the BulkOnlyRequestBlock is
-	// a member variable, no need to do anything.
-	return;
+	
+	if ( fBulkOnlyCurrentRequestBlock == boRequestBlock )
+	{
+		fBulkOnlyCurrentRequestBlock = NULL;
+	}
+	
+	// Return the block to the pool. The block is the first member of its slot.
+	slot = ( BulkOnlyRequestSlot * ) boRequestBlock;
+	if ( ( fBulkOnlyRequestPool != NULL ) &&
+		 ( slot >= fBulkOnlyRequestPool ) &&
+		 ( slot < &fBulkOnlyRequestPool[kIOUSBMassStorageRequestPoolSize] ) )
+	{
+		
+		// A queued CSW read or data segment still points into this slot. Hand the slot back
+		// when it returns, otherwise its completion could land on the next command.
+		if ( ( slot->cswReadState == kBulkOnlyCSWReadPosted ) ||
+			 ( slot->cswReadState == kBulkOnlyCSWReadDiscarded ) ||
+			 ( slot->segmentedData.segmentsInFlight != 0 ) )
+		{
+			
+			slot->releaseDeferred = true;
+			return;
+			
+		}
+		
+		slot->cswReadState = kBulkOnlyCSWReadIdle;
+		ReleaseRequestSlot ( ( int ) ( slot - fBulkOnlyRequestPool ) );
+		
+	}
 	
 }
 
@@ -2135,47 +3149,59 @@ IOUSBMassStorageClass::GetNextBulkOnlyCommandTag ( void )
 
 //--------------------------------------------------------------------------------------------------
 //	AcceptSCSITask																		   [PRIVATE]
+//
+//		If the transport is idle the task takes ownership of the command structure and the caller
+//		sends it. Otherwise it is placed in the admission queue for its LUN and is sent from the
+//		completion path of the command ahead of it. The task is only rejected when that queue is full.
 //--------------------------------------------------------------------------------------------------
 
 IOReturn
-IOUSBMassStorageClass::AcceptSCSITask ( SCSITaskIdentifier request, bool * accepted )
+IOUSBMassStorageClass::AcceptSCSITask ( SCSITaskIdentifier request, bool * accepted, bool * queued )
 {
 	
-	*accepted = false;
+	*accepted 	= false;
+	*queued		= false;
 	
-	if ( GetInterfaceProtocol ( ) == kProtocolBulkOnly )
+	//	Tasks already waiting go first, so a new task is only sent directly when nothing is queued.
+	if ( ( IsTransportBusy ( ) == true ) || ( fAdmissionQueueCount != 0 ) )
 	{
 		
-		if ( fBulkOnlyCommandStructInUse == true  )
+		if ( EnqueueSCSITask ( request ) == false )
 		{
 			
-			RecordUSBTimeStamp (	UMC_TRACE ( kBOCommandAlreadyInProgress ),
-								( uintptr_t ) this, ( uintptr_t ) request, NULL, NULL );
-			goto Exit;
-			
-		}
-		
-		fBulkOnlyCommandStructInUse = true;
-	
-	}
-	
-	else
-	{
-		
-		if ( fCBICommandStructInUse == true )
-		{
+			if ( GetInterfaceProtocol ( ) == kProtocolBulkOnly )
+			{
+				
+				RecordUSBTimeStamp (	UMC_TRACE ( kBOCommandAlreadyInProgress ),
+									( uintptr_t ) this, ( uintptr_t ) request, NULL, NULL );
+				
+			}
 			
-			RecordUSBTimeStamp (	UMC_TRACE ( kCBICommandAlreadyInProgress ),
-								( uintptr_t ) this, ( uintptr_t ) request, NULL, NULL );
+			else
+			{
+				
+				RecordUSBTimeStamp (	UMC_TRACE ( kCBICommandAlreadyInProgress ),
+									( uintptr_t ) this, ( uintptr_t ) request, NULL, NULL );
+				
+			}
 			
 			goto Exit;
 			
 		}
 		
-		fCBICommandStructInUse = true;
+		*accepted 	= true;
+		*queued		= true;
+		
+		//	The transport may have gone idle while tasks were still queued (e.g. a new task
+		//	arriving from within CommandCompleted()). Make sure the queue keeps moving.
+		StartNextQueuedSCSITask ( );
+		
+		goto Exit;
 		
 	}
 	
+	ClaimTransport ( );
+	
 	*accepted = true;
 	
 	
@@ -2188,148 +3214,122 @@ Exit:
 
 
 //--------------------------------------------------------------------------------------------------
-//	CheckDeferredTermination																[PRIVATE]
+//	IsTransportBusy																		   [PRIVATE]
 //--------------------------------------------------------------------------------------------------
 
-void
-IOUSBMassStorageClass::CheckDeferredTermination ( void )
+bool
+IOUSBMassStorageClass::IsTransportBusy ( void )
 {
 	
-	require ( fWorkLoop->inGate ( ) == true, Exit );
-	
-	if ( fTerminationDeferred == true )
+	if ( GetInterfaceProtocol ( ) == kProtocolBulkOnly )
 	{
-		
-		fTerminationDeferred = false;
-		
-		STATUS_LOG ( ( 6, "%s[%p]: CheckDeferredTermination: Waking didTerminate thread", getName(), this ) );
-		
-		fCommandGate->commandWakeup ( &fTerminationDeferred, false );
-		
+		return fBulkOnlyCommandStructInUse;
 	}
 	
+	// UAS is busy once every command tag is in use, including the tags of aborted commands
+	// whose transfers USB has not returned yet. New commands are also held back while a
+	// reset is reselecting the UAS alternate setting.
+	if ( GetInterfaceProtocol ( ) == kProtocolUSBAttachedSCSI )
+	{
+		return ( ( fResetInProgress == true ) || ( fUASOutstandingCount >= fUASQueueDepth ) || ( fRequestPoolFreeMask == 0 ) );
+	}
 	
-Exit:
-	
-	
-	return;
+	return fCBICommandStructInUse;
 	
 }
 
 
 //--------------------------------------------------------------------------------------------------
-//	GatedCompleteSCSICommand															[PRIVATE]
+//	ClaimTransport																		   [PRIVATE]
+//
+//		Takes ownership of the command structure (or, for UAS, reserves a command tag) on behalf
+//		of a task that is about to be dispatched. Must be called behind the command gate.
 //--------------------------------------------------------------------------------------------------
 
 void
-IOUSBMassStorageClass::GatedCompleteSCSICommand (
-	SCSITaskIdentifier 		request,
-	SCSIServiceResponse *	serviceResponse,
-	SCSITaskStatus *		taskStatus )
+IOUSBMassStorageClass::ClaimTransport ( void )
 {
 	
-	require ( request != NULL, Exit );
-	require ( serviceResponse != NULL, Exit );
-	require ( taskStatus != NULL, Exit );
-	
-	fBulkOnlyCommandStructInUse = false;
-	fCBICommandStructInUse 		= false;
-    
-	//	Clear the count of consecutive I/Os which required a USB Device Reset.
-	fConsecutiveResetCount = 0;
-	
-	STATUS_LOG ( ( 4, "%s[%p]: GatedCompleteSCSICommand request=%p serviceResponse=%d taskStatus=0x%02x", getName(), this, request, *serviceResponse, *taskStatus ) );
-	
-	RecordUSBTimeStamp (	UMC_TRACE ( kCompleteSCSICommand ),
-						( uintptr_t ) this, ( uintptr_t ) request,
-						*serviceResponse, *taskStatus );
-	
-	CommandCompleted ( request, *serviceResponse, *taskStatus );
-	
-	//	If didTerminate() was called while this SCSI task was outstanding, then termination would
-	//	have been deferred until it completed. Check for that now, while behind the command gate.
-	CheckDeferredTermination ( );
+	if ( GetInterfaceProtocol ( ) == kProtocolBulkOnly )
+	{
+		fBulkOnlyCommandStructInUse = true;
+	}
 	
+	else if ( GetInterfaceProtocol ( ) == kProtocolUSBAttachedSCSI )
+	{
+		fUASOutstandingCount++;
+	}
 	
-Exit:
-
+	else
+	{
+		fCBICommandStructInUse = true;
+	}
 	
-	return;
+	// Bulk Only and CBI run one command at a time, so the claim time is the start time of
+	// the command on the wire. UAS keeps a start time in each request block.
+	clock_get_uptime ( &fTransportClaimTime );
+	fPhaseStartTime = fTransportClaimTime;
 	
 }
 
 
 //--------------------------------------------------------------------------------------------------
-//	HandlePowerOn - Will get called when a device has been resumed     						[PUBLIC]
+//	ReleaseTransport																	   [PRIVATE]
 //--------------------------------------------------------------------------------------------------
 
-IOReturn
-IOUSBMassStorageClass::HandlePowerOn ( void )
+void
+IOUSBMassStorageClass::ReleaseTransport ( void )
 {
-	IOReturn status = kIOReturnSuccess;
-#ifndef EMBEDDED
-	UInt8	eStatus[2];
 	
-#endif // EMBEDDED
-    
-	// The USB hub port that the device is connected to has been resumed,
-	// check to see if the device is still responding correctly and if not, 
-	// fix it so that it is.
-	STATUS_LOG(( 6, "%s[%p]: HandlePowerOn", getName(), this ));
+	fBulkOnlyCommandStructInUse = false;
+	fCBICommandStructInUse 		= false;
 	
-#ifndef EMBEDDED
-	if ( ( GetStatusEndpointStatus ( GetBulkInPipe(), &eStatus[0], NULL ) != kIOReturnSuccess ) ||
-		 ( fRequiresResetOnResume == true ) )
-	{   
-		
-		RecordUSBTimeStamp ( UMC_TRACE ( kHandlePowerOnUSBReset ), ( uintptr_t ) this, NULL, NULL, NULL );
-							 
-        status = ResetDeviceNow ( true );
-        
+	if ( ( GetInterfaceProtocol ( ) == kProtocolUSBAttachedSCSI ) && ( fUASOutstandingCount != 0 ) )
+	{
+		fUASOutstandingCount--;
 	}
-#else // EMBEDDED
-        status = ResetDeviceNow( true );
-#endif // EMBEDDED
-	
-	// If our port was suspended before sleep, it would have been resumed as part
-	// of the global resume on system wake.
-	fPortIsSuspended = false;
-	
-	return status;
 	
 }
 
 
 //--------------------------------------------------------------------------------------------------
-//	handleOpen														   						[PUBLIC]
+//	EnqueueSCSITask																		   [PRIVATE]
 //--------------------------------------------------------------------------------------------------
 
 bool
-IOUSBMassStorageClass::handleOpen ( IOService *		client,
-									IOOptionBits		options,
-									void *			arg )
+IOUSBMassStorageClass::EnqueueSCSITask ( SCSITaskIdentifier request )
 {
 	
-	bool	result = false;
+	SCSITaskAdmissionQueue *	queue;
+	UInt8						lun;
+	bool						result = false;
 	
+	check ( fWorkLoop->inGate ( ) == true );
 	
-	// If this is a normal open on a single LUN device.
-	if ( GetMaxLogicalUnitNumber() == 0 )
+	lun 	= GetLogicalUnitNumber ( request ) & kCBWLUNMask;
+	queue 	= &fAdmissionQueue[lun];
+	
+	if ( queue->count == kIOUSBMassStorageAdmissionQueueDepth )
 	{
 		
-		result = super::handleOpen ( client, options, arg );
+		RecordUSBTimeStamp (	UMC_TRACE ( kSCSITaskQueueFull ),
+							( uintptr_t ) this, ( uintptr_t ) request, lun, queue->count );
+		fStatistics[kIOUSBMassStorageStatisticQueueFullRejections]++;
 		goto Exit;
 		
 	}
 	
-	// It's an open from a multi-LUN client
-	require_nonzero ( fClients, ErrorExit );
-	require_nonzero ( OSDynamicCast ( IOSCSILogicalUnitNub, client ), ErrorExit );
-	result = fClients->setObject ( client );
+	queue->tasks[( queue->head + queue->count ) % kIOUSBMassStorageAdmissionQueueDepth] = request;
+	queue->count++;
+	fAdmissionQueueCount++;
+	
+	RecordUSBTimeStamp (	UMC_TRACE ( kSCSITaskQueued ),
+						( uintptr_t ) this, ( uintptr_t ) request, lun, queue->count );
+	
+	result = true;
 	
 	
 Exit:
-ErrorExit:
 	
 	
 	return result;
@@ -2338,443 +3338,2617 @@ ErrorExit:
 
 
 //--------------------------------------------------------------------------------------------------
-//	handleClose													   							[PUBLIC]
+//	RequeueSCSITask - Puts back a task which was dequeued but could not be sent, ahead of
+//					  everything that arrived after it.									   [PRIVATE]
 //--------------------------------------------------------------------------------------------------
 
-void
-IOUSBMassStorageClass::handleClose (	IOService *		client,
-										IOOptionBits	options )
+bool
+IOUSBMassStorageClass::RequeueSCSITask ( SCSITaskIdentifier request )
 {
-		
-	if ( GetMaxLogicalUnitNumber() == 0 )
-	{
-		super::handleClose ( client, options );
-		return;
-	}
 	
-	require_nonzero ( fClients, Exit );
+	SCSITaskAdmissionQueue *	queue;
+	UInt8						lun;
+	bool						result = false;
 	
-	if ( fClients->containsObject ( client ) )
+	check ( fWorkLoop->inGate ( ) == true );
+	
+	lun 	= GetLogicalUnitNumber ( request ) & kCBWLUNMask;
+	queue 	= &fAdmissionQueue[lun];
+	
+	if ( queue->count == kIOUSBMassStorageAdmissionQueueDepth )
 	{
-		fClients->removeObject( client );
 		
-		if ( ( fClients->getCount() == 0 ) && isInactive() )
-		{
-			message ( kIOMessageServiceIsRequestingClose, getProvider(), 0 );
-		}
+		RecordUSBTimeStamp (	UMC_TRACE ( kSCSITaskQueueFull ),
+							( uintptr_t ) this, ( uintptr_t ) request, lun, queue->count );
+		fStatistics[kIOUSBMassStorageStatisticQueueFullRejections]++;
+		goto Exit;
+		
 	}
 	
+	queue->head 				= ( queue->head + kIOUSBMassStorageAdmissionQueueDepth - 1 ) % kIOUSBMassStorageAdmissionQueueDepth;
+	queue->tasks[queue->head] 	= request;
+	queue->count++;
+	fAdmissionQueueCount++;
+	
+	// It was this LUN's turn when the task was taken, so it still is.
+	fNextLUNToService = lun;
+	
+	RecordUSBTimeStamp (	UMC_TRACE ( kSCSITaskQueued ),
+						( uintptr_t ) this, ( uintptr_t ) request, lun, queue->count );
+	
+	result = true;
+	
 	
 Exit:
 	
 	
-	return;
+	return result;
 	
 }
 
 
 //--------------------------------------------------------------------------------------------------
-//	handleIsOpen													   						[PUBLIC]
+//	DequeueSCSITask																		   [PRIVATE]
+//
+//		LUNs are serviced round robin so that a busy LUN cannot starve its neighbours on a
+//		multi-slot reader. Tasks within a LUN are taken in arrival order.
 //--------------------------------------------------------------------------------------------------
 
-bool
-IOUSBMassStorageClass::handleIsOpen ( const IOService * client ) const
+SCSITaskIdentifier
+IOUSBMassStorageClass::DequeueSCSITask ( void )
 {
 	
-	bool	result = false;
-	UInt8	lun = GetMaxLogicalUnitNumber();
+	SCSITaskAdmissionQueue *	queue;
+	SCSITaskIdentifier			request = NULL;
+	UInt8						lun;
+	UInt8						index;
 	
-	require_nonzero ( lun, CallSuperClass );
-	require_nonzero ( fClients, CallSuperClass );
+	check ( fWorkLoop->inGate ( ) == true );
 	
-	// General case (is anybody open)
-	if ( ( client == NULL ) && ( fClients->getCount ( ) != 0 ) )
+	require_quiet ( ( fAdmissionQueueCount != 0 ), Exit );
+	
+	for ( index = 0; index < kIOUSBMassStorageMaxLogicalUnits; index++ )
 	{
-		result = true;
+		
+		lun 	= ( fNextLUNToService + index ) % kIOUSBMassStorageMaxLogicalUnits;
+		queue 	= &fAdmissionQueue[lun];
+		
+		if ( queue->count == 0 )
+		{
+			continue;
+		}
+		
+		request 					= queue->tasks[queue->head];
+		queue->tasks[queue->head] 	= NULL;
+		queue->head 				= ( queue->head + 1 ) % kIOUSBMassStorageAdmissionQueueDepth;
+		queue->count--;
+		fAdmissionQueueCount--;
+		
+		fNextLUNToService = ( lun + 1 ) % kIOUSBMassStorageMaxLogicalUnits;
+		
+		RecordUSBTimeStamp (	UMC_TRACE ( kSCSITaskDequeued ),
+							( uintptr_t ) this, ( uintptr_t ) request, lun, queue->count );
+		
+		break;
+		
+	}
+	
+	
+Exit:
+	
+	
+	return request;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	StartNextQueuedSCSITask																   [PRIVATE]
+//
+//		Called behind the command gate whenever the transport may have become idle. Sends queued
+//		tasks until one of them owns the transport, or fails them all if the device is going away.
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::StartNextQueuedSCSITask ( void )
+{
+	
+	SCSITaskIdentifier		request;
+	IOReturn				status;
+	
+	check ( fWorkLoop->inGate ( ) == true );
+	
+	//	A task which fails to dispatch is completed from within the loop below, and that completion
+	//	calls back in here. The outer loop will pick up where it left off.
+	require_quiet ( ( fDispatchingQueuedTasks == false ), Exit );
+	
+	fDispatchingQueuedTasks = true;
+	
+	while ( ( fAdmissionQueueCount != 0 ) && ( IsTransportBusy ( ) == false ) )
+	{
+		
+		if ( ( fTerminating == true ) || ( fDeviceAttached == false ) || ( isInactive ( ) == true ) )
+		{
+			
+			FlushQueuedSCSITasks ( );
+			break;
+			
+		}
+		
+		request = DequeueSCSITask ( );
+		
+		ClaimTransport ( );
+		
+		status = DispatchSCSITask ( request );
+		if ( status != kIOReturnSuccess )
+		{
+			
+			SCSIServiceResponse	localServiceResponse 	= kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+			SCSITaskStatus		localTaskStatus			= kSCSITaskStatus_DeliveryFailure;
+			
+			STATUS_LOG ( ( 5, "%s[%p]: StartNextQueuedSCSITask failing request=%p due to status=0x%x", getName ( ), this, request, status ) );
+			GatedCompleteSCSICommand ( request, &localServiceResponse, &localTaskStatus );
+			
+		}
+		
+	}
+	
+	fDispatchingQueuedTasks = false;
+	
+	
+Exit:
+	
+	
+	return;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	FlushQueuedSCSITasks																   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::FlushQueuedSCSITasks ( void )
+{
+	
+	SCSITaskIdentifier		request;
+	
+	check ( fWorkLoop->inGate ( ) == true );
+	
+	while ( fAdmissionQueueCount != 0 )
+	{
+		
+		request = DequeueSCSITask ( );
+		
+		STATUS_LOG ( ( 4, "%s[%p]: FlushQueuedSCSITasks failing request=%p with device not present", getName ( ), this, request ) );
+		
+		RecordUSBTimeStamp (	UMC_TRACE ( kCompleteSCSICommand ),
+							( uintptr_t ) this, ( uintptr_t ) request,
+							kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE, kSCSITaskStatus_DeviceNotPresent );
+		
+		CommandCompleted ( request, kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE, kSCSITaskStatus_DeviceNotPresent );
+		
+	}
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	RemoveQueuedSCSITask - Takes a task out of the admission queue, keeping the order of the
+//						   tasks behind it.												   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+bool
+IOUSBMassStorageClass::RemoveQueuedSCSITask ( SCSITaskIdentifier request )
+{
+	
+	SCSITaskAdmissionQueue *	queue;
+	UInt8						lun;
+	UInt8						index;
+	bool						result = false;
+	
+	check ( fWorkLoop->inGate ( ) == true );
+	
+	require_quiet ( ( fAdmissionQueueCount != 0 ), Exit );
+	
+	lun 	= GetLogicalUnitNumber ( request ) & kCBWLUNMask;
+	queue 	= &fAdmissionQueue[lun];
+	
+	for ( index = 0; index < queue->count; index++ )
+	{
+		
+		if ( queue->tasks[( queue->head + index ) % kIOUSBMassStorageAdmissionQueueDepth] == request )
+		{
+			result = true;
+			break;
+		}
+		
+	}
+	
+	require_quiet ( result, Exit );
+	
+	for ( ; index + 1 < queue->count; index++ )
+	{
+		
+		queue->tasks[( queue->head + index ) % kIOUSBMassStorageAdmissionQueueDepth] =
+			queue->tasks[( queue->head + index + 1 ) % kIOUSBMassStorageAdmissionQueueDepth];
+		
+	}
+	
+	queue->tasks[( queue->head + index ) % kIOUSBMassStorageAdmissionQueueDepth] = NULL;
+	queue->count--;
+	fAdmissionQueueCount--;
+	
+	RecordUSBTimeStamp (	UMC_TRACE ( kSCSITaskDequeued ),
+						( uintptr_t ) this, ( uintptr_t ) request, lun, queue->count );
+	
+	
+Exit:
+	
+	
+	return result;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	AllocateRequestPool																	   [PRIVATE]
+//
+//		Preallocates the request blocks for the interface protocol, each with its own prepared
+//		descriptors, so that no allocation happens on the command path.
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageClass::AllocateRequestPool ( void )
+{
+	
+	IOReturn	status = kIOReturnNoMemory;
+	UInt32		index;
+	
+	fRequestPoolSize = kIOUSBMassStorageRequestPoolSize;
+	
+	if ( GetInterfaceProtocol ( ) == kProtocolUSBAttachedSCSI )
+	{
+		
+		// One slot per command tag.
+		fRequestPoolSize = fUASQueueDepth;
+		
+		fUASRequestPool = ( UASRequestSlot * ) IOMalloc ( sizeof ( UASRequestSlot ) * fRequestPoolSize );
+		require_nonzero ( fUASRequestPool, Exit );
+		bzero ( fUASRequestPool, sizeof ( UASRequestSlot ) * fRequestPoolSize );
+		
+		for ( index = 0; index < fRequestPoolSize; index++ )
+		{
+			
+			UASRequestSlot *	slot = &fUASRequestPool[index];
+			
+			slot->commandDescriptor = IOMemoryDescriptor::withAddress ( 
+												&slot->block.uasCommandIU, 
+												kUASCommandIUSize, 
+												kIODirectionOut );
+			require_nonzero_action ( slot->commandDescriptor, Exit, status = kIOReturnNoMemory );
+			
+			status = slot->commandDescriptor->prepare ( );
+			require_success_action ( status, Exit, slot->commandDescriptor->release ( ); slot->commandDescriptor = NULL );
+			
+			slot->statusDescriptor = IOMemoryDescriptor::withAddress ( 
+												&slot->block.uasStatusIU, 
+												kUASMaxStatusIUSize, 
+												kIODirectionIn );
+			require_nonzero_action ( slot->statusDescriptor, Exit, status = kIOReturnNoMemory );
+			
+			status = slot->statusDescriptor->prepare ( );
+			require_success_action ( status, Exit, slot->statusDescriptor->release ( ); slot->statusDescriptor = NULL );
+			
+		}
+		
+		// The shared status reader is used without streams, and for task management in either mode.
+		fUASStatusReader = ( UASStatusReader * ) IOMalloc ( sizeof ( UASStatusReader ) );
+		require_nonzero_action ( fUASStatusReader, Exit, status = kIOReturnNoMemory );
+		bzero ( fUASStatusReader, sizeof ( UASStatusReader ) );
+		
+		fUASStatusReader->descriptor = IOMemoryDescriptor::withAddress ( 
+												&fUASStatusReader->buffer, 
+												kUASMaxStatusIUSize, 
+												kIODirectionIn );
+		require_nonzero_action ( fUASStatusReader->descriptor, Exit, status = kIOReturnNoMemory );
+		
+		status = fUASStatusReader->descriptor->prepare ( );
+		require_success_action ( status, Exit, fUASStatusReader->descriptor->release ( ); fUASStatusReader->descriptor = NULL );
+		
+		fUASStatusReader->taskManagementDescriptor = IOMemoryDescriptor::withAddress ( 
+												&fUASStatusReader->taskManagementIU, 
+												kUASTaskManagementIUSize, 
+												kIODirectionOut );
+		require_nonzero_action ( fUASStatusReader->taskManagementDescriptor, Exit, status = kIOReturnNoMemory );
+		
+		status = fUASStatusReader->taskManagementDescriptor->prepare ( );
+		require_success_action ( status, Exit, fUASStatusReader->taskManagementDescriptor->release ( ); fUASStatusReader->taskManagementDescriptor = NULL );
+		
+	}
+	
+	// CB devices run through the CBI engine as well, so only Bulk Only gets the CBW/CSW pool.
+	else if ( GetInterfaceProtocol ( ) != kProtocolBulkOnly )
+	{
+		
+		fCBIRequestPool = ( CBIRequestSlot * ) IOMalloc ( sizeof ( CBIRequestSlot ) * kIOUSBMassStorageRequestPoolSize );
+		require_nonzero ( fCBIRequestPool, Exit );
+		bzero ( fCBIRequestPool, sizeof ( CBIRequestSlot ) * kIOUSBMassStorageRequestPoolSize );
+		
+		for ( index = 0; index < kIOUSBMassStorageRequestPoolSize; index++ )
+		{
+			
+			CBIRequestSlot *	slot = &fCBIRequestPool[index];
+			
+			slot->statusDescriptor = IOMemoryDescriptor::withAddress ( 
+												&slot->block.cbiGetStatusBuffer, 
+												kUSBStorageAutoStatusSize, 
+												kIODirectionIn );
+			require_nonzero_action ( slot->statusDescriptor, Exit, status = kIOReturnNoMemory );
+			
+			status = slot->statusDescriptor->prepare ( );
+			require_success_action ( status, Exit, slot->statusDescriptor->release ( ); slot->statusDescriptor = NULL );
+			
+			status = AllocateDataSegments ( &slot->segmentedData );
+			require_success ( status, Exit );
+			
+		}
+		
+	}
+	
+	else
+	{
+		
+		fBulkOnlyRequestPool = ( BulkOnlyRequestSlot * ) IOMalloc ( sizeof ( BulkOnlyRequestSlot ) * kIOUSBMassStorageRequestPoolSize );
+		require_nonzero ( fBulkOnlyRequestPool, Exit );
+		bzero ( fBulkOnlyRequestPool, sizeof ( BulkOnlyRequestSlot ) * kIOUSBMassStorageRequestPoolSize );
+		
+		for ( index = 0; index < kIOUSBMassStorageRequestPoolSize; index++ )
+		{
+			
+			BulkOnlyRequestSlot *	slot = &fBulkOnlyRequestPool[index];
+			
+			slot->cbwDescriptor = IOMemoryDescriptor::withAddress ( 
+												&slot->block.boCBW, 
+												kByteCountOfCBW, 
+												kIODirectionOut );
+			require_nonzero_action ( slot->cbwDescriptor, Exit, status = kIOReturnNoMemory );
+			
+			status = slot->cbwDescriptor->prepare ( );
+			require_success_action ( status, Exit, slot->cbwDescriptor->release ( ); slot->cbwDescriptor = NULL );
+			
+			slot->cswDescriptor = IOMemoryDescriptor::withAddress ( 
+												&slot->block.boCSW, 
+												kByteCountOfCSW, 
+												kIODirectionIn );
+			require_nonzero_action ( slot->cswDescriptor, Exit, status = kIOReturnNoMemory );
+			
+			status = slot->cswDescriptor->prepare ( );
+			require_success_action ( status, Exit, slot->cswDescriptor->release ( ); slot->cswDescriptor = NULL );
+			
+			status = AllocateDataSegments ( &slot->segmentedData );
+			require_success ( status, Exit );
+			
+		}
+		
+	}
+	
+	// The pool never holds more than 32 slots.
+	fRequestPoolFreeMask = ( fRequestPoolSize == 32 ) ? 0xFFFFFFFF : ( ( 1 << fRequestPoolSize ) - 1 );
+	status = kIOReturnSuccess;
+	
+	
+Exit:
+	
+	
+	return status;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	FreeRequestPool																		   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::FreeRequestPool ( void )
+{
+	
+	UInt32		index;
+	
+	fRequestPoolFreeMask = 0;
+	fBulkOnlyCurrentRequestBlock = NULL;
+	fCBICurrentRequestBlock = NULL;
+	
+	if ( fUASRequestPool != NULL )
+	{
+		
+		for ( index = 0; index < fRequestPoolSize; index++ )
+		{
+			
+			if ( fUASRequestPool[index].commandDescriptor != NULL )
+			{
+				
+				fUASRequestPool[index].commandDescriptor->complete ( );
+				fUASRequestPool[index].commandDescriptor->release ( );
+				fUASRequestPool[index].commandDescriptor = NULL;
+				
+			}
+			
+			if ( fUASRequestPool[index].statusDescriptor != NULL )
+			{
+				
+				fUASRequestPool[index].statusDescriptor->complete ( );
+				fUASRequestPool[index].statusDescriptor->release ( );
+				fUASRequestPool[index].statusDescriptor = NULL;
+				
+			}
+			
+		}
+		
+		IOFree ( fUASRequestPool, sizeof ( UASRequestSlot ) * fRequestPoolSize );
+		fUASRequestPool = NULL;
+		
+	}
+	
+	if ( fUASStatusReader != NULL )
+	{
+		
+		if ( fUASStatusReader->descriptor != NULL )
+		{
+			
+			fUASStatusReader->descriptor->complete ( );
+			fUASStatusReader->descriptor->release ( );
+			fUASStatusReader->descriptor = NULL;
+			
+		}
+		
+		if ( fUASStatusReader->taskManagementDescriptor != NULL )
+		{
+			
+			fUASStatusReader->taskManagementDescriptor->complete ( );
+			fUASStatusReader->taskManagementDescriptor->release ( );
+			fUASStatusReader->taskManagementDescriptor = NULL;
+			
+		}
+		
+		IOFree ( fUASStatusReader, sizeof ( UASStatusReader ) );
+		fUASStatusReader = NULL;
+		
+	}
+	
+	if ( fCBIRequestPool != NULL )
+	{
+		
+		for ( index = 0; index < kIOUSBMassStorageRequestPoolSize; index++ )
+		{
+			
+			if ( fCBIRequestPool[index].statusDescriptor != NULL )
+			{
+				
+				fCBIRequestPool[index].statusDescriptor->complete ( );
+				fCBIRequestPool[index].statusDescriptor->release ( );
+				fCBIRequestPool[index].statusDescriptor = NULL;
+				
+			}
+			
+			FreeDataSegments ( &fCBIRequestPool[index].segmentedData );
+			
+		}
+		
+		IOFree ( fCBIRequestPool, sizeof ( CBIRequestSlot ) * kIOUSBMassStorageRequestPoolSize );
+		fCBIRequestPool = NULL;
+		
+	}
+	
+	if ( fBulkOnlyRequestPool != NULL )
+	{
+		
+		for ( index = 0; index < kIOUSBMassStorageRequestPoolSize; index++ )
+		{
+			
+			if ( fBulkOnlyRequestPool[index].cbwDescriptor != NULL )
+			{
+				
+				fBulkOnlyRequestPool[index].cbwDescriptor->complete ( );
+				fBulkOnlyRequestPool[index].cbwDescriptor->release ( );
+				fBulkOnlyRequestPool[index].cbwDescriptor = NULL;
+				
+			}
+			
+			if ( fBulkOnlyRequestPool[index].cswDescriptor != NULL )
+			{
+				
+				fBulkOnlyRequestPool[index].cswDescriptor->complete ( );
+				fBulkOnlyRequestPool[index].cswDescriptor->release ( );
+				fBulkOnlyRequestPool[index].cswDescriptor = NULL;
+				
+			}
+			
+			FreeDataSegments ( &fBulkOnlyRequestPool[index].segmentedData );
+			
+		}
+		
+		IOFree ( fBulkOnlyRequestPool, sizeof ( BulkOnlyRequestSlot ) * kIOUSBMassStorageRequestPoolSize );
+		fBulkOnlyRequestPool = NULL;
+		
+	}
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	AllocateRequestSlot																	   [PRIVATE]
+//
+//		Takes a slot off the free mask. Lock free, since commands may be staged from outside the
+//		command gate while the previous command is being completed on the workloop.
+//--------------------------------------------------------------------------------------------------
+
+int
+IOUSBMassStorageClass::AllocateRequestSlot ( void )
+{
+	
+	UInt32		bit;
+	int			index;
+	
+	for ( index = 0; index < ( int ) fRequestPoolSize; index++ )
+	{
+		
+		bit = ( 1 << index );
+		
+		// OSBitAndAtomic returns the previous value, so we own the slot if its bit was still set.
+		if ( ( OSBitAndAtomic ( ~bit, &fRequestPoolFreeMask ) & bit ) != 0 )
+		{
+			return index;
+		}
+		
+	}
+	
+	return -1;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	ReleaseRequestSlot																	   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::ReleaseRequestSlot ( int slotIndex )
+{
+	
+	check ( ( fRequestPoolFreeMask & ( 1 << slotIndex ) ) == 0 );
+	OSBitOrAtomic ( ( 1 << slotIndex ), &fRequestPoolFreeMask );
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	AutoTuneInitialize - With the auto tune characteristic set, use the maximum byte count
+//						 remembered for this device, or measure for one during the first
+//						 minutes of use. Full and low speed devices keep the default.	   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::AutoTuneInitialize ( OSDictionary * characterDict )
+{
+	
+	OSNumber *		remembered 	= NULL;
+	UInt64			window		= 0;
+	char			key[64];
+	
+	fAutoTuneActive 		= false;
+	fAutoTunedMaxByteCount 	= 0;
+	bzero ( fAutoTuneStatistics, sizeof ( fAutoTuneStatistics ) );
+	
+	require_quiet ( ( characterDict != NULL ), Exit );
+	require_quiet ( ( characterDict->getObject ( kIOUSBMassStorageAutoTuneMaxByteCount ) != NULL ), Exit );
+	
+	// Below high speed the bus, not the transfer size, sets the pace, and anything larger than
+	// the default only makes each command take longer to fail.
+	require_quiet ( ( GetInterfaceReference()->GetDevice()->GetSpeed() >= kUSBDeviceSpeedHigh ), Exit );
+	require ( ( gAutoTuneLock != NULL ) && ( gAutoTuneResults != NULL ), Exit );
+	require ( GetAutoTuneDeviceKey ( key, sizeof ( key ) ), Exit );
+	
+	IOLockLock ( gAutoTuneLock );
+	
+	remembered = OSDynamicCast ( OSNumber, gAutoTuneResults->getObject ( key ) );
+	if ( remembered != NULL )
+	{
+		fAutoTunedMaxByteCount = remembered->unsigned32BitValue ( );
+	}
+	
+	IOLockUnlock ( gAutoTuneLock );
+	
+	if ( fAutoTunedMaxByteCount != 0 )
+	{
+		
+		STATUS_LOG ( ( 4, "%s[%p]: AutoTuneInitialize using remembered maximum byte count %u for %s", getName(), this, fAutoTunedMaxByteCount, key ) );
+		setProperty ( kIOUSBMassStorageTunedMaxByteCountKey, fAutoTunedMaxByteCount, 32 );
+		goto Exit;
+		
+	}
+	
+	nanoseconds_to_absolutetime ( ( UInt64 ) kIOUSBMassStorageAutoTuneWindowSeconds * NSEC_PER_SEC, &window );
+	clock_get_uptime ( &fAutoTuneDeadline );
+	fAutoTuneDeadline += window;
+	fAutoTuneActive = true;
+	
+	STATUS_LOG ( ( 4, "%s[%p]: AutoTuneInitialize measuring transfer sizes for %s", getName(), this, key ) );
+	
+	
+Exit:
+	
+	
+	return;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	AutoTuneRecordSample - Counts a completed command against its candidate size. Commands
+//						   of half a candidate or less say nothing about the largest size the
+//						   device handles well, and are ignored.						   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::AutoTuneRecordSample ( SCSITaskIdentifier request, UInt64 startTime, UInt64 endTime, bool failed )
+{
+	
+	TransferSizeStatistics *	statistics	= NULL;
+	UInt64						length		= 0;
+	UInt64						candidate	= kIOUSBMassStorageAutoTuneMinByteCount;
+	UInt32						index		= 0;
+	
+	require_quiet ( fAutoTuneActive, Exit );
+	
+	length = GetRequestedDataTransferCount ( request );
+	while ( ( index < kIOUSBMassStorageAutoTuneSizes ) && ( length > candidate ) )
+	{
+		
+		index++;
+		candidate <<= 1;
+		
+	}
+	
+	require_quiet ( ( index < kIOUSBMassStorageAutoTuneSizes ), CheckDeadline );
+	require_quiet ( ( length > ( candidate / 2 ) ), CheckDeadline );
+	
+	statistics = &fAutoTuneStatistics[index];
+	statistics->commands++;
+	
+	if ( failed == true )
+	{
+		
+		statistics->errors++;
+		
+		// Stop as soon as a size is ruled out, so the next attach uses something smaller
+		// even if this session goes on to lose the device.
+		if ( ( statistics->errors * kIOUSBMassStorageAutoTuneMaxErrorRatio ) > statistics->commands )
+		{
+			
+			AutoTuneFinish ( );
+			goto Exit;
+			
+		}
+		
+	}
+	
+	else
+	{
+		
+		statistics->bytes 		+= GetRealizedDataTransferCount ( request );
+		statistics->busyTime 	+= endTime - startTime;
+		
+	}
+	
+	
+CheckDeadline:
+	
+	
+	if ( endTime >= fAutoTuneDeadline )
+	{
+		AutoTuneFinish ( );
+	}
+	
+	
+Exit:
+	
+	
+	return;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	AutoTuneFinish - Settles on the candidate with the best throughput below the smallest size
+//					 that failed too often, publishes it and remembers it for this device.
+//																					   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::AutoTuneFinish ( void )
+{
+	
+	OSNumber *		result		= NULL;
+	UInt64			bestRate	= 0;
+	UInt32			ceiling		= kIOUSBMassStorageAutoTuneSizes;
+	UInt32			best		= kIOUSBMassStorageAutoTuneSizes;
+	UInt32			index;
+	char			key[64];
+	
+	fAutoTuneActive = false;
+	
+	for ( index = 0; index < kIOUSBMassStorageAutoTuneSizes; index++ )
+	{
+		
+		TransferSizeStatistics *	statistics = &fAutoTuneStatistics[index];
+		
+		if ( ( statistics->errors * kIOUSBMassStorageAutoTuneMaxErrorRatio ) > statistics->commands )
+		{
+			
+			ceiling = index;
+			break;
+			
+		}
+		
+	}
+	
+	for ( index = 0; index < ceiling; index++ )
+	{
+		
+		TransferSizeStatistics *	statistics = &fAutoTuneStatistics[index];
+		UInt64						rate;
+		
+		if ( ( statistics->commands < kIOUSBMassStorageAutoTuneMinCommands ) || ( statistics->busyTime == 0 ) )
+		{
+			continue;
+		}
+		
+		// Bytes per 1024 absolute time units; only compared against the other sizes.
+		rate = ( statistics->bytes << 10 ) / statistics->busyTime;
+		if ( rate > bestRate )
+		{
+			
+			bestRate 	= rate;
+			best		= index;
+			
+		}
+		
+	}
+	
+	// Not enough traffic to judge by. Only settle on a size if one was ruled out.
+	if ( best == kIOUSBMassStorageAutoTuneSizes )
+	{
+		
+		require_quiet ( ( ceiling < kIOUSBMassStorageAutoTuneSizes ), Exit );
+		best = ( ceiling > 0 ) ? ( ceiling - 1 ) : 0;
+		
+	}
+	
+	fAutoTunedMaxByteCount = kIOUSBMassStorageAutoTuneMinByteCount << best;
+	setProperty ( kIOUSBMassStorageTunedMaxByteCountKey, fAutoTunedMaxByteCount, 32 );
+	
+	require ( GetAutoTuneDeviceKey ( key, sizeof ( key ) ), Exit );
+	
+	result = OSNumber::withNumber ( fAutoTunedMaxByteCount, 32 );
+	require_nonzero ( result, Exit );
+	
+	IOLockLock ( gAutoTuneLock );
+	gAutoTuneResults->setObject ( key, result );
+	IOLockUnlock ( gAutoTuneLock );
+	
+	result->release ( );
+	
+	
+Exit:
+	
+	
+	STATUS_LOG ( ( 4, "%s[%p]: AutoTuneFinish settled on maximum byte count %u, ceiling index %u", getName(), this, fAutoTunedMaxByteCount, ceiling ) );
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	GetAutoTuneDeviceKey - Builds the "VID:PID:speed:serial" key tuning results are kept
+//						   under. A size measured on one bus speed says nothing about another.
+//																					   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+bool
+IOUSBMassStorageClass::GetAutoTuneDeviceKey ( char * key, size_t length )
+{
+	
+	IOUSBInterface *	interfaceRef	= NULL;
+	IOUSBDevice *		deviceRef		= NULL;
+	OSString *			serialNumber	= NULL;
+	bool				result			= false;
+	
+	interfaceRef = GetInterfaceReference ( );
+	require_nonzero ( interfaceRef, Exit );
+	
+	deviceRef = interfaceRef->GetDevice ( );
+	require_nonzero ( deviceRef, Exit );
+	
+	// Devices without a serial number share the result for their model.
+	serialNumber = OSDynamicCast ( OSString, deviceRef->getProperty ( kUSBSerialNumberString ) );
+	
+	snprintf ( key, length, "%04x:%04x:%u:%s",
+			   deviceRef->GetVendorID ( ),
+			   deviceRef->GetProductID ( ),
+			   ( unsigned int ) deviceRef->GetSpeed ( ),
+			   ( serialNumber != NULL ) ? serialNumber->getCStringNoCopy ( ) : "" );
+	
+	result = true;
+	
+	
+Exit:
+	
+	
+	return result;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	UseSegmentedDataTransfer															   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+bool
+IOUSBMassStorageClass::UseSegmentedDataTransfer ( UInt64 length )
+{
+	
+	return ( ( fDataSegmentSize != 0 ) && ( length > fDataSegmentSize ) );
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	AllocateDataSegments - Gives each segment entry of a request slot a sub-descriptor of its own,
+//						   so queuing a segment only re-targets it with initSubRange().
+//																					   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageClass::AllocateDataSegments ( SegmentedDataTransfer * transfer )
+{
+	
+	UInt32		index;
+	
+	// Segmentation is configured before the pool is built and never turned on later.
+	if ( fDataSegmentSize == 0 )
+	{
+		return kIOReturnSuccess;
+	}
+	
+	for ( index = 0; index < fDataSegmentsInFlight; index++ )
+	{
+		
+		transfer->segments[index].descriptor = OSTypeAlloc ( IOSubMemoryDescriptor );
+		if ( transfer->segments[index].descriptor == NULL )
+		{
+			return kIOReturnNoMemory;
+		}
+		
+	}
+	
+	return kIOReturnSuccess;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	FreeDataSegments																	   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::FreeDataSegments ( SegmentedDataTransfer * transfer )
+{
+	
+	UInt32		index;
+	
+	for ( index = 0; index < kIOUSBMassStorageMaxDataSegments; index++ )
+	{
+		
+		DataSegment *	segment = &transfer->segments[index];
+		
+		if ( segment->descriptor == NULL )
+		{
+			continue;
+		}
+		
+		if ( segment->prepared == true )
+		{
+			
+			segment->descriptor->complete ( );
+			segment->prepared = false;
+			
+		}
+		
+		// Also drops the reference on the last client buffer the entry pointed at.
+		segment->descriptor->release ( );
+		segment->descriptor = NULL;
+		
+	}
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	StartSegmentedDataTransfer - Splits a data phase into segments of fDataSegmentSize and keeps
+//								 up to fDataSegmentsInFlight of them queued on the pipe. The
+//								 protocol completion is called once, after the last segment has
+//								 returned, with the status and residue of the whole phase.
+//																					   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageClass::StartSegmentedDataTransfer ( 
+							SegmentedDataTransfer *		transfer,
+							IOUSBPipe *					pipe,
+							IOMemoryDescriptor *		buffer,
+							UInt64						length,
+							UInt32						timeout,
+							IOUSBCompletion *			completion )
+{
+	
+	IOReturn	status 	= kIOReturnError;
+	UInt32		index;
+	
+	require_nonzero ( pipe, Exit );
+	require_nonzero ( buffer, Exit );
+	require ( ( transfer->segmentsInFlight == 0 ), Exit );
+	
+	// The segment entries keep their descriptors from the pool, IssueDataSegment fills in the rest.
+	bzero ( transfer, offsetof ( SegmentedDataTransfer, segments ) );
+	
+	transfer->completion 	= completion;
+	transfer->pipe			= pipe;
+	transfer->buffer		= buffer;
+	transfer->length		= length;
+	transfer->segmentSize	= fDataSegmentSize;
+	transfer->timeout		= timeout;
+	transfer->status		= kIOReturnSuccess;
+	
+	for ( index = 0; ( index < fDataSegmentsInFlight ) && ( transfer->nextOffset < length ); index++ )
+	{
+		
+		status = IssueDataSegment ( transfer, &transfer->segments[index] );
+		if ( status != kIOReturnSuccess )
+		{
+			break;
+		}
+		
+	}
+	
+	// Nothing made it out, the caller handles the failure as it would a single transfer.
+	require ( ( transfer->segmentsInFlight != 0 ), Exit );
+	
+	// Segments already queued will finish the phase and report the failure.
+	if ( status != kIOReturnSuccess )
+	{
+		
+		transfer->status 	= status;
+		transfer->ended		= true;
+		status 				= kIOReturnSuccess;
+		
+	}
+	
+	
+Exit:
+	
+	
+	STATUS_LOG ( ( 5, "%s[%p]: StartSegmentedDataTransfer length=%llu segments=%u returned %x", getName(), this, length, transfer->segmentsInFlight, status ) );
+	
+	return status;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	IssueDataSegment - Queues the next segment of the phase on the given segment entry.
+//																					   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageClass::IssueDataSegment ( 
+							SegmentedDataTransfer *		transfer,
+							DataSegment *				segment )
+{
+	
+	IOReturn	status = kIOReturnNoMemory;
+	
+	segment->transfer 	= transfer;
+	segment->offset		= transfer->nextOffset;
+	segment->length		= transfer->segmentSize;
+	
+	if ( ( transfer->length - transfer->nextOffset ) < transfer->segmentSize )
+	{
+		segment->length = ( UInt32 ) ( transfer->length - transfer->nextOffset );
+	}
+	
+	require_nonzero ( segment->descriptor, Exit );
+	require_action ( segment->descriptor->initSubRange ( transfer->buffer,
+														 segment->offset,
+														 segment->length,
+														 transfer->buffer->getDirection ( ) ),
+					 Exit,
+					 status = kIOReturnError );
+	
+	status = segment->descriptor->prepare ( );
+	require_success ( status, Exit );
+	
+	segment->prepared = true;
+	
+	segment->completion.target 		= this;
+	segment->completion.action 		= &this->DataSegmentCompletionAction;
+	segment->completion.parameter 	= segment;
+	
+	if ( transfer->pipe->GetDirection ( ) == kUSBIn )
+	{
+		
+		status = transfer->pipe->Read (	segment->descriptor,
+										transfer->timeout,
+										transfer->timeout,
+										segment->length,
+										&segment->completion );
+		
+	}
+	else
+	{
+		
+		status = transfer->pipe->Write (	segment->descriptor,
+											transfer->timeout,
+											transfer->timeout,
+											segment->length,
+											&segment->completion );
+		
+	}
+	
+	require_success ( status, CompleteDescriptor );
+	
+	transfer->segmentsInFlight++;
+	transfer->nextOffset += segment->length;
+	
+	goto Exit;
+	
+	
+CompleteDescriptor:
+	
+	
+	segment->descriptor->complete ( );
+	segment->prepared = false;
+	
+	
+Exit:
+	
+	
+	return status;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	DataSegmentCompletionAction															  [STATIC]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::DataSegmentCompletionAction ( 
+							void *						target,
+							void *						parameter,
+							IOReturn					status,
+							UInt32						bufferSizeRemaining )
+{
+	
+	IOUSBMassStorageClass *		theMSC 	= ( IOUSBMassStorageClass * ) target;
+	DataSegment *				segment	= ( DataSegment * ) parameter;
+	
+	theMSC->DataSegmentCompletion ( segment, status, bufferSizeRemaining );
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	DataSegmentCompletion - Segments on a pipe complete in order. The first one that comes back
+//							short or with an error ends the phase: anything queued behind it is
+//							aborted, and the residue is counted from that point.		   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::DataSegmentCompletion ( 
+							DataSegment *				segment,
+							IOReturn					status,
+							UInt32						bufferSizeRemaining )
+{
+	
+	SegmentedDataTransfer *		transfer 	= segment->transfer;
+	IOUSBCompletion *			completion	= NULL;
+	UInt32						transferred	= 0;
+	
+	if ( bufferSizeRemaining <= segment->length )
+	{
+		transferred = segment->length - bufferSizeRemaining;
+	}
+	
+	if ( segment->prepared == true )
+	{
+		
+		segment->descriptor->complete ( );
+		segment->prepared = false;
+		
+	}
+	
+	transfer->segmentsInFlight--;
+	
+	if ( transfer->ended == false )
+	{
+		
+		transfer->bytesTransferred += transferred;
+		
+		if ( ( status != kIOReturnSuccess ) || ( transferred < segment->length ) )
+		{
+			
+			// The device ended the data phase, or the transfer failed. Take back whatever is
+			// still queued. Abort may call back into here, so mark the phase ended first.
+			transfer->status 	= status;
+			transfer->ended 	= true;
+			
+			if ( transfer->segmentsInFlight != 0 )
+			{
+				transfer->pipe->Abort ( );
+			}
+			
+		}
+		else if ( transfer->nextOffset < transfer->length )
+		{
+			
+			status = IssueDataSegment ( transfer, segment );
+			if ( status != kIOReturnSuccess )
+			{
+				
+				transfer->status 	= status;
+				transfer->ended 	= true;
+				
+			}
+			
+		}
+		
+	}
+	else if ( ( status == kIOReturnSuccess ) && ( transferred != 0 ) && ( transfer->spillLength == 0 ) )
+	{
+		
+		// A segment queued after a short one picked up whatever the device sent next.
+		// The protocol has to recover, the data is not its to use.
+		transfer->spillLength = transferred;
+		
+	}
+	
+	// Report the whole phase once, after the last segment is back.
+	if ( ( transfer->segmentsInFlight == 0 ) && ( transfer->completion != NULL ) )
+	{
+		
+		completion 				= transfer->completion;
+		transfer->completion 	= NULL;
+		
+		STATUS_LOG ( ( 5, "%s[%p]: DataSegmentCompletion status=%x transferred=%llu of %llu", getName(), this, transfer->status, transfer->bytesTransferred, transfer->length ) );
+		
+		( *completion->action ) ( completion->target,
+								  completion->parameter,
+								  transfer->status,
+								  ( UInt32 ) ( transfer->length - transfer->bytesTransferred ) );
+		
+	}
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	CheckDeferredTermination																[PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::CheckDeferredTermination ( void )
+{
+	
+	require ( fWorkLoop->inGate ( ) == true, Exit );
+	
+	if ( fTerminationDeferred == true )
+	{
+		
+		fTerminationDeferred = false;
+		
+		STATUS_LOG ( ( 6, "%s[%p]: CheckDeferredTermination: Waking didTerminate thread", getName(), this ) );
+		
+		fCommandGate->commandWakeup ( &fTerminationDeferred, false );
+		
+	}
+	
+	
+Exit:
+	
+	
+	return;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	GatedCompleteSCSICommand															[PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::GatedCompleteSCSICommand (
+	SCSITaskIdentifier 		request,
+	SCSIServiceResponse *	serviceResponse,
+	SCSITaskStatus *		taskStatus )
+{
+	
+	require ( request != NULL, Exit );
+	require ( serviceResponse != NULL, Exit );
+	require ( taskStatus != NULL, Exit );
+	
+	ReleaseTransport ( );
+    
+	//	Clear the count of consecutive I/Os which required a USB Device Reset.
+	fConsecutiveResetCount = 0;
+	
+	STATUS_LOG ( ( 4, "%s[%p]: GatedCompleteSCSICommand request=%p serviceResponse=%d taskStatus=0x%02x", getName(), this, request, *serviceResponse, *taskStatus ) );
+	
+	RecordUSBTimeStamp (	UMC_TRACE ( kCompleteSCSICommand ),
+						( uintptr_t ) this, ( uintptr_t ) request,
+						*serviceResponse, *taskStatus );
+	
+	StartNextQueuedSCSITask ( );
+	
+	CommandCompleted ( request, *serviceResponse, *taskStatus );
+	
+	//	If didTerminate() was called while this SCSI task was outstanding, then termination would
+	//	have been deferred until it completed. Check for that now, while behind the command gate.
+	CheckDeferredTermination ( );
+	
+	
+Exit:
+
+	
+	return;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	HandlePowerOn - Will get called when a device has been resumed     						[PUBLIC]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageClass::HandlePowerOn ( void )
+{
+	IOReturn status = kIOReturnSuccess;
+#ifndef EMBEDDED
+	UInt8	eStatus[2];
+	
+#endif // EMBEDDED
+    
+	// The USB hub port that the device is connected to has been resumed,
+	// check to see if the device is still responding correctly and if not, 
+	// fix it so that it is.
+	STATUS_LOG(( 6, "%s[%p]: HandlePowerOn", getName(), this ));
+	
+#ifndef EMBEDDED
+	if ( ( GetStatusEndpointStatus ( GetBulkInPipe(), &eStatus[0], NULL ) != kIOReturnSuccess ) ||
+		 ( fRequiresResetOnResume == true ) )
+	{   
+		
+		RecordUSBTimeStamp ( UMC_TRACE ( kHandlePowerOnUSBReset ), ( uintptr_t ) this, NULL, NULL, NULL );
+							 
+        status = ResetDeviceNow ( true );
+        
+	}
+#else // EMBEDDED
+        status = ResetDeviceNow( true );
+#endif // EMBEDDED
+	
+	// If our port was suspended before sleep, it would have been resumed as part
+	// of the global resume on system wake.
+	fPortIsSuspended = false;
+	
+	return status;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	handleOpen														   						[PUBLIC]
+//--------------------------------------------------------------------------------------------------
+
+bool
+IOUSBMassStorageClass::handleOpen ( IOService *		client,
+									IOOptionBits		options,
+									void *			arg )
+{
+	
+	bool	result = false;
+	
+	
+	// If this is a normal open on a single LUN device.
+	if ( GetMaxLogicalUnitNumber() == 0 )
+	{
+		
+		result = super::handleOpen ( client, options, arg );
+		goto Exit;
+		
+	}
+	
+	// It's an open from a multi-LUN client
+	require_nonzero ( fClients, ErrorExit );
+	require_nonzero ( OSDynamicCast ( IOSCSILogicalUnitNub, client ), ErrorExit );
+	result = fClients->setObject ( client );
+	
+	
+Exit:
+ErrorExit:
+	
+	
+	return result;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	handleClose													   							[PUBLIC]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::handleClose (	IOService *		client,
+										IOOptionBits	options )
+{
+		
+	if ( GetMaxLogicalUnitNumber() == 0 )
+	{
+		super::handleClose ( client, options );
+		return;
+	}
+	
+	require_nonzero ( fClients, Exit );
+	
+	if ( fClients->containsObject ( client ) )
+	{
+		fClients->removeObject( client );
+		
+		if ( ( fClients->getCount() == 0 ) && isInactive() )
+		{
+			message ( kIOMessageServiceIsRequestingClose, getProvider(), 0 );
+		}
+	}
+	
+	
+Exit:
+	
+	
+	return;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	handleIsOpen													   						[PUBLIC]
+//--------------------------------------------------------------------------------------------------
+
+bool
+IOUSBMassStorageClass::handleIsOpen ( const IOService * client ) const
+{
+	
+	bool	result = false;
+	UInt8	lun = GetMaxLogicalUnitNumber();
+	
+	require_nonzero ( lun, CallSuperClass );
+	require_nonzero ( fClients, CallSuperClass );
+	
+	// General case (is anybody open)
+	if ( ( client == NULL ) && ( fClients->getCount ( ) != 0 ) )
+	{
+		result = true;
+	}
+	
+	else
+	{
+		// specific case (is this client open)
+		result = fClients->containsObject ( client );
+	}
+	
+	return result;
+	
+	
+CallSuperClass:
+	
+	
+	result = super::handleIsOpen ( client );	
+	return result;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	sWaitForReset																 [STATIC][PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageClass::sWaitForReset ( void * refcon )
+{
+	
+	return ( ( IOUSBMassStorageClass * ) refcon )->GatedWaitForReset();
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	GatedWaitForReset																	 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageClass::GatedWaitForReset ( void )
+{
+	
+	IOReturn status = kIOReturnSuccess;
+	
+	while ( fResetInProgress == true )
+	{
+		status = fCommandGate->commandSleep ( &fResetInProgress, THREAD_UNINT );
+	}
+	
+	return status;
+	
+}
+
+
+#ifndef EMBEDDED
+//--------------------------------------------------------------------------------------------------
+//	sWaitForTaskAbort															 [STATIC][PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageClass::sWaitForTaskAbort ( void * refcon )
+{
+	return kIOReturnUnsupported;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	GatedWaitForTaskAbort																 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageClass::GatedWaitForTaskAbort ( void )
+{
+	return kIOReturnUnsupported;
+}
+#endif // EMBEDDED
+
+
+//--------------------------------------------------------------------------------------------------
+//	sResetDevice																 [STATIC][PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::sResetDevice ( void * refcon )
+{
+	
+	IOUSBMassStorageClass *		driver          = NULL;
+    IOUSBInterface *			interfaceRef	= NULL;
+	IOUSBDevice *				deviceRef		= NULL;
+	IOReturn					status          = kIOReturnError;
+	UInt32						deviceInfo		= 0;
+	UInt64						resetStartTime	= 0;
+	USBFlightRecorder *			recorder		= NULL;
+	OSData *					recordData		= NULL;
+	
+	driver = ( IOUSBMassStorageClass * ) refcon;
+    require ( ( driver != NULL ), Exit );
+    
+	STATUS_LOG ( ( 4, "%s[%p]: sResetDevice Entered", driver->getName ( ), driver ) );
+
+	// Check if we should bail out because we are
+	// being terminated.
+	if ( ( driver->fTerminating == true ) ||
+		 ( driver->isInactive ( ) == true ) )
+	{
+        
+		STATUS_LOG ( ( 2, "%s[%p]: sResetDevice - We are being terminated!", driver->getName ( ), driver ) );
+		RecordUSBTimeStamp ( UMC_TRACE ( kUSBDeviceResetWhileTerminating ), ( uintptr_t ) driver, 
+                             ( unsigned int ) driver->fTerminating, ( unsigned int ) driver->isInactive ( ), NULL );
+        
+		goto ErrorExit;
+        
+	}
+    
+    interfaceRef = driver->GetInterfaceReference ( );
+    require ( ( interfaceRef != NULL ), ErrorExit );
+	
+	deviceRef = interfaceRef->GetDevice ( );
+	require ( ( deviceRef != NULL ), ErrorExit );
+	
+	// Check that we are still connected to the hub and that our port is enabled.
+	status = deviceRef->GetDeviceInformation ( &deviceInfo );
+	STATUS_LOG ( ( 5, "%s[%p]: GetDeviceInfo returned status = %x deviceInfo = %x", driver->getName ( ), driver, status, deviceInfo ) );
+    RecordUSBTimeStamp ( UMC_TRACE ( kDeviceInformation ), ( uintptr_t ) driver, status, deviceInfo, NULL );
+	require_noerr ( status, ErrorExit );
+	
+	// If GetDeviceInformation ( ) failed, or if the device is no longer connected, or if the device
+	// has been disabled by the IOUSBFamily, don't reset it. 
+	if ( ( ( deviceInfo & kUSBInformationDeviceIsConnectedMask ) == 0 ) ||
+		 ( ( ( deviceInfo & kUSBInformationDeviceIsEnabledMask ) == 0 ) && ( ( deviceInfo & kUSBInformationDeviceIsInternalMask ) == 0 ) ) )
+	{
+	
+		status = kIOReturnNoDevice;
+		RecordUSBTimeStamp ( UMC_TRACE ( kUSBDeviceResetAfterDisconnect ), ( uintptr_t ) driver, NULL, NULL, NULL );  
+		goto ErrorExit;
+		
+	}
+
+	// Make sure our port isn't suspended, it shouldn't be, but just in case.
+    // If the port is active this will be a NOP.
+	if ( deviceInfo & kUSBInformationDeviceIsSuspendedMask )
+	{
+		driver->SuspendPort ( false );
+	}
+	
+	// Once the device is reset we have to wait for the kIOUSBMessageCompositeDriverReconfigured
+	// message in order for the reset process to be considered complete. If we resume activity prior
+	// to receive the message our I/O may resume before the SET_CONFIGURATION following device reset
+	// makes it to our device. The flag is armed before the reset, since the message can be
+	// delivered before ResetDevice() returns.
+	IOLockLock ( driver->fRecoveryLock );
+	driver->fWaitingForReconfigurationMessage = true;
+	IOLockUnlock ( driver->fRecoveryLock );
+	
+	clock_get_uptime ( &resetStartTime );
+	
+	// Device is still attached. Lets try resetting it.
+	status = deviceRef->ResetDevice();
+	STATUS_LOG ( ( 5, "%s[%p]: ResetDevice() returned = %x", driver->getName ( ), driver, status ) );
+	RecordUSBTimeStamp ( UMC_TRACE ( kUSBDeviceResetReturned ), ( uintptr_t ) driver, status, NULL, NULL );
+	require_action ( ( status == kIOReturnSuccess ), ErrorExit, driver->fWaitingForReconfigurationMessage = false );
+	
+	// Reset host side data toggles.
+	if ( driver->fBulkInPipe != NULL )
+	{
+		driver->fBulkInPipe->ClearPipeStall ( false );
+	}
+	
+	if ( driver->fBulkOutPipe != NULL )
+	{
+		driver->fBulkOutPipe->ClearPipeStall ( false );
+	}
+	
+	if ( driver->fInterruptPipe != NULL )
+	{
+		driver->fInterruptPipe->ClearPipeStall ( false );
+	}
+	
+	
+ErrorExit:
+
+	
+	STATUS_LOG ( ( 2, "%s[%p]: sResetDevice status=0x%x fResetInProgress=%d", driver->getName ( ), driver, status, driver->fResetInProgress ) );
+
+	if ( status != kIOReturnSuccess )
+	{
+    
+        // We set the device state to detached so the proper status for the 
+        // device is returned along with the aborted SCSITask.
+        driver->fDeviceAttached = false;
+        
+        // Let the clients know that the device is gone.
+        driver->SendNotification_DeviceRemoved ( );
+		
+	}
+	
+	else 
+	{
+	
+		AbsoluteTime	deadline;
+		UInt64			reconfiguredTime	= 0;
+		UInt64			latency				= 0;
+		bool			timedOut			= false;
+		
+		// Sleep until message() sees the reconfiguration, or the timeout passes.
+		clock_interval_to_deadline ( kIOUSBMassStorageReconfigurationTimeoutMS, kMillisecondScale, ( uint64_t * ) &deadline );
+		
+		IOLockLock ( driver->fRecoveryLock );
+		
+		while ( driver->fWaitingForReconfigurationMessage == true )
+		{
+			
+			if ( IOLockSleepDeadline ( driver->fRecoveryLock, &driver->fWaitingForReconfigurationMessage, deadline, THREAD_UNINT ) == THREAD_TIMED_OUT )
+			{
+				
+				timedOut = driver->fWaitingForReconfigurationMessage;
+				break;
+				
+			}
+			
+		}
+		
+		driver->fWaitingForReconfigurationMessage = false;
+		
+		IOLockUnlock ( driver->fRecoveryLock );
+		
+		clock_get_uptime ( &reconfiguredTime );
+		absolutetime_to_nanoseconds ( reconfiguredTime - resetStartTime, &latency );
+		driver->fReconfigurationLatencyUS = ( UInt32 ) ( latency / 1000 );
+		
+		// This runs on the recovery worker, so the counters and the flight record are updated
+		// behind the command gate like everywhere else.
+		driver->fCommandGate->runAction ( OSMemberFunctionCast ( IOCommandGate::Action,
+																 driver,
+																 &IOUSBMassStorageClass::GatedNoteDeviceReset ) );
+		
+		if ( timedOut == false )
+		{
+			driver->RecordLatency ( kUSBLatencyPhaseUSBReset, resetStartTime );
+		}
+		
+		STATUS_LOG ( ( 4, "%s[%p]: sResetDevice reconfigured after %u us timedOut=%d", driver->getName ( ), driver, driver->fReconfigurationLatencyUS, timedOut ) );
+		RecordUSBTimeStamp ( UMC_TRACE ( kUSBDeviceReconfigured ), ( uintptr_t ) driver, driver->fReconfigurationLatencyUS, timedOut, NULL );
+
+#ifndef EMBEDDED
+		// Do we have a device which requires some to collect itself following a USB device reset?
+		// We only do this if the device successfully reconfigured.
+		if ( ( driver->fPostDeviceResetCoolDownInterval != 0 ) && 
+			 ( timedOut == false ) )
+		{
+			
+			// We do. Wait the prescribed amount of time.
+			IOSleep ( driver->fPostDeviceResetCoolDownInterval );
+			
+		}
+#endif // EMBEDDED
+		
+		// The reset put the interface back on its default alternate setting. Select the UAS
+		// setting again, and recreate its streams, before any queued task is sent.
+		if ( driver->GetInterfaceProtocol ( ) == kProtocolUSBAttachedSCSI )
+		{
+			
+			if ( driver->UASRestoreAfterReset ( ) != kIOReturnSuccess )
+			{
+				
+				driver->fDeviceAttached = false;
+				driver->SendNotification_DeviceRemoved ( );
+				
+			}
+			
+		}
+		
+	}
+     
+	// We complete the failed I/O with kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE  
+	// and either kSCSITaskStatus_DeliveryFailure or kSCSITaskStatus_DeviceNotPresent,
+	// as per the fDeviceAttached flag.
+	driver->AbortCurrentSCSITask ( );
+
+	// If the maximum number of unsuccessful resets has been exceeded, then terminate ourself.
+	if ( driver->fDeviceAttached == false && ( driver->isInactive() == false ) )
+	{
+		
+        // Leave behind some of evidence that there was a catastorphic failure which guided us to self termination. 
+        IOLog ( "[%p](%u)/(%u) Device not responding\n", driver, driver->fConsecutiveResetCount, kMaxConsecutiveResets );
+        
+        if  ( driver->GetInterfaceReference() != NULL )
+        {
+            
+            driver->GetInterfaceReference()->setProperty ( "IOUSBMassStorageClass Detached", driver->fConsecutiveResetCount, 8 );
+            
+            // And the commands which led up to it.
+            recorder = ( USBFlightRecorder * ) IOMalloc ( sizeof ( USBFlightRecorder ) );
+            if ( recorder != NULL )
+            {
+                
+                bzero ( recorder, sizeof ( USBFlightRecorder ) );
+                driver->CopyFlightRecorder ( recorder );
+                
+                recordData = OSData::withBytes ( recorder->records,
+                                                 min ( recorder->recordCount, kUSBFlightRecorderDepth ) * sizeof ( USBFlightRecord ) );
+                if ( recordData != NULL )
+                {
+                    
+                    driver->GetInterfaceReference()->setProperty ( kIOUSBMassStorageFlightRecorderKey, recordData );
+                    recordData->release ( );
+                    
+                }
+                
+                IOFree ( recorder, sizeof ( USBFlightRecorder ) );
+                
+            }
+            
+        }
+        
+		driver->fResetInProgress = false;
+				
+		if ( driver->fBlockOnResetThread == false )
+		{
+			driver->fResetStatus = kUSBResetStatusFailure;
+			// Unblock our main thread.
+			driver->fCommandGate->commandWakeup ( &driver->fResetInProgress, false );
+		
+		}
+        // Terminate.
+ 		driver->terminate();
+		
+	} 
+
+	else
+	
+	{
+	
+		driver->fResetInProgress = false;
+        
+		if ( driver->fBlockOnResetThread == false )
+		{
+			driver->fResetStatus = kUSBResetStatusSuccess;
+       	 	// Unblock our main thread.
+			driver->fCommandGate->commandWakeup ( &driver->fResetInProgress, false );
+        
+		}
+		
+		// Tasks which were queued while the reset was in progress can go now.
+		driver->fCommandGate->runAction ( OSMemberFunctionCast ( IOCommandGate::Action,
+																 driver,
+																 &IOUSBMassStorageClass::StartNextQueuedSCSITask ) );
+		
+	}
+	
+	STATUS_LOG ( ( 6, "%s[%p]: sResetDevice exiting.", driver->getName ( ), driver ) );
+	
+	// We retained the driver in ResetDeviceNow() when
+	// we queued the reset job.
+	driver->release();
+    
+    
+Exit:
+    
+    
+	return;
+	
+}
+
+
+#ifndef EMBEDDED
+//--------------------------------------------------------------------------------------------------
+//	sAbortCurrentSCSITask														 [STATIC][PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::sAbortCurrentSCSITask ( void * refcon )
+{
+}
+#endif // EMBEDDED
+
+
+//--------------------------------------------------------------------------------------------------
+//	ClearPipeStall - Method to recover from a pipe stall.
+//
+//						This method runs on the recovery worker because IOUSBPipe::ClearPipeStall() must
+//						not be called from the USB completion thread.
+//																							[PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::ClearPipeStall( void )
+{
+	
+	IOReturn					status = kIOReturnBadArgument;
+	IOUSBPipe *					pipe;
+	UInt8						endpointNumber;
+	IOUSBCompletion *			completion;
+	IOUSBInterface *			interfaceRef;
+	
+	STATUS_LOG ( ( 4, "%s[%p]: ClearPipeStall Entered with endpoint %d", getName ( ), this, fPotentiallyStalledPipe ? fPotentiallyStalledPipe->GetEndpointNumber() : -1 ) );
+
+	// The pipe to be cleared is specified by instance variable.	
+	pipe = fPotentiallyStalledPipe;
+	require ( ( pipe != NULL ), Exit );
+	
+	endpointNumber = pipe->GetEndpointNumber();
+	if ( pipe->GetDirection() == kUSBIn )
+	{
+		endpointNumber |= 0x80;
+	}
+
+	if ( fTerminating == true )
+	{
+		status = kIOReturnOffline;
+		goto Exit;
 	}
 	
+	// Make sure that the Data Toggles are reset before issuing the CLEAR_FEATURE device request.
+	// This synchronous method must not be called from the USB completion thread.
+	status = pipe->ClearPipeStall ( false );
+	require_success ( status, Exit );
+	
+	// Clear out the structure for the request
+	bzero ( &fUSBDeviceRequest, sizeof ( IOUSBDevRequest ) );
+	
+	// Build the USB command
+	fUSBDeviceRequest.bmRequestType 	= USBmakebmRequestType ( kUSBNone, kUSBStandard, kUSBEndpoint );
+	fUSBDeviceRequest.bRequest 			= kUSBRqClearFeature;
+	fUSBDeviceRequest.wValue			= kUSBFeatureEndpointStall;
+	fUSBDeviceRequest.wIndex			= endpointNumber;
+	
+	// We assume that the relevent IOUSBCompletion block can be determined solely from the interface protocol.
+	// The command may have been aborted while the job was queued, then nobody is waiting for the result.
+	if ( GetInterfaceProtocol() == kProtocolBulkOnly )
+	{
+		
+		BulkOnlyRequestBlock *	boRequestBlock = GetBulkOnlyRequestBlock ( );
+		
+		require_action ( ( boRequestBlock != NULL ), Exit, status = kIOReturnAborted );
+		completion = &boRequestBlock->boCompletion;
+		
+	}
+    
 	else
 	{
-		// specific case (is this client open)
-		result = fClients->containsObject ( client );
+		
+		CBIRequestBlock *		cbiRequestBlock = GetCBIRequestBlock ( );
+		
+		require_action ( ( cbiRequestBlock != NULL ), Exit, status = kIOReturnAborted );
+		completion = &cbiRequestBlock->cbiCompletion;
+		
+	}
+	
+	interfaceRef = GetInterfaceReference();
+	require ( interfaceRef != NULL, Exit );
+	
+	// Send the command over the control endpoint. Because we specify a completion argument, it executes
+	// asynchronously, with a callback to the protocol-specific completion method.
+	status = interfaceRef->DeviceRequest( &fUSBDeviceRequest, completion );
+	
+	RecordUSBTimeStamp (	UMC_TRACE ( kClearEndPointStall ), ( uintptr_t ) this, status, 
+						pipe->GetEndpointNumber(), NULL );
+	
+Exit:
+	
+	STATUS_LOG ( ( 5, "%s[%p]: ClearPipeStall Returning with status=0x%x", getName(), this, status ) );
+	
+	// Decrement our retain count here, to balance the retain which occurred when the job was queued.
+	release();
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	RecordLatency - Counts the time since startTime in the histogram for phase. Returns the
+//					current time, which callers use as the start of the next phase.  [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+UInt64
+IOUSBMassStorageClass::RecordLatency ( UInt32 phase, UInt64 startTime )
+{
+	
+	UInt64		now;
+	
+	clock_get_uptime ( &now );
+	RecordLatencyUntil ( phase, startTime, now );
+	
+	return now;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	RecordLatencyUntil - Counts the time from startTime to endTime in the histogram for phase.
+//						 Each phase is only updated from one thread at a time, so no lock is
+//						 taken.															   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::RecordLatencyUntil ( UInt32 phase, UInt64 startTime, UInt64 endTime )
+{
+	
+	USBFlightRecord *	record;
+	UInt64				latency;
+	UInt32				bucket = 0;
+	
+	if ( ( fDiagnostics != NULL ) && ( phase < kUSBLatencyPhaseCount ) && ( startTime != 0 ) && ( endTime > startTime ) )
+	{
+		
+		absolutetime_to_nanoseconds ( endTime - startTime, &latency );
+		latency /= 1000;
+		
+		// Transport phases are also kept with the command in the flight recorder. Bulk-Only
+		// and CBI list theirs in the same order, and a segmented data phase adds up.
+		record = CurrentFlightRecord ( );
+		if ( ( record != NULL ) && ( phase <= kUSBLatencyPhaseCBITotal ) )
+		{
+			record->phaseUS[( phase >= kUSBLatencyPhaseCBICommand ) ? ( phase - kUSBLatencyPhaseCBICommand ) : phase] += ( UInt32 ) latency;
+		}
+		
+		while ( ( latency > 1 ) && ( bucket < ( kUSBLatencyHistogramBuckets - 1 ) ) )
+		{
+			
+			latency >>= 1;
+			bucket++;
+			
+		}
+		
+		fDiagnostics->latencyHistograms[phase][bucket]++;
+		
+	}
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	RecordCommandStartTrace - Emits the kSCSICommand start record, with the CDB decoded.  [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::RecordCommandStartTrace ( SCSITaskIdentifier request, UInt32 tag )
+{
+	
+	SCSICommandDescriptorBlock	cdb;
+	UInt64						lba		= 0;
+	UInt32						length;
+	
+	// Skip the decoding too when nobody is listening.
+	require_quiet ( ( ( gUSBTraceCategories & kUSBTraceCategoryCommand ) != 0 ), Exit );
+	
+	GetCommandDescriptorBlock ( request, &cdb );
+	length = ( UInt32 ) GetRequestedDataTransferCount ( request );
+	
+	switch ( cdb[0] )
+	{
+		
+		case kSCSICmd_READ_6:
+		case kSCSICmd_WRITE_6:
+		{
+			
+			lba		= ( ( cdb[1] & 0x1F ) << 16 ) | ( cdb[2] << 8 ) | cdb[3];
+			length	= ( cdb[4] == 0 ) ? 256 : cdb[4];
+			
+		}
+		break;
+		
+		case kSCSICmd_READ_10:
+		case kSCSICmd_WRITE_10:
+		{
+			
+			lba		= OSReadBigInt32 ( cdb, 2 );
+			length	= OSReadBigInt16 ( cdb, 7 );
+			
+		}
+		break;
+		
+		case kSCSICmd_READ_12:
+		case kSCSICmd_WRITE_12:
+		{
+			
+			lba		= OSReadBigInt32 ( cdb, 2 );
+			length	= OSReadBigInt32 ( cdb, 6 );
+			
+		}
+		break;
+		
+		case kSCSICmd_READ_16:
+		case kSCSICmd_WRITE_16:
+		{
+			
+			lba		= OSReadBigInt64 ( cdb, 2 );
+			length	= OSReadBigInt32 ( cdb, 10 );
+			
+		}
+		break;
+		
+		default:
+			break;
+		
 	}
 	
-	return result;
+	RecordUSBTimeStamp (	UMC_TRACE ( kSCSICommand ) | DBG_FUNC_START,
+							( uintptr_t ) this,
+							( unsigned int ) lba,
+							length,
+							USB_COMMAND_START_INFO ( cdb[0], GetLogicalUnitNumber ( request ), ( lba >> 32 ), tag ) );
 	
 	
-CallSuperClass:
+Exit:
 	
 	
-	result = super::handleIsOpen ( client );	
-	return result;
+	return;
 	
 }
 
 
 //--------------------------------------------------------------------------------------------------
-//	sWaitForReset																 [STATIC][PROTECTED]
+//	RecordCommandEndTrace - Emits the kSCSICommand end record.							   [PRIVATE]
 //--------------------------------------------------------------------------------------------------
 
-IOReturn
-IOUSBMassStorageClass::sWaitForReset ( void * refcon )
+void
+IOUSBMassStorageClass::RecordCommandEndTrace (	SCSITaskIdentifier		request,
+												UInt64					startTime,
+												UInt64					endTime,
+												UInt32					tag,
+												SCSIServiceResponse		serviceResponse,
+												SCSITaskStatus			taskStatus )
 {
 	
-	return ( ( IOUSBMassStorageClass * ) refcon )->GatedWaitForReset();
+	UInt64		latency = 0;
+	
+	require_quiet ( ( ( gUSBTraceCategories & kUSBTraceCategoryCommand ) != 0 ), Exit );
+	
+	if ( ( startTime != 0 ) && ( endTime > startTime ) )
+	{
+		absolutetime_to_nanoseconds ( endTime - startTime, &latency );
+	}
+	
+	RecordUSBTimeStamp (	UMC_TRACE ( kSCSICommand ) | DBG_FUNC_END,
+							( uintptr_t ) this,
+							( unsigned int ) ( latency / 1000 ),
+							( unsigned int ) GetRealizedDataTransferCount ( request ),
+							USB_COMMAND_END_INFO ( taskStatus, serviceResponse, tag ) );
+	
+	
+Exit:
+	
+	
+	return;
 	
 }
 
 
 //--------------------------------------------------------------------------------------------------
-//	GatedWaitForReset																	 [PROTECTED]
+//	CopyLatencyHistograms																	[PUBLIC]
 //--------------------------------------------------------------------------------------------------
 
-IOReturn
-IOUSBMassStorageClass::GatedWaitForReset ( void )
+void
+IOUSBMassStorageClass::CopyLatencyHistograms ( USBLatencyHistograms * histograms )
 {
 	
-	IOReturn status = kIOReturnSuccess;
+	IOUSBInterface *	interfaceRef = GetInterfaceReference ( );
 	
-	while ( fResetInProgress == true )
+	require_nonzero ( fDiagnostics, Exit );
+	
+	// Counters may move while they are copied; the snapshot need not be exact.
+	bcopy ( fDiagnostics->latencyHistograms, histograms->buckets, sizeof ( histograms->buckets ) );
+	
+	if ( ( interfaceRef != NULL ) && ( interfaceRef->GetDevice ( ) != NULL ) )
 	{
-		status = fCommandGate->commandSleep ( &fResetInProgress, THREAD_UNINT );
+		
+		histograms->locationID 	= interfaceRef->GetDevice ( )->GetLocationID ( );
+		histograms->protocol	= interfaceRef->GetInterfaceProtocol ( );
+		
 	}
 	
-	return status;
+	
+Exit:
+	
+	
+	return;
 	
 }
 
 
-#ifndef EMBEDDED
 //--------------------------------------------------------------------------------------------------
-//	sWaitForTaskAbort															 [STATIC][PROTECTED]
+//	GetLocationID - Returns the location ID of the device, or zero.						[PUBLIC]
 //--------------------------------------------------------------------------------------------------
 
-IOReturn
-IOUSBMassStorageClass::sWaitForTaskAbort ( void * refcon )
+UInt32
+IOUSBMassStorageClass::GetLocationID ( void )
 {
-	return kIOReturnUnsupported;
+	
+	IOUSBInterface *	interfaceRef	= GetInterfaceReference ( );
+	UInt32				locationID		= 0;
+	
+	if ( ( interfaceRef != NULL ) && ( interfaceRef->GetDevice ( ) != NULL ) )
+	{
+		locationID = interfaceRef->GetDevice ( )->GetLocationID ( );
+	}
+	
+	return locationID;
+	
 }
 
 
 //--------------------------------------------------------------------------------------------------
-//	GatedWaitForTaskAbort																 [PROTECTED]
+//	ResetLatencyHistograms																	[PUBLIC]
 //--------------------------------------------------------------------------------------------------
 
-IOReturn
-IOUSBMassStorageClass::GatedWaitForTaskAbort ( void )
+void
+IOUSBMassStorageClass::ResetLatencyHistograms ( void )
 {
-	return kIOReturnUnsupported;
+	
+	if ( fDiagnostics != NULL )
+	{
+		bzero ( fDiagnostics->latencyHistograms, sizeof ( fDiagnostics->latencyHistograms ) );
+	}
+	
 }
-#endif // EMBEDDED
 
 
 //--------------------------------------------------------------------------------------------------
-//	sResetDevice																 [STATIC][PROTECTED]
+//	CopyFlightRecorder - Copies the recorded commands out, oldest first. Records are written
+//						 without a lock, so the one for the command in flight may be only
+//						 partly filled in.													[PUBLIC]
 //--------------------------------------------------------------------------------------------------
 
 void
-IOUSBMassStorageClass::sResetDevice ( void * refcon )
+IOUSBMassStorageClass::CopyFlightRecorder ( USBFlightRecorder * recorder )
 {
 	
-	IOUSBMassStorageClass *		driver          = NULL;
-    IOUSBInterface *			interfaceRef	= NULL;
-	IOUSBDevice *				deviceRef		= NULL;
-	IOReturn					status          = kIOReturnError;
-    thread_t                    thread          = THREAD_NULL;
-	UInt32						deviceInfo		= 0;
+	UInt32				count			= 0;
+	UInt32				first			= 0;
+	UInt32				index;
 	
-	driver = ( IOUSBMassStorageClass * ) refcon;
-    require ( ( driver != NULL ), Exit );
-    
-	STATUS_LOG ( ( 4, "%s[%p]: sResetDevice Entered", driver->getName ( ), driver ) );
-
-	// Check if we should bail out because we are
-	// being terminated.
-	if ( ( driver->fTerminating == true ) ||
-		 ( driver->isInactive ( ) == true ) )
+	if ( fDiagnostics != NULL )
 	{
-        
-		STATUS_LOG ( ( 2, "%s[%p]: sResetDevice - We are being terminated!", driver->getName ( ), driver ) );
-		RecordUSBTimeStamp ( UMC_TRACE ( kUSBDeviceResetWhileTerminating ), ( uintptr_t ) driver, 
-                             ( unsigned int ) driver->fTerminating, ( unsigned int ) driver->isInactive ( ), NULL );
-        
-		goto ErrorExit;
-        
+		count = fDiagnostics->flightRecordCount;
 	}
-    
-    interfaceRef = driver->GetInterfaceReference ( );
-    require ( ( interfaceRef != NULL ), ErrorExit );
-	
-	deviceRef = interfaceRef->GetDevice ( );
-	require ( ( deviceRef != NULL ), ErrorExit );
-	
-	// Check that we are still connected to the hub and that our port is enabled.
-	status = deviceRef->GetDeviceInformation ( &deviceInfo );
-	STATUS_LOG ( ( 5, "%s[%p]: GetDeviceInfo returned status = %x deviceInfo = %x", driver->getName ( ), driver, status, deviceInfo ) );
-    RecordUSBTimeStamp ( UMC_TRACE ( kDeviceInformation ), ( uintptr_t ) driver, status, deviceInfo, NULL );
-	require_noerr ( status, ErrorExit );
 	
-	// If GetDeviceInformation ( ) failed, or if the device is no longer connected, or if the device
-	// has been disabled by the IOUSBFamily, don't reset it. 
-	if ( ( ( deviceInfo & kUSBInformationDeviceIsConnectedMask ) == 0 ) ||
-		 ( ( ( deviceInfo & kUSBInformationDeviceIsEnabledMask ) == 0 ) && ( ( deviceInfo & kUSBInformationDeviceIsInternalMask ) == 0 ) ) )
+	if ( count > kUSBFlightRecorderDepth )
 	{
+		first = count - kUSBFlightRecorderDepth;
+	}
 	
-		status = kIOReturnNoDevice;
-		RecordUSBTimeStamp ( UMC_TRACE ( kUSBDeviceResetAfterDisconnect ), ( uintptr_t ) driver, NULL, NULL, NULL );  
-		goto ErrorExit;
+	for ( index = first; index < count; index++ )
+	{
+		
+		bcopy ( &fDiagnostics->flightRecords[index % kUSBFlightRecorderDepth],
+				&recorder->records[index - first],
+				sizeof ( USBFlightRecord ) );
 		
 	}
+	
+	recorder->recordCount	= count;
+	recorder->locationID	= GetLocationID ( );
+	
+}
 
-	// Make sure our port isn't suspended, it shouldn't be, but just in case.
-    // If the port is active this will be a NOP.
-	if ( deviceInfo & kUSBInformationDeviceIsSuspendedMask )
-	{
-		driver->SuspendPort ( false );
-	}
+
+//--------------------------------------------------------------------------------------------------
+//	BeginFlightRecord - Starts the record for a command about to be sent. Only called by the
+//						owner of the Bulk-Only or CBI transport, which is the only writer of
+//						the ring.														   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::BeginFlightRecord ( SCSITaskIdentifier request )
+{
 	
-	// Device is still attached. Lets try resetting it.
-	status = deviceRef->ResetDevice();
-	STATUS_LOG ( ( 5, "%s[%p]: ResetDevice() returned = %x", driver->getName ( ), driver, status ) );
-	RecordUSBTimeStamp ( UMC_TRACE ( kUSBDeviceResetReturned ), ( uintptr_t ) driver, status, NULL, NULL );
-	require ( ( status == kIOReturnSuccess ), ErrorExit );
+	USBFlightRecord *	record;
+	UInt64				now;
+	
+	require_nonzero ( fDiagnostics, Exit );
+	
+	record = &fDiagnostics->flightRecords[fDiagnostics->flightRecordCount % kUSBFlightRecorderDepth];
+	bzero ( record, sizeof ( USBFlightRecord ) );
+	
+	GetCommandDescriptorBlock ( request, ( SCSICommandDescriptorBlock * ) record->cdb );
+	record->lun			= GetLogicalUnitNumber ( request );
+	record->cswStatus	= kUSBFlightRecordNoCSW;
+	
+	clock_get_uptime ( &now );
+	absolutetime_to_nanoseconds ( now, &record->startTime );
+	
+	fDiagnostics->flightRecordCount++;
+	
+	
+Exit:
+	
+	
+	return;
+	
+}
 
-	// We successfully reset the device. Now we have to wait for the fWaitingForReconfigurationMessage
-	// message in order for the reset process to be considered complete. If we resume activity prior
-	// to receive the message our I/O may resume before the SET_CONFIGURATION following device reset
-	// makes it to our device. 
-	driver->fWaitingForReconfigurationMessage = true;
+
+//--------------------------------------------------------------------------------------------------
+//	CurrentFlightRecord - Returns the record of the latest command, or NULL.			   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+USBFlightRecord *
+IOUSBMassStorageClass::CurrentFlightRecord ( void )
+{
 	
-	// Reset host side data toggles.
-	if ( driver->fBulkInPipe != NULL )
+	if ( ( fDiagnostics == NULL ) || ( fDiagnostics->flightRecordCount == 0 ) )
 	{
-		driver->fBulkInPipe->ClearPipeStall ( false );
+		return NULL;
 	}
 	
-	if ( driver->fBulkOutPipe != NULL )
-	{
-		driver->fBulkOutPipe->ClearPipeStall ( false );
-	}
+	return &fDiagnostics->flightRecords[( fDiagnostics->flightRecordCount - 1 ) % kUSBFlightRecorderDepth];
 	
-	if ( driver->fInterruptPipe != NULL )
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	NoteFlightRecovery - Adds a kUSBFlightRecovery step to the latest command.			   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::NoteFlightRecovery ( UInt8 step )
+{
+	
+	USBFlightRecord *	record = CurrentFlightRecord ( );
+	
+	if ( record != NULL )
 	{
-		driver->fInterruptPipe->ClearPipeStall ( false );
+		record->recoverySteps |= step;
 	}
 	
-	
-ErrorExit:
+}
 
+
+//--------------------------------------------------------------------------------------------------
+//	GatedNoteDeviceReset - Counts a completed USB device reset, and adds it to the latest
+//						   command.														   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::GatedNoteDeviceReset ( void )
+{
 	
-	STATUS_LOG ( ( 2, "%s[%p]: sResetDevice status=0x%x fResetInProgress=%d", driver->getName ( ), driver, status, driver->fResetInProgress ) );
+	check ( fWorkLoop->inGate ( ) == true );
+	
+	fStatistics[kIOUSBMassStorageStatisticDeviceResets]++;
+	fStatistics[kIOUSBMassStorageStatisticReconfigurationLatency] = fReconfigurationLatencyUS;
+	NoteFlightRecovery ( kUSBFlightRecoveryDeviceReset );
+	
+}
 
-	if ( status != kIOReturnSuccess )
-	{
-    
-        // We set the device state to detached so the proper status for the 
-        // device is returned along with the aborted SCSITask.
-        driver->fDeviceAttached = false;
-        
-        // Let the clients know that the device is gone.
-        driver->SendNotification_DeviceRemoved ( );
-		
-	}
+
+//--------------------------------------------------------------------------------------------------
+//	EndFlightRecord - Marks the latest command complete.								   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::EndFlightRecord ( IOReturn result )
+{
 	
-	else 
-	{
+	USBFlightRecord *	record = CurrentFlightRecord ( );
 	
-		UInt16	timeout	= 0;
+	if ( record != NULL )
+	{
 		
-		while ( ( timeout < kIOUSBMassStorageReconfigurationTimeoutMS ) && 
-			    ( driver->fWaitingForReconfigurationMessage == true ) )
-		{
-			
-			// Hang out for a ms. 
-			IOSleep ( 1 );
-			
-			// Increment our timeout counter.
-			timeout++;
-			
-		}
-
-#ifndef EMBEDDED
-		// Do we have a device which requires some to collect itself following a USB device reset?
-		// We only do this if the device successfully reconfigured.
-		if ( ( driver->fPostDeviceResetCoolDownInterval != 0 ) && 
-			 ( driver->fWaitingForReconfigurationMessage == false ) )
-		{
-			
-			// We do. Wait the prescribed amount of time.
-			IOSleep ( driver->fPostDeviceResetCoolDownInterval );
-			
-		}
-#endif // EMBEDDED
+		record->result		= result;
+		record->completed	= 1;
 		
 	}
-     
-	// We complete the failed I/O with kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE  
-	// and either kSCSITaskStatus_DeliveryFailure or kSCSITaskStatus_DeviceNotPresent,
-	// as per the fDeviceAttached flag.
-	driver->AbortCurrentSCSITask ( );
+	
+}
 
-	// If the maximum number of unsuccessful resets has been exceeded, then terminate ourself.
-	if ( driver->fDeviceAttached == false && ( driver->isInactive() == false ) )
+
+//--------------------------------------------------------------------------------------------------
+//	PublishStatistics - Copies the counters into the Statistics dictionary on the interface.
+//																					   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::PublishStatistics ( void )
+{
+	
+	IOUSBInterface *	interfaceRef	= GetInterfaceReference ( );
+	OSNumber *			number			= NULL;
+	UInt32				index;
+	
+	fStatisticsPublishScheduled = false;
+	
+	require_quiet ( ( interfaceRef != NULL ), Exit );
+	
+	if ( fStatisticsDictionary == NULL )
 	{
 		
-        // Leave behind some of evidence that there was a catastorphic failure which guided us to self termination. 
-        IOLog ( "[%p](%u)/(%u) Device not responding\n", driver, driver->fConsecutiveResetCount, kMaxConsecutiveResets );
-        
-        if  ( driver->GetInterfaceReference() != NULL )
-        {
-            driver->GetInterfaceReference()->setProperty ( "IOUSBMassStorageClass Detached", driver->fConsecutiveResetCount, 8 );
-        }
-        
-		driver->fResetInProgress = false;
-				
-		if ( driver->fBlockOnResetThread == false )
-		{
-			driver->fResetStatus = kUSBResetStatusFailure;
-			// Unblock our main thread.
-			driver->fCommandGate->commandWakeup ( &driver->fResetInProgress, false );
+		fStatisticsDictionary = OSDictionary::withCapacity ( kIOUSBMassStorageStatisticCount );
+		require ( ( fStatisticsDictionary != NULL ), Exit );
 		
+		for ( index = 0; index < kIOUSBMassStorageStatisticCount; index++ )
+		{
+			
+			number = OSNumber::withNumber ( fStatistics[index], 64 );
+			if ( number != NULL )
+			{
+				
+				fStatisticsDictionary->setObject ( gStatisticKeys[index], number );
+				number->release ( );
+				
+			}
+			
 		}
-        // Terminate.
- 		driver->terminate();
 		
-	} 
-
-	else
+		interfaceRef->setProperty ( kIOUSBMassStorageStatisticsKey, fStatisticsDictionary );
+		goto Exit;
+		
+	}
 	
+	// Like IOBlockStorageDriver, update the published numbers in place rather than
+	// replacing the property.
+	for ( index = 0; index < kIOUSBMassStorageStatisticCount; index++ )
 	{
-	
-		driver->fResetInProgress = false;
-        
-		if ( driver->fBlockOnResetThread == false )
+		
+		number = OSDynamicCast ( OSNumber, fStatisticsDictionary->getObject ( gStatisticKeys[index] ) );
+		if ( number != NULL )
 		{
-			driver->fResetStatus = kUSBResetStatusSuccess;
-       	 	// Unblock our main thread.
-			driver->fCommandGate->commandWakeup ( &driver->fResetInProgress, false );
-        
+			number->setValue ( fStatistics[index] );
 		}
+		
 	}
 	
-	STATUS_LOG ( ( 6, "%s[%p]: sResetDevice exiting.", driver->getName ( ), driver ) );
 	
-	// We retained the driver in ResetDeviceNow() when
-	// we created a thread for sResetDevice().
-	driver->release();
-    
-    
 Exit:
-    
-    
-    // Terminate the thread.
-	thread = current_thread ( );
-    if ( thread != THREAD_NULL )
-    {
-        thread_deallocate ( thread );
-        thread_terminate ( thread );
-    }
-    
+	
+	
 	return;
 	
 }
 
 
-#ifndef EMBEDDED
 //--------------------------------------------------------------------------------------------------
-//	sAbortCurrentSCSITask														 [STATIC][PROTECTED]
+//	SchedulePublishStatistics - The counters are bumped on every command, the dictionary is
+//								refreshed by a thread call at most once per interval, so the
+//								completion path only tests a flag.					   [PRIVATE]
 //--------------------------------------------------------------------------------------------------
 
 void
-IOUSBMassStorageClass::sAbortCurrentSCSITask ( void * refcon )
+IOUSBMassStorageClass::SchedulePublishStatistics ( void )
 {
+	
+	AbsoluteTime	deadline;
+	
+	if ( ( fStatisticsPublishScheduled == true ) || ( fStatisticsThread == NULL ) || ( isInactive ( ) == true ) )
+	{
+		return;
+	}
+	
+	fStatisticsPublishScheduled = true;
+	
+	// Retain ourselves so that this object doesn't go away before the call runs.
+	retain ( );
+	
+	clock_interval_to_deadline ( kIOUSBMassStorageStatisticsIntervalMS, kMillisecondScale, &deadline );
+	if ( thread_call_enter_delayed ( fStatisticsThread, deadline ) )
+	{
+		
+		// Already enqueued, and holding a retain of its own.
+		release ( );
+		
+	}
+	
 }
-#endif // EMBEDDED
 
 
 //--------------------------------------------------------------------------------------------------
-//	ClearPipeStall - Method to recover from a pipe stall.
-//
-//						This method runs on a helper thread because IOUSBPipe::ClearPipeStall() must
-//						not be called from the USB completion thread.
-//																							[PRIVATE]
+//	sPublishStatistics																 [STATIC][PRIVATE]
 //--------------------------------------------------------------------------------------------------
 
 void
-IOUSBMassStorageClass::ClearPipeStall( void )
+IOUSBMassStorageClass::sPublishStatistics ( thread_call_param_t driver, thread_call_param_t unused )
 {
 	
-	IOReturn					status = kIOReturnBadArgument;
-	IOUSBPipe *					pipe;
-	UInt8						endpointNumber;
-	IOUSBCompletion *			completion;
-	IOUSBInterface *			interfaceRef;
-	thread_t					thread;
+	IOUSBMassStorageClass *		theMSC = ( IOUSBMassStorageClass * ) driver;
 	
-	STATUS_LOG ( ( 4, "%s[%p]: ClearPipeStall Entered with endpoint %d", getName ( ), this, fPotentiallyStalledPipe ? fPotentiallyStalledPipe->GetEndpointNumber() : -1 ) );
-
-	// The pipe to be cleared is specified by instance variable.	
-	pipe = fPotentiallyStalledPipe;
-	require ( ( pipe != NULL ), Exit );
+	( void ) unused;
 	
-	endpointNumber = pipe->GetEndpointNumber();
-	if ( pipe->GetDirection() == kUSBIn )
+	if ( theMSC->isInactive ( ) == false )
 	{
-		endpointNumber |= 0x80;
+		
+		theMSC->fCommandGate->runAction ( OSMemberFunctionCast (	IOCommandGate::Action,
+																	theMSC,
+																	&IOUSBMassStorageClass::PublishStatistics ) );
+		
 	}
+	
+	// Balances the retain taken when the call was scheduled.
+	theMSC->release ( );
+	
+}
 
-	if ( fTerminating == true )
-	{
-		status = kIOReturnOffline;
-		goto Exit;
-	}
+
+//--------------------------------------------------------------------------------------------------
+//	StartRecoveryWorker - Starts the thread which runs stall clearing and USB device resets for
+//						  this instance, so that recovery does not create a thread each time.
+//																						   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageClass::StartRecoveryWorker ( void )
+{
 	
-	// Make sure that the Data Toggles are reset before issuing the CLEAR_FEATURE device request.
-	// This synchronous method must not be called from the USB completion thread.
-	status = pipe->ClearPipeStall ( false );
-	require_success ( status, Exit );
+	thread_t		thread = THREAD_NULL;
+	kern_return_t	result = KERN_FAILURE;
+	IOReturn		status = kIOReturnNoMemory;
 	
-	// Clear out the structure for the request
-	bzero ( &fUSBDeviceRequest, sizeof ( IOUSBDevRequest ) );
+	fRecoveryLock = IOLockAlloc ( );
+	require_nonzero ( fRecoveryLock, Exit );
 	
-	// Build the USB command
-	fUSBDeviceRequest.bmRequestType 	= USBmakebmRequestType ( kUSBNone, kUSBStandard, kUSBEndpoint );
-	fUSBDeviceRequest.bRequest 			= kUSBRqClearFeature;
-	fUSBDeviceRequest.wValue			= kUSBFeatureEndpointStall;
-	fUSBDeviceRequest.wIndex			= endpointNumber;
+	fRecoveryJobHead 		= 0;
+	fRecoveryJobCount 		= 0;
+	fRecoveryWorkerExit 	= false;
+	fRecoveryWorkerRunning 	= true;
 	
-	// We assume that the relevent IOUSBCompletion block can be determined solely from the interface protocol.
-	if ( GetInterfaceProtocol() == kProtocolBulkOnly )
-	{
-		completion = &GetBulkOnlyRequestBlock()->boCompletion;
-	}
-    
-	else
+	// The worker holds its own retain, and dropping it is the last thing it does. A job may
+	// release the last reference a client had, so free() can never run under the worker.
+	retain ( );
+	
+	result = kernel_thread_start (	( thread_continue_t ) &IOUSBMassStorageClass::sRecoveryWorker,
+									this,
+									&thread );
+	require_action ( ( result == KERN_SUCCESS ), Exit, fRecoveryWorkerRunning = false; release ( ); status = kIOReturnNoResources );
+	
+	// The worker never needs to be looked up, so drop the reference kernel_thread_start() gave us.
+	thread_deallocate ( thread );
+	status = kIOReturnSuccess;
+	
+	
+Exit:
+	
+	
+	return status;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	StopRecoveryWorker - Called from stop(). No new jobs are accepted, and the worker exits once
+//						 the ones already queued have run. It is not waited for, since stop()
+//						 may itself be waiting on a reset the worker is running. The lock stays
+//						 until free(), which cannot run before the worker drops its retain.
+//																						   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::StopRecoveryWorker ( void )
+{
+	
+	require_quiet ( ( fRecoveryLock != NULL ), Exit );
+	
+	IOLockLock ( fRecoveryLock );
+	
+	fRecoveryWorkerExit = true;
+	IOLockWakeup ( fRecoveryLock, &fRecoveryJobCount, false );
+	
+	IOLockUnlock ( fRecoveryLock );
+	
+	
+Exit:
+	
+	
+	return;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	EnqueueRecoveryJob - Jobs run one at a time, in the order they were queued.		   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageClass::EnqueueRecoveryJob ( UInt8 type )
+{
+	
+	RecoveryJob *	job 	= NULL;
+	IOReturn		status 	= kIOReturnNoResources;
+	
+	require_nonzero ( fRecoveryLock, Exit );
+	
+	IOLockLock ( fRecoveryLock );
+	
+	if ( ( fRecoveryWorkerRunning == true ) && 
+		 ( fRecoveryWorkerExit == false ) &&
+		 ( fRecoveryJobCount < kIOUSBMassStorageRecoveryQueueDepth ) )
 	{
-		completion = &GetCBIRequestBlock()->cbiCompletion;
+		
+		job = &fRecoveryJobs[( fRecoveryJobHead + fRecoveryJobCount ) % kIOUSBMassStorageRecoveryQueueDepth];
+		job->type = type;
+		clock_get_uptime ( &job->queuedTime );
+		fRecoveryJobCount++;
+		
+		IOLockWakeup ( fRecoveryLock, &fRecoveryJobCount, true );
+		status = kIOReturnSuccess;
+		
 	}
 	
-	interfaceRef = GetInterfaceReference();
-	require ( interfaceRef != NULL, Exit );
+	RecordUSBTimeStamp (	UMC_TRACE ( kRecoveryJobQueued ),
+						( uintptr_t ) this, type, fRecoveryJobCount, status );
 	
-	// Send the command over the control endpoint. Because we specify a completion argument, it executes
-	// asynchronously, with a callback to the protocol-specific completion method.
-	status = interfaceRef->DeviceRequest( &fUSBDeviceRequest, completion );
+	IOLockUnlock ( fRecoveryLock );
 	
-	RecordUSBTimeStamp (	UMC_TRACE ( kClearEndPointStall ), ( uintptr_t ) this, status, 
-						pipe->GetEndpointNumber(), NULL );
 	
 Exit:
 	
-	STATUS_LOG ( ( 5, "%s[%p]: ClearPipeStall Returning with status=0x%x", getName(), this, status ) );
 	
-	// Decrement our retain count here, to balance the retain which occurred when our task was spawned.
-	release();
+	return status;
 	
-	// Terminate our helper thread.
-	thread = current_thread ( );
-	thread_deallocate ( thread );
-	thread_terminate ( thread );
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	sRecoveryWorker																 [STATIC][PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::sRecoveryWorker ( void * refcon )
+{
+	
+	( ( IOUSBMassStorageClass * ) refcon )->RecoveryWorker ( );
+	
+	thread_terminate ( current_thread ( ) );
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	RecoveryWorker - Body of the recovery worker thread.								   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::RecoveryWorker ( void )
+{
+	
+	RecoveryJob		job;
+	UInt64			started;
+	UInt64			finished;
+	UInt64			latency;
+	
+	IOLockLock ( fRecoveryLock );
+	
+	for ( ;; )
+	{
+		
+		while ( ( fRecoveryJobCount == 0 ) && ( fRecoveryWorkerExit == false ) )
+		{
+			IOLockSleep ( fRecoveryLock, &fRecoveryJobCount, THREAD_UNINT );
+		}
+		
+		if ( fRecoveryJobCount == 0 )
+		{
+			break;
+		}
+		
+		job = fRecoveryJobs[fRecoveryJobHead];
+		fRecoveryJobHead = ( fRecoveryJobHead + 1 ) % kIOUSBMassStorageRecoveryQueueDepth;
+		fRecoveryJobCount--;
+		
+		IOLockUnlock ( fRecoveryLock );
+		
+		clock_get_uptime ( &started );
+		absolutetime_to_nanoseconds ( started - job.queuedTime, &latency );
+		
+		RecordUSBTimeStamp (	UMC_TRACE ( kRecoveryJobStarted ),
+							( uintptr_t ) this, job.type, ( unsigned int ) ( latency / 1000 ), NULL );
+		
+		// Each job holds a retain on us, which the job itself drops.
+		switch ( job.type )
+		{
+			
+			case kIOUSBMassStorageRecoveryJobClearStall:
+			{
+				ClearPipeStall ( );
+			}
+			break;
+			
+			case kIOUSBMassStorageRecoveryJobResetDevice:
+			{
+				sResetDevice ( this );
+			}
+			break;
+			
+			default:
+			break;
+			
+		}
+		
+		clock_get_uptime ( &finished );
+		absolutetime_to_nanoseconds ( finished - started, &latency );
+		
+		RecordUSBTimeStamp (	UMC_TRACE ( kRecoveryJobFinished ),
+							( uintptr_t ) this, job.type, ( unsigned int ) ( latency / 1000 ), NULL );
+		
+		IOLockLock ( fRecoveryLock );
+		
+	}
+	
+	fRecoveryWorkerRunning = false;
+	IOLockUnlock ( fRecoveryLock );
+	
+	// May be the last reference, nothing may touch the instance after this.
+	release ( );
 	
 }
 
@@ -2802,20 +5976,36 @@ IOUSBMassStorageClass::StartDeviceRecovery ( void )
 	
 	if ( fBulkOnlyCommandStructInUse == true )
 	{
+		
+		BulkOnlyRequestBlock *	boRequestBlock = GetBulkOnlyRequestBlock ( );
+		
+		require ( ( boRequestBlock != NULL ), Exit );
+		
 		// Set up the IOUSBCompletion structure
-		fBulkOnlyCommandRequestBlock.boCompletion.target 		= this;
-		fBulkOnlyCommandRequestBlock.boCompletion.action 		= &this->DeviceRecoveryCompletionAction;
-		status = GetStatusEndpointStatus ( GetBulkInPipe(), &eStatus[0], &fBulkOnlyCommandRequestBlock.boCompletion);
+		boRequestBlock->boCompletion.target 		= this;
+		boRequestBlock->boCompletion.action 		= &this->DeviceRecoveryCompletionAction;
+		status = GetStatusEndpointStatus ( GetBulkInPipe(), &eStatus[0], &boRequestBlock->boCompletion);
+		
 	}
     
 	else if ( fCBICommandStructInUse == true )
 	{
+		
+		CBIRequestBlock *		cbiRequestBlock = GetCBIRequestBlock ( );
+		
+		require ( ( cbiRequestBlock != NULL ), Exit );
+		
 		// Set up the IOUSBCompletion structure
-		fCBICommandRequestBlock.cbiCompletion.target 		= this;
-		fCBICommandRequestBlock.cbiCompletion.action 		= &this->DeviceRecoveryCompletionAction;
-		status = GetStatusEndpointStatus ( GetBulkInPipe(), &eStatus[0], &fCBICommandRequestBlock.cbiCompletion);
+		cbiRequestBlock->cbiCompletion.target 		= this;
+		cbiRequestBlock->cbiCompletion.action 		= &this->DeviceRecoveryCompletionAction;
+		status = GetStatusEndpointStatus ( GetBulkInPipe(), &eStatus[0], &cbiRequestBlock->cbiCompletion);
+		
    	}
-    
+	
+	
+Exit:
+	
+	
 	return status;
 }
 
@@ -2865,7 +6055,6 @@ IOReturn
 IOUSBMassStorageClass::ResetDeviceNow ( bool waitForReset )
 {
 	
-	thread_t        thread = THREAD_NULL;
 	kern_return_t   result = KERN_FAILURE;
 	IOReturn		status = kIOReturnError;
 	
@@ -2880,7 +6069,7 @@ IOUSBMassStorageClass::ResetDeviceNow ( bool waitForReset )
 	
 	STATUS_LOG ( ( 4, "%s[%p]: ResetDeviceNow waitForReset=%d fConsecutiveResetCount=%d", getName(), this, waitForReset, fConsecutiveResetCount ) );
 	
-	// Reset the device on its own thread so we don't deadlock.
+	// Reset the device on the recovery worker so we don't deadlock.
 	fResetInProgress = true;
 	
 	// When peforming a USB device reset, we have two options. We can actively block on the reset thread,
@@ -2889,9 +6078,10 @@ IOUSBMassStorageClass::ResetDeviceNow ( bool waitForReset )
 	
 	fBlockOnResetThread = !waitForReset;
 	
-	result = kernel_thread_start (	( thread_continue_t ) &IOUSBMassStorageClass::sResetDevice,
-									this,
-									&thread );
+	if ( EnqueueRecoveryJob ( kIOUSBMassStorageRecoveryJobResetDevice ) == kIOReturnSuccess )
+	{
+		result = KERN_SUCCESS;
+	}
 	require ( ( result == KERN_SUCCESS ), ErrorExit );
 		
 	if (result == KERN_SUCCESS)
@@ -2915,7 +6105,7 @@ Exit:
 	
 	// If the reset didnt happen complete the failed command with an error here.
 	if ( ( result == KERN_FAILURE ) && 
-         ( fBulkOnlyCommandStructInUse | fCBICommandStructInUse ) )
+         ( fBulkOnlyCommandStructInUse | fCBICommandStructInUse | ( fUASOutstandingCount != 0 ) ) )
 	{
 		AbortCurrentSCSITask ( );
 	}
@@ -2931,6 +6121,12 @@ ErrorExit:
 	
     fResetInProgress = false;
     
+	// No reset was queued, so nothing else will complete the failed command.
+	if ( fBulkOnlyCommandStructInUse | fCBICommandStructInUse | ( fUASOutstandingCount != 0 ) )
+	{
+		AbortCurrentSCSITask ( );
+	}
+	
 	release ( );
 
 	return status;
@@ -2971,14 +6167,26 @@ IOUSBMassStorageClass::AbortCurrentSCSITask ( void )
 
 	STATUS_LOG ( ( 4, "%s[%p]: AbortCurrentSCSITask Entered", getName(), this ) );
 	
-	if( fBulkOnlyCommandStructInUse == true )
+	if( ( fBulkOnlyCommandStructInUse == true ) && ( fBulkOnlyCurrentRequestBlock != NULL ) )
 	{
-		currentTask = fBulkOnlyCommandRequestBlock.request;
+		
+		currentTask = fBulkOnlyCurrentRequestBlock->request;
+		ReleaseBulkOnlyRequestBlock ( fBulkOnlyCurrentRequestBlock );
+		
 	}
     
-	else if( fCBICommandStructInUse == true )
+	else if( ( fCBICommandStructInUse == true ) && ( fCBICurrentRequestBlock != NULL ) )
+	{
+		
+		currentTask = fCBICurrentRequestBlock->request;
+		ReleaseCBIRequestBlock ( fCBICurrentRequestBlock );
+		
+	}
+	
+	// UAS may have several commands outstanding. All of them are failed below.
+	else if ( GetInterfaceProtocol ( ) == kProtocolUSBAttachedSCSI )
 	{
-		currentTask = fCBICommandRequestBlock.request;
+		currentTask = UASGetFirstOutstandingTask ( );
 	}
 	
 	if ( currentTask != NULL )
@@ -2987,9 +6195,7 @@ IOUSBMassStorageClass::AbortCurrentSCSITask ( void )
 		SCSITaskStatus			taskStatus;
 	
 		fBulkOnlyCommandStructInUse 			= false;
-		fBulkOnlyCommandRequestBlock.request 	= NULL;
         fCBICommandStructInUse 					= false;
-		fCBICommandRequestBlock.request 		= NULL;
         
 		//	Increment the count of consecutive I/Os which were aborted during a reset.	
 		//	If that count is greater than the max, then consider the drive unusable, and mark the device as detached
@@ -3031,11 +6237,36 @@ IOUSBMassStorageClass::AbortCurrentSCSITask ( void )
 			
 		}
 		
-		RecordUSBTimeStamp (	UMC_TRACE ( kCompleteSCSICommand ),
-							( uintptr_t ) this, ( uintptr_t ) currentTask,
-							kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE, taskStatus );
+		if ( GetInterfaceProtocol ( ) == kProtocolUSBAttachedSCSI )
+		{
+			UASAbortAllCommands ( taskStatus );
+		}
+		
+		else
+		{
+			
+			UInt64		now;
+			
+			clock_get_uptime ( &now );
+			
+			AutoTuneRecordSample ( currentTask, fTransportClaimTime, now, true );
+			
+			EndFlightRecord ( ( taskStatus == kSCSITaskStatus_DeviceNotPresent ) ? kIOReturnNoDevice : kIOReturnNotResponding );
+			
+			RecordUSBTimeStamp (	UMC_TRACE ( kCompleteSCSICommand ),
+								( uintptr_t ) this, ( uintptr_t ) currentTask,
+								kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE, taskStatus );
+			
+			RecordCommandEndTrace (	currentTask, fTransportClaimTime, now,
+									( GetInterfaceProtocol ( ) == kProtocolBulkOnly ) ? fBulkOnlyCommandTag : 0,
+									kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE, taskStatus );
+			
+			CommandCompleted ( currentTask, kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE, taskStatus );
+			
+		}
 		
-		CommandCompleted ( currentTask, kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE, taskStatus );
+		//	Move on to the next queued task, or fail them all if the device is now considered detached.
+		StartNextQueuedSCSITask ( );
 		
 		//	If didTerminate() was called while this SCSI task was outstanding, then termination would
 		//	have been deferred until it completed. Check for that now, while behind the command gate.
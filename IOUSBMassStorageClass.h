@@ -58,6 +58,19 @@
 #define kIOUSBMassStorageDoNotOperate			"Do Not Operate"
 #define kIOUSBMassStorageEnableSuspendResumePM	"Enable Port Suspend-Resume PM"
 #define kIOUSBMassStoragePostResetCoolDown		"Reset Recovery Time"
+#define kIOUSBMassStorageEnableUAS				"Enable UAS"
+#define kIOUSBMassStorageUASQueueDepth			"UAS Queue Depth"
+#define kIOUSBMassStorageDisableCSWPipelining	"Disable CSW Pipelining"
+#define kIOUSBMassStorageDataSegmentSize		"Data Segment Size"
+#define kIOUSBMassStorageDataSegmentsInFlight	"Data Segments In Flight"
+#define kIOUSBMassStorageAutoTuneMaxByteCount	"Auto Tune Maximum Byte Count"
+#define kIOUSBMassStorageTunedMaxByteCountKey	"Tuned Maximum Byte Count"
+#define kIOUSBMassStorageStatisticsKey			"Statistics"
+#define kIOUSBMassStorageFlightRecorderKey		"Flight Recorder"
+#define kIOUSBMassStorageMediaPollMinInterval	"Media Poll Minimum Interval"
+#define kIOUSBMassStorageMediaPollMaxInterval	"Media Poll Maximum Interval"
+#define kIOUSBMassStorageMediaPollFastCount		"Media Poll Fast Count"
+#define kIOUSBMassStorageMaxCommandByteCount	"Maximum Command Byte Count"
 
 #ifndef EMBEDDED
 #define kIOUSBMassStorageSuspendOnReboot        "Suspend On Reboot"
@@ -74,6 +87,66 @@ enum
 	kIOUSBMassStorageReconfigurationTimeoutMS = 5000
 };
 
+enum
+{
+	// A Bulk Only LUN is 4 bits wide, so no device can present more than 16 LUNs.
+	kIOUSBMassStorageMaxLogicalUnits		= 16,
+	
+	// Number of SCSITasks held per LUN while the transport is busy with another command.
+	kIOUSBMassStorageAdmissionQueueDepth	= 8
+};
+
+// Counters published in the Statistics dictionary. The keys are in the same order in
+// IOUSBMassStorageClass.cpp.
+enum
+{
+	kIOUSBMassStorageStatisticOperations				= 0,
+	kIOUSBMassStorageStatisticBytesTransferred			= 1,
+	kIOUSBMassStorageStatisticQueueFullRejections		= 2,
+	kIOUSBMassStorageStatisticEndpointStalls			= 3,
+	kIOUSBMassStorageStatisticClassResets				= 4,	// Bulk-Only Mass Storage Reset or CBI Command Block Reset
+	kIOUSBMassStorageStatisticDeviceResets				= 5,	// USB device resets
+	kIOUSBMassStorageStatisticCSWErrors					= 6,	// Phase errors, bad status and tag mismatches
+	kIOUSBMassStorageStatisticReconfigurationLatency	= 7,	// Of the last USB device reset, in microseconds
+	kIOUSBMassStorageStatisticCount						= 8,
+	
+	// The dictionary is refreshed from the counters at most this often.
+	kIOUSBMassStorageStatisticsIntervalMS				= 1000
+};
+
+#pragma mark -
+#pragma mark Recovery Worker Structures
+
+// Jobs run in order on the recovery worker thread.
+enum
+{
+	kIOUSBMassStorageRecoveryJobClearStall	= 1,	// Reset data toggles, then CLEAR_FEATURE(ENDPOINT_HALT)
+	kIOUSBMassStorageRecoveryJobResetDevice	= 2,	// USB device reset and reconfiguration
+	
+	kIOUSBMassStorageRecoveryQueueDepth		= 8
+};
+
+struct RecoveryJob
+{
+	UInt8			type;
+	UInt64			queuedTime;		// Absolute time, for the queue latency tracepoint
+};
+
+typedef struct RecoveryJob		RecoveryJob;
+
+
+#pragma mark -
+#pragma mark Admission Queue Structures
+// Per LUN FIFO of SCSITasks which have been accepted, but not yet sent to the device.
+struct SCSITaskAdmissionQueue
+{
+	SCSITaskIdentifier			tasks[kIOUSBMassStorageAdmissionQueueDepth];
+	UInt8						head;
+	UInt8						count;
+};
+
+typedef struct SCSITaskAdmissionQueue	SCSITaskAdmissionQueue;
+
 
 #pragma mark -
 #pragma mark CBI Protocol Strutures
@@ -131,6 +204,155 @@ struct	BulkOnlyRequestBlock
 typedef struct BulkOnlyRequestBlock		BulkOnlyRequestBlock;
 
 
+#pragma mark -
+#pragma mark Transfer Size Tuning Structures
+
+enum
+{
+	// Candidate maximum byte counts, 64 KB doubling up to 1 MB.
+	kIOUSBMassStorageAutoTuneMinByteCount		= 64 * 1024,
+	kIOUSBMassStorageAutoTuneSizes				= 5,
+	
+	// A size needs this many commands before its numbers are trusted, and is ruled out
+	// (along with everything larger) once more than 1 in kAutoTuneMaxErrorRatio fail.
+	kIOUSBMassStorageAutoTuneMinCommands		= 64,
+	kIOUSBMassStorageAutoTuneMaxErrorRatio		= 100,
+	
+	// Length of the measurement window after the device is started.
+	kIOUSBMassStorageAutoTuneWindowSeconds		= 300
+};
+
+// Commands are counted against the smallest candidate size that holds them, provided
+// they are more than half that size.
+struct TransferSizeStatistics
+{
+	UInt64		bytes;
+	UInt64		busyTime;		// Absolute time units from dispatch to completion
+	UInt32		commands;
+	UInt32		errors;
+};
+
+typedef struct TransferSizeStatistics	TransferSizeStatistics;
+
+
+#pragma mark -
+#pragma mark Segmented Data Phase Structures
+
+enum
+{
+	// Large data phases are split into segments so the host controller always has the
+	// next transfer queued. Only used for transfers longer than one segment.
+	kIOUSBMassStorageMaxDataSegments			= 8,
+	kIOUSBMassStorageDefaultDataSegments		= 4,
+	kIOUSBMassStorageDefaultDataSegmentSize		= 256 * 1024,
+	kIOUSBMassStorageMinDataSegmentSize			= 16 * 1024
+};
+
+class IOSubMemoryDescriptor;
+struct SegmentedDataTransfer;
+
+struct DataSegment
+{
+	IOUSBCompletion					completion;
+	IOSubMemoryDescriptor *			descriptor;		// Allocated with the pool, re-targeted per segment
+	struct SegmentedDataTransfer *	transfer;
+	UInt64							offset;
+	UInt32							length;
+	bool							prepared;
+};
+
+typedef struct DataSegment				DataSegment;
+
+struct SegmentedDataTransfer
+{
+	IOUSBCompletion *		completion;			// Protocol completion, called once for the whole phase
+	IOUSBPipe *				pipe;
+	IOMemoryDescriptor *	buffer;
+	UInt64					length;
+	UInt64					nextOffset;
+	UInt64					bytesTransferred;	// Contiguous bytes up to the first short or failed segment
+	UInt32					segmentSize;
+	UInt32					timeout;
+	UInt32					segmentsInFlight;
+	IOReturn				status;
+	bool					ended;				// Short packet or error, queue nothing more
+	UInt32					spillLength;		// Data received by a segment queued after a short one
+	DataSegment				segments[kIOUSBMassStorageMaxDataSegments];
+};
+
+typedef struct SegmentedDataTransfer	SegmentedDataTransfer;
+
+
+#pragma mark -
+#pragma mark Request Block Pool Structures
+
+enum
+{
+	// Bulk-Only and CBI still run one command at a time, so one block owns the transport and
+	// the rest cover blocks whose release waits on a CSW read or data segments still queued.
+	// The pool only saves the per command allocation.
+	kIOUSBMassStorageRequestPoolSize	= 4
+};
+
+// States of the CSW read a Bulk Only slot may queue behind its data in read.
+enum
+{
+	kBulkOnlyCSWReadIdle				= 0,
+	kBulkOnlyCSWReadPosted				= 1,
+	kBulkOnlyCSWReadCompleted			= 2,	// Returned before the data phase was processed
+	kBulkOnlyCSWReadDiscarded			= 3		// Aborted after a data phase error, result ignored
+};
+
+// A pool slot wraps a request block together with the wired descriptors for its own
+// CBW/CSW (or CBI status) buffers. The block must stay the first member so that the
+// block pointer handed to the completion routines is also the slot pointer.
+struct BulkOnlyRequestSlot
+{
+	BulkOnlyRequestBlock	block;
+	IOMemoryDescriptor *	cbwDescriptor;
+	IOMemoryDescriptor *	cswDescriptor;
+	
+	// A CSW read queued on the bulk in pipe right behind a data in read. It has its own
+	// completion so the data phase result is always seen first by the state machine.
+	IOUSBCompletion			cswCompletion;
+	IOReturn				cswStatus;
+	UInt32					cswBufferSizeRemaining;
+	UInt8					cswReadState;
+	bool					releaseDeferred;		// Return the slot once USB gives back the last request
+	bool					abortRequested;			// AbortSCSICommand asked for the command to be dropped
+	
+	SegmentedDataTransfer	segmentedData;
+};
+
+typedef struct BulkOnlyRequestSlot		BulkOnlyRequestSlot;
+
+struct CBIRequestSlot
+{
+	CBIRequestBlock			block;
+	IOMemoryDescriptor *	statusDescriptor;
+	bool					releaseDeferred;		// Return the slot once the data segments come back
+	bool					abortRequested;			// AbortSCSICommand asked for the command to be dropped
+	SegmentedDataTransfer	segmentedData;
+};
+
+typedef struct CBIRequestSlot			CBIRequestSlot;
+
+
+#pragma mark -
+#pragma mark Private Structures
+
+// The tracepoint, debug sysctl and USB Attached SCSI definitions are private, and so are the
+// structures sized by them. The class only keeps pointers to these, and allocates them itself.
+struct USBMassStorageDiagnostics;
+struct USBLatencyHistograms;
+struct USBFlightRecorder;
+struct USBFlightRecord;
+struct UASStatusIUInfo;
+struct UASRequestBlock;
+struct UASRequestSlot;
+struct UASStatusReader;
+
+
 #pragma mark -
 #pragma mark IOUSBMassStorageClass definition
 
@@ -162,7 +384,7 @@ private:
 	// ---- Member variables used by CBI protocol ----
 	bool						fCBICommandStructInUse; 
 
-	CBIRequestBlock				fCBICommandRequestBlock;
+	CBIRequestBlock				fCBICommandRequestBlock;			/* OBSOLETE */
     
 	// ---- Member variables used by Bulk Only protocol ----
  	// Command tag, this driver just uses a sequential counter that is
@@ -171,11 +393,10 @@ private:
 
 	bool						fBulkOnlyCommandStructInUse; 
     
-    // Dedicated CBW and CSW IOMemoryDescriptors are listed in the ExpansionData struct.
+    // Request blocks, and their dedicated CBW and CSW IOMemoryDescriptors,
+    // come from the request pool listed in the ExpansionData struct.
 		
- 	// The Request block that contains all the necessary data for 
- 	// transporting a Bulk Only request across the USB.
- 	BulkOnlyRequestBlock		fBulkOnlyCommandRequestBlock;
+ 	BulkOnlyRequestBlock		fBulkOnlyCommandRequestBlock;		/* OBSOLETE */
 
 protected:
     // Reserve space for future expansion.
@@ -190,9 +411,9 @@ protected:
 		IOUSBPipe *				fPotentiallyStalledPipe;
 		bool					fUseUSBResetNotBOReset;
 		bool					fAbortCurrentSCSITaskInProgress;
-		IOMemoryDescriptor *	fCBIMemoryDescriptor;
-		IOMemoryDescriptor *	fBulkOnlyCBWMemoryDescriptor;
-		IOMemoryDescriptor *	fBulkOnlyCSWMemoryDescriptor;
+		IOMemoryDescriptor *	fCBIMemoryDescriptor;					/* OBSOLETE */
+		IOMemoryDescriptor *	fBulkOnlyCBWMemoryDescriptor;			/* OBSOLETE */
+		IOMemoryDescriptor *	fBulkOnlyCSWMemoryDescriptor;			/* OBSOLETE */
         bool                    fDeviceAttached;
 		bool                    fWaitingForReconfigurationMessage;
 		bool					fTerminating;
@@ -217,6 +438,47 @@ protected:
 		bool					fSuspendOnReboot;
 #endif // EMBEDDED
 		UInt8					fResetStatus;
+		SCSITaskAdmissionQueue	fAdmissionQueue[kIOUSBMassStorageMaxLogicalUnits];
+		UInt32					fAdmissionQueueCount;
+		UInt8					fNextLUNToService;
+		bool					fDispatchingQueuedTasks;
+		BulkOnlyRequestSlot *	fBulkOnlyRequestPool;
+		BulkOnlyRequestBlock *	fBulkOnlyCurrentRequestBlock;
+		CBIRequestSlot *		fCBIRequestPool;
+		CBIRequestBlock *		fCBICurrentRequestBlock;
+		volatile UInt32			fRequestPoolFreeMask;
+		UInt32					fRequestPoolSize;
+		UASRequestSlot *		fUASRequestPool;
+		UASStatusReader *		fUASStatusReader;
+		IOUSBPipe *				fUASCommandPipe;
+		IOUSBPipe *				fUASStatusPipe;
+		UInt32					fUASQueueDepth;
+		UInt32					fUASOutstandingCount;
+		UInt32					fUASActiveDataTransfers;
+		UInt8					fUASAlternateSetting;
+		bool					fUASStreamsEnabled;
+		bool					fBulkOnlyPipelineCSW;
+		UInt32					fDataSegmentSize;
+		UInt32					fDataSegmentsInFlight;
+		bool					fAutoTuneActive;
+		UInt32					fAutoTunedMaxByteCount;
+		UInt64					fAutoTuneDeadline;
+		UInt64					fTransportClaimTime;
+		TransferSizeStatistics	fAutoTuneStatistics[kIOUSBMassStorageAutoTuneSizes];
+		IOLock *				fRecoveryLock;
+		bool					fRecoveryWorkerRunning;
+		bool					fRecoveryWorkerExit;
+		UInt8					fRecoveryJobHead;
+		UInt8					fRecoveryJobCount;
+		RecoveryJob				fRecoveryJobs[kIOUSBMassStorageRecoveryQueueDepth];
+		UInt32					fReconfigurationLatencyUS;
+		UInt64					fPhaseStartTime;
+		UInt64					fRecoveryStartTime;
+		USBMassStorageDiagnostics *	fDiagnostics;
+		OSDictionary *			fStatisticsDictionary;
+		UInt64					fStatistics[kIOUSBMassStorageStatisticCount];
+		thread_call_t			fStatisticsThread;
+		bool					fStatisticsPublishScheduled;
         
 #ifndef EMBEDDED
 	};
@@ -248,6 +510,47 @@ protected:
     #define fPostDeviceResetCoolDownInterval	reserved->fPostDeviceResetCoolDownInterval
     #define fSuspendOnReboot					reserved->fSuspendOnReboot
     #define fResetStatus						reserved->fResetStatus	
+    #define fAdmissionQueue						reserved->fAdmissionQueue
+    #define fAdmissionQueueCount				reserved->fAdmissionQueueCount
+    #define fNextLUNToService					reserved->fNextLUNToService
+    #define fDispatchingQueuedTasks				reserved->fDispatchingQueuedTasks
+    #define fBulkOnlyRequestPool				reserved->fBulkOnlyRequestPool
+    #define fBulkOnlyCurrentRequestBlock		reserved->fBulkOnlyCurrentRequestBlock
+    #define fCBIRequestPool						reserved->fCBIRequestPool
+    #define fCBICurrentRequestBlock				reserved->fCBICurrentRequestBlock
+    #define fRequestPoolFreeMask				reserved->fRequestPoolFreeMask
+    #define fRequestPoolSize					reserved->fRequestPoolSize
+    #define fUASRequestPool						reserved->fUASRequestPool
+    #define fUASStatusReader					reserved->fUASStatusReader
+    #define fUASCommandPipe						reserved->fUASCommandPipe
+    #define fUASStatusPipe						reserved->fUASStatusPipe
+    #define fUASQueueDepth						reserved->fUASQueueDepth
+    #define fUASOutstandingCount				reserved->fUASOutstandingCount
+    #define fUASActiveDataTransfers				reserved->fUASActiveDataTransfers
+    #define fUASAlternateSetting				reserved->fUASAlternateSetting
+    #define fUASStreamsEnabled					reserved->fUASStreamsEnabled
+    #define fBulkOnlyPipelineCSW				reserved->fBulkOnlyPipelineCSW
+    #define fDataSegmentSize					reserved->fDataSegmentSize
+    #define fDataSegmentsInFlight				reserved->fDataSegmentsInFlight
+    #define fAutoTuneActive						reserved->fAutoTuneActive
+    #define fAutoTunedMaxByteCount				reserved->fAutoTunedMaxByteCount
+    #define fAutoTuneDeadline					reserved->fAutoTuneDeadline
+    #define fTransportClaimTime					reserved->fTransportClaimTime
+    #define fAutoTuneStatistics					reserved->fAutoTuneStatistics
+    #define fRecoveryLock						reserved->fRecoveryLock
+    #define fRecoveryWorkerRunning				reserved->fRecoveryWorkerRunning
+    #define fRecoveryWorkerExit					reserved->fRecoveryWorkerExit
+    #define fRecoveryJobHead					reserved->fRecoveryJobHead
+    #define fRecoveryJobCount					reserved->fRecoveryJobCount
+    #define fRecoveryJobs						reserved->fRecoveryJobs
+    #define fReconfigurationLatencyUS			reserved->fReconfigurationLatencyUS
+    #define fPhaseStartTime						reserved->fPhaseStartTime
+    #define fRecoveryStartTime					reserved->fRecoveryStartTime
+    #define fDiagnostics						reserved->fDiagnostics
+    #define fStatisticsDictionary				reserved->fStatisticsDictionary
+    #define fStatistics							reserved->fStatistics
+    #define fStatisticsThread					reserved->fStatisticsThread
+    #define fStatisticsPublishScheduled			reserved->fStatisticsPublishScheduled
 #endif // EMBEDDED
     
 	// Enumerated constants used to control various aspects of this
@@ -276,7 +579,8 @@ protected:
 	{
 		kProtocolControlBulkInterrupt	= 0x00,
 		kProtocolControlBulk			= 0x01,
-		kProtocolBulkOnly				= 0x50
+		kProtocolBulkOnly				= 0x50,
+		kProtocolUSBAttachedSCSI		= 0x62
 	};
 
 	// ------- Protocol support functions ------------
@@ -361,6 +665,9 @@ protected:
 								CBIRequestBlock *	cbiRequestBlock );
 
 	// Methods used for CBI/CB command transportation.
+	IOReturn		GatedSendSCSICommandForCBIProtocol(
+						SCSITaskIdentifier			request );
+	
 	static void		CBIProtocolUSBCompletionAction(
 						void *					target,
 		                void *					parameter,
@@ -384,6 +691,10 @@ protected:
 						IOUSBPipe *				targetPipe,
 						CBIRequestBlock *		cbiRequestBlock,
 						UInt32					nextExecutionState );
+	
+	IOReturn		CBIProtocolCommandBlockReset( 
+						CBIRequestBlock *		cbiRequestBlock,
+						UInt32					nextExecutionState );
 						
 	void 			CBIProtocolCommandCompletion(
 						CBIRequestBlock *		cbiRequestBlock,
@@ -439,6 +750,9 @@ protected:
 						UInt32						nextExecutionState );
 						
 	// Methods used for Bulk Only command transportation.
+	IOReturn		GatedSendSCSICommandForBulkOnlyProtocol(
+						SCSITaskIdentifier			request );
+	
 	IOReturn		BulkOnlySendCBWPacket(
 						BulkOnlyRequestBlock *		boRequestBlock,
 						UInt32						nextExecutionState );
@@ -451,6 +765,17 @@ protected:
 						BulkOnlyRequestBlock *		boRequestBlock,
 						UInt32						nextExecutionState );
 	
+	IOReturn		BulkOnlyPostCSWWithData(
+						BulkOnlyRequestBlock *		boRequestBlock );
+	
+	void			BulkOnlyDiscardPostedCSW(
+						BulkOnlyRequestBlock *		boRequestBlock );
+	
+	void			BulkOnlyPostedCSWCompletion(
+						BulkOnlyRequestBlock *		boRequestBlock,
+		                IOReturn					resultingStatus,
+		                UInt32						bufferSizeRemaining );
+	
 	void			BulkOnlyExecuteCommandCompletion (
 						BulkOnlyRequestBlock *		boRequestBlock,
 		                IOReturn					resultingStatus,
@@ -462,6 +787,97 @@ protected:
 		                IOReturn		status,
 		                UInt32			bufferSizeRemaining );
 	
+	static void		BulkOnlyCSWCompletionAction (
+		                void *			target,
+		                void *			parameter,
+		                IOReturn		status,
+		                UInt32			bufferSizeRemaining );
+	
+ 	/* All USB Attached SCSI transport related methods.
+ 	 */
+	IOReturn		SendSCSICommandForUASProtocol(
+						SCSITaskIdentifier			request );
+	
+	IOReturn		GatedSendSCSICommandForUASProtocol(
+						SCSITaskIdentifier			request );
+	
+	IOReturn		UASConfigureInterface( void );
+	
+	IOReturn		UASRestoreAfterReset( void );
+	
+	void			UASReleasePipes( void );
+	
+	IOReturn		UASReportLUNs(
+						UInt8 *						maxLUN );
+	
+	IOReturn		UASTransferData(
+						UASRequestBlock *			uasRequestBlock );
+	
+	IOReturn		UASReceiveStatus(
+						UASRequestBlock *			uasRequestBlock );
+	
+	IOReturn		UASPostStatusReader( void );
+	
+	void			UASProcessStatusIU(
+						UASRequestBlock *			uasRequestBlock,
+						UInt8 *						statusIU,
+						UInt32						length );
+	
+	void			UASCheckForCompletion(
+						UASRequestBlock *			uasRequestBlock );
+	
+	void			UASCompleteCommand(
+						UASRequestBlock *			uasRequestBlock );
+	
+	void			UASAbortAllCommands(
+						SCSITaskStatus				taskStatus );
+	
+	IOReturn		UASAbortTask(
+						SCSITaskIdentifier			abortTask );
+	
+	void			UASProcessTaskManagementResponse(
+						const UASStatusIUInfo *		info,
+						bool						valid );
+	
+	SCSITaskIdentifier	UASGetFirstOutstandingTask( void );
+	
+	UASRequestBlock *	UASGetRequestBlockForTag(
+							UInt16					tag );
+	
+	void			UASStartRecovery(
+						UASRequestBlock *			uasRequestBlock,
+						IOReturn					status );
+	
+	static void		UASCommandCompletionAction (
+		                void *			target,
+		                void *			parameter,
+		                IOReturn		status,
+		                UInt32			bufferSizeRemaining );
+	
+	static void		UASDataCompletionAction (
+		                void *			target,
+		                void *			parameter,
+		                IOReturn		status,
+		                UInt32			bufferSizeRemaining );
+	
+	static void		UASStatusCompletionAction (
+		                void *			target,
+		                void *			parameter,
+		                IOReturn		status,
+		                UInt32			bufferSizeRemaining );
+	
+	static void		UASTaskManagementCompletionAction (
+		                void *			target,
+		                void *			parameter,
+		                IOReturn		status,
+		                UInt32			bufferSizeRemaining );
+	
+	static void		UASStatusReaderCompletionAction (
+		                void *			target,
+		                void *			parameter,
+		                IOReturn		status,
+		                UInt32			bufferSizeRemaining );
+	
 public:
 
     bool				init( OSDictionary * 	propTable );
@@ -488,6 +904,15 @@ public:
 	
 	virtual IOReturn	HandlePowerOn( void );
 	
+	// Latency histograms for the debug sysctl.
+	void				CopyLatencyHistograms( USBLatencyHistograms * histograms );
+	void				ResetLatencyHistograms( void );
+	
+	// Recent Bulk-Only and CBI commands, for the debug sysctl.
+	void				CopyFlightRecorder( USBFlightRecorder * recorder );
+	
+	UInt32				GetLocationID( void );
+	
 #ifndef EMBEDDED
 	virtual void		systemWillShutdown ( IOOptionBits specifier );
 #endif // EMBEDDED
@@ -532,7 +957,122 @@ private:
 	
 	void				ClearPipeStall ( void );
 	
-	IOReturn			AcceptSCSITask ( SCSITaskIdentifier scsiTask, bool * pAccepted );
+	UInt64				RecordLatency ( UInt32 phase, UInt64 startTime );
+	
+	void				RecordLatencyUntil ( UInt32 phase, UInt64 startTime, UInt64 endTime );
+	
+	void				RecordCommandStartTrace ( SCSITaskIdentifier request, UInt32 tag );
+	
+	void				RecordCommandEndTrace (	SCSITaskIdentifier		request,
+												UInt64					startTime,
+												UInt64					endTime,
+												UInt32					tag,
+												SCSIServiceResponse		serviceResponse,
+												SCSITaskStatus			taskStatus );
+	
+	void				PublishStatistics ( void );
+	
+	void				SchedulePublishStatistics ( void );
+	
+	static void			sPublishStatistics ( thread_call_param_t driver, thread_call_param_t unused );
+	
+	void				BeginFlightRecord ( SCSITaskIdentifier request );
+	
+	USBFlightRecord *	CurrentFlightRecord ( void );
+	
+	void				NoteFlightRecovery ( UInt8 step );
+	
+	void				GatedNoteDeviceReset ( void );
+	
+	void				EndFlightRecord ( IOReturn result );
+	
+	IOReturn			StartRecoveryWorker ( void );
+	
+	void				StopRecoveryWorker ( void );
+	
+	IOReturn			EnqueueRecoveryJob ( UInt8 type );
+	
+	void				RecoveryWorker ( void );
+	
+	static void			sRecoveryWorker ( void * refcon );
+	
+	IOReturn			AcceptSCSITask ( SCSITaskIdentifier scsiTask, bool * pAccepted, bool * pQueued );
+	
+	bool				IsTransportBusy ( void );
+	
+	void				ClaimTransport ( void );
+	
+	void				ReleaseTransport ( void );
+	
+	IOReturn			DispatchSCSITask ( SCSITaskIdentifier request );
+	
+	bool				EnqueueSCSITask ( SCSITaskIdentifier request );
+	
+	bool				RequeueSCSITask ( SCSITaskIdentifier request );
+	
+	SCSITaskIdentifier	DequeueSCSITask ( void );
+	
+	void				StartNextQueuedSCSITask ( void );
+	
+	void				FlushQueuedSCSITasks ( void );
+	
+	bool				RemoveQueuedSCSITask ( SCSITaskIdentifier request );
+	
+	IOReturn			GatedAbortSCSICommand ( SCSITaskIdentifier abortTask );
+	
+	void				CompleteAbortedSCSITask ( SCSITaskIdentifier request );
+	
+	IOReturn			AllocateRequestPool ( void );
+	
+	void				FreeRequestPool ( void );
+	
+	int					AllocateRequestSlot ( void );
+	
+	void				ReleaseRequestSlot ( int slotIndex );
+	
+	BulkOnlyRequestBlock *	AllocateBulkOnlyRequestBlock ( void );
+	
+	CBIRequestBlock *		AllocateCBIRequestBlock ( void );
+	
+	UASRequestBlock *		AllocateUASRequestBlock ( void );
+	
+	void					ReleaseUASRequestBlock ( UASRequestBlock * uasRequestBlock );
+	
+	void				AutoTuneInitialize ( OSDictionary * characterDict );
+	
+	void				AutoTuneRecordSample ( SCSITaskIdentifier request, UInt64 startTime, UInt64 endTime, bool failed );
+	
+	void				AutoTuneFinish ( void );
+	
+	bool				GetAutoTuneDeviceKey ( char * key, size_t length );
+	
+	bool				UseSegmentedDataTransfer ( UInt64 length );
+	
+	IOReturn			AllocateDataSegments ( SegmentedDataTransfer * transfer );
+	void				FreeDataSegments ( SegmentedDataTransfer * transfer );
+	
+	IOReturn			StartSegmentedDataTransfer ( 
+							SegmentedDataTransfer *		transfer,
+							IOUSBPipe *					pipe,
+							IOMemoryDescriptor *		buffer,
+							UInt64						length,
+							UInt32						timeout,
+							IOUSBCompletion *			completion );
+	
+	IOReturn			IssueDataSegment ( 
+							SegmentedDataTransfer *		transfer,
+							DataSegment *				segment );
+	
+	void				DataSegmentCompletion ( 
+							DataSegment *				segment,
+							IOReturn					status,
+							UInt32						bufferSizeRemaining );
+	
+	static void			DataSegmentCompletionAction ( 
+							void *						target,
+							void *						parameter,
+							IOReturn					status,
+							UInt32						bufferSizeRemaining );
 	
 	void				CheckDeferredTermination ( void );
 	
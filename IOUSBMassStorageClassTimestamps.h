@@ -39,29 +39,9 @@ extern "C" {
 #endif
 
 extern UInt32		gUSBDebugFlags;
+extern UInt32		gUSBTraceCategories;	// Categories traced, zero while tracing is off
+extern uintptr_t	gUSBTraceFilter;		// The only driver traced, or zero
 
-#if KERNEL
-    
-//--------------------------------------------------------------------------------------------------
-//	RecordUSBTimeStamp											       						[STATIC]
-//--------------------------------------------------------------------------------------------------
-
-static inline void
-RecordUSBTimeStamp ( 
-	unsigned int code,
-	unsigned int a, unsigned int b,
-	unsigned int c, unsigned int d )
-{
-
-	if ( gUSBDebugFlags != 0 )
-	{
-		IOTimeStampConstant ( code, a, b, c, d );
-	}
-	
-}
-
-#endif 
-    
 #define USBMASS_SYSCTL	"debug.USBMassStorageClass"
 
 typedef struct USBSysctlArgs
@@ -69,6 +49,10 @@ typedef struct USBSysctlArgs
 	uint32_t		type;
 	uint32_t		operation;
 	uint32_t		debugFlags;
+	uint32_t		instance;			// Device index for the per device operations
+	uint32_t		traceCategories;	// kUSBTraceCategory bits
+	uint32_t		traceFilter;		// kUSBTraceFilter
+	uint32_t		locationID;			// Device traced with kUSBTraceFilterLocationID
 } USBSysctlArgs;
 
 
@@ -76,10 +60,124 @@ typedef struct USBSysctlArgs
 
 enum
 {
-	kUSBOperationGetFlags 	= 0,
-	kUSBOperationSetFlags	= 1
+	kUSBOperationGetFlags 					= 0,
+	kUSBOperationSetFlags					= 1,
+	kUSBOperationGetLatencyHistograms		= 2,	// Returns a USBLatencyHistograms
+	kUSBOperationResetLatencyHistograms		= 3,
+	kUSBOperationGetFlightRecorder			= 4,	// Returns a USBFlightRecorder
+	kUSBOperationSetTraceFilter				= 5
+};
+
+// Tracepoint categories. Tracing is on when debugFlags is nonzero; traceCategories then picks
+// which tracepoints are emitted.
+enum
+{
+	kUSBTraceCategoryGeneral		= 0x0001,	// Start, stop, termination and configuration
+	kUSBTraceCategoryCDB			= 0x0002,	// Raw CDB and CBW, off unless asked for
+	kUSBTraceCategoryCompletion		= 0x0004,
+	kUSBTraceCategoryQueue			= 0x0008,	// Admission queue
+	kUSBTraceCategoryRecovery		= 0x0010,	// Stalls, resets and aborts
+	kUSBTraceCategoryPower			= 0x0020,
+	kUSBTraceCategoryCBI			= 0x0040,
+	kUSBTraceCategoryBO				= 0x0080,
+	kUSBTraceCategoryUAS			= 0x0100,
+	kUSBTraceCategorySubclass		= 0x0200,	// AppleUSBODD and AppleUSBCardReaderUMC
+	kUSBTraceCategoryCommand		= 0x0400,	// One kSCSICommand start and end record per command
+	kUSBTraceCategoryAll			= 0xFFFFFFFF,
+	
+	// kSCSICommand carries what the raw CDB records did, decoded, in one record.
+	kUSBTraceCategoryDefault		= ( kUSBTraceCategoryAll & ~kUSBTraceCategoryCDB )
+};
+
+// Which devices are traced
+enum
+{
+	kUSBTraceFilterNone				= 0,
+	kUSBTraceFilterInstance			= 1,	// The device at USBSysctlArgs.instance
+	kUSBTraceFilterLocationID		= 2		// The device at USBSysctlArgs.locationID, once it appears
+};
+
+// Phases timed by the latency histograms.
+enum
+{
+	kUSBLatencyPhaseBOCommand		= 0,	// CBW out
+	kUSBLatencyPhaseBOData			= 1,
+	kUSBLatencyPhaseBOStatus		= 2,	// CSW in
+	kUSBLatencyPhaseBOTotal			= 3,
+	kUSBLatencyPhaseCBICommand		= 4,	// ADSC on the control pipe
+	kUSBLatencyPhaseCBIData			= 5,
+	kUSBLatencyPhaseCBIStatus		= 6,	// Interrupt in
+	kUSBLatencyPhaseCBITotal		= 7,
+	kUSBLatencyPhaseClearStall		= 8,
+	kUSBLatencyPhaseClassReset		= 9,	// Bulk-Only Mass Storage Reset or CBI Command Block Reset
+	kUSBLatencyPhaseUSBReset		= 10,	// USB device reset until reconfigured
+	kUSBLatencyPhaseUASCommand		= 11,	// Command IU out
+	kUSBLatencyPhaseUASData			= 12,	// Command IU sent until the data has moved
+	kUSBLatencyPhaseUASStatus		= 13,	// Sense or Response IU in
+	kUSBLatencyPhaseUASTotal		= 14,
+	kUSBLatencyPhaseCount			= 15
+};
+
+// Bucket 0 counts latencies under 2 us, bucket n those from 2^n up to 2^(n+1) us. The last
+// bucket also takes everything longer.
+enum
+{
+	kUSBLatencyHistogramBuckets		= 24
 };
 
+typedef struct USBLatencyHistograms
+{
+	uint32_t		instance;
+	uint32_t		instanceCount;		// Number of devices which can be asked for
+	uint32_t		locationID;
+	uint32_t		protocol;			// bInterfaceProtocol
+	uint32_t		buckets[kUSBLatencyPhaseCount][kUSBLatencyHistogramBuckets];
+} USBLatencyHistograms;
+
+// The flight recorder keeps the last kUSBFlightRecorderDepth Bulk-Only and CBI commands.
+enum
+{
+	kUSBFlightRecorderDepth			= 32
+};
+
+// USBFlightRecord.recoverySteps
+enum
+{
+	kUSBFlightRecoveryClearStall	= 0x01,
+	kUSBFlightRecoveryClassReset	= 0x02,
+	kUSBFlightRecoveryDeviceReset	= 0x04,
+	kUSBFlightRecoveryAborted		= 0x08
+};
+
+// USBFlightRecord.cswStatus when no CSW was received
+enum
+{
+	kUSBFlightRecordNoCSW			= 0xFF
+};
+
+typedef struct USBFlightRecord
+{
+	uint64_t		startTime;			// Uptime in nanoseconds when the command was sent
+	uint8_t			cdb[16];
+	uint32_t		tag;				// CBW tag, Bulk-Only only
+	uint32_t		residue;			// CSW data residue
+	uint32_t		phaseUS[4];			// Command, data, status and whole command, in microseconds
+	int32_t			result;				// IOReturn the command completed with
+	uint8_t			lun;
+	uint8_t			cswStatus;
+	uint8_t			recoverySteps;
+	uint8_t			completed;
+} USBFlightRecord;
+
+typedef struct USBFlightRecorder
+{
+	uint32_t			instance;
+	uint32_t			instanceCount;
+	uint32_t			locationID;
+	uint32_t			recordCount;		// Commands recorded since start, may exceed the depth
+	USBFlightRecord		records[kUSBFlightRecorderDepth];	// Oldest first
+} USBFlightRecorder;
+
 
 /* The trace codes consist of the following:
  *
@@ -125,6 +223,14 @@ enum
     kDeviceInformation                  = 0x16,
     kSuspendPort                        = 0x17,
     kSubclassUse                        = 0x18,
+	kSCSITaskQueued						= 0x19,
+	kSCSITaskDequeued					= 0x1A,
+	kSCSITaskQueueFull					= 0x1B,
+	kRecoveryJobQueued					= 0x1C,
+	kRecoveryJobStarted					= 0x1D,
+	kRecoveryJobFinished				= 0x1E,
+	kUSBDeviceReconfigured				= 0x1F,
+	kSCSICommand						= 0x20,	// DBG_FUNC_START when sent, DBG_FUNC_END when completed
 
 	// CBI Tracepoints					0x05278900 - 0x0527897C
 	kCBIProtocolDeviceDetected			= 0x40,
@@ -134,7 +240,7 @@ enum
 	
 	// UFI Tracepoints					0x05278980 - 0x052789FC
 
-	// Bulk-Only Tracepoints			0x05278A00 - 0x05278BFC
+	// Bulk-Only Tracepoints			0x05278A00 - 0x05278AFC
 	kBODeviceDetected					= 0x80,
 	kBOPreferredMaxLUN					= 0x81,
 	kBOGetMaxLUNReturned				= 0x82,
@@ -144,7 +250,22 @@ enum
 	kBOCBWBulkOutWriteResult			= 0x86,
 	kBODoubleCompleteion				= 0x87,
 	kBOCompletionDuringTermination		= 0x88,
-	kBOCompletion						= 0x89
+	kBOCompletion						= 0x89,
+	kBOPostedCSW						= 0x8A,
+	kBOPostedCSWDiscarded				= 0x8B,
+	
+	// USB Attached SCSI Tracepoints	0x05278B00 - 0x05278BFC
+	kUASDeviceDetected					= 0xC0,
+	kUASConfigurationFailed				= 0xC1,
+	kUASCommandIU						= 0xC2,
+	kUASSendSCSICommandReturned			= 0xC3,
+	kUASStatusIU						= 0xC4,
+	kUASCompletion						= 0xC5,
+	kUASTransportError					= 0xC6,
+	kUASAbortAllCommands				= 0xC7,
+	kUASTaskManagementIU				= 0xC8,
+	kUASTaskManagementResponse			= 0xC9,
+	kUASReportLUNs						= 0xCA
 	
 };
     
@@ -194,6 +315,142 @@ enum
 #define UMC_TRACE( code )           ( ( ( DBG_IOKIT & 0xFF ) << 24 ) | ( ( DBG_IOSAM & 0xFF ) << 16 ) | ( ( kSAMClassUSB & 0x3F ) << 10 ) | ( ( code & 0xFF ) << 2 ) )
 #define USBODD_TRACE( code )        ( ( ( kSubclassCode_AppleUSBODD & 0xFF ) << 24 ) | ( code & 0xFFFFFF ) )
 #define USBCARDREADER_TRACE( code )	( ( ( kSubclassCode_AppleUSBCardReaderUMC & 0xFF ) << 24 ) | ( code & 0xFFFFFF ) )
+
+// kSCSICommand records. Both start with the driver in arg1 and end with the low 16 bits of the
+// transport tag in the top of arg4; the tag is zero for CBI.
+//
+// DBG_FUNC_START	arg2	LBA bits 0-31
+//					arg3	Transfer length, in blocks for READ and WRITE, otherwise in bytes
+//					arg4	Operation code (0-7), LUN (8-11), LBA bits 32-35 (12-15)
+// DBG_FUNC_END		arg2	Microseconds since the command was sent
+//					arg3	Bytes transferred
+//					arg4	Task status (0-7), service response (8-15)
+#define USB_COMMAND_START_INFO( opcode, lun, lbaHigh, tag )		( ( ( opcode ) & 0xFF ) | ( ( ( lun ) & 0xF ) << 8 ) | ( ( ( lbaHigh ) & 0xF ) << 12 ) | ( ( ( tag ) & 0xFFFF ) << 16 ) )
+#define USB_COMMAND_END_INFO( taskStatus, serviceResponse, tag )	( ( ( taskStatus ) & 0xFF ) | ( ( ( serviceResponse ) & 0xFF ) << 8 ) | ( ( ( tag ) & 0xFFFF ) << 16 ) )
+    
+//--------------------------------------------------------------------------------------------------
+//	USBTraceCategory - Returns the kUSBTraceCategory of a tracepoint. UMCLogger filters	[STATIC]
+//	with it too.
+//--------------------------------------------------------------------------------------------------
+
+static inline unsigned int
+USBTraceCategory ( unsigned int code )
+{
+	
+	// The subclass drivers use their own layout.
+	if ( ( code >> 24 ) != ( DBG_IOKIT & 0xFF ) )
+	{
+		return kUSBTraceCategorySubclass;
+	}
+	
+	code = ( code >> 2 ) & 0xFF;
+	
+	switch ( code )
+	{
+		
+		case kCDBLog1:
+		case kCDBLog2:
+		case kBOCBWDescription:
+			return kUSBTraceCategoryCDB;
+		
+		case kSCSICommand:
+			return kUSBTraceCategoryCommand;
+		
+		case kAbortedTask:
+		case kCompleteSCSICommand:
+		case kCompletingCommandWithError:
+			return kUSBTraceCategoryCompletion;
+		
+		case kSCSITaskQueued:
+		case kSCSITaskDequeued:
+		case kSCSITaskQueueFull:
+			return kUSBTraceCategoryQueue;
+		
+		case kClearEndPointStall:
+		case kGetEndPointStatus:
+		case kUSBDeviceResetWhileTerminating:
+		case kUSBDeviceResetAfterDisconnect:
+		case kUSBDeviceResetReturned:
+		case kAbortCurrentSCSITask:
+		case kRecoveryJobQueued:
+		case kRecoveryJobStarted:
+		case kRecoveryJobFinished:
+		case kUSBDeviceReconfigured:
+			return kUSBTraceCategoryRecovery;
+		
+		case kHandlePowerOnUSBReset:
+		case kSuspendPort:
+			return kUSBTraceCategoryPower;
+		
+		default:
+			break;
+		
+	}
+	
+	if ( code >= kUASDeviceDetected )
+	{
+		return kUSBTraceCategoryUAS;
+	}
+	
+	if ( code >= kBODeviceDetected )
+	{
+		return kUSBTraceCategoryBO;
+	}
+	
+	if ( code >= kCBIProtocolDeviceDetected )
+	{
+		return kUSBTraceCategoryCBI;
+	}
+	
+	return kUSBTraceCategoryGeneral;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	USBTraceCarriesDriver - Whether the first argument of a tracepoint is the driver, which	[STATIC]
+//	is what the trace filter compares. Subclass tracepoints and kSubclassUse carry something
+//	else there.
+//--------------------------------------------------------------------------------------------------
+
+static inline bool
+USBTraceCarriesDriver ( unsigned int code )
+{
+	
+	return ( ( ( code >> 24 ) == ( DBG_IOKIT & 0xFF ) ) && ( code != UMC_TRACE ( kSubclassUse ) ) );
+	
+}
+
+
+#if KERNEL
+
+
+//--------------------------------------------------------------------------------------------------
+//	RecordUSBTimeStamp											       						[STATIC]
+//--------------------------------------------------------------------------------------------------
+
+static inline void
+RecordUSBTimeStamp ( 
+	unsigned int code,
+	uintptr_t a, uintptr_t b,
+	uintptr_t c, uintptr_t d )
+{
+	
+	// Every caller passes a constant code, so the category and whether the filter applies
+	// fold away, and a category which is off costs a single test.
+	if ( ( gUSBTraceCategories & USBTraceCategory ( code ) ) != 0 )
+	{
+		
+		if ( ( gUSBTraceFilter == 0 ) || ( USBTraceCarriesDriver ( code ) == false ) || ( gUSBTraceFilter == a ) )
+		{
+			IOTimeStampConstant ( code, a, b, c, d );
+		}
+		
+	}
+	
+}
+
+#endif
     
 #ifdef __cplusplus
 }
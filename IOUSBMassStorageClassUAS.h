@@ -0,0 +1,551 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef __IOKIT_IO_IOUSBMASSTORAGECLASS_UAS__
+#define __IOKIT_IO_IOUSBMASSTORAGECLASS_UAS__
+
+// USB Attached SCSI Information Units, built and parsed a byte at a time so that the same
+// code runs in the kernel and in the host side tests. The request blocks of the driver are
+// only defined for the kernel.
+
+#include <stdint.h>
+#include <string.h>
+
+#if KERNEL
+#include <IOKit/IOMemoryDescriptor.h>
+#include <IOKit/usb/USB.h>
+#include <IOKit/scsi/SCSITask.h>
+#endif
+
+
+//--------------------------------------------------------------------------------------------------
+//	USB Attached SCSI Protocol Constants
+//--------------------------------------------------------------------------------------------------
+
+enum
+{
+	// Information Unit IDs
+	kUASCommandIUID					= 0x01,
+	kUASSenseIUID					= 0x03,
+	kUASResponseIUID				= 0x04,
+	kUASTaskManagementIUID			= 0x05,
+	kUASReadReadyIUID				= 0x06,
+	kUASWriteReadyIUID				= 0x07,
+
+	// Pipe IDs from the Pipe Usage class specific endpoint descriptor
+	kUASPipeUsageDescriptorType		= 0x24,
+	kUASCommandPipeID				= 0x01,
+	kUASStatusPipeID				= 0x02,
+	kUASDataInPipeID				= 0x03,
+	kUASDataOutPipeID				= 0x04,
+
+	kUASCommandIUSize				= 32,
+	kUASTaskManagementIUSize		= 16,
+	kUASResponseIUSize				= 8,
+	kUASSenseIUHeaderSize			= 16,
+	kUASMaxSenseDataSize			= 252,
+	kUASMaxStatusIUSize				= kUASSenseIUHeaderSize + kUASMaxSenseDataSize,
+
+	// Command tags run from 1 to the queue depth. The tag after that is kept for
+	// task management, so a streams capable device needs depth + 1 streams.
+	kUASMaxQueueDepth				= 32,
+	kUASDefaultQueueDepth			= 32
+};
+
+// Field offsets. All multi-byte fields are big endian.
+enum
+{
+	kUASIUIDOffset						= 0,
+	kUASIUTagOffset						= 2,
+
+	kUASCommandIUTaskAttributeOffset	= 4,
+	kUASCommandIULUNOffset				= 8,
+	kUASCommandIUCDBOffset				= 16,
+
+	kUASTaskManagementIUFunctionOffset	= 4,
+	kUASTaskManagementIUTaskTagOffset	= 6,
+	kUASTaskManagementIULUNOffset		= 8,
+
+	kUASSenseIUStatusOffset				= 6,
+	kUASSenseIULengthOffset				= 14,
+
+	kUASResponseIUCodeOffset			= 7
+};
+
+// Task attributes
+enum
+{
+	kUASTaskAttributeSimple			= 0x00
+};
+
+// Task management functions
+enum
+{
+	kUASTaskManagementAbortTask		= 0x01
+};
+
+// Response IU response codes
+enum
+{
+	kUASResponseTMFunctionComplete		= 0x00,
+	kUASResponseInvalidIU				= 0x02,
+	kUASResponseTMFunctionNotSupported	= 0x04,
+	kUASResponseTMFunctionFailed		= 0x05,
+	kUASResponseTMFunctionSucceeded		= 0x08,
+	kUASResponseIncorrectLUN			= 0x09,
+	kUASResponseOverlappedTag			= 0x0A
+};
+
+// REPORT LUNS. The list is sized for every LUN the admission queues can hold.
+enum
+{
+	kUASReportLUNsOperationCode		= 0xA0,
+	kUASReportLUNsCDBSize			= 12,
+	kUASReportLUNsHeaderSize		= 8,
+	kUASReportLUNsEntrySize			= 8,
+	kUASReportLUNsMaxEntries		= 16,
+	kUASReportLUNsDataSize			= kUASReportLUNsHeaderSize + ( kUASReportLUNsMaxEntries * kUASReportLUNsEntrySize )
+};
+
+// A Sense, Response, Read Ready or Write Ready IU as received on the status pipe.
+typedef struct UASStatusIUInfo
+{
+	uint8_t			iuID;
+	uint16_t		tag;
+	uint8_t			taskStatus;			// Sense IU
+	uint16_t		senseLength;		// Sense IU, limited to the sense data received
+	uint8_t			responseCode;		// Response IU
+} UASStatusIUInfo;
+
+
+//--------------------------------------------------------------------------------------------------
+//	Tags
+//--------------------------------------------------------------------------------------------------
+
+// Tags are also bulk stream IDs, so they start at 1 and follow the request slots.
+static inline uint16_t
+UASTagForSlot ( uint32_t slotIndex )
+{
+	return ( uint16_t ) ( slotIndex + 1 );
+}
+
+// Returns the request slot of a command tag, or -1 when the tag cannot belong to a command.
+static inline int
+UASSlotForTag ( uint16_t tag, uint32_t poolSize )
+{
+
+	if ( ( tag == 0 ) || ( tag > poolSize ) )
+	{
+		return -1;
+	}
+
+	return ( int ) ( tag - 1 );
+
+}
+
+static inline uint16_t
+UASTaskManagementTag ( uint32_t queueDepth )
+{
+	return ( uint16_t ) ( queueDepth + 1 );
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	Information Units
+//--------------------------------------------------------------------------------------------------
+
+// The LUN uses the single level peripheral device addressing method. Only CDBs of up to
+// 16 bytes fit without an additional CDB length, and the IU is not built for longer ones.
+static inline bool
+UASBuildCommandIU (	uint8_t *			iu,
+					uint16_t			tag,
+					uint8_t				lun,
+					const uint8_t *		cdb,
+					uint8_t				cdbLength )
+{
+
+	if ( cdbLength > ( kUASCommandIUSize - kUASCommandIUCDBOffset ) )
+	{
+		return false;
+	}
+
+	memset ( iu, 0, kUASCommandIUSize );
+
+	iu[kUASIUIDOffset]						= kUASCommandIUID;
+	iu[kUASIUTagOffset]						= ( uint8_t ) ( tag >> 8 );
+	iu[kUASIUTagOffset + 1]					= ( uint8_t ) tag;
+	iu[kUASCommandIUTaskAttributeOffset]	= kUASTaskAttributeSimple;
+	iu[kUASCommandIULUNOffset + 1]			= lun;
+
+	memcpy ( &iu[kUASCommandIUCDBOffset], cdb, cdbLength );
+
+	return true;
+
+}
+
+
+static inline void
+UASBuildTaskManagementIU (	uint8_t *			iu,
+							uint16_t			tag,
+							uint8_t				function,
+							uint16_t			taskTag,
+							uint8_t				lun )
+{
+
+	memset ( iu, 0, kUASTaskManagementIUSize );
+
+	iu[kUASIUIDOffset]							= kUASTaskManagementIUID;
+	iu[kUASIUTagOffset]							= ( uint8_t ) ( tag >> 8 );
+	iu[kUASIUTagOffset + 1]						= ( uint8_t ) tag;
+	iu[kUASTaskManagementIUFunctionOffset]		= function;
+	iu[kUASTaskManagementIUTaskTagOffset]		= ( uint8_t ) ( taskTag >> 8 );
+	iu[kUASTaskManagementIUTaskTagOffset + 1]	= ( uint8_t ) taskTag;
+	iu[kUASTaskManagementIULUNOffset + 1]		= lun;
+
+}
+
+
+// Decodes the header of a status pipe IU of length bytes. Returns false if it is too short
+// to be the IU its ID claims, in which case only iuID and tag are valid.
+static inline bool
+UASParseStatusIU ( const uint8_t * iu, uint32_t length, UASStatusIUInfo * info )
+{
+
+	bool		valid = false;
+	uint32_t	senseLength;
+
+	memset ( info, 0, sizeof ( UASStatusIUInfo ) );
+
+	if ( length < 4 )
+	{
+		return false;
+	}
+
+	info->iuID	= iu[kUASIUIDOffset];
+	info->tag	= ( uint16_t ) ( ( iu[kUASIUTagOffset] << 8 ) | iu[kUASIUTagOffset + 1] );
+
+	switch ( info->iuID )
+	{
+
+		case kUASSenseIUID:
+		{
+
+			if ( length < kUASSenseIUHeaderSize )
+			{
+				break;
+			}
+
+			info->taskStatus = iu[kUASSenseIUStatusOffset];
+
+			// Never trust the length field past the end of what actually arrived.
+			senseLength = ( iu[kUASSenseIULengthOffset] << 8 ) | iu[kUASSenseIULengthOffset + 1];
+			if ( senseLength > ( length - kUASSenseIUHeaderSize ) )
+			{
+				senseLength = length - kUASSenseIUHeaderSize;
+			}
+
+			if ( senseLength > kUASMaxSenseDataSize )
+			{
+				senseLength = kUASMaxSenseDataSize;
+			}
+
+			info->senseLength	= ( uint16_t ) senseLength;
+			valid				= true;
+
+		}
+		break;
+
+		case kUASResponseIUID:
+		{
+
+			if ( length < kUASResponseIUSize )
+			{
+				break;
+			}
+
+			info->responseCode	= iu[kUASResponseIUCodeOffset];
+			valid				= true;
+
+		}
+		break;
+
+		case kUASReadReadyIUID:
+		case kUASWriteReadyIUID:
+		{
+			valid = true;
+		}
+		break;
+
+		default:
+		break;
+
+	}
+
+	return valid;
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	Status Routing
+//--------------------------------------------------------------------------------------------------
+
+// What a status pipe IU asks of the driver.
+enum
+{
+	kUASRouteIgnore				= 0,	// Not a command tag, nothing can be waiting on it
+	kUASRouteTaskManagement		= 1,	// The response to the outstanding ABORT TASK
+	kUASRouteDataPhase			= 2,	// Read Ready or Write Ready, start the data phase
+	kUASRouteStatus				= 3,	// Completes the command, an unusable IU as an error
+	kUASRouteProtocolError		= 4		// Can't belong where it was read, recover the device
+};
+
+
+// Routes an IU parsed by UASParseStatusIU ( ). streamTag is the tag of the command whose
+// stream the IU was read on, or 0 for the shared status read used without streams.
+static inline uint8_t
+UASRouteStatusIU (	const UASStatusIUInfo *	info,
+					bool					valid,
+					uint16_t				streamTag,
+					bool					taskManagementPending,
+					uint32_t				queueDepth )
+{
+
+	// A stream only ever carries the status of its own command.
+	if ( streamTag != 0 )
+	{
+		return ( info->tag == streamTag ) ? kUASRouteStatus : kUASRouteProtocolError;
+	}
+
+	if ( ( taskManagementPending == true ) && ( info->tag == UASTaskManagementTag ( queueDepth ) ) )
+	{
+		return kUASRouteTaskManagement;
+	}
+
+	if ( UASSlotForTag ( info->tag, queueDepth ) < 0 )
+	{
+		return kUASRouteIgnore;
+	}
+
+	if ( ( valid == true ) && ( ( info->iuID == kUASReadReadyIUID ) || ( info->iuID == kUASWriteReadyIUID ) ) )
+	{
+		return kUASRouteDataPhase;
+	}
+
+	return kUASRouteStatus;
+
+}
+
+
+// Whether a Read Ready or Write Ready IU is the one the command waits for: the first,
+// and for the direction its data moves in.
+static inline bool
+UASReadyIUMatchesCommand ( uint8_t iuID, bool dataPhaseNeeded, bool dataIn )
+{
+
+	if ( dataPhaseNeeded == false )
+	{
+		return false;
+	}
+
+	return ( iuID == ( dataIn ? kUASReadReadyIUID : kUASWriteReadyIUID ) );
+
+}
+
+
+// Whether the device carried out the task management function.
+static inline bool
+UASTaskManagementSucceeded ( const UASStatusIUInfo * info, bool valid )
+{
+
+	return ( ( valid == true ) && ( info->iuID == kUASResponseIUID ) &&
+			 ( ( info->responseCode == kUASResponseTMFunctionComplete ) ||
+			   ( info->responseCode == kUASResponseTMFunctionSucceeded ) ) );
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	REPORT LUNS
+//--------------------------------------------------------------------------------------------------
+
+static inline void
+UASBuildReportLUNsCDB ( uint8_t * cdb )
+{
+
+	memset ( cdb, 0, kUASReportLUNsCDBSize );
+
+	cdb[0] = kUASReportLUNsOperationCode;
+	cdb[6] = ( uint8_t ) ( kUASReportLUNsDataSize >> 24 );
+	cdb[7] = ( uint8_t ) ( kUASReportLUNsDataSize >> 16 );
+	cdb[8] = ( uint8_t ) ( kUASReportLUNsDataSize >> 8 );
+	cdb[9] = ( uint8_t ) kUASReportLUNsDataSize;
+
+}
+
+
+// Returns the highest LUN in REPORT LUNS parameter data that can be addressed the way the
+// Command IU does it, and is at most maxLUN. LUN 0 is always reported.
+static inline uint8_t
+UASParseReportLUNs ( const uint8_t * data, uint32_t length, uint8_t maxLUN )
+{
+
+	uint32_t		listLength;
+	uint32_t		offset;
+	uint8_t			highest = 0;
+
+	if ( length < kUASReportLUNsHeaderSize )
+	{
+		return 0;
+	}
+
+	listLength = ( ( uint32_t ) data[0] << 24 ) | ( ( uint32_t ) data[1] << 16 ) | ( ( uint32_t ) data[2] << 8 ) | data[3];
+
+	// The list may have been cut short by the allocation length.
+	if ( listLength > ( length - kUASReportLUNsHeaderSize ) )
+	{
+		listLength = length - kUASReportLUNsHeaderSize;
+	}
+
+	for ( offset = kUASReportLUNsHeaderSize;
+		  ( offset + kUASReportLUNsEntrySize ) <= ( kUASReportLUNsHeaderSize + listLength );
+		  offset += kUASReportLUNsEntrySize )
+	{
+
+		const uint8_t *		entry = &data[offset];
+
+		// Peripheral device addressing, bus 0, single level.
+		if ( ( entry[0] != 0 ) || ( entry[2] != 0 ) || ( entry[3] != 0 ) ||
+			 ( entry[4] != 0 ) || ( entry[5] != 0 ) || ( entry[6] != 0 ) || ( entry[7] != 0 ) )
+		{
+			continue;
+		}
+
+		if ( ( entry[1] > highest ) && ( entry[1] <= maxLUN ) )
+		{
+			highest = entry[1];
+		}
+
+	}
+
+	return highest;
+
+}
+
+
+#if KERNEL
+
+//--------------------------------------------------------------------------------------------------
+//	Driver Structures
+//--------------------------------------------------------------------------------------------------
+
+// All multi-byte IU fields are big endian.
+struct UASCommandIU
+{
+	UInt8		iuID;
+	UInt8		reserved1;
+	UInt16		tag;
+	UInt8		taskAttribute;			// Bits 0-2: Task attribute, 3-6: Command priority
+	UInt8		reserved5;
+	UInt8		additionalCDBLength;	// Bits 2-7: Additional CDB length in dwords
+	UInt8		reserved7;
+	UInt8		lun[8];
+	UInt8		cdb[16];
+};
+
+typedef struct UASCommandIU		UASCommandIU;
+
+struct UASTaskManagementIU
+{
+	UInt8		iuID;
+	UInt8		reserved1;
+	UInt16		tag;
+	UInt8		function;
+	UInt8		reserved5;
+	UInt16		taskTag;
+	UInt8		lun[8];
+};
+
+typedef struct UASTaskManagementIU	UASTaskManagementIU;
+
+// Sense, Response, Read Ready and Write Ready IUs all share this header. 
+struct UASStatusIUHeader
+{
+	UInt8		iuID;
+	UInt8		reserved1;
+	UInt16		tag;
+};
+
+typedef struct UASStatusIUHeader	UASStatusIUHeader;
+
+struct UASRequestBlock
+{
+	SCSITaskIdentifier		request;
+	IOUSBCompletion			uasCommandCompletion;
+	IOUSBCompletion			uasDataCompletion;
+	IOUSBCompletion			uasStatusCompletion;
+	UInt16					uasTag;
+	UInt8					uasPendingPhases;		// USB requests still owned by the host controller
+	UInt8					uasFlags;
+	IOReturn				uasTransportStatus;
+	UInt64					uasBytesTransferred;
+	UASCommandIU			uasCommandIU;
+	UInt8					uasStatusIU[kUASMaxStatusIUSize];
+	UInt32					uasStatusLength;
+	UInt64					uasStartTime;
+	UInt64					uasPhaseStartTime;		// End of the previous phase, for the latency histograms
+};
+
+typedef struct UASRequestBlock		UASRequestBlock;
+
+struct UASRequestSlot
+{
+	UASRequestBlock			block;
+	IOMemoryDescriptor *	commandDescriptor;
+	IOMemoryDescriptor *	statusDescriptor;
+};
+
+typedef struct UASRequestSlot			UASRequestSlot;
+
+// Without bulk streams a single status read collects the IUs for every tag. With streams it
+// only collects the response to a task management IU, on that IU's own stream.
+struct UASStatusReader
+{
+	IOUSBCompletion			completion;
+	bool					posted;
+	UInt8					buffer[kUASMaxStatusIUSize];
+	IOMemoryDescriptor *	descriptor;
+	UASTaskManagementIU		taskManagementIU;
+	IOMemoryDescriptor *	taskManagementDescriptor;
+	IOUSBCompletion			taskManagementCompletion;
+	bool					taskManagementPending;		// Waiting on the Response IU
+	UInt16					taskManagementTaskTag;
+	SCSITaskIdentifier		taskManagementRequest;
+};
+
+typedef struct UASStatusReader			UASStatusReader;
+
+#endif	/* KERNEL */
+
+
+#endif	/* __IOKIT_IO_IOUSBMASSTORAGECLASS_UAS__ */
@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef __IOKIT_IO_IOUSBMASSTORAGE_UFI_POLICY__
+#define __IOKIT_IO_IOUSBMASSTORAGE_UFI_POLICY__
+
+// The media polling backoff and the read/write split arithmetic of the UFI driver, kept
+// free of IOKit so that the same code runs in the kernel and in the host side tests.
+
+#include <stdint.h>
+
+
+//--------------------------------------------------------------------------------------------------
+//	Constants
+//--------------------------------------------------------------------------------------------------
+
+// Default polling policy, in milliseconds. Once the device has reported a media
+// change event the poll for removal is only a fallback for changes no command has
+// seen yet, so it may back off further. The poll for new media never does.
+enum
+{
+	kPollIntervalMinimum			= 1000,
+	kPollIntervalMaximum			= 4000,
+	kPollIntervalMaximumMediaEvents	= 16000,
+	kPollIntervalFloor				= 100,
+	kPollFastCount					= 5
+};
+
+// Reads and writes are split into commands of at most this many bytes, unless
+// the device personality says otherwise. UFI addresses blocks with 32 bits.
+enum
+{
+	kMaxCommandByteCountDefault		= 65536,
+	kUFIMaxBlockAddress				= 0xFFFFFFFF
+};
+
+
+//--------------------------------------------------------------------------------------------------
+//	Polling Policy
+//--------------------------------------------------------------------------------------------------
+
+// Media polling policy, in milliseconds. The interval starts at minimumInterval
+// after media activity, user I/O or a power change, stays there for fastPolls
+// polls and then doubles with every idle poll up to maximumInterval, or up to
+// newMediaMaximumInterval while polling for new media. maximumInterval is raised
+// to eventMaximumInterval by the first media change event.
+typedef struct UFIPollingPolicy
+{
+	uint32_t	minimumInterval;
+	uint32_t	maximumInterval;
+	uint32_t	newMediaMaximumInterval;
+	uint32_t	eventMaximumInterval;
+	uint32_t	fastPolls;
+	uint32_t	currentInterval;
+	uint32_t	fastPollsLeft;
+} UFIPollingPolicy;
+
+
+// The defaults, before a device personality overrides any of them. mediaChangeEvents
+// says the protocol driver can report media changes, not that this device does.
+static inline void
+UFIInitPollingPolicy ( UFIPollingPolicy * policy, bool mediaChangeEvents )
+{
+
+	policy->minimumInterval	= kPollIntervalMinimum;
+	policy->maximumInterval	= kPollIntervalMaximum;
+	policy->fastPolls		= kPollFastCount;
+
+	// Media change events only report removal promptly. Polling for new media keeps the
+	// ceiling of a polled device, or an inserted disk can go unseen for up to 16 seconds.
+	policy->newMediaMaximumInterval = kPollIntervalMaximum;
+
+	// Many devices never send the interrupt data a change is reported with, so the poll
+	// for removal keeps the same ceiling until one of them has.
+	policy->eventMaximumInterval = mediaChangeEvents ? kPollIntervalMaximumMediaEvents : kPollIntervalMaximum;
+
+}
+
+
+// Brings overridden intervals back into a usable order: floor <= minimum <= new media
+// maximum <= maximum <= event maximum.
+static inline void
+UFIClampPollingPolicy ( UFIPollingPolicy * policy )
+{
+
+	if ( policy->minimumInterval < kPollIntervalFloor )
+	{
+		policy->minimumInterval = kPollIntervalFloor;
+	}
+
+	if ( policy->maximumInterval < policy->minimumInterval )
+	{
+		policy->maximumInterval = policy->minimumInterval;
+	}
+
+	if ( policy->newMediaMaximumInterval > policy->maximumInterval )
+	{
+		policy->newMediaMaximumInterval = policy->maximumInterval;
+	}
+
+	if ( policy->newMediaMaximumInterval < policy->minimumInterval )
+	{
+		policy->newMediaMaximumInterval = policy->minimumInterval;
+	}
+
+	if ( policy->eventMaximumInterval < policy->maximumInterval )
+	{
+		policy->eventMaximumInterval = policy->maximumInterval;
+	}
+
+}
+
+
+// The device has reported a media change, so later ones will be reported as well
+// and the poll for removal may back off further.
+static inline void
+UFINoteMediaChangeEvent ( UFIPollingPolicy * policy )
+{
+
+	if ( policy->maximumInterval < policy->eventMaximumInterval )
+	{
+		policy->maximumInterval = policy->eventMaximumInterval;
+	}
+
+}
+
+
+static inline void
+UFIResetPollingInterval ( UFIPollingPolicy * policy )
+{
+
+	policy->currentInterval	= policy->minimumInterval;
+	policy->fastPollsLeft	= policy->fastPolls;
+
+}
+
+
+// Returns the delay before the next poll and backs off for the one after.
+static inline uint32_t
+UFINextPollingInterval ( UFIPollingPolicy * policy, bool newMedia )
+{
+
+	uint32_t	maximum = newMedia ? policy->newMediaMaximumInterval : policy->maximumInterval;
+	uint32_t	interval;
+
+	// The interval may have backed off further while polling for removal.
+	if ( policy->currentInterval > maximum )
+	{
+		policy->currentInterval = maximum;
+	}
+
+	interval = policy->currentInterval;
+
+	if ( policy->fastPollsLeft > 0 )
+	{
+		policy->fastPollsLeft--;
+	}
+	else if ( policy->currentInterval < maximum / 2 )
+	{
+		policy->currentInterval *= 2;
+	}
+	else
+	{
+		policy->currentInterval = maximum;
+	}
+
+	return interval;
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	Splitting Reads and Writes
+//--------------------------------------------------------------------------------------------------
+
+// The most blocks one READ or WRITE may move: never less than a block, and never
+// more than READ_12 can express.
+static inline uint64_t
+UFIMaxBlocksPerCommand ( uint32_t maxCommandByteCount, uint64_t blockSize )
+{
+
+	uint64_t	maxBlockCount = 1;
+
+	if ( blockSize != 0 )
+	{
+		maxBlockCount = maxCommandByteCount / blockSize;
+	}
+
+	if ( maxBlockCount == 0 )
+	{
+		maxBlockCount = 1;
+	}
+
+	if ( maxBlockCount > kUFIMaxBlockAddress )
+	{
+		maxBlockCount = kUFIMaxBlockAddress;
+	}
+
+	return maxBlockCount;
+
+}
+
+
+// Whether every block of the request has a 32 bit address.
+static inline bool
+UFIRequestIsAddressable ( uint64_t startBlock, uint64_t blockCount )
+{
+	return ( ( startBlock + blockCount ) <= ( ( uint64_t ) kUFIMaxBlockAddress + 1 ) );
+}
+
+
+// Blocks in the next command of a request with blocksLeft blocks still to send.
+static inline uint64_t
+UFICommandBlocks ( uint64_t blocksLeft, uint64_t maxBlockCount )
+{
+	return ( blocksLeft < maxBlockCount ) ? blocksLeft : maxBlockCount;
+}
+
+
+// Only a request that fits in one command is sent with the client's buffer, every
+// command of a split one gets its own part of it.
+static inline bool
+UFIRequestIsSplit ( uint64_t blockCount, uint64_t maxBlockCount )
+{
+	return ( blockCount > maxBlockCount );
+}
+
+
+#endif	/* __IOKIT_IO_IOUSBMASSTORAGE_UFI_POLICY__ */
@@ -31,6 +31,9 @@
 
 #include <IOKit/storage/IOBlockStorageDriver.h>
 #include <IOKit/IOSyncer.h>
+#include <IOKit/IOSubMemoryDescriptor.h>
+#include <IOKit/IOLocks.h>
+#include <IOKit/IOWorkLoop.h>
 #include <IOKit/usb/IOUFIStorageServices.h>
 #include <IOKit/scsi/SCSICmds_INQUIRY_Definitions.h>
 #include <IOKit/scsi/SCSICommandOperationCodes.h>
@@ -54,6 +57,16 @@
 #define kKeySwitchProperty			"Keyswitch"
 #define kAppleKeySwitchProperty		"AppleKeyswitch"
 
+// Set on the device nub by the protocol driver when media changes are reported
+// on the interrupt pipe.
+#define kMediaChangeEventsProperty	"Media Change Events"
+
+// Delay in milliseconds before asking a drive that is not ready again.
+#define kNotReadyRetryDelay				200
+
+// Published on the device nub once NOT_READY status has been cleared.
+#define kDeviceReadyProperty			"Device Ready"
+
 #define super IOSCSIPrimaryCommandsDevice
 
 enum
@@ -130,6 +143,38 @@ ErrorExit:
 }
 
 
+//--------------------------------------------------------------------------------------------------
+//	sNotReadyTimerFired -	Asks a drive that was not ready again.					[STATIC][PUBLIC]
+//--------------------------------------------------------------------------------------------------
+
+void 
+IOUSBMassStorageUFIDevice::sNotReadyTimerFired ( void * theUFIDriver, void * refCon )
+{
+	UNUSED( refCon );
+	
+	IOUSBMassStorageUFIDevice *	driver;
+	
+	driver = (IOUSBMassStorageUFIDevice *) theUFIDriver;
+	require_nonzero ( driver, ErrorExit );
+	
+	// The state machine's own retain keeps the driver around until it finishes.
+	if ( driver->isInactive() == true )
+	{
+		driver->NotReadyStatusCleared();
+	}
+	else
+	{
+		driver->IssueNotReadyCommand ( kNotReadyState_TestUnitReady );
+	}
+	
+	
+ErrorExit:
+
+	return;
+	
+}
+
+
 //--------------------------------------------------------------------------------------------------
 //	AsyncReadWriteComplete - Completion routine for I/O							   [STATIC][PRIVATE]
 //--------------------------------------------------------------------------------------------------
@@ -165,9 +210,20 @@ IOUSBMassStorageUFIDevice::AsyncReadWriteComplete ( SCSITaskIdentifier request )
 	else
 	{
 	
+		SCSI_Sense_Data		senseBuffer;
+		
 		STATUS_LOG ( ( 4, "%s[%p]::Error on read/write", taskOwner->getName(), taskOwner ) );
 		status = kIOReturnError;
 		
+		// The medium may have changed under this I/O, check now rather than at the next poll.
+		if ( ( taskOwner->GetTaskStatus( request ) == kSCSITaskStatus_CHECK_CONDITION ) &&
+			 ( taskOwner->GetAutoSenseData( request, &senseBuffer ) == true ) &&
+			 ( ( senseBuffer.ADDITIONAL_SENSE_CODE == 0x28 ) ||
+			   ( senseBuffer.ADDITIONAL_SENSE_CODE == 0x3A ) ) )
+		{
+			taskOwner->ExpeditePolling();
+		}
+		
 	}
 
 	if ( status == kIOReturnSuccess )
@@ -176,8 +232,113 @@ IOUSBMassStorageUFIDevice::AsyncReadWriteComplete ( SCSITaskIdentifier request )
 	}
 	
 
-	taskOwner->ReleaseSCSITask( request );
+	taskOwner->ReleasePooledSCSITask( request );
+
+	IOUFIStorageServices::AsyncReadWriteComplete( clientData, status, actCount );
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	ClearNotReadyStatusComplete - Completion routine for the NOT_READY state machine  [STATIC][PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void 
+IOUSBMassStorageUFIDevice::ClearNotReadyStatusComplete ( SCSITaskIdentifier request )
+{
+	IOUSBMassStorageUFIDevice *		taskOwner;
+	
+	
+	if ( request == NULL )
+	{
+		PANIC_NOW ( ( "IOUSBMassStorageUFIDevice::ClearNotReadyStatusComplete request==NULL." ) );
+	}
+
+	taskOwner = OSDynamicCast ( IOUSBMassStorageUFIDevice, IOSCSIPrimaryCommandsDevice::sGetOwnerForTask ( request ) );
+	if ( taskOwner == NULL )
+	{
+		PANIC_NOW ( ( "IOUSBMassStorageUFIDevice::ClearNotReadyStatusComplete taskOwner==NULL." ) );
+	}
+	
+	taskOwner->ProcessNotReadyCompletion ( request );
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	SplitReadWriteComplete - Completion routine for each command of a split I/O		   [STATIC][PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void 
+IOUSBMassStorageUFIDevice::SplitReadWriteComplete ( SCSITaskIdentifier request )
+{
+	UFISplitRequest *				split;
+	void *							clientData;
+	IOReturn						status;
+	UInt64							actCount;
+	IOUSBMassStorageUFIDevice *		taskOwner;
+		
+		
+	if ( request == NULL )
+	{
+		PANIC_NOW ( ( "IOUSBMassStorageUFIDevice::SplitReadWriteComplete request==NULL." ) );
+	}
+
+	taskOwner = OSDynamicCast ( IOUSBMassStorageUFIDevice, IOSCSIPrimaryCommandsDevice::sGetOwnerForTask ( request ) );
+	if ( taskOwner == NULL )
+	{
+		PANIC_NOW ( ( "IOUSBMassStorageUFIDevice::SplitReadWriteComplete taskOwner==NULL." ) );
+	}
 
+	split = ( UFISplitRequest * ) taskOwner->GetApplicationLayerReference( request );
+	
+	if ( ( taskOwner->GetServiceResponse( request ) == kSCSIServiceResponse_TASK_COMPLETE ) &&
+		( taskOwner->GetTaskStatus( request ) == kSCSITaskStatus_GOOD ) ) 
+	{
+		
+		status = kIOReturnSuccess;
+		split->actualByteCount += split->commandBuffer->getLength();
+		
+	}
+	else
+	{
+	
+		SCSI_Sense_Data		senseBuffer;
+		
+		STATUS_LOG ( ( 4, "%s[%p]::Error on split read/write", taskOwner->getName(), taskOwner ) );
+		status = kIOReturnError;
+		
+		// The medium may have changed under this I/O, check now rather than at the next poll.
+		if ( ( taskOwner->GetTaskStatus( request ) == kSCSITaskStatus_CHECK_CONDITION ) &&
+			 ( taskOwner->GetAutoSenseData( request, &senseBuffer ) == true ) &&
+			 ( ( senseBuffer.ADDITIONAL_SENSE_CODE == 0x28 ) ||
+			   ( senseBuffer.ADDITIONAL_SENSE_CODE == 0x3A ) ) )
+		{
+			taskOwner->ExpeditePolling();
+		}
+		
+	}
+	
+	split->commandBuffer->complete();
+	
+	// Send the next command right away, on the same task.
+	if ( ( status == kIOReturnSuccess ) && ( split->blocksLeft > 0 ) )
+	{
+		
+		status = taskOwner->IssueSplitCommand ( request, split );
+		if ( status == kIOReturnSuccess )
+		{
+			return;
+		}
+		
+	}
+	
+	clientData	= split->clientData;
+	actCount	= split->actualByteCount;
+	
+	// The split request belongs to the task, so it is free again along with it.
+	taskOwner->ReleasePooledSCSITask( request );
+	
 	IOUFIStorageServices::AsyncReadWriteComplete( clientData, status, actCount );
 	
 }
@@ -204,14 +365,18 @@ IOUSBMassStorageUFIDevice::InitializeDeviceSupport ( void )
 
     STATUS_LOG ( ( 6, "%s[%p]::InitializeDeviceSupport called", getName(), this ) );
 
-	ClearNotReadyStatus();
-	
+	// NOT_READY status is cleared by StartDeviceSupport without holding up start.
 	fPollingMode = kPollingMode_NewMedia;
 
 	fIOUSBMassStorageUFIDeviceReserved = ( IOUSBMassStorageUFIDeviceExpansionData * )
 			IOMalloc ( sizeof ( IOUSBMassStorageUFIDeviceExpansionData ) );
 	require_nonzero ( fIOUSBMassStorageUFIDeviceReserved, ErrorExit );
 
+	bzero ( fIOUSBMassStorageUFIDeviceReserved,
+			sizeof ( IOUSBMassStorageUFIDeviceExpansionData ) );	
+
+	require_success ( AllocateTaskPool( ), ErrorExit );
+
 	require ( ( DetermineDeviceCharacteristics( ) == true ), ErrorExit );
 	
 	fPollingThread = thread_call_allocate (
@@ -219,8 +384,10 @@ IOUSBMassStorageUFIDevice::InitializeDeviceSupport ( void )
 					( thread_call_param_t ) this );
 	require_nonzero ( fPollingThread, ErrorExit );
 
-	bzero ( fIOUSBMassStorageUFIDeviceReserved,
-			sizeof ( IOUSBMassStorageUFIDeviceExpansionData ) );	
+	fNotReadyTimer = thread_call_allocate (
+					( thread_call_func_t ) IOUSBMassStorageUFIDevice::sNotReadyTimerFired,
+					( thread_call_param_t ) this );
+	require_nonzero ( fNotReadyTimer, ErrorExit );
 
 	InitializePowerManagement ( GetProtocolDriver ( ) );
 
@@ -246,25 +413,20 @@ ErrorExit:
 void
 IOUSBMassStorageUFIDevice::StartDeviceSupport ( void )
 {
-	OSBoolean *		shouldNotPoll = NULL;
+	OSBoolean *		mediaChangeEvents = NULL;
 	
-		
-	shouldNotPoll = OSDynamicCast (	OSBoolean,
-									getProperty ( kAppleKeySwitchProperty ) );
 	
-	if ( shouldNotPoll != NULL )
+	mediaChangeEvents = OSDynamicCast ( OSBoolean, getProperty ( kMediaChangeEventsProperty ) );
+	if ( mediaChangeEvents != NULL )
 	{
-		
-		// See if we should not poll.
-		require ( shouldNotPoll->isFalse ( ), Exit );
-		
+		fMediaChangeEvents = mediaChangeEvents->isTrue ( );
 	}
 	
-	// Start polling
-	EnablePolling ( );
+	InitializePollingPolicy ( );
+	DetermineTransferLimits ( );
 	
-	
-Exit:
+	// Polling starts once the drive is ready, the nub does not have to wait for it.
+	BeginClearNotReadyStatus ( );
 	
 	CreateStorageServiceNub ( );
 	
@@ -299,6 +461,7 @@ IOUSBMassStorageUFIDevice::ResumeDeviceSupport ( void )
 	{
 		fPollingMode = kPollingMode_NewMedia;
 
+		ResetPollingInterval();
 	    EnablePolling();
 	}
 	
@@ -336,6 +499,17 @@ IOUSBMassStorageUFIDevice::TerminateDeviceSupport ( void )
 
 	if ( fIOUSBMassStorageUFIDeviceReserved != NULL)
 	{
+		
+		FreeTaskPool();
+		
+		if ( fNotReadyTimer != NULL )
+		{
+			
+			thread_call_free ( fNotReadyTimer );
+			fNotReadyTimer = NULL;
+			
+		}
+		
 		IODelete ( fIOUSBMassStorageUFIDeviceReserved, IOUSBMassStorageUFIDeviceExpansionData, 1 );
 		fIOUSBMassStorageUFIDeviceReserved = NULL;
 	}
@@ -343,97 +517,306 @@ IOUSBMassStorageUFIDevice::TerminateDeviceSupport ( void )
 
 
 //--------------------------------------------------------------------------------------------------
-//	ClearNotReadyStatus - Clears any NOT_READY status on device							 [PROTECTED]
+//	AllocateTaskPool - Preallocates the SCSITasks used for I/O and polling				 [PROTECTED]
 //--------------------------------------------------------------------------------------------------
 
-bool
-IOUSBMassStorageUFIDevice::ClearNotReadyStatus( void )
+IOReturn
+IOUSBMassStorageUFIDevice::AllocateTaskPool( void )
 {
-	SCSI_Sense_Data				senseBuffer;
-	IOMemoryDescriptor *		bufferDesc;
-	SCSITaskIdentifier			request;
-	bool						driveReady = false;
-	bool						result = true;
-	SCSIServiceResponse 		serviceResponse = kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+	IOReturn	status = kIOReturnNoMemory;
+	UInt32		index;
 	
 	
-	STATUS_LOG ( ( 6, "%s[%p]::%s called", getName(), this,  __FUNCTION__ ) );
-	
-	bufferDesc = IOMemoryDescriptor::withAddress (	( void * ) &senseBuffer,
-													kSenseDefaultSize,
-													kIODirectionIn );
+	fTaskPoolLock = IOLockAlloc();
+	require_nonzero ( fTaskPoolLock, Exit );
 	
-	request = GetSCSITask();
-	do
+	for ( index = 0; index < kUFITaskPoolSize; index++ )
 	{
+		
+		fTaskPool[index] = GetSCSITask();
+		require_nonzero ( fTaskPool[index], Exit );
+		
+		// Targeted with initSubRange() for each command of a split request.
+		fSplitRequests[index].commandBuffer = OSTypeAlloc ( IOSubMemoryDescriptor );
+		require_nonzero ( fSplitRequests[index].commandBuffer, Exit );
+		
+	}
 	
-		if ( TEST_UNIT_READY ( request ) == true )
+	// The pool never holds more than 32 tasks.
+	fTaskPoolFreeMask = ( kUFITaskPoolSize == 32 ) ? 0xFFFFFFFF : ( ( 1 << kUFITaskPoolSize ) - 1 );
+	status = kIOReturnSuccess;
+	
+	
+Exit:
+	
+	
+	return status;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	FreeTaskPool - Releases the preallocated SCSITasks									 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageUFIDevice::FreeTaskPool( void )
+{
+	UInt32		index;
+	
+	
+	fTaskPoolFreeMask = 0;
+	
+	for ( index = 0; index < kUFITaskPoolSize; index++ )
+	{
+		
+		if ( fTaskPool[index] != NULL )
 		{
-			// The command was successfully built, now send it
-			serviceResponse = SendCommand ( request, 0 );
+			
+			ReleaseSCSITask ( fTaskPool[index] );
+			fTaskPool[index] = NULL;
+			
 		}
-		else
+		
+		if ( fSplitRequests[index].commandBuffer != NULL )
 		{
-			PANIC_NOW( ( "IOUSBMassStorageUFIDevice::ClearNotReadyStatus malformed command" ) );
+			
+			fSplitRequests[index].commandBuffer->release ( );
+			fSplitRequests[index].commandBuffer = NULL;
+			
 		}
 		
-		if ( serviceResponse == kSCSIServiceResponse_TASK_COMPLETE )
-		{
+	}
+	
+	if ( fTaskPoolLock != NULL )
+	{
 		
-			bool validSense = false;
+		IOLockFree ( fTaskPoolLock );
+		fTaskPoolLock = NULL;
+		
+	}
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	GetPooledSCSITask - Takes a SCSITask from the pool, waiting while none is free		 [PROTECTED]
+//
+//		Lock free while a task is free, since tasks are taken on client threads and returned
+//		from completions. The pool is the only source of tasks, so an empty pool means waiting
+//		for a completion rather than allocating. Completions run with the work loop gate held,
+//		and a caller holding it can't wait for one, so it gets NULL instead.
+//--------------------------------------------------------------------------------------------------
+
+SCSITaskIdentifier
+IOUSBMassStorageUFIDevice::GetPooledSCSITask( void )
+{
+	IOWorkLoop *	workLoop;
+	UInt32			mask;
+	UInt32			index;
+	
+	
+	for ( ;; )
+	{
+		
+		mask = fTaskPoolFreeMask;
+		while ( mask != 0 )
+		{
 			
-			if ( GetTaskStatus( request ) == kSCSITaskStatus_CHECK_CONDITION )
+			// Take the lowest free task, unless another thread changed the mask first.
+			index = ffs ( mask ) - 1;
+			if ( OSCompareAndSwap ( mask, mask & ~( 1 << index ), &fTaskPoolFreeMask ) == true )
 			{
+				return fTaskPool[index];
+			}
 			
-				validSense = GetAutoSenseData( request, &senseBuffer );
-				if ( validSense == false )
-				{
-				
-					if ( REQUEST_SENSE( request, bufferDesc, kSenseDefaultSize ) == true )
-					{
-						// The command was successfully built, now send it
-						serviceResponse = SendCommand ( request, 0 );
-					}
-					else
-					{
-						PANIC_NOW ( ( "IOUSBMassStorageUFIDevice::ClearNotReadyStatus malformed command" ) );
-					}
-					
-					if ( serviceResponse == kSCSIServiceResponse_TASK_COMPLETE )
-					{
-						validSense = true;
-					}
-					
-				}
-				
-				if ( validSense == true )
-				{
-					if ( ( ( senseBuffer.SENSE_KEY  & kSENSE_KEY_Mask ) == kSENSE_KEY_NOT_READY  ) && 
-							( senseBuffer.ADDITIONAL_SENSE_CODE == 0x04 ) &&
-							( senseBuffer.ADDITIONAL_SENSE_CODE_QUALIFIER == 0x01 ) )
-					{
-						
-						STATUS_LOG ( ( 5, "%s[%p]::drive not ready", getName(), this ) );
-						driveReady = false;
-						IOSleep ( 200 );
-						
-					}
-					else if ( ( ( senseBuffer.SENSE_KEY  & kSENSE_KEY_Mask ) == kSENSE_KEY_NOT_READY  ) && 
-							( senseBuffer.ADDITIONAL_SENSE_CODE == 0x04 ) &&
-							( senseBuffer.ADDITIONAL_SENSE_CODE_QUALIFIER == 0x02 ) )
-					{
-						// The drive needs to be spun up. Issue a START_STOP_UNIT to it.
-						if ( START_STOP_UNIT( request, 0x00, 0x00, 0x01 ) == true )
-						{
-							serviceResponse = SendCommand( request, 0 );
-						}
-						
-					}
-					else
-					{
-					
-						driveReady = true;
-						STATUS_LOG ( (5, "%s[%p]::drive READY", getName(), this ) );
+			mask = fTaskPoolFreeMask;
+			
+		}
+		
+		workLoop = getWorkLoop ( );
+		if ( ( workLoop != NULL ) && ( workLoop->inGate ( ) == true ) )
+		{
+			
+			STATUS_LOG ( ( 4, "%s[%p]::GetPooledSCSITask pool empty on the work loop", getName(), this ) );
+			return NULL;
+			
+		}
+		
+		STATUS_LOG ( ( 4, "%s[%p]::GetPooledSCSITask pool empty, waiting", getName(), this ) );
+		
+		// ReleasePooledSCSITask sets its bit before it looks for waiters, and we count
+		// ourselves before looking at the mask again, so one of us sees the other.
+		IOLockLock ( fTaskPoolLock );
+		OSIncrementAtomic ( &fTaskPoolWaiters );
+		
+		if ( fTaskPoolFreeMask == 0 )
+		{
+			IOLockSleep ( fTaskPoolLock, ( void * ) &fTaskPoolFreeMask, THREAD_UNINT );
+		}
+		
+		OSDecrementAtomic ( &fTaskPoolWaiters );
+		IOLockUnlock ( fTaskPoolLock );
+		
+	}
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	ReleasePooledSCSITask - Returns a SCSITask to the pool								 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageUFIDevice::ReleasePooledSCSITask( SCSITaskIdentifier request )
+{
+	UInt32		index;
+	
+	
+	index = GetTaskPoolIndex ( request );
+	require ( index < kUFITaskPoolSize, Exit );
+	
+	// Drop the buffer and client references now rather than at the next build.
+	ResetForNewTask ( request );
+	
+	check ( ( fTaskPoolFreeMask & ( 1 << index ) ) == 0 );
+	OSBitOrAtomic ( ( 1 << index ), &fTaskPoolFreeMask );
+	
+	if ( fTaskPoolWaiters != 0 )
+	{
+		
+		IOLockLock ( fTaskPoolLock );
+		IOLockWakeup ( fTaskPoolLock, ( void * ) &fTaskPoolFreeMask, true );
+		IOLockUnlock ( fTaskPoolLock );
+		
+	}
+	
+	
+Exit:
+	
+	
+	return;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	GetTaskPoolIndex - Returns the pool slot of a SCSITask, or kUFITaskPoolSize			 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+UInt32
+IOUSBMassStorageUFIDevice::GetTaskPoolIndex( SCSITaskIdentifier request )
+{
+	UInt32		index;
+	
+	
+	for ( index = 0; index < kUFITaskPoolSize; index++ )
+	{
+		
+		if ( fTaskPool[index] == request )
+		{
+			break;
+		}
+		
+	}
+	
+	return index;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	ClearNotReadyStatus - Clears any NOT_READY status on device, blocking until it is	 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+bool
+IOUSBMassStorageUFIDevice::ClearNotReadyStatus( void )
+{
+	SCSI_Sense_Data				senseBuffer;
+	IOMemoryDescriptor *		bufferDesc;
+	SCSITaskIdentifier			request;
+	bool						driveReady = false;
+	bool						result = true;
+	SCSIServiceResponse 		serviceResponse = kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+	
+	
+	STATUS_LOG ( ( 6, "%s[%p]::%s called", getName(), this,  __FUNCTION__ ) );
+	
+	bufferDesc = IOMemoryDescriptor::withAddress (	( void * ) &senseBuffer,
+													kSenseDefaultSize,
+													kIODirectionIn );
+	
+	request = GetPooledSCSITask();
+	do
+	{
+	
+		if ( TEST_UNIT_READY ( request ) == true )
+		{
+			// The command was successfully built, now send it
+			serviceResponse = SendCommand ( request, 0 );
+		}
+		else
+		{
+			PANIC_NOW( ( "IOUSBMassStorageUFIDevice::ClearNotReadyStatus malformed command" ) );
+		}
+		
+		if ( serviceResponse == kSCSIServiceResponse_TASK_COMPLETE )
+		{
+		
+			bool validSense = false;
+			
+			if ( GetTaskStatus( request ) == kSCSITaskStatus_CHECK_CONDITION )
+			{
+			
+				validSense = GetAutoSenseData( request, &senseBuffer );
+				if ( validSense == false )
+				{
+				
+					if ( REQUEST_SENSE( request, bufferDesc, kSenseDefaultSize ) == true )
+					{
+						// The command was successfully built, now send it
+						serviceResponse = SendCommand ( request, 0 );
+					}
+					else
+					{
+						PANIC_NOW ( ( "IOUSBMassStorageUFIDevice::ClearNotReadyStatus malformed command" ) );
+					}
+					
+					if ( serviceResponse == kSCSIServiceResponse_TASK_COMPLETE )
+					{
+						validSense = true;
+					}
+					
+				}
+				
+				if ( validSense == true )
+				{
+					if ( ( ( senseBuffer.SENSE_KEY  & kSENSE_KEY_Mask ) == kSENSE_KEY_NOT_READY  ) && 
+							( senseBuffer.ADDITIONAL_SENSE_CODE == 0x04 ) &&
+							( senseBuffer.ADDITIONAL_SENSE_CODE_QUALIFIER == 0x01 ) )
+					{
+						
+						STATUS_LOG ( ( 5, "%s[%p]::drive not ready", getName(), this ) );
+						driveReady = false;
+						IOSleep ( 200 );
+						
+					}
+					else if ( ( ( senseBuffer.SENSE_KEY  & kSENSE_KEY_Mask ) == kSENSE_KEY_NOT_READY  ) && 
+							( senseBuffer.ADDITIONAL_SENSE_CODE == 0x04 ) &&
+							( senseBuffer.ADDITIONAL_SENSE_CODE_QUALIFIER == 0x02 ) )
+					{
+						// The drive needs to be spun up. Issue a START_STOP_UNIT to it.
+						if ( START_STOP_UNIT( request, 0x00, 0x00, 0x01 ) == true )
+						{
+							serviceResponse = SendCommand( request, 0 );
+						}
+						
+					}
+					else
+					{
+					
+						driveReady = true;
+						STATUS_LOG ( (5, "%s[%p]::drive READY", getName(), this ) );
 						
 					}
 					
@@ -462,65 +845,435 @@ IOUSBMassStorageUFIDevice::ClearNotReadyStatus( void )
 	// and we are in an infinite loop here
 	} while( ( driveReady == false ) && ( isInactive() == false ) );
 	
-	bufferDesc->release();
-	ReleaseSCSITask ( request );
+	bufferDesc->release();
+	ReleasePooledSCSITask ( request );
+	
+	result = isInactive() ? false : true;
+	return result;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	BeginClearNotReadyStatus - Starts clearing NOT_READY status without blocking		 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageUFIDevice::BeginClearNotReadyStatus( void )
+{
+	STATUS_LOG ( ( 6, "%s[%p]::%s called", getName(), this,  __FUNCTION__ ) );
+	
+	// Held until NotReadyStatusCleared, so the timer and the commands in
+	// flight never outlive us.
+	retain();
+	
+	fNotReadyTask = GetPooledSCSITask();
+	require_nonzero ( fNotReadyTask, ErrorExit );
+	
+	fNotReadySenseDesc = IOMemoryDescriptor::withAddress (	( void * ) &fNotReadySenseData,
+															kSenseDefaultSize,
+															kIODirectionIn );
+	require_nonzero ( fNotReadySenseDesc, ErrorExit );
+	
+	IssueNotReadyCommand ( kNotReadyState_TestUnitReady );
+	return;
+	
+	
+ErrorExit:
+	
+	// Without the state machine there is nothing to wait for, carry on as the
+	// synchronous version did once the device stopped answering.
+	NotReadyStatusCleared();
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	IssueNotReadyCommand - Sends the command for the next NOT_READY state				 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageUFIDevice::IssueNotReadyCommand( UInt32 state )
+{
+	bool	built = false;
+	
+	
+	fNotReadyState = state;
+	
+	switch ( state )
+	{
+		
+		case kNotReadyState_TestUnitReady:
+		{
+			built = TEST_UNIT_READY ( fNotReadyTask );
+		}
+		break;
+		
+		case kNotReadyState_RequestSense:
+		{
+			built = REQUEST_SENSE ( fNotReadyTask, fNotReadySenseDesc, kSenseDefaultSize );
+		}
+		break;
+		
+		case kNotReadyState_StartUnit:
+		{
+			// The drive needs to be spun up.
+			built = START_STOP_UNIT ( fNotReadyTask, 0x00, 0x00, 0x01 );
+		}
+		break;
+		
+		default:
+		break;
+		
+	}
+	
+	if ( built == false )
+	{
+		PANIC_NOW ( ( "IOUSBMassStorageUFIDevice::IssueNotReadyCommand malformed command" ) );
+		NotReadyStatusCleared();
+		return;
+	}
+	
+	SendCommand ( fNotReadyTask, 0, &this->ClearNotReadyStatusComplete );
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	ProcessNotReadyCompletion - Moves the NOT_READY state machine on					 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageUFIDevice::ProcessNotReadyCompletion( SCSITaskIdentifier request )
+{
+	bool	validSense = false;
+	
+	
+	if ( isInactive() == true )
+	{
+		NotReadyStatusCleared();
+		return;
+	}
+	
+	if ( GetServiceResponse ( request ) != kSCSIServiceResponse_TASK_COMPLETE )
+	{
+		// the command failed - perhaps the device was hot unplugged
+		ScheduleNotReadyRetry();
+		return;
+	}
+	
+	switch ( fNotReadyState )
+	{
+		
+		case kNotReadyState_TestUnitReady:
+		{
+			
+			if ( GetTaskStatus ( request ) != kSCSITaskStatus_CHECK_CONDITION )
+			{
+				NotReadyStatusCleared();
+				return;
+			}
+			
+			validSense = GetAutoSenseData ( request, &fNotReadySenseData );
+			if ( validSense == false )
+			{
+				IssueNotReadyCommand ( kNotReadyState_RequestSense );
+				return;
+			}
+			
+		}
+		break;
+		
+		case kNotReadyState_RequestSense:
+		{
+			validSense = true;
+		}
+		break;
+		
+		case kNotReadyState_StartUnit:
+		{
+			IssueNotReadyCommand ( kNotReadyState_TestUnitReady );
+			return;
+		}
+		break;
+		
+		default:
+		break;
+		
+	}
+	
+	if ( validSense == false )
+	{
+		ScheduleNotReadyRetry();
+		return;
+	}
+	
+	STATUS_LOG ( ( 5, "%s[%p]:: sense data: %01x, %02x, %02x", getName(), this,
+				   ( fNotReadySenseData.SENSE_KEY  & kSENSE_KEY_Mask ),
+				   fNotReadySenseData.ADDITIONAL_SENSE_CODE,
+				   fNotReadySenseData.ADDITIONAL_SENSE_CODE_QUALIFIER ) );
+	
+	if ( ( ( fNotReadySenseData.SENSE_KEY  & kSENSE_KEY_Mask ) == kSENSE_KEY_NOT_READY  ) && 
+			( fNotReadySenseData.ADDITIONAL_SENSE_CODE == 0x04 ) &&
+			( fNotReadySenseData.ADDITIONAL_SENSE_CODE_QUALIFIER == 0x01 ) )
+	{
+		
+		STATUS_LOG ( ( 5, "%s[%p]::drive not ready", getName(), this ) );
+		ScheduleNotReadyRetry();
+		
+	}
+	else if ( ( ( fNotReadySenseData.SENSE_KEY  & kSENSE_KEY_Mask ) == kSENSE_KEY_NOT_READY  ) && 
+			( fNotReadySenseData.ADDITIONAL_SENSE_CODE == 0x04 ) &&
+			( fNotReadySenseData.ADDITIONAL_SENSE_CODE_QUALIFIER == 0x02 ) )
+	{
+		IssueNotReadyCommand ( kNotReadyState_StartUnit );
+	}
+	else
+	{
+		NotReadyStatusCleared();
+	}
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	ScheduleNotReadyRetry - Asks the drive again after kNotReadyRetryDelay				 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageUFIDevice::ScheduleNotReadyRetry( void )
+{
+    AbsoluteTime	time;
+	
+	
+	fNotReadyState = kNotReadyState_TestUnitReady;
+	
+	clock_interval_to_deadline( kNotReadyRetryDelay, kMillisecondScale, &time );
+	thread_call_enter_delayed( fNotReadyTimer, time );
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	NotReadyStatusCleared - Publishes readiness and starts polling						 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageUFIDevice::NotReadyStatusCleared( void )
+{
+	OSBoolean *		shouldNotPoll = NULL;
+	
+	
+	if ( fNotReadySenseDesc != NULL )
+	{
+		fNotReadySenseDesc->release();
+		fNotReadySenseDesc = NULL;
+	}
+	
+	if ( fNotReadyTask != NULL )
+	{
+		ReleasePooledSCSITask ( fNotReadyTask );
+		fNotReadyTask = NULL;
+	}
+	
+	fNotReadyState = kNotReadyState_Idle;
+	
+	require_quiet ( ( isInactive() == false ), Exit );
+	
+	STATUS_LOG ( ( 5, "%s[%p]::drive READY", getName(), this ) );
+	
+	fDeviceReady = true;
+	setProperty ( kDeviceReadyProperty, true );
+	
+	shouldNotPoll = OSDynamicCast (	OSBoolean,
+									getProperty ( kAppleKeySwitchProperty ) );
+	
+	if ( shouldNotPoll != NULL )
+	{
+		
+		// See if we should not poll.
+		require ( shouldNotPoll->isFalse ( ), Exit );
+		
+	}
+	
+	// Start polling
+	EnablePolling ( );
+	
+	
+Exit:
+	
+	// Drop the retain taken by BeginClearNotReadyStatus
+	release();
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	EnablePolling - Schedules the polling thread to run									 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void 
+IOUSBMassStorageUFIDevice::EnablePolling( void )
+{		
+    AbsoluteTime	time;
+	UInt32			interval;
+	
+    if ( ( fPollingMode != kPollingMode_Suspended ) &&
+			fDeviceReady &&
+			fPollingThread &&
+			( isInactive() == false ) )
+    {
+        // Retain ourselves so that this object doesn't go away
+        // while we are polling
+        retain();
+        
+		interval = GetNextPollingInterval();
+        clock_interval_to_deadline( interval, kMillisecondScale, &time );
+        
+		// Let's enqueue the polling.
+		if (thread_call_enter_delayed( fPollingThread, time ))
+		{
+			// The call was already enqueued therefore there already is
+			// a pending retain and we must release the last retain to
+			// maintain the proper balance: if we would not release it,
+			// the retain count would keep growing.
+			release();
+		}
+		
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	DisablePolling - Unschedules the polling thread if it hasn't run yet				 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void 
+IOUSBMassStorageUFIDevice::DisablePolling( void )
+{		
+	fPollingMode = kPollingMode_Suspended;
+
+	// Cancel the thread if it is scheduled
+	if( thread_call_cancel( fPollingThread ) )
+	{
+		// It was scheduled, so we balance out the retain()
+		// with a release()
+		release();
+		
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	ExpeditePolling - Runs a scheduled poll now instead of at its deadline				 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void 
+IOUSBMassStorageUFIDevice::ExpeditePolling( void )
+{
+	// Only a poll that is waiting for its deadline is moved up. While polling is
+	// suspended or the poll is running, which is where its own TEST_UNIT_READY
+	// reports a missing medium, there is nothing to do.
+	if ( ( fPollingThread != NULL ) && thread_call_cancel( fPollingThread ) )
+	{
+		
+		STATUS_LOG ( ( 5, "%s[%p]::ExpeditePolling", getName(), this ) );
+		
+		// The retain taken for the scheduled poll carries over, unless the
+		// call was enqueued again in the meantime.
+		if ( thread_call_enter( fPollingThread ) )
+		{
+			release();
+		}
+		
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	VerifyDeviceState - Called when the protocol driver reports a possible media change	 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageUFIDevice::VerifyDeviceState( void )
+{
+	UFINoteMediaChangeEvent ( &fPollingPolicy );
+	ExpeditePolling();
+	return kIOReturnSuccess;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	InitializePollingPolicy - Sets up the polling policy for this device				 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageUFIDevice::InitializePollingPolicy( void )
+{
+	OSDictionary *		characterDict	= NULL;
+	OSNumber *			number			= NULL;
+	
+	
+	UFIInitPollingPolicy ( &fPollingPolicy, fMediaChangeEvents );
+	
+	// A device personality may override any part of the policy.
+	characterDict = OSDynamicCast ( OSDictionary, GetProtocolDriver ( )->getProperty ( kIOUSBMassStorageCharacteristics ) );
+	if ( characterDict != NULL )
+	{
+		
+		number = OSDynamicCast ( OSNumber, characterDict->getObject ( kIOUSBMassStorageMediaPollMinInterval ) );
+		if ( number != NULL )
+		{
+			fPollingPolicy.minimumInterval = number->unsigned32BitValue ( );
+		}
+		
+		number = OSDynamicCast ( OSNumber, characterDict->getObject ( kIOUSBMassStorageMediaPollMaxInterval ) );
+		if ( number != NULL )
+		{
+			
+			fPollingPolicy.maximumInterval			= number->unsigned32BitValue ( );
+			fPollingPolicy.newMediaMaximumInterval	= fPollingPolicy.maximumInterval;
+			fPollingPolicy.eventMaximumInterval		= fPollingPolicy.maximumInterval;
+			
+		}
+		
+		number = OSDynamicCast ( OSNumber, characterDict->getObject ( kIOUSBMassStorageMediaPollFastCount ) );
+		if ( number != NULL )
+		{
+			fPollingPolicy.fastPolls = number->unsigned32BitValue ( );
+		}
+		
+	}
+	
+	UFIClampPollingPolicy ( &fPollingPolicy );
 	
-	result = isInactive() ? false : true;
-	return result;
+	STATUS_LOG ( ( 5, "%s[%p]::InitializePollingPolicy %u to %u ms (%u ms for new media) after %u fast polls", getName(), this,
+				   fPollingPolicy.minimumInterval, fPollingPolicy.maximumInterval,
+				   fPollingPolicy.newMediaMaximumInterval, fPollingPolicy.fastPolls ) );
 	
+	ResetPollingInterval();
 }
 
 
 //--------------------------------------------------------------------------------------------------
-//	EnablePolling - Schedules the polling thread to run									 [PROTECTED]
+//	ResetPollingInterval - Polls at the minimum interval again after activity			 [PROTECTED]
 //--------------------------------------------------------------------------------------------------
 
-void 
-IOUSBMassStorageUFIDevice::EnablePolling( void )
-{		
-    AbsoluteTime	time;
-	
-    if ( ( fPollingMode != kPollingMode_Suspended ) &&
-			fPollingThread &&
-			( isInactive() == false ) )
-    {
-        // Retain ourselves so that this object doesn't go away
-        // while we are polling
-        retain();
-        
-        clock_interval_to_deadline( 1000, kMillisecondScale, &time );
-        
-		// Let's enqueue the polling.
-		if (thread_call_enter_delayed( fPollingThread, time ))
-		{
-			// The call was already enqueued therefore there already is
-			// a pending retain and we must release the last retain to
-			// maintain the proper balance: if we would not release it,
-			// the retain count would keep growing.
-			release();
-		}
-		
-	}
+void
+IOUSBMassStorageUFIDevice::ResetPollingInterval( void )
+{
+	UFIResetPollingInterval ( &fPollingPolicy );
 }
 
 
 //--------------------------------------------------------------------------------------------------
-//	DisablePolling - Unschedules the polling thread if it hasn't run yet				 [PROTECTED]
+//	GetNextPollingInterval - Returns the delay before the next poll and backs off		 [PROTECTED]
 //--------------------------------------------------------------------------------------------------
 
-void 
-IOUSBMassStorageUFIDevice::DisablePolling( void )
-{		
-	fPollingMode = kPollingMode_Suspended;
-
-	// Cancel the thread if it is scheduled
-	if( thread_call_cancel( fPollingThread ) )
-	{
-		// It was scheduled, so we balance out the retain()
-		// with a release()
-		release();
-		
-	}
+UInt32
+IOUSBMassStorageUFIDevice::GetNextPollingInterval( void )
+{
+	return UFINextPollingInterval ( &fPollingPolicy, ( fPollingMode == kPollingMode_NewMedia ) );
 }
 
 
@@ -562,7 +1315,7 @@ IOUSBMassStorageUFIDevice::DetermineDeviceCharacteristics( void )
 		
 	}
 
-	request = GetSCSITask();
+	request = GetPooledSCSITask();
 	if ( request == NULL )
 	{
 		goto ErrorExit;
@@ -689,7 +1442,7 @@ ErrorExit:
 
 	if ( request )
 	{
-		ReleaseSCSITask ( request );
+		ReleasePooledSCSITask ( request );
 		request = NULL;
 	}
 
@@ -852,6 +1605,9 @@ IOUSBMassStorageUFIDevice::PollForNewMedia( void )
 	
 	fMediumPresent	= true;
 	
+	// Someone is swapping media, keep a close eye on the device for a while.
+	ResetPollingInterval();
+	
 	// Message up the chain that we have media
 	messageClients ( kIOMessageMediaStateHasChanged,
 					 ( void * ) kIOMediaStateOnline,
@@ -891,7 +1647,7 @@ IOUSBMassStorageUFIDevice::DetermineMediaPresence ( void )
 		}
 	}
 
-	request = GetSCSITask();
+	request = GetPooledSCSITask();
 	if ( request == NULL )
 	{
 		return false;
@@ -1156,7 +1912,7 @@ CheckDone:
 
 	if( request != NULL )
 	{
-		ReleaseSCSITask( request );
+		ReleasePooledSCSITask( request );
 		request = NULL;
 	}
 
@@ -1185,7 +1941,7 @@ IOUSBMassStorageUFIDevice::DetermineMediumCapacity (	UInt64 * blockSize,
 	*blockSize 	= 0;
 	*blockCount = 0;
 
-	request = GetSCSITask();
+	request = GetPooledSCSITask();
 	if ( request == NULL )
 	{
 	
@@ -1243,7 +1999,7 @@ IsDone:
 
 	if ( request != NULL )
 	{
-		ReleaseSCSITask ( request );
+		ReleasePooledSCSITask ( request );
 	}
 	
 	if ( bufferDesc != NULL )
@@ -1272,7 +2028,7 @@ IOUSBMassStorageUFIDevice::DetermineMediumWriteProtectState( void )
 
 	STATUS_LOG ( ( 6, "%s[%p]::checkWriteProtection called", getName(), this ) );
 		
-	request = GetSCSITask();
+	request = GetPooledSCSITask();
 	if ( request == NULL )
 	{
 		// Since a SCSI Task could not be gotten, do the safe thing and report
@@ -1337,7 +2093,7 @@ WriteProtectCheckDone:
 	
 	if ( request != NULL )
 	{
-		ReleaseSCSITask ( request );
+		ReleasePooledSCSITask ( request );
 		request = NULL;
 	}
 	
@@ -1362,7 +2118,7 @@ IOUSBMassStorageUFIDevice::PollForMediaRemoval ( void )
 		fPollingMode = kPollingMode_Suspended;
 	}
 		
-	request = GetSCSITask();
+	request = GetPooledSCSITask();
 	if ( request == NULL )
 	{
 		// A SCSI Task could not be gotten, return immediately.
@@ -1454,7 +2210,7 @@ RemoveCheckDone:
 	if ( request != NULL )
 	{
 	
-		ReleaseSCSITask( request );
+		ReleasePooledSCSITask( request );
 		request = NULL;
 		
 	}
@@ -1462,6 +2218,7 @@ RemoveCheckDone:
 	{ 
 		// Media was removed, set the polling to determine when new media has been inserted
  		fPollingMode = kPollingMode_NewMedia;
+		ResetPollingInterval();
 		
 		// Message up the chain that we do not have media
 		messageClients( kIOMessageMediaStateHasChanged,
@@ -1621,6 +2378,8 @@ IOUSBMassStorageUFIDevice::HandlePowerChange ( void )
 				STATUS_LOG ( ( 5, "case kIOUSBMassStorageUFIDevicePowerStateActive\n" ) );
 				
 				fCurrentPowerState = kIOUSBMassStorageUFIDevicePowerStateActive;
+				
+				ResetPollingInterval();
 
 				if (fMediumPresent == true)
 				{
@@ -1663,204 +2422,442 @@ IOUSBMassStorageUFIDevice::HandlePowerChange ( void )
 }
 
 
-#pragma mark -
-#pragma mark *** Client Requests Support ***
-#pragma mark -
-
-
-
+#pragma mark -
+#pragma mark *** Client Requests Support ***
+#pragma mark -
+
+
+
+//--------------------------------------------------------------------------------------------------
+//	IssueRead - Performs the Synchronous Read Request									 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn 
+IOUSBMassStorageUFIDevice::IssueRead ( 	IOMemoryDescriptor *	buffer,
+										UInt64					startBlock,
+										UInt64					blockCount )
+{
+
+	STATUS_LOG ( ( 6, "%s[%p]: syncRead Attempted", getName(), this ) );
+	
+	return IssueSyncReadWrite ( buffer, kIODirectionIn, startBlock, blockCount );
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	IssueRead - Performs the Asynchronous Read Request									 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn 
+IOUSBMassStorageUFIDevice::IssueRead ( 	IOMemoryDescriptor *	buffer,
+										UInt64					startBlock,
+										UInt64					blockCount,
+										void *					clientData )
+{
+
+	STATUS_LOG ( ( 6, "%s[%p]: asyncRead Attempted", getName(), this ) );
+	
+	return IssueAsyncReadWrite ( buffer, kIODirectionIn, startBlock, blockCount, clientData );
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	IssueWrite - Performs the Synchronous Write Request									 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn 
+IOUSBMassStorageUFIDevice::IssueWrite ( IOMemoryDescriptor *	buffer,
+										UInt64					startBlock,
+										UInt64					blockCount )
+{
+
+	STATUS_LOG ( ( 6, "%s[%p]: syncWrite Attempted", getName(), this ) );
+	
+	return IssueSyncReadWrite ( buffer, kIODirectionOut, startBlock, blockCount );
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	IssueWrite - Performs the Asynchronous Write Request								 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn 
+IOUSBMassStorageUFIDevice::IssueWrite (	IOMemoryDescriptor *	buffer,
+										UInt64					startBlock,
+										UInt64					blockCount,
+										void *					clientData )
+{
+
+	STATUS_LOG ( ( 6, "%s[%p]:: asyncWrite Attempted", getName(), this ) );
+	
+	return IssueAsyncReadWrite ( buffer, kIODirectionOut, startBlock, blockCount, clientData );
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	DetermineTransferLimits - Sets the largest command reads and writes are split into	 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageUFIDevice::DetermineTransferLimits ( void )
+{
+
+	OSDictionary *		characterDict	= NULL;
+	OSNumber *			number			= NULL;
+	
+	
+	fMaxCommandByteCount = kMaxCommandByteCountDefault;
+	
+	characterDict = OSDynamicCast ( OSDictionary, GetProtocolDriver ( )->getProperty ( kIOUSBMassStorageCharacteristics ) );
+	if ( characterDict != NULL )
+	{
+		
+		number = OSDynamicCast ( OSNumber, characterDict->getObject ( kIOUSBMassStorageMaxCommandByteCount ) );
+		if ( ( number != NULL ) && ( number->unsigned32BitValue ( ) != 0 ) )
+		{
+			fMaxCommandByteCount = number->unsigned32BitValue ( );
+		}
+		
+	}
+	
+	STATUS_LOG ( ( 5, "%s[%p]::DetermineTransferLimits %u bytes per command", getName(), this, fMaxCommandByteCount ) );
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	GetMaxBlocksPerCommand - Returns the most blocks one READ or WRITE may move			 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+UInt64
+IOUSBMassStorageUFIDevice::GetMaxBlocksPerCommand ( void )
+{
+	return UFIMaxBlocksPerCommand ( fMaxCommandByteCount, fMediumBlockSize );
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	BuildReadWriteCommand - Builds the smallest READ or WRITE that moves blockCount	 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+bool
+IOUSBMassStorageUFIDevice::BuildReadWriteCommand ( 	SCSITaskIdentifier		request,
+													IOMemoryDescriptor *	buffer,
+													IODirection				direction,
+													UInt64					startBlock,
+													UInt64					blockCount )
+{
+
+	bool	built = false;
+	
+	
+	if ( blockCount <= kSCSICmdFieldMask2Byte )
+	{
+		
+		if ( direction == kIODirectionIn )
+		{
+			
+			built = READ_10 ( 	request,
+								buffer,
+								fMediumBlockSize,
+								0,
+								0,
+								0,
+								( SCSICmdField4Byte ) startBlock,
+								( SCSICmdField2Byte ) blockCount );
+			
+		}
+		else
+		{
+			
+			built = WRITE_10 ( 	request,
+								buffer,
+								fMediumBlockSize,
+								0,
+								0,
+								0,
+								( SCSICmdField4Byte ) startBlock,
+								( SCSICmdField2Byte ) blockCount );
+			
+		}
+		
+	}
+	else
+	{
+		
+		if ( direction == kIODirectionIn )
+		{
+			
+			built = READ_12 ( 	request,
+								buffer,
+								fMediumBlockSize,
+								0,
+								0,
+								0,
+								( SCSICmdField4Byte ) startBlock,
+								( SCSICmdField4Byte ) blockCount );
+			
+		}
+		else
+		{
+			
+			built = WRITE_12 ( 	request,
+								buffer,
+								fMediumBlockSize,
+								0,
+								0,
+								0,
+								( SCSICmdField4Byte ) startBlock,
+								( SCSICmdField4Byte ) blockCount );
+			
+		}
+		
+	}
+	
+	return built;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	IssueSyncReadWrite - Performs a synchronous read or write, split into commands		 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageUFIDevice::IssueSyncReadWrite ( IOMemoryDescriptor *	buffer,
+												IODirection				direction,
+												UInt64					startBlock,
+												UInt64					blockCount )
+{
+
+	SCSIServiceResponse 	serviceResponse = kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+	SCSITaskIdentifier		request			= NULL;
+	IOSubMemoryDescriptor *	subBuffer		= NULL;
+	IOMemoryDescriptor *	commandBuffer	= NULL;
+	IOReturn				status			= kIOReturnSuccess;
+	UInt64					maxBlockCount	= 0;
+	UInt64					commandBlocks	= 0;
+	UInt64					offset			= 0;
+	
+	
+	require_action ( UFIRequestIsAddressable ( startBlock, blockCount ), Exit, status = kIOReturnBadArgument );
+	
+	request = GetPooledSCSITask ( );
+	require_action ( ( request != NULL ), Exit, status = kIOReturnNoResources );
+	
+	maxBlockCount = GetMaxBlocksPerCommand ( );
+	
+	if ( UFIRequestIsSplit ( blockCount, maxBlockCount ) == true )
+	{
+		subBuffer = fSplitRequests[GetTaskPoolIndex ( request )].commandBuffer;
+	}
+	
+	while ( blockCount > 0 )
+	{
+		
+		commandBlocks 	= UFICommandBlocks ( blockCount, maxBlockCount );
+		commandBuffer	= buffer;
+		
+		if ( subBuffer != NULL )
+		{
+			
+			require_action ( subBuffer->initSubRange ( 	buffer,
+														offset,
+														commandBlocks * fMediumBlockSize,
+														direction ),
+							 Exit,
+							 status = kIOReturnError );
+			
+			status = subBuffer->prepare ( );
+			require_success ( status, Exit );
+			
+			commandBuffer = subBuffer;
+			
+		}
+		
+		if ( BuildReadWriteCommand ( request, commandBuffer, direction, startBlock, commandBlocks ) == true )
+		{
+			
+			// The command was successfully built, now send it
+			serviceResponse = SendCommand ( request, 0 );
+			
+		}
+		else
+		{
+			
+			PANIC_NOW ( ( "IOUSBMassStorageUFIDevice::IssueSyncReadWrite malformed command" ) );
+			serviceResponse = kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+			
+		}
+		
+		if ( subBuffer != NULL )
+		{
+			subBuffer->complete ( );
+		}
+		
+		if ( ( serviceResponse != kSCSIServiceResponse_TASK_COMPLETE ) ||
+			 ( GetTaskStatus ( request ) != kSCSITaskStatus_GOOD ) )
+		{
+			
+			status = kIOReturnError;
+			break;
+			
+		}
+		
+		startBlock	+= commandBlocks;
+		blockCount	-= commandBlocks;
+		offset		+= commandBlocks * fMediumBlockSize;
+		
+	}
+	
+	
+Exit:
+	
+	
+	if ( request != NULL )
+	{
+		ReleasePooledSCSITask ( request );
+	}
+	
+	return status;
+	
+}
+
+
 //--------------------------------------------------------------------------------------------------
-//	IssueRead - Performs the Synchronous Read Request									 [PROTECTED]
+//	IssueAsyncReadWrite - Starts an asynchronous read or write, split into commands		 [PROTECTED]
 //--------------------------------------------------------------------------------------------------
 
-IOReturn 
-IOUSBMassStorageUFIDevice::IssueRead ( 	IOMemoryDescriptor *	buffer,
-										UInt64					startBlock,
-										UInt64					blockCount )
+IOReturn
+IOUSBMassStorageUFIDevice::IssueAsyncReadWrite ( 	IOMemoryDescriptor *	buffer,
+													IODirection				direction,
+													UInt64					startBlock,
+													UInt64					blockCount,
+													void *					clientData )
 {
 
-	SCSIServiceResponse 	serviceResponse = kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
-	SCSITaskIdentifier		request;
+	SCSITaskIdentifier		request	= NULL;
+	UFISplitRequest *		split	= NULL;
+	IOReturn				status	= kIOReturnSuccess;
 	
 	
-	STATUS_LOG ( ( 6, "%s[%p]: syncRead Attempted", getName(), this ) );
-
-	request = GetSCSITask ( );
+	require_action ( UFIRequestIsAddressable ( startBlock, blockCount ), Exit, status = kIOReturnBadArgument );
 	
-	if ( READ_10 ( 	request,
-					buffer,
-  					fMediumBlockSize,
-					0,
-					0,
-					0,
-					( SCSICmdField4Byte ) startBlock,
-					( SCSICmdField2Byte ) blockCount ) == false )
-    {
-    
-    	// The command was successfully built, now send it
-    	serviceResponse = SendCommand( request, 0 );
-		
-	}
-	else
-	{
+	request = GetPooledSCSITask ( );
+	require_action ( ( request != NULL ), Exit, status = kIOReturnNoResources );
 	
-		PANIC_NOW(( "IOUSBMassStorageUFIDevice::IssueRead malformed command" ) );
+	if ( UFIRequestIsSplit ( blockCount, GetMaxBlocksPerCommand ( ) ) == false )
+	{
+		
+		// One command does it, complete straight to the client.
+		if ( BuildReadWriteCommand ( request, buffer, direction, startBlock, blockCount ) == false )
+		{
+			
+			PANIC_NOW ( ( "IOUSBMassStorageUFIDevice::IssueAsyncReadWrite malformed command" ) );
+			status = kIOReturnError;
+			goto Exit;
+			
+		}
+		
+		SetApplicationLayerReference ( request, clientData );
+		STATUS_LOG ( ( 6, "%s[%p]::IssueAsyncReadWrite send command.", getName(), this ) );
+		SendCommand ( request, 0, &this->AsyncReadWriteComplete );
+		request = NULL;
+		goto Exit;
 		
 	}
-
-	ReleaseSCSITask ( request );
 	
-	if ( serviceResponse == kSCSIServiceResponse_TASK_COMPLETE )
-	{
+	// The task's split request is ours until the task goes back to the pool.
+	split = &fSplitRequests[GetTaskPoolIndex ( request )];
 	
-		return kIOReturnSuccess;
-		
-	}
-	else
-	{
+	split->buffer			= buffer;
+	split->direction		= direction;
+	split->clientData		= clientData;
+	split->nextBlock		= startBlock;
+	split->blocksLeft		= blockCount;
+	split->nextOffset		= 0;
+	split->actualByteCount	= 0;
 	
-		return kIOReturnError;
-		
-	}
+	STATUS_LOG ( ( 6, "%s[%p]::IssueAsyncReadWrite splitting %llu blocks.", getName(), this, blockCount ) );
 	
-}
-
-
-//--------------------------------------------------------------------------------------------------
-//	IssueRead - Performs the Asynchronous Read Request									 [PROTECTED]
-//--------------------------------------------------------------------------------------------------
-
-IOReturn 
-IOUSBMassStorageUFIDevice::IssueRead ( 	IOMemoryDescriptor *	buffer,
-										UInt64					startBlock,
-										UInt64					blockCount,
-										void *					clientData )
-{
-
-	IOReturn 				status = kIOReturnSuccess;
-	SCSITaskIdentifier		request;
+	status = IssueSplitCommand ( request, split );
+	require_success ( status, Exit );
 	
-
-	STATUS_LOG ( ( 6, "%s[%p]: asyncRead Attempted", getName(), this ) );
+	request = NULL;
 	
-	request = GetSCSITask();
 	
-	if (READ_10(	request,
-					buffer,
-      				fMediumBlockSize,
-					0,
-					0,
-					0,
-					( SCSICmdField4Byte ) startBlock,
-					( SCSICmdField2Byte ) blockCount ) == true )
-    {
-    
-    	// The command was successfully built, now send it
-    	SetApplicationLayerReference( request, clientData );
-		STATUS_LOG ( ( 6, "%s[%p]::IssueRead send command.", getName(), this ) );
-    	SendCommand( request, 0, &this->AsyncReadWriteComplete );
-		
-	}
-	else
-	{
+Exit:
 	
-		PANIC_NOW(( "IOUSBMassStorageUFIDevice::IssueWrite malformed command" ) );
-		status = kIOReturnError;
-		
+	
+	if ( request != NULL )
+	{
+		ReleasePooledSCSITask ( request );
 	}
-
+	
 	return status;
+	
 }
 
 
 //--------------------------------------------------------------------------------------------------
-//	IssueWrite - Performs the Synchronous Write Request									 [PROTECTED]
+//	IssueSplitCommand - Sends the next command of a split read or write					 [PROTECTED]
 //--------------------------------------------------------------------------------------------------
 
-IOReturn 
-IOUSBMassStorageUFIDevice::IssueWrite ( IOMemoryDescriptor *	buffer,
-										UInt64					startBlock,
-										UInt64					blockCount )
+IOReturn
+IOUSBMassStorageUFIDevice::IssueSplitCommand ( 	SCSITaskIdentifier		request,
+												UFISplitRequest *		split )
 {
 
-	SCSIServiceResponse 	serviceResponse = kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
-	SCSITaskIdentifier		request;
+	IOReturn	status			= kIOReturnError;
+	UInt64		commandBlocks	= 0;
+	UInt64		commandBytes	= 0;
 	
 	
-	STATUS_LOG ( ( 6, "%s[%p]: syncWrite Attempted", getName(), this ) );
+	commandBlocks	= UFICommandBlocks ( split->blocksLeft, GetMaxBlocksPerCommand ( ) );
+	commandBytes	= commandBlocks * fMediumBlockSize;
 	
-	request = GetSCSITask();
-	if ( WRITE_10 ( request,
-					buffer,
-					fMediumBlockSize,
-					0,
-					0,
-					0,
-					( SCSICmdField4Byte ) startBlock,
-					( SCSICmdField2Byte ) blockCount ) == true )
-    {
-    	// The command was successfully built, now send it
-    	serviceResponse = SendCommand( request, 0 );
-		
-	}
-	else
-	{
-		PANIC_NOW ( ( "IOUSBMassStorageUFIDevice::IssueWrite malformed command" ) );
-	}
-
-	ReleaseSCSITask ( request );
+	require ( split->commandBuffer->initSubRange ( 	split->buffer,
+													split->nextOffset,
+													commandBytes,
+													split->direction ),
+			  Exit );
 	
-	if ( serviceResponse == kSCSIServiceResponse_TASK_COMPLETE )
-	{
-		return kIOReturnSuccess;
-	}
-	else
+	status = split->commandBuffer->prepare ( );
+	require_success ( status, Exit );
+	
+	if ( BuildReadWriteCommand ( request, split->commandBuffer, split->direction, split->nextBlock, commandBlocks ) == false )
 	{
-		return kIOReturnError;
+		
+		PANIC_NOW ( ( "IOUSBMassStorageUFIDevice::IssueSplitCommand malformed command" ) );
+		status = kIOReturnError;
+		goto CompleteDescriptor;
+		
 	}
 	
-}
-
-
-//--------------------------------------------------------------------------------------------------
-//	IssueWrite - Performs the Asynchronous Write Request								 [PROTECTED]
-//--------------------------------------------------------------------------------------------------
-
-IOReturn 
-IOUSBMassStorageUFIDevice::IssueWrite (	IOMemoryDescriptor *	buffer,
-										UInt64					startBlock,
-										UInt64					blockCount,
-										void *					clientData )
-{
-
-	IOReturn				status = kIOReturnSuccess;
-	SCSITaskIdentifier		request;
+	split->nextBlock	+= commandBlocks;
+	split->blocksLeft	-= commandBlocks;
+	split->nextOffset	+= commandBytes;
 	
+	SetApplicationLayerReference ( request, split );
+	SendCommand ( request, 0, &this->SplitReadWriteComplete );
+	
+	status = kIOReturnSuccess;
+	goto Exit;
+	
+	
+CompleteDescriptor:
+	
+	
+	split->commandBuffer->complete ( );
+	
+	
+Exit:
 	
-	STATUS_LOG ( ( 6, "%s[%p]:: asyncWrite Attempted", getName(), this ) );
-
-	request = GetSCSITask();
 	
-	if ( WRITE_10 ( request, 
-					buffer,
-   					fMediumBlockSize,
-					0,
-					0,
-					0,
-					( SCSICmdField4Byte ) startBlock,
-					( SCSICmdField2Byte ) blockCount ) == true )
-    {
-    	// The command was successfully built, now send it
-    	SetApplicationLayerReference ( request, clientData );
-		STATUS_LOG ( ( 6, "%s[%p]::IssueWrite send command.", getName(), this ) );
-    	SendCommand ( request, 0, &this->AsyncReadWriteComplete );
-		
-	}
-	else
-	{
-		PANIC_NOW ( ( "IOUSBMassStorageUFIDevice::IssueWrite malformed command" ) );
-	}
-
 	return status;
 	
 }
@@ -1883,6 +2880,8 @@ IOUSBMassStorageUFIDevice::SyncReadWrite ( 	IOMemoryDescriptor *	buffer,
 	IOReturn		theErr;
 	
 
+	ResetPollingInterval();
+	
 	direction = buffer->getDirection();
 	
 	if ( direction == kIODirectionIn )
@@ -1925,19 +2924,19 @@ IOUSBMassStorageUFIDevice::AsyncReadWrite (	IOMemoryDescriptor *	buffer,
 	IOReturn		theErr;
 	
 	
+	ResetPollingInterval();
+	
 	direction = buffer->getDirection();
 	if ( direction == kIODirectionIn )
 	{
 	
-		IssueRead( buffer, startBlock, blockCount, clientData );
-		theErr = kIOReturnSuccess;
+		theErr = IssueRead( buffer, startBlock, blockCount, clientData );
 		
 	}
 	else if ( direction == kIODirectionOut )
 	{
 	
-		IssueWrite( buffer, startBlock, blockCount, clientData );
-		theErr = kIOReturnSuccess;
+		theErr = IssueWrite( buffer, startBlock, blockCount, clientData );
 		
 	}
 	else
@@ -1971,6 +2970,7 @@ IOUSBMassStorageUFIDevice::EjectTheMedium ( void )
 	
 		fPollingMode = kPollingMode_MediaRemoval;
 			
+		ResetPollingInterval();
 		EnablePolling();
 		
 	}
@@ -2148,7 +3148,8 @@ IOUSBMassStorageUFIDevice::ReportDeviceMaxBlocksReadTransfer ( void )
 
     STATUS_LOG ( ( 6, "%s[%p]::%s", getName(), this, __FUNCTION__ ) );
 
-	maxBlockCount = 256;
+	// Requests are split into commands the device can take, so there is no limit.
+	maxBlockCount = 0;
 
 	return maxBlockCount;
 	
@@ -2169,7 +3170,8 @@ IOUSBMassStorageUFIDevice::ReportDeviceMaxBlocksWriteTransfer ( void )
 	
     STATUS_LOG ( ( 6, "%s[%p]::%s", getName(), this, __FUNCTION__ ) );
 
-	maxBlockCount = 256;
+	// Requests are split into commands the device can take, so there is no limit.
+	maxBlockCount = 0;
 
 	return maxBlockCount;
 	
@@ -3391,16 +4393,116 @@ IOUSBMassStorageUFIDevice::WRITE_12 (
 							SCSICmdField4Byte 			TRANSFER_LENGTH )
 {
 
-	UNUSED ( request );
-	UNUSED ( dataBuffer );
-	UNUSED ( blockSize );
-	UNUSED ( DPO );
-	UNUSED ( EBP );
-	UNUSED ( RELADR );
-	UNUSED ( LOGICAL_BLOCK_ADDRESS );
-	UNUSED ( TRANSFER_LENGTH );
+	UInt32					requestedByteCount;
 	
-	return false;
+	
+	STATUS_LOG ( ( 6, "%s[%p]::WRITE_12 called", getName(), this ) );
+
+	if ( ResetForNewTask( request ) == false )
+	{
+	
+		STATUS_LOG ( ( 1, "%s[%p]:: ResetForNewTask on the request SCSITask failed.", getName(), this ) );
+		return false;
+		
+	}
+	
+	// Check the validity of the media
+	if ( blockSize == 0 )
+	{
+		// There is no media in the device, or it has an undetermined
+		// blocksize (could be unformatted).
+		return false;
+		
+	}
+
+	// Make sure that we were given a valid buffer
+	if (dataBuffer == NULL )
+	{
+	
+		return false;
+		
+	}
+	else
+	{
+		// We have a valid buffer object, check that it has the required
+		// capcity for the data to be transfered.
+		requestedByteCount = TRANSFER_LENGTH * blockSize;
+		
+		// We know the number of bytes to transfer, now check that the 
+		// buffer is large enough to accomodate this request.
+		if ( dataBuffer->getLength() < requestedByteCount )
+		{
+			return false;
+		}
+		
+	}
+
+	// Do the pre-flight check on the passed in parameters
+	if( IsParameterValid ( DPO, kSCSICmdFieldMask1Bit ) == false )
+	{
+	
+		STATUS_LOG ( ( 4, "%s[%p]:: DPO = %x not valid", getName(), this, DPO ) );
+		return false;
+		
+	}
+
+	if( IsParameterValid ( EBP, kSCSICmdFieldMask1Bit ) == false )
+	{
+	
+		STATUS_LOG ( ( 4, "%s[%p]:: EBP = %x not valid", getName(), this, EBP ) );
+		return false;
+		
+	}
+
+	if( IsParameterValid ( RELADR, kSCSICmdFieldMask1Bit ) == false )
+	{
+	
+		STATUS_LOG ( ( 4, "%s[%p]:: RELADR = %x not valid", getName(), this, RELADR ) );
+		return false;
+		
+	}
+
+	if( IsParameterValid ( LOGICAL_BLOCK_ADDRESS, kSCSICmdFieldMask4Byte ) == false )
+	{
+	
+		STATUS_LOG ( ( 4, "%s[%p]:: LOGICAL_BLOCK_ADDRESS = %x not valid",
+						getName(), this, LOGICAL_BLOCK_ADDRESS ) );
+		return false;
+		
+	}
+
+	if( IsParameterValid ( TRANSFER_LENGTH, kSCSICmdFieldMask4Byte ) == false )
+	{
+	
+		STATUS_LOG ( ( 4, "%s[%p]:: TRANSFER_LENGTH = %x not valid",
+						getName(), this, TRANSFER_LENGTH ) );
+		return false;
+		
+	}
+
+	// This is a 12-Byte command, fill out the cdb appropriately  
+	SetCommandDescriptorBlock (	request,
+								kSCSICmd_WRITE_12,
+								( DPO << 4 ) | ( EBP << 2 ) | RELADR,
+								( LOGICAL_BLOCK_ADDRESS >> 24 ) & 0xFF,
+								( LOGICAL_BLOCK_ADDRESS >> 16 ) & 0xFF,
+								( LOGICAL_BLOCK_ADDRESS >> 8  ) & 0xFF,
+								  LOGICAL_BLOCK_ADDRESS			& 0xFF,
+								( TRANSFER_LENGTH >> 24 ) 		& 0xFF,
+								( TRANSFER_LENGTH >> 16 ) 		& 0xFF,
+								( TRANSFER_LENGTH >> 8  ) 		& 0xFF,
+								  TRANSFER_LENGTH				& 0xFF,
+								0x00,
+								0x00 );
+	
+	SetDataTransferDirection ( 	request,
+								kSCSIDataTransfer_FromInitiatorToTarget );
+	SetDataBuffer ( 			request,
+								dataBuffer );
+	SetRequestedDataTransferCount ( request,
+									requestedByteCount );
+	
+	return true;
 	
 }
 
@@ -3458,6 +4560,13 @@ IOUSBMassStorageUFISubclass::BeginProvidedServices ( void )
 	
 	ufiDevice->init ( NULL );
 	
+	// A CBI device may report UNIT ATTENTION in its interrupt data block, which is
+	// only read after a write. Polling backs off further once one has arrived.
+	if ( ( GetInterfaceProtocol() == kProtocolControlBulkInterrupt ) && ( GetInterruptPipe() != NULL ) )
+	{
+		ufiDevice->setProperty ( kMediaChangeEventsProperty, true );
+	}
+	
 	if ( !ufiDevice->attach( this ) )
 	{
 		// panic since the nub can't attach
@@ -29,6 +29,41 @@
 #include <IOKit/usb/IOUSBMassStorageClass.h>
 #include <IOKit/scsi/IOSCSIPrimaryCommandsDevice.h>
 
+#include "IOUSBMassStorageUFIPolicy.h"
+
+
+#pragma mark -
+#pragma mark UFI Split Requests
+
+// A read or write larger than one command moves is split into commands that
+// are sent back to back, each from the completion of the one before, and the
+// client is completed once for all of them. Each pooled task has one, so a
+// split request needs no allocation of its own.
+struct UFISplitRequest
+{
+	IOMemoryDescriptor *	buffer;
+	IODirection				direction;
+	void *					clientData;
+	UInt64					nextBlock;			// First block not yet sent
+	UInt64					blocksLeft;			// Blocks not yet sent
+	UInt64					nextOffset;			// Offset of nextBlock in buffer
+	UInt64					actualByteCount;	// Bytes moved by finished commands
+	IOSubMemoryDescriptor *	commandBuffer;		// Allocated with the pool, re-targeted per command
+};
+
+typedef struct UFISplitRequest		UFISplitRequest;
+
+
+#pragma mark -
+#pragma mark UFI Task Pool
+
+// SCSITasks preallocated per device and shared by every kind of request. Past
+// that, callers wait for a task to come back. The free mask limits the pool to 32.
+enum
+{
+	kUFITaskPoolSize	= 16
+};
+
 
 #pragma mark -
 #pragma mark IOUSBMassStorageUFIDevice declaration
@@ -39,13 +74,55 @@ class IOUSBMassStorageUFIDevice : public IOSCSIPrimaryCommandsDevice
 
 private:
 	static void			AsyncReadWriteComplete( SCSITaskIdentifier	completedTask );
+	static void			ClearNotReadyStatusComplete( SCSITaskIdentifier	completedTask );
+	static void			SplitReadWriteComplete( SCSITaskIdentifier	completedTask );
 	
 protected:
     // Reserve space for future expansion.
     struct IOUSBMassStorageUFIDeviceExpansionData
 	{
+		// The protocol driver can report media changes as they happen. Once
+		// it has, polling only runs as a slow fallback.
+		bool				fMediaChangeEvents;
+		
+		UFIPollingPolicy	fPollingPolicy;
+		
+		// Clearing NOT_READY status at start up runs on command completions and
+		// fNotReadyTimer, polling only starts once fDeviceReady is set.
+		bool				fDeviceReady;
+		UInt32				fNotReadyState;
+		SCSITaskIdentifier	fNotReadyTask;
+		IOMemoryDescriptor *	fNotReadySenseDesc;
+		SCSI_Sense_Data		fNotReadySenseData;
+		thread_call_t		fNotReadyTimer;
+		
+		// Reads and writes are split into commands of at most this many bytes.
+		UInt32				fMaxCommandByteCount;
+		
+		SCSITaskIdentifier	fTaskPool[kUFITaskPoolSize];
+		UFISplitRequest		fSplitRequests[kUFITaskPoolSize];
+		volatile UInt32		fTaskPoolFreeMask;
+		
+		// Callers sleep on fTaskPoolFreeMask until a task comes back.
+		IOLock *			fTaskPoolLock;
+		volatile SInt32		fTaskPoolWaiters;
 	};
     IOUSBMassStorageUFIDeviceExpansionData *fIOUSBMassStorageUFIDeviceReserved;
+	
+	#define fMediaChangeEvents		fIOUSBMassStorageUFIDeviceReserved->fMediaChangeEvents
+	#define fPollingPolicy			fIOUSBMassStorageUFIDeviceReserved->fPollingPolicy
+	#define fDeviceReady			fIOUSBMassStorageUFIDeviceReserved->fDeviceReady
+	#define fNotReadyState			fIOUSBMassStorageUFIDeviceReserved->fNotReadyState
+	#define fNotReadyTask			fIOUSBMassStorageUFIDeviceReserved->fNotReadyTask
+	#define fNotReadySenseDesc		fIOUSBMassStorageUFIDeviceReserved->fNotReadySenseDesc
+	#define fNotReadySenseData		fIOUSBMassStorageUFIDeviceReserved->fNotReadySenseData
+	#define fNotReadyTimer			fIOUSBMassStorageUFIDeviceReserved->fNotReadyTimer
+	#define fMaxCommandByteCount	fIOUSBMassStorageUFIDeviceReserved->fMaxCommandByteCount
+	#define fTaskPool				fIOUSBMassStorageUFIDeviceReserved->fTaskPool
+	#define fSplitRequests			fIOUSBMassStorageUFIDeviceReserved->fSplitRequests
+	#define fTaskPoolFreeMask		fIOUSBMassStorageUFIDeviceReserved->fTaskPoolFreeMask
+	#define fTaskPoolLock			fIOUSBMassStorageUFIDeviceReserved->fTaskPoolLock
+	#define fTaskPoolWaiters		fIOUSBMassStorageUFIDeviceReserved->fTaskPoolWaiters
 
 	// ---- Medium Characteristics ----
 	bool				fMediumPresent;
@@ -69,6 +146,15 @@ protected:
 		kPollingMode_MediaRemoval	= 2
 	};
 	
+	// States of the start up NOT_READY state machine
+	enum
+	{
+		kNotReadyState_Idle				= 0,
+		kNotReadyState_TestUnitReady	= 1,
+		kNotReadyState_RequestSense		= 2,
+		kNotReadyState_StartUnit		= 3
+	};
+	
 	// ---- Methods for controlling the current state of device support ----
 	virtual bool		InitializeDeviceSupport( void );
 	virtual void 		StartDeviceSupport ( void );
@@ -86,6 +172,7 @@ protected:
 	virtual void		ProcessPoll( void );
 	virtual void		EnablePolling( void );
 	virtual void		DisablePolling( void );
+	virtual IOReturn	VerifyDeviceState( void );
 
 	// ---- Main and support methods for polling for new Media ----
 	virtual void		PollForNewMedia( void );
@@ -124,7 +211,6 @@ protected:
                      		UInt64					blockCount,
                        		void * 					clientData );
 
-
 	virtual IOReturn	IssueWrite( 
 							IOMemoryDescriptor *	buffer,
                     		UInt64					startBlock,
@@ -136,9 +222,57 @@ protected:
                       		UInt64					blockCount,
 							void * 					clientData );
 
+	// ---- Helpers for the methods above ----
+	// Not virtual, so they are not part of the vtable subclasses are built against.
+	
+	// Task pool
+	IOReturn			AllocateTaskPool( void );
+	void				FreeTaskPool( void );
+	SCSITaskIdentifier	GetPooledSCSITask( void );
+	void				ReleasePooledSCSITask( SCSITaskIdentifier request );
+	UInt32				GetTaskPoolIndex( SCSITaskIdentifier request );
+	
+	// Clearing NOT_READY status at start up
+	void				BeginClearNotReadyStatus( void );
+	void				IssueNotReadyCommand( UInt32 state );
+	void				ProcessNotReadyCompletion( SCSITaskIdentifier request );
+	void				ScheduleNotReadyRetry( void );
+	void				NotReadyStatusCleared( void );
+	
+	// Polling interval
+	void				ExpeditePolling( void );
+	void				InitializePollingPolicy( void );
+	void				ResetPollingInterval( void );
+	UInt32				GetNextPollingInterval( void );
+	
+	// Splitting reads and writes into commands
+	void				DetermineTransferLimits( void );
+	UInt64				GetMaxBlocksPerCommand( void );
+	bool				BuildReadWriteCommand(
+							SCSITaskIdentifier		request,
+							IOMemoryDescriptor *	buffer,
+							IODirection				direction,
+							UInt64					startBlock,
+							UInt64					blockCount );
+	IOReturn			IssueSyncReadWrite(
+							IOMemoryDescriptor *	buffer,
+							IODirection				direction,
+							UInt64					startBlock,
+							UInt64					blockCount );
+	IOReturn			IssueAsyncReadWrite(
+							IOMemoryDescriptor *	buffer,
+							IODirection				direction,
+							UInt64					startBlock,
+							UInt64					blockCount,
+							void * 					clientData );
+	IOReturn			IssueSplitCommand(
+							SCSITaskIdentifier		request,
+							UFISplitRequest *		split );
+
 public:
 											
 	static 	void		sProcessPoll( void * pdtDriver, void * refCon );
+	static 	void		sNotReadyTimerFired( void * pdtDriver, void * refCon );
 
 	// Interface to the UFI Storage Services Driver
 	// ---- Methods for controlling the device ----
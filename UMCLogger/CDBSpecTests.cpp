@@ -0,0 +1,385 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+Checks the CDB table UMCLogger decodes commands with: that every entry is well
+formed and reachable, that service actions pick the right entry, and that the
+fields of common commands decode to the values that were encoded. Exits non-zero
+on failure:
+g++ -W -Wall -Wextra -O2 -o CDBSpecTests CDBSpecTests.cpp
+./CDBSpecTests
+*/
+
+
+//-----------------------------------------------------------------------------
+//	Includes
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "UMCCDBSpecs.h"
+
+
+//-----------------------------------------------------------------------------
+//	Constants
+//-----------------------------------------------------------------------------
+
+#define kCDBSize						16
+#define kCDBSpecCount					( sizeof ( kCDBSpecs ) / sizeof ( kCDBSpecs[0] ) )
+
+
+//-----------------------------------------------------------------------------
+//	Globals
+//-----------------------------------------------------------------------------
+
+static int				gFailures	= 0;
+static int				gChecks		= 0;
+
+
+//-----------------------------------------------------------------------------
+//	Macros
+//-----------------------------------------------------------------------------
+
+#define CHECK(x)																\
+	do																			\
+	{																			\
+		gChecks++;																\
+		if ( !( x ) )															\
+		{																		\
+			gFailures++;														\
+			fprintf ( stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x );	\
+		}																		\
+	} while ( 0 )
+
+
+//-----------------------------------------------------------------------------
+//	Helpers
+//-----------------------------------------------------------------------------
+
+// Returns the value of the named field of cdb, checking that spec has it.
+static uint64_t
+FieldValue ( const CDBSpec * spec, const char * name, const uint8_t * cdb )
+{
+
+	unsigned int	i;
+
+	for ( i = 0; ( i < kCDBMaxFields ) && ( spec->fields[i].bytes != 0 ); i++ )
+	{
+
+		if ( strcmp ( spec->fields[i].name, name ) == 0 )
+		{
+			return CDBFieldValue ( &spec->fields[i], cdb );
+		}
+
+	}
+
+	fprintf ( stderr, "%s has no field %s\n", spec->name, name );
+	CHECK ( false );
+
+	return 0;
+
+}
+
+
+static const CDBSpec *
+Decode ( const uint8_t * cdb, const char * expectedName )
+{
+
+	const CDBSpec *		spec = FindCDBSpec ( cdb[0], cdb, kCDBSize );
+
+	CHECK ( spec != NULL );
+	if ( spec == NULL )
+	{
+		return NULL;
+	}
+
+	if ( strcmp ( spec->name, expectedName ) != 0 )
+	{
+		fprintf ( stderr, "0x%02X decoded as %s, expected %s\n", cdb[0], spec->name, expectedName );
+	}
+
+	CHECK ( strcmp ( spec->name, expectedName ) == 0 );
+
+	return spec;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	Tests
+//-----------------------------------------------------------------------------
+
+static void
+TestTableIsWellFormed ( void )
+{
+
+	unsigned int	i;
+	unsigned int	j;
+	unsigned int	k;
+
+	for ( i = 0; i < kCDBSpecCount; i++ )
+	{
+
+		const CDBSpec *		spec = &kCDBSpecs[i];
+
+		CHECK ( spec->name != NULL );
+
+		for ( j = 0; ( j < kCDBMaxFields ) && ( spec->fields[j].bytes != 0 ); j++ )
+		{
+
+			const CDBField *	field = &spec->fields[j];
+
+			// Every field lies inside the longest CDB and fits the 64 bit value it is read into.
+			CHECK ( field->name != NULL );
+			CHECK ( field->bytes <= 8 );
+			CHECK ( ( field->offset + field->bytes ) <= kCDBSize );
+			CHECK ( ( field->shift + field->bits ) <= ( field->bytes * 8 ) );
+			CHECK ( field->bits < 64 );
+
+			// Byte 0 is the operation code, nothing decodes it as a field.
+			CHECK ( field->offset > 0 );
+
+			// Names are unique within a command.
+			for ( k = 0; k < j; k++ )
+			{
+				CHECK ( strcmp ( spec->fields[k].name, field->name ) != 0 );
+			}
+
+		}
+
+		for ( k = 0; k < i; k++ )
+		{
+
+			// Sorted by operation code, so lookups and reviews find things where they expect.
+			CHECK ( kCDBSpecs[k].operationCode <= spec->operationCode );
+
+			// A catch-all entry ahead of a service action entry would hide it.
+			if ( kCDBSpecs[k].operationCode == spec->operationCode )
+			{
+
+				CHECK ( kCDBSpecs[k].serviceAction != kCDBAnyServiceAction );
+				CHECK ( kCDBSpecs[k].serviceAction != spec->serviceAction );
+
+			}
+
+		}
+
+	}
+
+}
+
+
+static void
+TestEveryEntryIsFound ( void )
+{
+
+	uint8_t			cdb[kCDBSize];
+	unsigned int	i;
+
+	for ( i = 0; i < kCDBSpecCount; i++ )
+	{
+
+		memset ( cdb, 0, sizeof ( cdb ) );
+		cdb[0] = kCDBSpecs[i].operationCode;
+		if ( kCDBSpecs[i].serviceAction != kCDBAnyServiceAction )
+		{
+			cdb[1] = kCDBSpecs[i].serviceAction;
+		}
+
+		CHECK ( FindCDBSpec ( cdb[0], cdb, sizeof ( cdb ) ) == &kCDBSpecs[i] );
+
+	}
+
+	// Operation codes nothing in the table uses.
+	CHECK ( FindCDBSpec ( 0xFF, NULL, 0 ) == NULL );
+	CHECK ( FindCDBSpec ( 0x02, NULL, 0 ) == NULL );
+
+}
+
+
+static void
+TestServiceActions ( void )
+{
+
+	uint8_t		cdb[kCDBSize] = { 0x9E, 0x10 };
+
+	Decode ( cdb, "READ_CAPACITY_16" );
+
+	// The service action is the low 5 bits of byte 1.
+	cdb[1] = 0xF0;
+	Decode ( cdb, "READ_CAPACITY_16" );
+
+	cdb[1] = 0x11;
+	Decode ( cdb, "SERVICE_ACTION_IN_16" );
+
+	// Without the CDB, as for the analyzer and export names, only the catch-all matches.
+	CHECK ( strcmp ( FindCDBSpec ( 0x9E, NULL, 0 )->name, "SERVICE_ACTION_IN_16" ) == 0 );
+
+	// A CDB too short to hold byte 1 cannot pick a service action either.
+	cdb[1] = 0x10;
+	CHECK ( strcmp ( FindCDBSpec ( 0x9E, cdb, 1 )->name, "SERVICE_ACTION_IN_16" ) == 0 );
+
+}
+
+
+static void
+TestReadWrite ( void )
+{
+
+	const uint8_t		read6[kCDBSize]		= { 0x08, 0xFF, 0x34, 0x56, 0x80 };
+	const uint8_t		read10[kCDBSize]	= { 0x28, 0xB8, 0x12, 0x34, 0x56, 0x78, 0x1F, 0x01, 0x00 };
+	const uint8_t		write16[kCDBSize]	= { 0x8A, 0x00, 0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF, 0x00, 0x01, 0x00, 0x00, 0x00 };
+	const CDBSpec *		spec;
+
+	// READ (6) only has 21 bits of LBA, the rest of byte 1 is not part of it.
+	spec = Decode ( read6, "READ_6" );
+	if ( spec != NULL )
+	{
+
+		CHECK ( FieldValue ( spec, "LBA", read6 ) == 0x1F3456 );
+		CHECK ( FieldValue ( spec, "TRANSFER_LENGTH", read6 ) == 0x80 );
+
+	}
+
+	spec = Decode ( read10, "READ_10" );
+	if ( spec != NULL )
+	{
+
+		CHECK ( FieldValue ( spec, "RDPROTECT", read10 ) == 5 );
+		CHECK ( FieldValue ( spec, "DPO", read10 ) == 1 );
+		CHECK ( FieldValue ( spec, "FUA", read10 ) == 1 );
+		CHECK ( FieldValue ( spec, "LBA", read10 ) == 0x12345678 );
+		CHECK ( FieldValue ( spec, "GROUP_NUMBER", read10 ) == 0x1F );
+		CHECK ( FieldValue ( spec, "TRANSFER_LENGTH", read10 ) == 0x100 );
+
+	}
+
+	spec = Decode ( write16, "WRITE_16" );
+	if ( spec != NULL )
+	{
+
+		CHECK ( FieldValue ( spec, "FUA", write16 ) == 0 );
+		CHECK ( FieldValue ( spec, "LBA", write16 ) == 0x0123456789ABCDEFULL );
+		CHECK ( FieldValue ( spec, "TRANSFER_LENGTH", write16 ) == 0x10000 );
+
+	}
+
+}
+
+
+static void
+TestOtherCommands ( void )
+{
+
+	const uint8_t		inquiry[kCDBSize]	= { 0x12, 0x01, 0x80, 0x01, 0x00 };
+	const uint8_t		modeSense[kCDBSize]	= { 0x1A, 0x08, 0xBF, 0xFF, 0xC0 };
+	const uint8_t		startStop[kCDBSize]	= { 0x1B, 0x01, 0x00, 0x00, 0x32 };
+	const uint8_t		ata12[kCDBSize]		= { 0xA1, 0x08, 0x2E, 0x00, 0x01, 0x00, 0x00, 0x00, 0xA0, 0xEC };
+	const uint8_t		reportLUNs[kCDBSize]	= { 0xA0, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x08 };
+	const CDBSpec *		spec;
+
+	spec = Decode ( inquiry, "INQUIRY" );
+	if ( spec != NULL )
+	{
+
+		CHECK ( FieldValue ( spec, "EVPD", inquiry ) == 1 );
+		CHECK ( FieldValue ( spec, "PAGE_CODE", inquiry ) == 0x80 );
+		CHECK ( FieldValue ( spec, "ALLOCATION_LENGTH", inquiry ) == 0x100 );
+
+	}
+
+	spec = Decode ( modeSense, "MODE_SENSE_6" );
+	if ( spec != NULL )
+	{
+
+		CHECK ( FieldValue ( spec, "DBD", modeSense ) == 1 );
+		CHECK ( FieldValue ( spec, "PC", modeSense ) == 2 );
+		CHECK ( FieldValue ( spec, "PAGE_CODE", modeSense ) == 0x3F );
+		CHECK ( FieldValue ( spec, "SUBPAGE_CODE", modeSense ) == 0xFF );
+		CHECK ( FieldValue ( spec, "ALLOCATION_LENGTH", modeSense ) == 0xC0 );
+
+	}
+
+	spec = Decode ( startStop, "START_STOP_UNIT" );
+	if ( spec != NULL )
+	{
+
+		CHECK ( FieldValue ( spec, "IMMED", startStop ) == 1 );
+		CHECK ( FieldValue ( spec, "POWER_CONDITION", startStop ) == 3 );
+		CHECK ( FieldValue ( spec, "LOEJ", startStop ) == 1 );
+		CHECK ( FieldValue ( spec, "START", startStop ) == 0 );
+
+	}
+
+	// 0xA1 is what bridges send for ATA PASS-THROUGH (12), not MMC BLANK.
+	spec = Decode ( ata12, "ATA_PASS_THROUGH_12" );
+	if ( spec != NULL )
+	{
+
+		CHECK ( FieldValue ( spec, "PROTOCOL", ata12 ) == 4 );
+		CHECK ( FieldValue ( spec, "T_DIR", ata12 ) == 1 );
+		CHECK ( FieldValue ( spec, "BYT_BLOK", ata12 ) == 1 );
+		CHECK ( FieldValue ( spec, "T_LENGTH", ata12 ) == 2 );
+		CHECK ( FieldValue ( spec, "SECTOR_COUNT", ata12 ) == 1 );
+		CHECK ( FieldValue ( spec, "DEVICE", ata12 ) == 0xA0 );
+		CHECK ( FieldValue ( spec, "ATA_COMMAND", ata12 ) == 0xEC );
+
+	}
+
+	spec = Decode ( reportLUNs, "REPORT_LUNS" );
+	if ( spec != NULL )
+	{
+
+		CHECK ( FieldValue ( spec, "SELECT_REPORT", reportLUNs ) == 2 );
+		CHECK ( FieldValue ( spec, "ALLOCATION_LENGTH", reportLUNs ) == 0x108 );
+
+	}
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	main
+//-----------------------------------------------------------------------------
+
+int
+main ( int argc, const char * argv[] )
+{
+
+	( void ) argc;
+	( void ) argv;
+
+	TestTableIsWellFormed ( );
+	TestEveryEntryIsFound ( );
+	TestServiceActions ( );
+	TestReadWrite ( );
+	TestOtherCommands ( );
+
+	printf ( "%d checks, %d failed\n", gChecks, gFailures );
+
+	return ( gFailures == 0 ) ? 0 : 1;
+
+}
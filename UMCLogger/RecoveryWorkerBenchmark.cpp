@@ -0,0 +1,470 @@
+/*
+ * Copyright (c) 2008-2009 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * "Portions Copyright (c) 1999 Apple Inc.  All Rights
+ * Reserved.  This file contains Original Code and/or Modifications of
+ * Original Code as defined in and that are subject to the Apple Public
+ * Source License Version 1.0 (the 'License').	You may not use this file
+ * except in compliance with the License.  Please obtain a copy of the
+ * License at http://www.apple.com/publicsource and read it before using
+ * this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE OR NON-INFRINGEMENT.  Please see the
+ * License for the specific language governing rights and limitations
+ * under the License."
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+Measures the recovery latency of IOUSBMassStorageClass during a stall storm, such
+as a flaky cable causes. Every command stalls, and the next one is only sent once
+the recovery for it has run, as the driver does. Recovery runs first on a thread
+started for each job and terminated after it, as ResetDeviceNow ( ) and
+ClearPipeStall ( ) used to do, then on the one long lived worker each instance
+now keeps. The emulated recovery takes [work] microseconds, 0 to measure only
+what the thread handling adds:
+g++ -W -Wall -Wextra -O2 -pthread -o RecoveryWorkerBenchmark RecoveryWorkerBenchmark.cpp
+./RecoveryWorkerBenchmark [jobs] [work]
+*/
+
+
+//-----------------------------------------------------------------------------
+//	Includes
+//-----------------------------------------------------------------------------
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+//-----------------------------------------------------------------------------
+//	Constants
+//-----------------------------------------------------------------------------
+
+#define kDefaultJobs					20000
+#define kDefaultWorkUS					0
+
+// As in IOUSBMassStorageClass.h
+#define kRecoveryQueueDepth				8
+#define kRecoveryJobClearStall			1
+#define kRecoveryJobResetDevice			2
+
+
+//-----------------------------------------------------------------------------
+//	Structures
+//-----------------------------------------------------------------------------
+
+typedef struct RecoveryJob
+{
+	uint8_t				type;
+	uint64_t			sequence;
+	uint64_t			queuedTime;
+} RecoveryJob;
+
+typedef struct EmulatedDevice
+{
+	pthread_mutex_t		lock;
+	pthread_cond_t		jobQueued;
+	pthread_cond_t		jobFinished;
+
+	// The persistent worker
+	pthread_t			worker;
+	bool				workerExit;
+	uint8_t				jobHead;
+	uint8_t				jobCount;
+	RecoveryJob			jobs[kRecoveryQueueDepth];
+
+	unsigned int		workUS;
+	uint64_t			jobsQueued;
+	uint64_t			jobsFinished;
+	uint64_t			orderErrors;
+	uint64_t *			dispatchLatency;	// Queued to started, ns
+	uint64_t *			totalLatency;		// Queued to finished, ns
+} EmulatedDevice;
+
+typedef struct ThreadJob
+{
+	EmulatedDevice *	device;
+	RecoveryJob			job;
+} ThreadJob;
+
+typedef bool ( * QueueJobFunction ) ( EmulatedDevice * inDevice, uint8_t inType );
+
+
+//-----------------------------------------------------------------------------
+//	Helpers
+//-----------------------------------------------------------------------------
+
+static uint64_t
+CurrentTimeNS ( void )
+{
+
+	struct timespec		now;
+
+	clock_gettime ( CLOCK_MONOTONIC, &now );
+	return ( uint64_t ) now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+}
+
+
+static int
+CompareLatency ( const void * inA, const void * inB )
+{
+
+	uint64_t	a = * ( const uint64_t * ) inA;
+	uint64_t	b = * ( const uint64_t * ) inB;
+
+	return ( a < b ) ? -1 : ( ( a > b ) ? 1 : 0 );
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	The emulated recovery
+//-----------------------------------------------------------------------------
+
+static void
+RunRecoveryJob ( EmulatedDevice * inDevice, RecoveryJob * inJob )
+{
+
+	uint64_t	started		= CurrentTimeNS ( );
+	uint64_t	index;
+
+	// ClearPipeStall ( ) or sResetDevice ( ), spinning for as long as the USB requests take.
+	while ( ( CurrentTimeNS ( ) - started ) < ( uint64_t ) inDevice->workUS * 1000 )
+	{
+	}
+
+	pthread_mutex_lock ( &inDevice->lock );
+
+	index = inDevice->jobsFinished;
+	inDevice->dispatchLatency[index]	= started - inJob->queuedTime;
+	inDevice->totalLatency[index]		= CurrentTimeNS ( ) - inJob->queuedTime;
+
+	// Jobs run in the order they were queued.
+	if ( inJob->sequence != index )
+	{
+		inDevice->orderErrors++;
+	}
+
+	inDevice->jobsFinished++;
+
+	pthread_cond_broadcast ( &inDevice->jobFinished );
+	pthread_mutex_unlock ( &inDevice->lock );
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	A thread per job, before
+//-----------------------------------------------------------------------------
+
+static void *
+ThreadJobMain ( void * inArgument )
+{
+
+	ThreadJob *		threadJob = ( ThreadJob * ) inArgument;
+
+	RunRecoveryJob ( threadJob->device, &threadJob->job );
+	free ( threadJob );
+
+	return NULL;
+
+}
+
+
+static bool
+ThreadQueueJob ( EmulatedDevice * inDevice, uint8_t inType )
+{
+
+	ThreadJob *			threadJob	= NULL;
+	pthread_attr_t		attributes;
+	pthread_t			thread;
+	bool				result		= false;
+
+	threadJob = ( ThreadJob * ) calloc ( 1, sizeof ( ThreadJob ) );
+	if ( threadJob == NULL )
+	{
+		return false;
+	}
+
+	threadJob->device			= inDevice;
+	threadJob->job.type			= inType;
+	threadJob->job.sequence		= inDevice->jobsQueued;
+	threadJob->job.queuedTime	= CurrentTimeNS ( );
+
+	// kernel_thread_start ( ), then thread_deallocate ( ) since nobody joins it.
+	pthread_attr_init ( &attributes );
+	pthread_attr_setdetachstate ( &attributes, PTHREAD_CREATE_DETACHED );
+	result = ( pthread_create ( &thread, &attributes, ThreadJobMain, threadJob ) == 0 );
+	pthread_attr_destroy ( &attributes );
+
+	if ( result == false )
+	{
+		free ( threadJob );
+	}
+	else
+	{
+		inDevice->jobsQueued++;
+	}
+
+	return result;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	One worker per instance, after
+//-----------------------------------------------------------------------------
+
+static void *
+WorkerMain ( void * inArgument )
+{
+
+	EmulatedDevice *	device = ( EmulatedDevice * ) inArgument;
+	RecoveryJob			job;
+
+	pthread_mutex_lock ( &device->lock );
+
+	for ( ;; )
+	{
+
+		while ( ( device->jobCount == 0 ) && ( device->workerExit == false ) )
+		{
+			pthread_cond_wait ( &device->jobQueued, &device->lock );
+		}
+
+		if ( device->jobCount == 0 )
+		{
+			break;
+		}
+
+		job = device->jobs[device->jobHead];
+		device->jobHead = ( device->jobHead + 1 ) % kRecoveryQueueDepth;
+		device->jobCount--;
+
+		pthread_mutex_unlock ( &device->lock );
+		RunRecoveryJob ( device, &job );
+		pthread_mutex_lock ( &device->lock );
+
+	}
+
+	pthread_mutex_unlock ( &device->lock );
+
+	return NULL;
+
+}
+
+
+static bool
+WorkerQueueJob ( EmulatedDevice * inDevice, uint8_t inType )
+{
+
+	bool	result = false;
+
+	pthread_mutex_lock ( &inDevice->lock );
+
+	if ( inDevice->jobCount < kRecoveryQueueDepth )
+	{
+
+		RecoveryJob *	job = &inDevice->jobs[( inDevice->jobHead + inDevice->jobCount ) % kRecoveryQueueDepth];
+
+		job->type		= inType;
+		job->sequence	= inDevice->jobsQueued++;
+		job->queuedTime	= CurrentTimeNS ( );
+		inDevice->jobCount++;
+
+		pthread_cond_signal ( &inDevice->jobQueued );
+		result = true;
+
+	}
+
+	pthread_mutex_unlock ( &inDevice->lock );
+
+	return result;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	Benchmark
+//-----------------------------------------------------------------------------
+
+static double
+RunBenchmark ( const char *			inName,
+			   QueueJobFunction		inQueueJob,
+			   bool					inWorker,
+			   uint64_t				inJobs,
+			   unsigned int			inWorkUS )
+{
+
+	EmulatedDevice *	device		= NULL;
+	uint64_t			failures	= 0;
+	uint64_t			start		= 0;
+	uint64_t			elapsed		= 0;
+	uint64_t			sum			= 0;
+	uint64_t			index;
+	double				mean		= 0;
+
+	device = ( EmulatedDevice * ) calloc ( 1, sizeof ( EmulatedDevice ) );
+	if ( device == NULL )
+	{
+
+		fprintf ( stderr, "Out of memory\n" );
+		exit ( 1 );
+
+	}
+
+	device->dispatchLatency	= ( uint64_t * ) calloc ( inJobs, sizeof ( uint64_t ) );
+	device->totalLatency	= ( uint64_t * ) calloc ( inJobs, sizeof ( uint64_t ) );
+	if ( ( device->dispatchLatency == NULL ) || ( device->totalLatency == NULL ) )
+	{
+
+		fprintf ( stderr, "Out of memory\n" );
+		exit ( 1 );
+
+	}
+
+	device->workUS = inWorkUS;
+	pthread_mutex_init ( &device->lock, NULL );
+	pthread_cond_init ( &device->jobQueued, NULL );
+	pthread_cond_init ( &device->jobFinished, NULL );
+
+	// StartRecoveryWorker
+	if ( inWorker == true )
+	{
+		pthread_create ( &device->worker, NULL, WorkerMain, device );
+	}
+
+	start = CurrentTimeNS ( );
+
+	for ( index = 0; index < inJobs; index++ )
+	{
+
+		// Every fourth stall is past what clearing it fixes, and escalates to a reset.
+		if ( inQueueJob ( device, ( ( index % 4 ) == 3 ) ? kRecoveryJobResetDevice : kRecoveryJobClearStall ) == false )
+		{
+
+			failures++;
+			continue;
+
+		}
+
+		// The next command is only sent once the device has recovered.
+		pthread_mutex_lock ( &device->lock );
+		while ( device->jobsFinished < ( index + 1 - failures ) )
+		{
+			pthread_cond_wait ( &device->jobFinished, &device->lock );
+		}
+		pthread_mutex_unlock ( &device->lock );
+
+	}
+
+	elapsed = CurrentTimeNS ( ) - start;
+
+	// StopRecoveryWorker
+	if ( inWorker == true )
+	{
+
+		pthread_mutex_lock ( &device->lock );
+		device->workerExit = true;
+		pthread_cond_signal ( &device->jobQueued );
+		pthread_mutex_unlock ( &device->lock );
+		pthread_join ( device->worker, NULL );
+
+	}
+
+	for ( index = 0; index < device->jobsFinished; index++ )
+	{
+		sum += device->dispatchLatency[index];
+	}
+
+	qsort ( device->dispatchLatency, device->jobsFinished, sizeof ( uint64_t ), CompareLatency );
+	qsort ( device->totalLatency, device->jobsFinished, sizeof ( uint64_t ), CompareLatency );
+
+	if ( device->jobsFinished != 0 )
+	{
+
+		mean = ( double ) sum / device->jobsFinished / 1000.0;
+
+		printf ( "%-10s %8llu jobs in %7.3f s, dispatch mean %7.1f us p50 %7.1f us p99 %7.1f us, "
+				 "recovery p50 %7.1f us p99 %7.1f us, %llu failures, %llu out of order\n",
+				 inName,
+				 ( unsigned long long ) device->jobsFinished,
+				 elapsed / 1000000000.0,
+				 mean,
+				 device->dispatchLatency[device->jobsFinished / 2] / 1000.0,
+				 device->dispatchLatency[( device->jobsFinished * 99 ) / 100] / 1000.0,
+				 device->totalLatency[device->jobsFinished / 2] / 1000.0,
+				 device->totalLatency[( device->jobsFinished * 99 ) / 100] / 1000.0,
+				 ( unsigned long long ) failures,
+				 ( unsigned long long ) device->orderErrors );
+
+	}
+
+	pthread_cond_destroy ( &device->jobFinished );
+	pthread_cond_destroy ( &device->jobQueued );
+	pthread_mutex_destroy ( &device->lock );
+	free ( device->totalLatency );
+	free ( device->dispatchLatency );
+	free ( device );
+
+	return mean;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	Main
+//-----------------------------------------------------------------------------
+
+int
+main ( int argc, const char * argv[] )
+{
+
+	uint64_t		jobs		= kDefaultJobs;
+	unsigned int	workUS		= kDefaultWorkUS;
+	double			thread		= 0;
+	double			worker		= 0;
+
+	if ( argc > 1 )
+	{
+		jobs = strtoull ( argv[1], NULL, 0 );
+	}
+
+	if ( argc > 2 )
+	{
+		workUS = ( unsigned int ) strtoul ( argv[2], NULL, 0 );
+	}
+
+	if ( jobs == 0 )
+	{
+
+		fprintf ( stderr, "Usage: %s [jobs] [work, us]\n", argv[0] );
+		return 1;
+
+	}
+
+	printf ( "%llu recovery jobs, %u us of recovery work each\n", ( unsigned long long ) jobs, workUS );
+
+	thread		= RunBenchmark ( "thread", ThreadQueueJob, false, jobs, workUS );
+	worker		= RunBenchmark ( "worker", WorkerQueueJob, true, jobs, workUS );
+
+	if ( thread != 0 )
+	{
+		printf ( "The worker takes %.1f%% of the mean dispatch latency of a thread per job\n", worker * 100.0 / thread );
+	}
+
+	return 0;
+
+}
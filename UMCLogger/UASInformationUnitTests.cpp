@@ -0,0 +1,1549 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+Checks the USB Attached SCSI Information Unit helpers the driver uses against
+an emulated UAS target: IU layout, tag handling, status parsing, REPORT LUNS
+and ABORT TASK. The target keeps a set of LUNs and outstanding tags, answers
+INQUIRY, TEST UNIT READY, READ (10), WRITE (10) and REPORT LUNS, and rejects
+bad IUs with the Response IUs the spec calls for. A model of the driver's
+status completions, built on the same routing helpers, then runs commands
+against it with and without streams. Exits non-zero on failure:
+g++ -W -Wall -Wextra -O2 -o UASInformationUnitTests UASInformationUnitTests.cpp
+./UASInformationUnitTests
+*/
+
+
+//-----------------------------------------------------------------------------
+//	Includes
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../IOUSBMassStorageClassUAS.h"
+
+
+//-----------------------------------------------------------------------------
+//	Constants
+//-----------------------------------------------------------------------------
+
+// As the driver sizes things
+#define kQueueDepth						kUASDefaultQueueDepth
+
+#define kTargetLUNs						3
+#define kTargetBlocks					64
+#define kBlockSize						512
+
+#define kMaxStatusIUs					( kQueueDepth * 2 )
+
+// SCSI
+#define kTestUnitReady					0x00
+#define kInquiry						0x12
+#define kRead10							0x28
+#define kWrite10						0x2A
+
+#define kStatusGood						0x00
+#define kStatusCheckCondition			0x02
+
+#define kSenseKeyIllegalRequest			0x05
+#define kASCInvalidCommand				0x20
+#define kASCLBAOutOfRange				0x21
+
+
+//-----------------------------------------------------------------------------
+//	Structures
+//-----------------------------------------------------------------------------
+
+// A status pipe IU on its way to the host.
+typedef struct EmulatedStatusIU
+{
+	uint8_t				bytes[kUASMaxStatusIUSize];
+	uint32_t			length;
+} EmulatedStatusIU;
+
+typedef struct EmulatedTask
+{
+	bool				active;
+	uint8_t				lun;
+	uint8_t				cdb[16];
+} EmulatedTask;
+
+// The device side of a UAS interface without streams. Tasks are held until
+// CompleteTask ( ) is called, so the host sees them finish in any order.
+typedef struct EmulatedTarget
+{
+	uint8_t				media[kTargetLUNs][kTargetBlocks * kBlockSize];
+	EmulatedTask		tasks[65536];
+	EmulatedStatusIU	statusIUs[kMaxStatusIUs];
+	uint32_t			statusHead;
+	uint32_t			statusCount;
+	uint8_t				dataIn[kTargetBlocks * kBlockSize];
+	uint32_t			dataInLength;
+	bool				streams;
+} EmulatedTarget;
+
+// A command as the status completions of the driver see it.
+typedef struct HostCommand
+{
+	bool				active;
+	bool				dataIn;
+	bool				dataPhaseNeeded;
+	bool				abortRequested;
+	bool				aborted;
+	bool				statusReceived;
+	bool				failed;
+	uint32_t			dataPhases;
+	uint8_t				taskStatus;
+} HostCommand;
+
+// The status side of the driver. Every IU goes through the routing the driver uses,
+// and whatever would start recovery there is counted instead.
+typedef struct HostEngine
+{
+	HostCommand			commands[kQueueDepth];
+	bool				streams;
+	bool				taskManagementPending;
+	uint16_t			taskManagementTaskTag;
+	uint32_t			recoveries;
+	uint32_t			ignored;
+} HostEngine;
+
+
+//-----------------------------------------------------------------------------
+//	Globals
+//-----------------------------------------------------------------------------
+
+static int				gFailures	= 0;
+static int				gChecks		= 0;
+
+
+//-----------------------------------------------------------------------------
+//	Macros
+//-----------------------------------------------------------------------------
+
+#define CHECK(x)																\
+	do																			\
+	{																			\
+		gChecks++;																\
+		if ( !( x ) )															\
+		{																		\
+			gFailures++;														\
+			fprintf ( stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x );	\
+		}																		\
+	} while ( 0 )
+
+
+//-----------------------------------------------------------------------------
+//	Emulated target
+//-----------------------------------------------------------------------------
+
+static uint16_t
+ReadBig16 ( const uint8_t * p )
+{
+	return ( uint16_t ) ( ( p[0] << 8 ) | p[1] );
+}
+
+
+static uint32_t
+ReadBig32 ( const uint8_t * p )
+{
+	return ( ( uint32_t ) p[0] << 24 ) | ( ( uint32_t ) p[1] << 16 ) | ( ( uint32_t ) p[2] << 8 ) | p[3];
+}
+
+
+static void
+QueueStatusIU ( EmulatedTarget * target, const uint8_t * bytes, uint32_t length )
+{
+
+	EmulatedStatusIU *	iu;
+
+	if ( target->statusCount == kMaxStatusIUs )
+	{
+
+		fprintf ( stderr, "emulated status pipe overflowed\n" );
+		exit ( 2 );
+
+	}
+
+	iu = &target->statusIUs[( target->statusHead + target->statusCount ) % kMaxStatusIUs];
+	memcpy ( iu->bytes, bytes, length );
+	iu->length = length;
+	target->statusCount++;
+
+}
+
+
+static void
+QueueResponseIU ( EmulatedTarget * target, uint16_t tag, uint8_t responseCode )
+{
+
+	uint8_t		iu[kUASResponseIUSize];
+
+	memset ( iu, 0, sizeof ( iu ) );
+	iu[kUASIUIDOffset]				= kUASResponseIUID;
+	iu[kUASIUTagOffset]				= ( uint8_t ) ( tag >> 8 );
+	iu[kUASIUTagOffset + 1]			= ( uint8_t ) tag;
+	iu[kUASResponseIUCodeOffset]	= responseCode;
+
+	QueueStatusIU ( target, iu, sizeof ( iu ) );
+
+}
+
+
+static void
+QueueReadyIU ( EmulatedTarget * target, uint16_t tag, uint8_t iuID )
+{
+
+	uint8_t		iu[4];
+
+	// With streams the data phase is queued with the command, and nothing says it is ready.
+	if ( target->streams == true )
+	{
+		return;
+	}
+
+	memset ( iu, 0, sizeof ( iu ) );
+	iu[kUASIUIDOffset]				= iuID;
+	iu[kUASIUTagOffset]				= ( uint8_t ) ( tag >> 8 );
+	iu[kUASIUTagOffset + 1]			= ( uint8_t ) tag;
+
+	QueueStatusIU ( target, iu, sizeof ( iu ) );
+
+}
+
+
+static void
+QueueSenseIU ( EmulatedTarget * target, uint16_t tag, uint8_t status, uint8_t senseKey, uint8_t asc )
+{
+
+	uint8_t		iu[kUASSenseIUHeaderSize + 18];
+	uint32_t	length = kUASSenseIUHeaderSize;
+
+	memset ( iu, 0, sizeof ( iu ) );
+	iu[kUASIUIDOffset]				= kUASSenseIUID;
+	iu[kUASIUTagOffset]				= ( uint8_t ) ( tag >> 8 );
+	iu[kUASIUTagOffset + 1]			= ( uint8_t ) tag;
+	iu[kUASSenseIUStatusOffset]		= status;
+
+	if ( status == kStatusCheckCondition )
+	{
+
+		uint8_t *	sense = &iu[kUASSenseIUHeaderSize];
+
+		sense[0]	= 0x70;
+		sense[2]	= senseKey;
+		sense[7]	= 10;
+		sense[12]	= asc;
+
+		iu[kUASSenseIULengthOffset + 1]	= 18;
+		length							+= 18;
+
+	}
+
+	QueueStatusIU ( target, iu, length );
+
+}
+
+
+// Takes one Command or Task Management IU from the command pipe.
+static void
+TargetReceiveIU ( EmulatedTarget * target, const uint8_t * iu, uint32_t length )
+{
+
+	uint16_t	tag = ReadBig16 ( &iu[kUASIUTagOffset] );
+
+	if ( ( iu[kUASIUIDOffset] == kUASCommandIUID ) && ( length == kUASCommandIUSize ) )
+	{
+
+		uint8_t		lun = iu[kUASCommandIULUNOffset + 1];
+
+		if ( target->tasks[tag].active == true )
+		{
+
+			QueueResponseIU ( target, tag, kUASResponseOverlappedTag );
+			return;
+
+		}
+
+		if ( ( lun >= kTargetLUNs ) && ( iu[kUASCommandIUCDBOffset] != kUASReportLUNsOperationCode ) )
+		{
+
+			QueueResponseIU ( target, tag, kUASResponseIncorrectLUN );
+			return;
+
+		}
+
+		target->tasks[tag].active 	= true;
+		target->tasks[tag].lun		= lun;
+		memcpy ( target->tasks[tag].cdb, &iu[kUASCommandIUCDBOffset], sizeof ( target->tasks[tag].cdb ) );
+
+	}
+
+	else if ( ( iu[kUASIUIDOffset] == kUASTaskManagementIUID ) && ( length == kUASTaskManagementIUSize ) )
+	{
+
+		uint16_t	taskTag = ReadBig16 ( &iu[kUASTaskManagementIUTaskTagOffset] );
+
+		if ( iu[kUASTaskManagementIUFunctionOffset] != kUASTaskManagementAbortTask )
+		{
+
+			QueueResponseIU ( target, tag, kUASResponseTMFunctionNotSupported );
+			return;
+
+		}
+
+		if ( target->tasks[tag].active == true )
+		{
+
+			QueueResponseIU ( target, tag, kUASResponseOverlappedTag );
+			return;
+
+		}
+
+		// An aborted task never gets a Sense IU. Aborting a task the target doesn't have
+		// still completes the function.
+		target->tasks[taskTag].active = false;
+		QueueResponseIU ( target, tag, kUASResponseTMFunctionComplete );
+
+	}
+
+	else
+	{
+		QueueResponseIU ( target, tag, kUASResponseInvalidIU );
+	}
+
+}
+
+
+// Runs the task on the given tag through its data phase and queues its status.
+// Data in lands in target->dataIn; data out is taken from dataOut.
+static void
+TargetCompleteTask ( EmulatedTarget * target, uint16_t tag, const uint8_t * dataOut )
+{
+
+	EmulatedTask *	task = &target->tasks[tag];
+	uint32_t		lba;
+	uint32_t		blocks;
+
+	if ( task->active == false )
+	{
+		return;
+	}
+
+	task->active			= false;
+	target->dataInLength	= 0;
+
+	switch ( task->cdb[0] )
+	{
+
+		case kTestUnitReady:
+		{
+			QueueSenseIU ( target, tag, kStatusGood, 0, 0 );
+		}
+		break;
+
+		case kInquiry:
+		{
+
+			memset ( target->dataIn, 0, 36 );
+			target->dataIn[4]		= 31;
+			memcpy ( &target->dataIn[8], "EMULATEDUAS TARGET", 18 );
+			target->dataInLength	= ( task->cdb[4] < 36 ) ? task->cdb[4] : 36;
+
+			QueueReadyIU ( target, tag, kUASReadReadyIUID );
+			QueueSenseIU ( target, tag, kStatusGood, 0, 0 );
+
+		}
+		break;
+
+		case kUASReportLUNsOperationCode:
+		{
+
+			uint32_t	allocation	= ReadBig32 ( &task->cdb[6] );
+			uint32_t	index;
+
+			memset ( target->dataIn, 0, kUASReportLUNsHeaderSize + ( kTargetLUNs * kUASReportLUNsEntrySize ) );
+			target->dataIn[3] = kTargetLUNs * kUASReportLUNsEntrySize;
+
+			for ( index = 0; index < kTargetLUNs; index++ )
+			{
+				target->dataIn[kUASReportLUNsHeaderSize + ( index * kUASReportLUNsEntrySize ) + 1] = ( uint8_t ) index;
+			}
+
+			target->dataInLength = kUASReportLUNsHeaderSize + ( kTargetLUNs * kUASReportLUNsEntrySize );
+			if ( target->dataInLength > allocation )
+			{
+				target->dataInLength = allocation;
+			}
+
+			QueueReadyIU ( target, tag, kUASReadReadyIUID );
+			QueueSenseIU ( target, tag, kStatusGood, 0, 0 );
+
+		}
+		break;
+
+		case kRead10:
+		case kWrite10:
+		{
+
+			lba		= ReadBig32 ( &task->cdb[2] );
+			blocks	= ReadBig16 ( &task->cdb[7] );
+
+			if ( ( lba + blocks ) > kTargetBlocks )
+			{
+
+				QueueSenseIU ( target, tag, kStatusCheckCondition, kSenseKeyIllegalRequest, kASCLBAOutOfRange );
+				break;
+
+			}
+
+			if ( task->cdb[0] == kRead10 )
+			{
+
+				memcpy ( target->dataIn, &target->media[task->lun][lba * kBlockSize], blocks * kBlockSize );
+				target->dataInLength = blocks * kBlockSize;
+				QueueReadyIU ( target, tag, kUASReadReadyIUID );
+
+			}
+
+			else
+			{
+
+				QueueReadyIU ( target, tag, kUASWriteReadyIUID );
+				memcpy ( &target->media[task->lun][lba * kBlockSize], dataOut, blocks * kBlockSize );
+
+			}
+
+			QueueSenseIU ( target, tag, kStatusGood, 0, 0 );
+
+		}
+		break;
+
+		default:
+		{
+			QueueSenseIU ( target, tag, kStatusCheckCondition, kSenseKeyIllegalRequest, kASCInvalidCommand );
+		}
+		break;
+
+	}
+
+}
+
+
+// Takes the next IU off the status pipe. Returns false if there is none.
+static bool
+HostReadStatusIU ( EmulatedTarget * target, uint8_t * buffer, uint32_t * length )
+{
+
+	EmulatedStatusIU *	iu;
+
+	if ( target->statusCount == 0 )
+	{
+		return false;
+	}
+
+	iu = &target->statusIUs[target->statusHead];
+	memcpy ( buffer, iu->bytes, iu->length );
+	*length = iu->length;
+
+	target->statusHead = ( target->statusHead + 1 ) % kMaxStatusIUs;
+	target->statusCount--;
+
+	return true;
+
+}
+
+
+// Reads status IUs until the Sense or Response IU, skipping Read Ready and Write Ready.
+static bool
+HostReadFinalStatus ( EmulatedTarget * target, UASStatusIUInfo * info, uint8_t * buffer )
+{
+
+	uint32_t	length;
+
+	while ( HostReadStatusIU ( target, buffer, &length ) == true )
+	{
+
+		if ( UASParseStatusIU ( buffer, length, info ) == false )
+		{
+			return false;
+		}
+
+		if ( ( info->iuID == kUASSenseIUID ) || ( info->iuID == kUASResponseIUID ) )
+		{
+			return true;
+		}
+
+	}
+
+	return false;
+
+}
+
+
+static void
+BuildRead10 ( uint8_t * cdb, uint32_t lba, uint16_t blocks, uint8_t opcode )
+{
+
+	memset ( cdb, 0, 10 );
+	cdb[0] = opcode;
+	cdb[2] = ( uint8_t ) ( lba >> 24 );
+	cdb[3] = ( uint8_t ) ( lba >> 16 );
+	cdb[4] = ( uint8_t ) ( lba >> 8 );
+	cdb[5] = ( uint8_t ) lba;
+	cdb[7] = ( uint8_t ) ( blocks >> 8 );
+	cdb[8] = ( uint8_t ) blocks;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	Host engine
+//-----------------------------------------------------------------------------
+
+static void
+EngineReset ( HostEngine * engine, EmulatedTarget * target, bool streams )
+{
+
+	memset ( engine, 0, sizeof ( HostEngine ) );
+	engine->streams = streams;
+
+	memset ( target->tasks, 0, sizeof ( target->tasks ) );
+	target->statusHead	= 0;
+	target->statusCount	= 0;
+	target->streams		= streams;
+
+}
+
+
+// As GatedSendSCSICommandForUASProtocol ( ). Returns false if the command is refused.
+static bool
+EngineSendCommand (	HostEngine *		engine,
+					EmulatedTarget *	target,
+					uint32_t			slot,
+					uint8_t				lun,
+					const uint8_t *		cdb,
+					uint8_t				cdbLength,
+					bool				dataIn,
+					bool				hasData )
+{
+
+	HostCommand *	command = &engine->commands[slot];
+	uint8_t			iu[kUASCommandIUSize];
+
+	if ( UASBuildCommandIU ( iu, UASTagForSlot ( slot ), lun, cdb, cdbLength ) == false )
+	{
+		return false;
+	}
+
+	memset ( command, 0, sizeof ( HostCommand ) );
+	command->active				= true;
+	command->dataIn				= dataIn;
+	command->dataPhaseNeeded	= ( ( hasData == true ) && ( engine->streams == false ) );
+
+	TargetReceiveIU ( target, iu, sizeof ( iu ) );
+
+	return true;
+
+}
+
+
+// As UASAbortTask ( ).
+static void
+EngineAbortTask ( HostEngine * engine, EmulatedTarget * target, uint32_t slot )
+{
+
+	uint8_t		iu[kUASTaskManagementIUSize];
+
+	engine->commands[slot].abortRequested	= true;
+	engine->taskManagementPending			= true;
+	engine->taskManagementTaskTag			= UASTagForSlot ( slot );
+
+	UASBuildTaskManagementIU (	iu,
+								UASTaskManagementTag ( kQueueDepth ),
+								kUASTaskManagementAbortTask,
+								engine->taskManagementTaskTag,
+								0 );
+
+	TargetReceiveIU ( target, iu, sizeof ( iu ) );
+
+}
+
+
+// As UASStatusReaderCompletionAction ( ) for streamTag 0, and UASStatusCompletionAction ( )
+// for the stream of the command with that tag.
+static void
+EngineStatusIU ( HostEngine * engine, const uint8_t * iu, uint32_t length, uint16_t streamTag )
+{
+
+	UASStatusIUInfo		info;
+	HostCommand *		command = NULL;
+	bool				valid;
+	int					slot;
+
+	valid = UASParseStatusIU ( iu, length, &info );
+
+	switch ( UASRouteStatusIU ( &info, valid, streamTag, engine->taskManagementPending, kQueueDepth ) )
+	{
+
+		case kUASRouteTaskManagement:
+		{
+
+			command = &engine->commands[UASSlotForTag ( engine->taskManagementTaskTag, kQueueDepth )];
+
+			engine->taskManagementPending	= false;
+			command->abortRequested			= false;
+
+			if ( UASTaskManagementSucceeded ( &info, valid ) == true )
+			{
+				command->aborted = true;
+			}
+
+			else
+			{
+				engine->recoveries++;
+			}
+
+		}
+		break;
+
+		case kUASRouteIgnore:
+		{
+			engine->ignored++;
+		}
+		break;
+
+		case kUASRouteDataPhase:
+		{
+
+			command = &engine->commands[UASSlotForTag ( info.tag, kQueueDepth )];
+
+			if ( ( command->active == false ) || ( command->aborted == true ) )
+			{
+				engine->ignored++;
+			}
+
+			else if ( UASReadyIUMatchesCommand ( info.iuID, command->dataPhaseNeeded, command->dataIn ) == false )
+			{
+				engine->recoveries++;
+			}
+
+			else
+			{
+
+				command->dataPhaseNeeded = false;
+				command->dataPhases++;
+
+			}
+
+		}
+		break;
+
+		case kUASRouteStatus:
+		{
+
+			slot = UASSlotForTag ( ( streamTag != 0 ) ? streamTag : info.tag, kQueueDepth );
+			command = &engine->commands[slot];
+
+			if ( ( command->active == false ) || ( command->aborted == true ) )
+			{
+				engine->ignored++;
+			}
+
+			else
+			{
+
+				command->statusReceived	= true;
+				command->failed			= ( ( valid == false ) || ( info.iuID != kUASSenseIUID ) );
+				command->taskStatus		= info.taskStatus;
+				command->active			= false;
+
+			}
+
+		}
+		break;
+
+		default:
+		{
+			engine->recoveries++;
+		}
+		break;
+
+	}
+
+}
+
+
+// Hands every IU the target has queued to the engine. With streams the status of a command
+// lands on its own stream, and task management responses still go to the shared read.
+static void
+EngineRunStatusPipe ( HostEngine * engine, EmulatedTarget * target )
+{
+
+	uint8_t		iu[kUASMaxStatusIUSize];
+	uint32_t	length;
+	uint16_t	tag;
+
+	while ( HostReadStatusIU ( target, iu, &length ) == true )
+	{
+
+		tag = ReadBig16 ( &iu[kUASIUTagOffset] );
+		if ( ( engine->streams == false ) || ( UASSlotForTag ( tag, kQueueDepth ) < 0 ) )
+		{
+			tag = 0;
+		}
+
+		EngineStatusIU ( engine, iu, length, tag );
+
+	}
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	Tests
+//-----------------------------------------------------------------------------
+
+static void
+TestCommandIU ( void )
+{
+
+	uint8_t		iu[kUASCommandIUSize];
+	uint8_t		cdb[16];
+	uint8_t		longCDB[32];
+	uint32_t	index;
+
+	for ( index = 0; index < sizeof ( cdb ); index++ )
+	{
+		cdb[index] = ( uint8_t ) ( 0xA0 + index );
+	}
+
+	memset ( longCDB, 0x7F, sizeof ( longCDB ) );
+	memset ( iu, 0xEE, sizeof ( iu ) );
+	CHECK ( UASBuildCommandIU ( iu, 0x1234, 7, cdb, 10 ) == true );
+
+	CHECK ( iu[0] == kUASCommandIUID );
+	CHECK ( iu[1] == 0 );
+	CHECK ( iu[2] == 0x12 );
+	CHECK ( iu[3] == 0x34 );
+	CHECK ( iu[4] == kUASTaskAttributeSimple );
+	CHECK ( iu[6] == 0 );		// No additional CDB bytes
+	CHECK ( iu[8] == 0 );
+	CHECK ( iu[9] == 7 );
+	CHECK ( iu[10] == 0 && iu[15] == 0 );
+	CHECK ( memcmp ( &iu[16], cdb, 10 ) == 0 );
+	CHECK ( iu[26] == 0 && iu[31] == 0 );
+
+	// A 16 byte CDB fills the IU exactly.
+	CHECK ( UASBuildCommandIU ( iu, 1, 0, cdb, 16 ) == true );
+	CHECK ( memcmp ( &iu[16], cdb, 16 ) == 0 );
+
+	// A longer one needs an additional CDB length, and is refused rather than cut short.
+	memset ( iu, 0xEE, sizeof ( iu ) );
+	CHECK ( UASBuildCommandIU ( iu, 1, 0, longCDB, 17 ) == false );
+	CHECK ( UASBuildCommandIU ( iu, 1, 0, longCDB, sizeof ( longCDB ) ) == false );
+	CHECK ( iu[0] == 0xEE && iu[kUASCommandIUSize - 1] == 0xEE );
+
+}
+
+
+static void
+TestTaskManagementIU ( void )
+{
+
+	uint8_t		iu[kUASTaskManagementIUSize];
+
+	memset ( iu, 0xEE, sizeof ( iu ) );
+	UASBuildTaskManagementIU ( iu, UASTaskManagementTag ( kQueueDepth ), kUASTaskManagementAbortTask, 0x0102, 3 );
+
+	CHECK ( iu[0] == kUASTaskManagementIUID );
+	CHECK ( iu[1] == 0 );
+	CHECK ( ReadBig16 ( &iu[2] ) == kQueueDepth + 1 );
+	CHECK ( iu[4] == kUASTaskManagementAbortTask );
+	CHECK ( iu[5] == 0 );
+	CHECK ( iu[6] == 0x01 );
+	CHECK ( iu[7] == 0x02 );
+	CHECK ( iu[8] == 0 );
+	CHECK ( iu[9] == 3 );
+	CHECK ( iu[15] == 0 );
+
+}
+
+
+static void
+TestTags ( void )
+{
+
+	uint32_t	slot;
+
+	for ( slot = 0; slot < kQueueDepth; slot++ )
+	{
+
+		uint16_t	tag = UASTagForSlot ( slot );
+
+		// Tags are stream IDs, and stream 0 is reserved.
+		CHECK ( tag != 0 );
+		CHECK ( UASSlotForTag ( tag, kQueueDepth ) == ( int ) slot );
+		CHECK ( tag != UASTaskManagementTag ( kQueueDepth ) );
+
+	}
+
+	CHECK ( UASSlotForTag ( 0, kQueueDepth ) == -1 );
+	CHECK ( UASSlotForTag ( UASTaskManagementTag ( kQueueDepth ), kQueueDepth ) == -1 );
+	CHECK ( UASSlotForTag ( 0xFFFF, kQueueDepth ) == -1 );
+
+	// The task management tag is the last stream the driver creates, depth + 1.
+	CHECK ( UASTaskManagementTag ( 4 ) == 5 );
+
+}
+
+
+static void
+TestStatusParsing ( void )
+{
+
+	uint8_t				iu[kUASMaxStatusIUSize + 16];
+	UASStatusIUInfo		info;
+
+	// Sense IU with sense data
+	memset ( iu, 0, sizeof ( iu ) );
+	iu[0]	= kUASSenseIUID;
+	iu[3]	= 9;
+	iu[6]	= kStatusCheckCondition;
+	iu[15]	= 18;
+	CHECK ( UASParseStatusIU ( iu, kUASSenseIUHeaderSize + 18, &info ) == true );
+	CHECK ( info.iuID == kUASSenseIUID );
+	CHECK ( info.tag == 9 );
+	CHECK ( info.taskStatus == kStatusCheckCondition );
+	CHECK ( info.senseLength == 18 );
+
+	// The length field is never trusted past what arrived.
+	CHECK ( UASParseStatusIU ( iu, kUASSenseIUHeaderSize + 4, &info ) == true );
+	CHECK ( info.senseLength == 4 );
+
+	iu[14] = 0xFF;
+	iu[15] = 0xFF;
+	CHECK ( UASParseStatusIU ( iu, sizeof ( iu ), &info ) == true );
+	CHECK ( info.senseLength == kUASMaxSenseDataSize );
+
+	// A Sense IU too short for its header
+	CHECK ( UASParseStatusIU ( iu, kUASSenseIUHeaderSize - 1, &info ) == false );
+	CHECK ( info.iuID == kUASSenseIUID );
+	CHECK ( info.tag == 9 );
+
+	// Response IU
+	memset ( iu, 0, sizeof ( iu ) );
+	iu[0]	= kUASResponseIUID;
+	iu[2]	= 0x01;
+	iu[3]	= 0x00;
+	iu[7]	= kUASResponseIncorrectLUN;
+	CHECK ( UASParseStatusIU ( iu, kUASResponseIUSize, &info ) == true );
+	CHECK ( info.tag == 0x100 );
+	CHECK ( info.responseCode == kUASResponseIncorrectLUN );
+	CHECK ( UASParseStatusIU ( iu, kUASResponseIUSize - 1, &info ) == false );
+
+	// Read Ready and Write Ready are just a header
+	memset ( iu, 0, sizeof ( iu ) );
+	iu[0]	= kUASReadReadyIUID;
+	iu[3]	= 2;
+	CHECK ( UASParseStatusIU ( iu, 4, &info ) == true );
+	CHECK ( info.iuID == kUASReadReadyIUID );
+	CHECK ( info.tag == 2 );
+
+	iu[0]	= kUASWriteReadyIUID;
+	CHECK ( UASParseStatusIU ( iu, 4, &info ) == true );
+
+	// Unknown IUs and runts
+	iu[0]	= 0x7F;
+	CHECK ( UASParseStatusIU ( iu, 4, &info ) == false );
+	CHECK ( UASParseStatusIU ( iu, 3, &info ) == false );
+
+}
+
+
+static void
+TestStatusRouting ( void )
+{
+
+	UASStatusIUInfo		info;
+	uint16_t			tmTag = UASTaskManagementTag ( kQueueDepth );
+
+	memset ( &info, 0, sizeof ( info ) );
+
+	// Without streams
+	info.iuID	= kUASSenseIUID;
+	info.tag	= UASTagForSlot ( 4 );
+	CHECK ( UASRouteStatusIU ( &info, true, 0, false, kQueueDepth ) == kUASRouteStatus );
+	CHECK ( UASRouteStatusIU ( &info, false, 0, false, kQueueDepth ) == kUASRouteStatus );
+
+	info.iuID	= kUASReadReadyIUID;
+	CHECK ( UASRouteStatusIU ( &info, true, 0, false, kQueueDepth ) == kUASRouteDataPhase );
+	info.iuID	= kUASWriteReadyIUID;
+	CHECK ( UASRouteStatusIU ( &info, true, 0, true, kQueueDepth ) == kUASRouteDataPhase );
+
+	// An IU that didn't parse fails the command instead of starting a data phase.
+	CHECK ( UASRouteStatusIU ( &info, false, 0, false, kQueueDepth ) == kUASRouteStatus );
+
+	info.iuID	= kUASResponseIUID;
+	info.tag	= tmTag;
+	CHECK ( UASRouteStatusIU ( &info, true, 0, true, kQueueDepth ) == kUASRouteTaskManagement );
+	CHECK ( UASRouteStatusIU ( &info, false, 0, true, kQueueDepth ) == kUASRouteTaskManagement );
+
+	// A late or stray response, and tags no command can have.
+	CHECK ( UASRouteStatusIU ( &info, true, 0, false, kQueueDepth ) == kUASRouteIgnore );
+	info.tag	= 0;
+	CHECK ( UASRouteStatusIU ( &info, true, 0, true, kQueueDepth ) == kUASRouteIgnore );
+	info.tag	= 0xFFFF;
+	CHECK ( UASRouteStatusIU ( &info, true, 0, false, kQueueDepth ) == kUASRouteIgnore );
+
+	// On a stream only the IU of its own command completes it.
+	info.iuID	= kUASSenseIUID;
+	info.tag	= UASTagForSlot ( 2 );
+	CHECK ( UASRouteStatusIU ( &info, true, UASTagForSlot ( 2 ), false, kQueueDepth ) == kUASRouteStatus );
+	CHECK ( UASRouteStatusIU ( &info, true, UASTagForSlot ( 3 ), false, kQueueDepth ) == kUASRouteProtocolError );
+	info.tag	= tmTag;
+	CHECK ( UASRouteStatusIU ( &info, true, UASTagForSlot ( 2 ), true, kQueueDepth ) == kUASRouteProtocolError );
+
+	// Ready IUs
+	CHECK ( UASReadyIUMatchesCommand ( kUASReadReadyIUID, true, true ) == true );
+	CHECK ( UASReadyIUMatchesCommand ( kUASWriteReadyIUID, true, false ) == true );
+	CHECK ( UASReadyIUMatchesCommand ( kUASWriteReadyIUID, true, true ) == false );
+	CHECK ( UASReadyIUMatchesCommand ( kUASReadReadyIUID, true, false ) == false );
+	CHECK ( UASReadyIUMatchesCommand ( kUASReadReadyIUID, false, true ) == false );
+
+	// Task management responses
+	info.iuID			= kUASResponseIUID;
+	info.responseCode	= kUASResponseTMFunctionComplete;
+	CHECK ( UASTaskManagementSucceeded ( &info, true ) == true );
+	CHECK ( UASTaskManagementSucceeded ( &info, false ) == false );
+	info.responseCode	= kUASResponseTMFunctionSucceeded;
+	CHECK ( UASTaskManagementSucceeded ( &info, true ) == true );
+	info.responseCode	= kUASResponseTMFunctionFailed;
+	CHECK ( UASTaskManagementSucceeded ( &info, true ) == false );
+	info.responseCode	= kUASResponseTMFunctionNotSupported;
+	CHECK ( UASTaskManagementSucceeded ( &info, true ) == false );
+	info.iuID			= kUASSenseIUID;
+	info.responseCode	= kUASResponseTMFunctionComplete;
+	CHECK ( UASTaskManagementSucceeded ( &info, true ) == false );
+
+}
+
+
+static void
+TestReportLUNsParsing ( void )
+{
+
+	uint8_t		cdb[kUASReportLUNsCDBSize];
+	uint8_t		data[kUASReportLUNsDataSize];
+
+	UASBuildReportLUNsCDB ( cdb );
+	CHECK ( cdb[0] == kUASReportLUNsOperationCode );
+	CHECK ( ReadBig32 ( &cdb[6] ) == kUASReportLUNsDataSize );
+	CHECK ( cdb[11] == 0 );
+
+	// LUNs 0, 1 and 3, one flat space LUN the Command IU can't address, and LUN 20
+	// which the admission queues have no room for.
+	memset ( data, 0, sizeof ( data ) );
+	data[3] = 5 * kUASReportLUNsEntrySize;
+	data[8 + 8 + 1]		= 1;
+	data[8 + 16 + 1]	= 3;
+	data[8 + 24 + 0]	= 0x40;
+	data[8 + 24 + 1]	= 9;
+	data[8 + 32 + 1]	= 20;
+
+	CHECK ( UASParseReportLUNs ( data, sizeof ( data ), 15 ) == 3 );
+	CHECK ( UASParseReportLUNs ( data, sizeof ( data ), 2 ) == 1 );
+
+	// A list cut short by the transfer only counts whole entries.
+	CHECK ( UASParseReportLUNs ( data, 8 + 16 + 4, 15 ) == 1 );
+	CHECK ( UASParseReportLUNs ( data, 4, 15 ) == 0 );
+
+	// An empty list still means LUN 0.
+	data[3] = 0;
+	CHECK ( UASParseReportLUNs ( data, sizeof ( data ), 15 ) == 0 );
+
+}
+
+
+static void
+TestOutOfOrderCompletion ( EmulatedTarget * target )
+{
+
+	uint8_t				iu[kUASCommandIUSize];
+	uint8_t				status[kUASMaxStatusIUSize];
+	uint8_t				cdb[16];
+	uint8_t				pattern[kBlockSize * 2];
+	UASStatusIUInfo		info;
+	bool				seen[kQueueDepth];
+	uint32_t			slot;
+	uint32_t			count;
+
+	memset ( seen, 0, sizeof ( seen ) );
+
+	for ( slot = 0; slot < sizeof ( pattern ); slot++ )
+	{
+		pattern[slot] = ( uint8_t ) ( slot * 7 );
+	}
+
+	// Fill every tag, each with a write to its own blocks on LUN 1.
+	for ( slot = 0; slot < kQueueDepth; slot++ )
+	{
+
+		memset ( cdb, 0, sizeof ( cdb ) );
+		BuildRead10 ( cdb, slot * 2, 2, kWrite10 );
+		UASBuildCommandIU ( iu, UASTagForSlot ( slot ), 1, cdb, 10 );
+		TargetReceiveIU ( target, iu, sizeof ( iu ) );
+
+	}
+
+	CHECK ( target->statusCount == 0 );
+
+	// Finish them in a scrambled order. Every status must map back to the slot which
+	// sent the command.
+	for ( count = 0; count < kQueueDepth; count++ )
+	{
+
+		uint16_t	tag = UASTagForSlot ( ( count * 13 ) % kQueueDepth );
+		uint32_t	length	= 0;
+		int			found;
+
+		TargetCompleteTask ( target, tag, pattern );
+
+		CHECK ( HostReadStatusIU ( target, status, &length ) == true );
+		CHECK ( UASParseStatusIU ( status, length, &info ) == true );
+		CHECK ( info.iuID == kUASWriteReadyIUID );
+
+		CHECK ( HostReadFinalStatus ( target, &info, status ) == true );
+		CHECK ( info.iuID == kUASSenseIUID );
+		CHECK ( info.taskStatus == kStatusGood );
+		CHECK ( info.senseLength == 0 );
+
+		found = UASSlotForTag ( info.tag, kQueueDepth );
+		CHECK ( found == ( int ) ( ( count * 13 ) % kQueueDepth ) );
+		if ( ( found >= 0 ) && ( found < kQueueDepth ) )
+		{
+
+			CHECK ( seen[found] == false );
+			seen[found] = true;
+
+		}
+
+	}
+
+	for ( slot = 0; slot < kQueueDepth; slot++ )
+	{
+		CHECK ( seen[slot] == true );
+	}
+
+	CHECK ( memcmp ( &target->media[1][( kQueueDepth - 1 ) * 2 * kBlockSize], pattern, sizeof ( pattern ) ) == 0 );
+	CHECK ( target->media[0][0] == 0 );
+
+	// And read one back.
+	BuildRead10 ( cdb, 6, 2, kRead10 );
+	UASBuildCommandIU ( iu, UASTagForSlot ( 5 ), 1, cdb, 10 );
+	TargetReceiveIU ( target, iu, sizeof ( iu ) );
+	TargetCompleteTask ( target, UASTagForSlot ( 5 ), NULL );
+	CHECK ( HostReadFinalStatus ( target, &info, status ) == true );
+	CHECK ( info.taskStatus == kStatusGood );
+	CHECK ( target->dataInLength == sizeof ( pattern ) );
+	CHECK ( memcmp ( target->dataIn, pattern, sizeof ( pattern ) ) == 0 );
+
+}
+
+
+static void
+TestRejectedIUs ( EmulatedTarget * target )
+{
+
+	uint8_t				iu[kUASCommandIUSize];
+	uint8_t				status[kUASMaxStatusIUSize];
+	uint8_t				cdb[16];
+	UASStatusIUInfo		info;
+
+	memset ( cdb, 0, sizeof ( cdb ) );
+
+	// Overlapped tag: the second command reuses an outstanding tag.
+	UASBuildCommandIU ( iu, UASTagForSlot ( 3 ), 0, cdb, 6 );
+	TargetReceiveIU ( target, iu, sizeof ( iu ) );
+	TargetReceiveIU ( target, iu, sizeof ( iu ) );
+	CHECK ( HostReadFinalStatus ( target, &info, status ) == true );
+	CHECK ( info.iuID == kUASResponseIUID );
+	CHECK ( info.tag == UASTagForSlot ( 3 ) );
+	CHECK ( info.responseCode == kUASResponseOverlappedTag );
+
+	TargetCompleteTask ( target, UASTagForSlot ( 3 ), NULL );
+	CHECK ( HostReadFinalStatus ( target, &info, status ) == true );
+	CHECK ( info.iuID == kUASSenseIUID );
+	CHECK ( info.taskStatus == kStatusGood );
+
+	// Incorrect LUN
+	UASBuildCommandIU ( iu, UASTagForSlot ( 0 ), kTargetLUNs, cdb, 6 );
+	TargetReceiveIU ( target, iu, sizeof ( iu ) );
+	CHECK ( HostReadFinalStatus ( target, &info, status ) == true );
+	CHECK ( info.iuID == kUASResponseIUID );
+	CHECK ( info.responseCode == kUASResponseIncorrectLUN );
+
+	// Invalid IU
+	iu[0] = 0x02;
+	TargetReceiveIU ( target, iu, sizeof ( iu ) );
+	CHECK ( HostReadFinalStatus ( target, &info, status ) == true );
+	CHECK ( info.responseCode == kUASResponseInvalidIU );
+
+	// An unsupported command gets CHECK CONDITION with its sense in the Sense IU.
+	cdb[0] = 0xFF;
+	UASBuildCommandIU ( iu, UASTagForSlot ( 1 ), 2, cdb, 6 );
+	TargetReceiveIU ( target, iu, sizeof ( iu ) );
+	TargetCompleteTask ( target, UASTagForSlot ( 1 ), NULL );
+	CHECK ( HostReadFinalStatus ( target, &info, status ) == true );
+	CHECK ( info.iuID == kUASSenseIUID );
+	CHECK ( info.taskStatus == kStatusCheckCondition );
+	CHECK ( info.senseLength == 18 );
+	CHECK ( ( status[kUASSenseIUHeaderSize + 2] & 0x0F ) == kSenseKeyIllegalRequest );
+	CHECK ( status[kUASSenseIUHeaderSize + 12] == kASCInvalidCommand );
+
+	// Past the end of the media
+	BuildRead10 ( cdb, kTargetBlocks - 1, 2, kRead10 );
+	UASBuildCommandIU ( iu, UASTagForSlot ( 1 ), 0, cdb, 10 );
+	TargetReceiveIU ( target, iu, sizeof ( iu ) );
+	TargetCompleteTask ( target, UASTagForSlot ( 1 ), NULL );
+	CHECK ( HostReadFinalStatus ( target, &info, status ) == true );
+	CHECK ( info.taskStatus == kStatusCheckCondition );
+	CHECK ( status[kUASSenseIUHeaderSize + 12] == kASCLBAOutOfRange );
+
+	CHECK ( target->statusCount == 0 );
+
+}
+
+
+static void
+TestAbortTask ( EmulatedTarget * target )
+{
+
+	uint8_t				iu[kUASCommandIUSize];
+	uint8_t				tmIU[kUASTaskManagementIUSize];
+	uint8_t				status[kUASMaxStatusIUSize];
+	uint8_t				cdb[16];
+	UASStatusIUInfo		info;
+	uint16_t			tmTag = UASTaskManagementTag ( kQueueDepth );
+
+	memset ( cdb, 0, sizeof ( cdb ) );
+
+	// Two commands outstanding; abort the first.
+	UASBuildCommandIU ( iu, UASTagForSlot ( 0 ), 0, cdb, 6 );
+	TargetReceiveIU ( target, iu, sizeof ( iu ) );
+	UASBuildCommandIU ( iu, UASTagForSlot ( 1 ), 0, cdb, 6 );
+	TargetReceiveIU ( target, iu, sizeof ( iu ) );
+
+	UASBuildTaskManagementIU ( tmIU, tmTag, kUASTaskManagementAbortTask, UASTagForSlot ( 0 ), 0 );
+	TargetReceiveIU ( target, tmIU, sizeof ( tmIU ) );
+
+	CHECK ( HostReadFinalStatus ( target, &info, status ) == true );
+	CHECK ( info.iuID == kUASResponseIUID );
+	CHECK ( info.tag == tmTag );
+	CHECK ( UASSlotForTag ( info.tag, kQueueDepth ) == -1 );
+	CHECK ( info.responseCode == kUASResponseTMFunctionComplete );
+
+	// The aborted task never reports status; the other one still does.
+	TargetCompleteTask ( target, UASTagForSlot ( 0 ), NULL );
+	CHECK ( target->statusCount == 0 );
+	TargetCompleteTask ( target, UASTagForSlot ( 1 ), NULL );
+	CHECK ( HostReadFinalStatus ( target, &info, status ) == true );
+	CHECK ( info.tag == UASTagForSlot ( 1 ) );
+	CHECK ( info.taskStatus == kStatusGood );
+
+	// The aborted tag can be used again.
+	UASBuildCommandIU ( iu, UASTagForSlot ( 0 ), 0, cdb, 6 );
+	TargetReceiveIU ( target, iu, sizeof ( iu ) );
+	TargetCompleteTask ( target, UASTagForSlot ( 0 ), NULL );
+	CHECK ( HostReadFinalStatus ( target, &info, status ) == true );
+	CHECK ( info.iuID == kUASSenseIUID );
+	CHECK ( info.tag == UASTagForSlot ( 0 ) );
+
+	// Other task management functions are refused.
+	UASBuildTaskManagementIU ( tmIU, tmTag, 0x02, UASTagForSlot ( 0 ), 0 );
+	TargetReceiveIU ( target, tmIU, sizeof ( tmIU ) );
+	CHECK ( HostReadFinalStatus ( target, &info, status ) == true );
+	CHECK ( info.responseCode == kUASResponseTMFunctionNotSupported );
+
+}
+
+
+static void
+TestReportLUNs ( EmulatedTarget * target )
+{
+
+	uint8_t				iu[kUASCommandIUSize];
+	uint8_t				status[kUASMaxStatusIUSize];
+	uint8_t				cdb[kUASReportLUNsCDBSize];
+	uint32_t			length	= 0;
+	UASStatusIUInfo		info;
+
+	// As UASReportLUNs ( ) sends it, on the first tag to LUN 0.
+	UASBuildReportLUNsCDB ( cdb );
+	UASBuildCommandIU ( iu, UASTagForSlot ( 0 ), 0, cdb, sizeof ( cdb ) );
+	TargetReceiveIU ( target, iu, sizeof ( iu ) );
+	TargetCompleteTask ( target, UASTagForSlot ( 0 ), NULL );
+
+	CHECK ( HostReadStatusIU ( target, status, &length ) == true );
+	CHECK ( UASParseStatusIU ( status, length, &info ) == true );
+	CHECK ( info.iuID == kUASReadReadyIUID );
+	CHECK ( info.tag == UASTagForSlot ( 0 ) );
+
+	CHECK ( HostReadFinalStatus ( target, &info, status ) == true );
+	CHECK ( info.iuID == kUASSenseIUID );
+	CHECK ( info.taskStatus == kStatusGood );
+
+	CHECK ( UASParseReportLUNs ( target->dataIn, target->dataInLength, 15 ) == kTargetLUNs - 1 );
+
+}
+
+
+static void
+TestEngineWithoutStreams ( EmulatedTarget * target )
+{
+
+	HostEngine *	engine = ( HostEngine * ) calloc ( 1, sizeof ( HostEngine ) );
+	uint8_t			cdb[16];
+	uint8_t			pattern[kBlockSize * 2];
+	uint32_t		index;
+
+	if ( engine == NULL )
+	{
+		exit ( 2 );
+	}
+
+	for ( index = 0; index < sizeof ( pattern ); index++ )
+	{
+		pattern[index] = ( uint8_t ) ( index * 3 );
+	}
+
+	EngineReset ( engine, target, false );
+
+	// A read, a write and a command without data, all outstanding at once.
+	BuildRead10 ( cdb, 8, 2, kWrite10 );
+	CHECK ( EngineSendCommand ( engine, target, 5, 2, cdb, 10, false, true ) == true );
+	BuildRead10 ( cdb, 8, 2, kRead10 );
+	CHECK ( EngineSendCommand ( engine, target, 2, 2, cdb, 10, true, true ) == true );
+	memset ( cdb, 0, sizeof ( cdb ) );
+	CHECK ( EngineSendCommand ( engine, target, 7, 2, cdb, 6, false, false ) == true );
+
+	CHECK ( engine->commands[5].dataPhaseNeeded == true );
+	CHECK ( engine->commands[2].dataPhaseNeeded == true );
+	CHECK ( engine->commands[7].dataPhaseNeeded == false );
+
+	// Every IU comes through the shared read, and each finds its own command.
+	TargetCompleteTask ( target, UASTagForSlot ( 7 ), NULL );
+	TargetCompleteTask ( target, UASTagForSlot ( 5 ), pattern );
+	TargetCompleteTask ( target, UASTagForSlot ( 2 ), NULL );
+	EngineRunStatusPipe ( engine, target );
+
+	for ( index = 0; index < kQueueDepth; index++ )
+	{
+
+		HostCommand *	command = &engine->commands[index];
+
+		if ( ( index == 2 ) || ( index == 5 ) || ( index == 7 ) )
+		{
+
+			CHECK ( command->statusReceived == true );
+			CHECK ( command->failed == false );
+			CHECK ( command->taskStatus == kStatusGood );
+			CHECK ( command->dataPhaseNeeded == false );
+			CHECK ( command->dataPhases == ( ( index == 7 ) ? 0U : 1U ) );
+
+		}
+
+		else
+		{
+			CHECK ( command->statusReceived == false );
+		}
+
+	}
+
+	CHECK ( memcmp ( target->dataIn, pattern, sizeof ( pattern ) ) == 0 );
+	CHECK ( engine->recoveries == 0 );
+	CHECK ( engine->ignored == 0 );
+
+	// A rejected command completes with an error, not a SCSI status.
+	CHECK ( EngineSendCommand ( engine, target, 3, kTargetLUNs, cdb, 6, false, false ) == true );
+	EngineRunStatusPipe ( engine, target );
+	CHECK ( engine->commands[3].statusReceived == true );
+	CHECK ( engine->commands[3].failed == true );
+
+	// Status for a tag nothing waits on any more, or no command can have, is dropped.
+	QueueSenseIU ( target, UASTagForSlot ( 7 ), kStatusGood, 0, 0 );
+	QueueSenseIU ( target, 0, kStatusGood, 0, 0 );
+	QueueResponseIU ( target, UASTaskManagementTag ( kQueueDepth ), kUASResponseTMFunctionComplete );
+	EngineRunStatusPipe ( engine, target );
+	CHECK ( engine->ignored == 3 );
+	CHECK ( engine->recoveries == 0 );
+
+	// A CDB the Command IU can't carry never reaches the target.
+	memset ( cdb, 0, sizeof ( cdb ) );
+	CHECK ( EngineSendCommand ( engine, target, 9, 0, cdb, 17, false, false ) == false );
+	CHECK ( engine->commands[9].active == false );
+	CHECK ( target->tasks[UASTagForSlot ( 9 )].active == false );
+
+	free ( engine );
+
+}
+
+
+static void
+TestEngineReadyIUs ( EmulatedTarget * target )
+{
+
+	HostEngine *	engine = ( HostEngine * ) calloc ( 1, sizeof ( HostEngine ) );
+	uint8_t			cdb[16];
+
+	if ( engine == NULL )
+	{
+		exit ( 2 );
+	}
+
+	EngineReset ( engine, target, false );
+
+	// Write Ready for a read must not start a write.
+	BuildRead10 ( cdb, 0, 1, kRead10 );
+	CHECK ( EngineSendCommand ( engine, target, 1, 0, cdb, 10, true, true ) == true );
+	QueueReadyIU ( target, UASTagForSlot ( 1 ), kUASWriteReadyIUID );
+	EngineRunStatusPipe ( engine, target );
+	CHECK ( engine->recoveries == 1 );
+	CHECK ( engine->commands[1].dataPhases == 0 );
+	CHECK ( engine->commands[1].dataPhaseNeeded == true );
+
+	// The right one starts it, a second one is refused.
+	QueueReadyIU ( target, UASTagForSlot ( 1 ), kUASReadReadyIUID );
+	QueueReadyIU ( target, UASTagForSlot ( 1 ), kUASReadReadyIUID );
+	EngineRunStatusPipe ( engine, target );
+	CHECK ( engine->commands[1].dataPhases == 1 );
+	CHECK ( engine->recoveries == 2 );
+
+	// Read Ready for a write, and a Ready IU for a command without data.
+	BuildRead10 ( cdb, 0, 1, kWrite10 );
+	CHECK ( EngineSendCommand ( engine, target, 2, 0, cdb, 10, false, true ) == true );
+	memset ( cdb, 0, sizeof ( cdb ) );
+	CHECK ( EngineSendCommand ( engine, target, 3, 0, cdb, 6, false, false ) == true );
+	QueueReadyIU ( target, UASTagForSlot ( 2 ), kUASReadReadyIUID );
+	QueueReadyIU ( target, UASTagForSlot ( 3 ), kUASWriteReadyIUID );
+	EngineRunStatusPipe ( engine, target );
+	CHECK ( engine->recoveries == 4 );
+	CHECK ( engine->commands[2].dataPhases == 0 );
+	CHECK ( engine->commands[3].dataPhases == 0 );
+
+	// The commands are still waiting on their status.
+	CHECK ( engine->commands[1].statusReceived == false );
+	CHECK ( engine->commands[2].statusReceived == false );
+	CHECK ( engine->commands[3].statusReceived == false );
+
+	free ( engine );
+
+}
+
+
+static void
+TestEngineWithStreams ( EmulatedTarget * target )
+{
+
+	HostEngine *	engine = ( HostEngine * ) calloc ( 1, sizeof ( HostEngine ) );
+	uint8_t			iu[kUASMaxStatusIUSize];
+	uint8_t			cdb[16];
+	uint8_t			pattern[kBlockSize];
+	uint32_t		length;
+
+	if ( engine == NULL )
+	{
+		exit ( 2 );
+	}
+
+	memset ( pattern, 0x5A, sizeof ( pattern ) );
+
+	EngineReset ( engine, target, true );
+
+	// The data phases are queued with the commands, nothing waits on a Ready IU.
+	BuildRead10 ( cdb, 20, 1, kWrite10 );
+	CHECK ( EngineSendCommand ( engine, target, 0, 1, cdb, 10, false, true ) == true );
+	BuildRead10 ( cdb, 20, 1, kRead10 );
+	CHECK ( EngineSendCommand ( engine, target, 1, 1, cdb, 10, true, true ) == true );
+	CHECK ( engine->commands[0].dataPhaseNeeded == false );
+	CHECK ( engine->commands[1].dataPhaseNeeded == false );
+
+	TargetCompleteTask ( target, UASTagForSlot ( 0 ), pattern );
+	TargetCompleteTask ( target, UASTagForSlot ( 1 ), NULL );
+	CHECK ( target->statusCount == 2 );
+	EngineRunStatusPipe ( engine, target );
+
+	CHECK ( engine->commands[0].statusReceived == true );
+	CHECK ( engine->commands[0].failed == false );
+	CHECK ( engine->commands[1].statusReceived == true );
+	CHECK ( engine->commands[1].failed == false );
+	CHECK ( engine->commands[1].dataPhases == 0 );
+	CHECK ( memcmp ( target->dataIn, pattern, sizeof ( pattern ) ) == 0 );
+	CHECK ( engine->recoveries == 0 );
+
+	// Status for another command on a stream is a protocol error, and completes neither.
+	memset ( cdb, 0, sizeof ( cdb ) );
+	CHECK ( EngineSendCommand ( engine, target, 4, 0, cdb, 6, false, false ) == true );
+	CHECK ( EngineSendCommand ( engine, target, 5, 0, cdb, 6, false, false ) == true );
+	TargetCompleteTask ( target, UASTagForSlot ( 5 ), NULL );
+	CHECK ( HostReadStatusIU ( target, iu, &length ) == true );
+	EngineStatusIU ( engine, iu, length, UASTagForSlot ( 4 ) );
+	CHECK ( engine->recoveries == 1 );
+	CHECK ( engine->commands[4].statusReceived == false );
+	CHECK ( engine->commands[5].statusReceived == false );
+
+	// On its own stream it completes the command.
+	EngineStatusIU ( engine, iu, length, UASTagForSlot ( 5 ) );
+	CHECK ( engine->commands[5].statusReceived == true );
+	CHECK ( engine->commands[5].failed == false );
+
+	// A Ready IU on a stream is not status, and fails the command.
+	memset ( iu, 0, sizeof ( iu ) );
+	iu[kUASIUIDOffset]			= kUASReadReadyIUID;
+	iu[kUASIUTagOffset]			= ( uint8_t ) ( UASTagForSlot ( 4 ) >> 8 );
+	iu[kUASIUTagOffset + 1]		= ( uint8_t ) UASTagForSlot ( 4 );
+	EngineStatusIU ( engine, iu, 4, UASTagForSlot ( 4 ) );
+	CHECK ( engine->commands[4].statusReceived == true );
+	CHECK ( engine->commands[4].failed == true );
+	CHECK ( engine->recoveries == 1 );
+
+	free ( engine );
+
+}
+
+
+static void
+TestEngineAbortTask ( EmulatedTarget * target )
+{
+
+	HostEngine *	engine = ( HostEngine * ) calloc ( 1, sizeof ( HostEngine ) );
+	uint8_t			cdb[16];
+
+	if ( engine == NULL )
+	{
+		exit ( 2 );
+	}
+
+	EngineReset ( engine, target, false );
+	memset ( cdb, 0, sizeof ( cdb ) );
+
+	// Abort one of two outstanding commands. The other still completes.
+	CHECK ( EngineSendCommand ( engine, target, 0, 0, cdb, 6, false, false ) == true );
+	CHECK ( EngineSendCommand ( engine, target, 1, 0, cdb, 6, false, false ) == true );
+	EngineAbortTask ( engine, target, 0 );
+	EngineRunStatusPipe ( engine, target );
+
+	CHECK ( engine->taskManagementPending == false );
+	CHECK ( engine->commands[0].abortRequested == false );
+	CHECK ( engine->commands[0].aborted == true );
+	CHECK ( engine->recoveries == 0 );
+
+	TargetCompleteTask ( target, UASTagForSlot ( 0 ), NULL );
+	TargetCompleteTask ( target, UASTagForSlot ( 1 ), NULL );
+	EngineRunStatusPipe ( engine, target );
+	CHECK ( engine->commands[0].statusReceived == false );
+	CHECK ( engine->commands[1].statusReceived == true );
+
+	// Status that crossed the ABORT TASK on the wire is dropped.
+	QueueSenseIU ( target, UASTagForSlot ( 0 ), kStatusGood, 0, 0 );
+	EngineRunStatusPipe ( engine, target );
+	CHECK ( engine->commands[0].statusReceived == false );
+	CHECK ( engine->ignored == 1 );
+
+	// A refused abort leaves the command to recovery.
+	CHECK ( EngineSendCommand ( engine, target, 2, 0, cdb, 6, false, false ) == true );
+	engine->commands[2].abortRequested	= true;
+	engine->taskManagementPending		= true;
+	engine->taskManagementTaskTag		= UASTagForSlot ( 2 );
+	QueueResponseIU ( target, UASTaskManagementTag ( kQueueDepth ), kUASResponseTMFunctionFailed );
+	EngineRunStatusPipe ( engine, target );
+	CHECK ( engine->taskManagementPending == false );
+	CHECK ( engine->commands[2].aborted == false );
+	CHECK ( engine->recoveries == 1 );
+
+	// So does one the response of which is a Sense IU.
+	engine->commands[2].abortRequested	= true;
+	engine->taskManagementPending		= true;
+	QueueSenseIU ( target, UASTaskManagementTag ( kQueueDepth ), kStatusGood, 0, 0 );
+	EngineRunStatusPipe ( engine, target );
+	CHECK ( engine->commands[2].aborted == false );
+	CHECK ( engine->recoveries == 2 );
+
+	// With streams the response still comes through the shared read.
+	EngineReset ( engine, target, true );
+	CHECK ( EngineSendCommand ( engine, target, 6, 0, cdb, 6, false, false ) == true );
+	EngineAbortTask ( engine, target, 6 );
+	EngineRunStatusPipe ( engine, target );
+	CHECK ( engine->commands[6].aborted == true );
+	CHECK ( engine->recoveries == 0 );
+	CHECK ( target->tasks[UASTagForSlot ( 6 )].active == false );
+
+	free ( engine );
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	main
+//-----------------------------------------------------------------------------
+
+int
+main ( int argc, const char * argv[] )
+{
+
+	EmulatedTarget *	target;
+
+	( void ) argc;
+	( void ) argv;
+
+	target = ( EmulatedTarget * ) calloc ( 1, sizeof ( EmulatedTarget ) );
+	if ( target == NULL )
+	{
+		return 2;
+	}
+
+	TestCommandIU ( );
+	TestTaskManagementIU ( );
+	TestTags ( );
+	TestStatusParsing ( );
+	TestStatusRouting ( );
+	TestReportLUNsParsing ( );
+	TestOutOfOrderCompletion ( target );
+	TestRejectedIUs ( target );
+	TestAbortTask ( target );
+	TestReportLUNs ( target );
+	TestEngineWithoutStreams ( target );
+	TestEngineReadyIUs ( target );
+	TestEngineWithStreams ( target );
+	TestEngineAbortTask ( target );
+
+	free ( target );
+
+	printf ( "%d checks, %d failed\n", gChecks, gFailures );
+
+	return ( gFailures == 0 ) ? 0 : 1;
+
+}
@@ -0,0 +1,495 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+Checks the UFI driver's media polling backoff and the arithmetic that splits reads
+and writes into commands, from the same header the driver builds them from. Split
+requests are run against an emulated medium, so a command sent with the wrong part
+of the client's buffer shows up as corrupted data. Exits non-zero on failure:
+g++ -W -Wall -Wextra -O2 -o UFIPolicyTests UFIPolicyTests.cpp
+./UFIPolicyTests
+*/
+
+
+//-----------------------------------------------------------------------------
+//	Includes
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../IOUSBMassStorageUFIPolicy.h"
+
+
+//-----------------------------------------------------------------------------
+//	Constants
+//-----------------------------------------------------------------------------
+
+#define kMediumBlocks					2048
+#define kBlockSize						512
+#define kMaxCommands					( kMediumBlocks + 1 )
+
+
+//-----------------------------------------------------------------------------
+//	Structures
+//-----------------------------------------------------------------------------
+
+// One READ as the driver would send it. A command that goes out with the client's
+// buffer has no sub-descriptor, so its data lands at offset 0.
+typedef struct EmulatedCommand
+{
+	uint64_t			block;
+	uint64_t			blocks;
+	uint64_t			offset;
+	bool				clientBuffer;
+} EmulatedCommand;
+
+
+//-----------------------------------------------------------------------------
+//	Globals
+//-----------------------------------------------------------------------------
+
+static int				gFailures	= 0;
+static int				gChecks		= 0;
+
+
+//-----------------------------------------------------------------------------
+//	Macros
+//-----------------------------------------------------------------------------
+
+#define CHECK(x)																\
+	do																			\
+	{																			\
+		gChecks++;																\
+		if ( !( x ) )															\
+		{																		\
+			gFailures++;														\
+			fprintf ( stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x );	\
+		}																		\
+	} while ( 0 )
+
+
+//-----------------------------------------------------------------------------
+//	Emulated driver
+//-----------------------------------------------------------------------------
+
+// Splits a request the way IssueSyncReadWrite ( ) and IssueSplitCommand ( ) do.
+// Returns the number of commands.
+static uint32_t
+SplitRequest ( uint64_t				startBlock,
+			   uint64_t				blockCount,
+			   uint64_t				maxBlockCount,
+			   EmulatedCommand *	commands )
+{
+
+	bool		split	= UFIRequestIsSplit ( blockCount, maxBlockCount );
+	uint64_t	offset	= 0;
+	uint32_t	count	= 0;
+
+	while ( ( blockCount > 0 ) && ( count < kMaxCommands ) )
+	{
+
+		commands[count].block			= startBlock;
+		commands[count].blocks			= UFICommandBlocks ( blockCount, maxBlockCount );
+		commands[count].offset			= offset;
+		commands[count].clientBuffer	= ( split == false );
+
+		startBlock	+= commands[count].blocks;
+		blockCount	-= commands[count].blocks;
+		offset		+= commands[count].blocks * kBlockSize;
+		count++;
+
+	}
+
+	return count;
+
+}
+
+
+// Runs the commands of a read against the medium. Returns false if the client's
+// buffer does not hold the blocks it asked for.
+static bool
+ReadFromMedium ( const uint8_t *			medium,
+				 uint64_t					startBlock,
+				 uint64_t					blockCount,
+				 const EmulatedCommand *	commands,
+				 uint32_t					count )
+{
+
+	uint8_t *	buffer	= NULL;
+	bool		result	= false;
+	uint32_t	index;
+
+	buffer = ( uint8_t * ) calloc ( blockCount, kBlockSize );
+	if ( buffer == NULL )
+	{
+		return false;
+	}
+
+	for ( index = 0; index < count; index++ )
+	{
+
+		uint64_t	offset = commands[index].clientBuffer ? 0 : commands[index].offset;
+
+		if ( ( offset + ( commands[index].blocks * kBlockSize ) ) > ( blockCount * kBlockSize ) )
+		{
+			goto Exit;
+		}
+
+		memcpy ( &buffer[offset], &medium[commands[index].block * kBlockSize], commands[index].blocks * kBlockSize );
+
+	}
+
+	result = ( memcmp ( buffer, &medium[startBlock * kBlockSize], blockCount * kBlockSize ) == 0 );
+
+
+Exit:
+
+
+	free ( buffer );
+	return result;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	Polling tests
+//-----------------------------------------------------------------------------
+
+// Polls count times and checks each interval against expected.
+static void
+CheckIntervals ( UFIPollingPolicy * policy, bool newMedia, const uint32_t * expected, uint32_t count )
+{
+
+	uint32_t	index;
+	uint32_t	interval;
+
+	for ( index = 0; index < count; index++ )
+	{
+
+		interval = UFINextPollingInterval ( policy, newMedia );
+		if ( interval != expected[index] )
+		{
+			fprintf ( stderr, "poll %u: %u ms, expected %u ms\n", index, interval, expected[index] );
+		}
+
+		CHECK ( interval == expected[index] );
+
+	}
+
+}
+
+
+static void
+TestPolledDevice ( void )
+{
+
+	UFIPollingPolicy	policy;
+	const uint32_t		expected[] = { 1000, 1000, 1000, 1000, 1000, 1000, 2000, 4000, 4000, 4000 };
+
+	// Without media change events both ceilings are 4 seconds, and stay there even if
+	// something reports an event.
+	UFIInitPollingPolicy ( &policy, false );
+	UFIClampPollingPolicy ( &policy );
+	CHECK ( policy.minimumInterval == kPollIntervalMinimum );
+	CHECK ( policy.maximumInterval == kPollIntervalMaximum );
+	CHECK ( policy.newMediaMaximumInterval == kPollIntervalMaximum );
+	CHECK ( policy.fastPolls == kPollFastCount );
+	UFINoteMediaChangeEvent ( &policy );
+	CHECK ( policy.maximumInterval == kPollIntervalMaximum );
+
+	// kPollFastCount polls at the minimum, then doubling up to the ceiling.
+	UFIResetPollingInterval ( &policy );
+	CheckIntervals ( &policy, false, expected, sizeof ( expected ) / sizeof ( expected[0] ) );
+
+	UFIResetPollingInterval ( &policy );
+	CheckIntervals ( &policy, true, expected, sizeof ( expected ) / sizeof ( expected[0] ) );
+
+}
+
+
+static void
+TestMediaChangeEvents ( void )
+{
+
+	UFIPollingPolicy	policy;
+	const uint32_t		polled[]	= { 1000, 1000, 1000, 1000, 1000, 1000, 2000, 4000, 4000, 4000 };
+	const uint32_t		removal[]	= { 1000, 1000, 1000, 1000, 1000, 1000, 2000, 4000, 8000, 16000, 16000 };
+	const uint32_t		newMedia[]	= { 4000, 4000, 4000 };
+	const uint32_t		reset[]		= { 1000, 1000, 1000, 1000, 1000, 1000, 2000, 4000, 4000 };
+
+	UFIInitPollingPolicy ( &policy, true );
+	UFIClampPollingPolicy ( &policy );
+	CHECK ( policy.maximumInterval == kPollIntervalMaximum );
+	CHECK ( policy.newMediaMaximumInterval == kPollIntervalMaximum );
+	CHECK ( policy.eventMaximumInterval == kPollIntervalMaximumMediaEvents );
+
+	// Until the device has reported a change it is polled like one without events.
+	UFIResetPollingInterval ( &policy );
+	CheckIntervals ( &policy, false, polled, sizeof ( polled ) / sizeof ( polled[0] ) );
+
+	// After the first event the poll for removal backs off to 16 seconds.
+	UFINoteMediaChangeEvent ( &policy );
+	CHECK ( policy.maximumInterval == kPollIntervalMaximumMediaEvents );
+	CHECK ( policy.newMediaMaximumInterval == kPollIntervalMaximum );
+	UFIResetPollingInterval ( &policy );
+	CheckIntervals ( &policy, false, removal, sizeof ( removal ) / sizeof ( removal[0] ) );
+
+	// Once the medium is gone the poll for new media comes straight back to 4 seconds,
+	// without waiting out the 16 it had backed off to.
+	CheckIntervals ( &policy, true, newMedia, sizeof ( newMedia ) / sizeof ( newMedia[0] ) );
+
+	// Activity starts over from the minimum, still capped at 4 seconds.
+	UFIResetPollingInterval ( &policy );
+	CheckIntervals ( &policy, true, reset, sizeof ( reset ) / sizeof ( reset[0] ) );
+
+}
+
+
+static void
+TestPersonalityOverrides ( void )
+{
+
+	UFIPollingPolicy	policy;
+	const uint32_t		odd[] = { 300, 600, 1000, 1000 };
+	uint32_t			index;
+	uint32_t			interval;
+
+	// Below the floor.
+	UFIInitPollingPolicy ( &policy, false );
+	policy.minimumInterval = 10;
+	UFIClampPollingPolicy ( &policy );
+	CHECK ( policy.minimumInterval == kPollIntervalFloor );
+
+	// A maximum below the minimum.
+	UFIInitPollingPolicy ( &policy, true );
+	policy.minimumInterval			= 2000;
+	policy.maximumInterval			= 500;
+	policy.newMediaMaximumInterval	= 500;
+	UFIClampPollingPolicy ( &policy );
+	CHECK ( policy.maximumInterval == 2000 );
+	CHECK ( policy.newMediaMaximumInterval == 2000 );
+
+	// A personality MaxInterval sets every ceiling, as InitializePollingPolicy ( ) does,
+	// and an event does not move it.
+	UFIInitPollingPolicy ( &policy, true );
+	policy.maximumInterval			= 30000;
+	policy.newMediaMaximumInterval	= 30000;
+	policy.eventMaximumInterval		= 30000;
+	UFIClampPollingPolicy ( &policy );
+	CHECK ( policy.maximumInterval == 30000 );
+	CHECK ( policy.newMediaMaximumInterval == 30000 );
+	UFINoteMediaChangeEvent ( &policy );
+	CHECK ( policy.maximumInterval == 30000 );
+
+	// The event ceiling is never below the other one.
+	UFIInitPollingPolicy ( &policy, true );
+	policy.maximumInterval			= 20000;
+	UFIClampPollingPolicy ( &policy );
+	CHECK ( policy.eventMaximumInterval == 20000 );
+
+	// The new media ceiling never goes above the other one.
+	UFIInitPollingPolicy ( &policy, true );
+	policy.maximumInterval = 2000;
+	UFIClampPollingPolicy ( &policy );
+	CHECK ( policy.newMediaMaximumInterval == 2000 );
+
+	// A ceiling that is not a power of two times the minimum, and no fast polls.
+	UFIInitPollingPolicy ( &policy, false );
+	policy.minimumInterval	= 300;
+	policy.maximumInterval	= 1000;
+	policy.fastPolls		= 0;
+	UFIClampPollingPolicy ( &policy );
+	UFIResetPollingInterval ( &policy );
+	CheckIntervals ( &policy, false, odd, sizeof ( odd ) / sizeof ( odd[0] ) );
+
+	// However long it idles, the interval stays between the minimum and the ceiling.
+	UFIInitPollingPolicy ( &policy, true );
+	UFIClampPollingPolicy ( &policy );
+	UFINoteMediaChangeEvent ( &policy );
+	UFIResetPollingInterval ( &policy );
+	for ( index = 0; index < 1000; index++ )
+	{
+
+		interval = UFINextPollingInterval ( &policy, ( index % 7 ) == 0 );
+		CHECK ( interval >= policy.minimumInterval );
+		CHECK ( interval <= ( ( ( index % 7 ) == 0 ) ? policy.newMediaMaximumInterval : policy.maximumInterval ) );
+
+	}
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	Split tests
+//-----------------------------------------------------------------------------
+
+static void
+TestMaxBlocksPerCommand ( void )
+{
+
+	CHECK ( UFIMaxBlocksPerCommand ( kMaxCommandByteCountDefault, 512 ) == 128 );
+	CHECK ( UFIMaxBlocksPerCommand ( kMaxCommandByteCountDefault, 2048 ) == 32 );
+	CHECK ( UFIMaxBlocksPerCommand ( 65535, 512 ) == 127 );
+
+	// Never less than a block, even before the block size is known.
+	CHECK ( UFIMaxBlocksPerCommand ( kMaxCommandByteCountDefault, 0 ) == 1 );
+	CHECK ( UFIMaxBlocksPerCommand ( 100, 512 ) == 1 );
+
+	// Never more than READ_12 can express.
+	CHECK ( UFIMaxBlocksPerCommand ( 0xFFFFFFFF, 1 ) == 0xFFFFFFFF );
+
+	CHECK ( UFIRequestIsAddressable ( 0, 1 ) == true );
+	CHECK ( UFIRequestIsAddressable ( 0xFFFFFFFF, 1 ) == true );
+	CHECK ( UFIRequestIsAddressable ( 0xFFFFFFFF, 2 ) == false );
+	CHECK ( UFIRequestIsAddressable ( 0, 0x100000000ULL ) == true );
+	CHECK ( UFIRequestIsAddressable ( 1, 0x100000000ULL ) == false );
+
+}
+
+
+static void
+TestSplitRequests ( uint8_t * medium )
+{
+
+	static EmulatedCommand	commands[kMaxCommands];
+	const uint64_t			sizes[]		= { 1, 2, 127, 128, 129, 255, 256, 257, 300, 1000, 2048 };
+	const uint64_t			starts[]	= { 0, 1, 7 };
+	const uint64_t			maxBlocks[]	= { 1, 3, 128 };
+	uint32_t				count;
+	uint32_t				index;
+	uint32_t				size;
+	uint32_t				start;
+	uint32_t				limit;
+	uint64_t				covered;
+
+	for ( limit = 0; limit < sizeof ( maxBlocks ) / sizeof ( maxBlocks[0] ); limit++ )
+	{
+
+		for ( size = 0; size < sizeof ( sizes ) / sizeof ( sizes[0] ); size++ )
+		{
+
+			for ( start = 0; start < sizeof ( starts ) / sizeof ( starts[0] ); start++ )
+			{
+
+				if ( ( starts[start] + sizes[size] ) > kMediumBlocks )
+				{
+					continue;
+				}
+
+				count	= SplitRequest ( starts[start], sizes[size], maxBlocks[limit], commands );
+				covered	= 0;
+
+				CHECK ( count == ( sizes[size] + maxBlocks[limit] - 1 ) / maxBlocks[limit] );
+
+				for ( index = 0; index < count; index++ )
+				{
+
+					// Back to back, in order, none larger than allowed.
+					CHECK ( commands[index].blocks > 0 );
+					CHECK ( commands[index].blocks <= maxBlocks[limit] );
+					CHECK ( commands[index].block == starts[start] + covered );
+					CHECK ( commands[index].offset == covered * kBlockSize );
+
+					// Only a request of one command uses the client's buffer as it is.
+					CHECK ( commands[index].clientBuffer == ( count == 1 ) );
+
+					covered += commands[index].blocks;
+
+				}
+
+				CHECK ( covered == sizes[size] );
+				CHECK ( ReadFromMedium ( medium, starts[start], sizes[size], commands, count ) == true );
+
+			}
+
+		}
+
+	}
+
+}
+
+
+// The last command of a split request must get its own part of the buffer too, even
+// though the blocks left then fit in one command.
+static void
+TestLastCommandOfSplit ( uint8_t * medium )
+{
+
+	EmulatedCommand		commands[2];
+
+	CHECK ( SplitRequest ( 16, 200, 128, commands ) == 2 );
+	CHECK ( commands[1].blocks == 72 );
+	CHECK ( commands[1].offset == 128 * kBlockSize );
+	CHECK ( commands[1].clientBuffer == false );
+	CHECK ( ReadFromMedium ( medium, 16, 200, commands, 2 ) == true );
+
+	// Sent with the client's buffer it would overwrite the first 72 blocks.
+	commands[1].clientBuffer = true;
+	CHECK ( ReadFromMedium ( medium, 16, 200, commands, 2 ) == false );
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	main
+//-----------------------------------------------------------------------------
+
+int
+main ( int argc, const char * argv[] )
+{
+
+	uint8_t *	medium;
+	uint32_t	index;
+
+	( void ) argc;
+	( void ) argv;
+
+	medium = ( uint8_t * ) malloc ( kMediumBlocks * kBlockSize );
+	if ( medium == NULL )
+	{
+		return 2;
+	}
+
+	// Every block different from every other.
+	for ( index = 0; index < kMediumBlocks * kBlockSize; index++ )
+	{
+		medium[index] = ( uint8_t ) ( ( index / kBlockSize ) ^ ( index * 31 ) ^ ( index >> 16 ) );
+	}
+
+	TestPolledDevice ( );
+	TestMediaChangeEvents ( );
+	TestPersonalityOverrides ( );
+	TestMaxBlocksPerCommand ( );
+	TestSplitRequests ( medium );
+	TestLastCommandOfSplit ( medium );
+
+	free ( medium );
+
+	printf ( "%d checks, %d failed\n", gChecks, gFailures );
+
+	return ( gFailures == 0 ) ? 0 : 1;
+
+}
@@ -0,0 +1,479 @@
+/*
+ * Copyright (c) 2008-2009 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * "Portions Copyright (c) 1999 Apple Inc.  All Rights
+ * Reserved.  This file contains Original Code and/or Modifications of
+ * Original Code as defined in and that are subject to the Apple Public
+ * Source License Version 1.0 (the 'License').	You may not use this file
+ * except in compliance with the License.  Please obtain a copy of the
+ * License at http://www.apple.com/publicsource and read it before using
+ * this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE OR NON-INFRINGEMENT.  Please see the
+ * License for the specific language governing rights and limitations
+ * under the License."
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+Measures the per-I/O task overhead of IOUSBMassStorageUFIDevice on an emulated
+UFI device, which completes every READ_10 as soon as it is sent. Each I/O takes
+a task, builds the CDB, sends it, checks the completion and gives the task back,
+first with a task allocated and freed per I/O as GetSCSITask ( ) and
+ReleaseSCSITask ( ) do, then with the lock free task pool the driver now uses.
+Every thread keeps [depth] I/Os outstanding, and threads * depth may not be
+more than the pool holds:
+g++ -W -Wall -O2 -pthread -o UFITaskPoolBenchmark UFITaskPoolBenchmark.cpp
+./UFITaskPoolBenchmark [iterations] [threads] [depth]
+*/
+
+
+//-----------------------------------------------------------------------------
+//	Includes
+//-----------------------------------------------------------------------------
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/time.h>
+
+
+//-----------------------------------------------------------------------------
+//	Constants
+//-----------------------------------------------------------------------------
+
+#define kDefaultIterations				10000000
+#define kDefaultThreads					1
+#define kDefaultDepth					4
+#define kMaxDepth						16
+
+// As in IOUSBMassStorageUFISubclass.h
+#define kUFITaskPoolSize				16
+
+#define kBlockSize						512
+#define kBlocksPerIO					128
+
+
+//-----------------------------------------------------------------------------
+//	Structures
+//-----------------------------------------------------------------------------
+
+// Roughly the state a SCSITask carries for one command.
+typedef struct EmulatedTask
+{
+	void *				owner;
+	void *				dataBuffer;
+	void *				clientData;
+	uint64_t			requestedByteCount;
+	uint64_t			realizedByteCount;
+	uint32_t			timeout;
+	uint8_t				cdb[16];
+	uint8_t				cdbSize;
+	uint8_t				direction;
+	uint8_t				serviceResponse;
+	uint8_t				taskStatus;
+	uint8_t				senseData[18];
+	bool				autosenseValid;
+	uint64_t			reserved[24];
+} EmulatedTask;
+
+typedef struct EmulatedDevice
+{
+	EmulatedTask *		taskPool[kUFITaskPoolSize];
+	volatile uint32_t	taskPoolFreeMask;
+	volatile int32_t	taskPoolWaiters;
+	pthread_mutex_t		taskPoolLock;
+	pthread_cond_t		taskPoolCondition;
+	volatile uint64_t	commandsCompleted;
+	uint8_t				buffer[kBlockSize * kBlocksPerIO];
+} EmulatedDevice;
+
+typedef EmulatedTask * ( * GetTaskFunction ) ( EmulatedDevice * inDevice );
+typedef void ( * ReleaseTaskFunction ) ( EmulatedDevice * inDevice, EmulatedTask * inTask );
+
+typedef struct BenchmarkThread
+{
+	pthread_t				thread;
+	EmulatedDevice *		device;
+	GetTaskFunction			getTask;
+	ReleaseTaskFunction		releaseTask;
+	uint64_t				iterations;
+	unsigned int			depth;
+	uint64_t				failures;
+} BenchmarkThread;
+
+
+//-----------------------------------------------------------------------------
+//	Task allocation, before and after
+//-----------------------------------------------------------------------------
+
+static EmulatedTask *
+AllocatedGetTask ( EmulatedDevice * inDevice )
+{
+
+	EmulatedTask *	task = ( EmulatedTask * ) calloc ( 1, sizeof ( EmulatedTask ) );
+
+	if ( task != NULL )
+	{
+		task->owner = inDevice;
+	}
+
+	return task;
+
+}
+
+
+static void
+AllocatedReleaseTask ( EmulatedDevice * inDevice, EmulatedTask * inTask )
+{
+
+	( void ) inDevice;
+	free ( inTask );
+
+}
+
+
+static EmulatedTask *
+PooledGetTask ( EmulatedDevice * inDevice )
+{
+
+	uint32_t		mask;
+	unsigned int	index;
+
+	for ( ;; )
+	{
+
+		// One load and one compare and swap for the lowest free task.
+		mask = inDevice->taskPoolFreeMask;
+		while ( mask != 0 )
+		{
+
+			index = __builtin_ffs ( mask ) - 1;
+			if ( __sync_bool_compare_and_swap ( &inDevice->taskPoolFreeMask, mask, mask & ~( 1 << index ) ) )
+			{
+				return inDevice->taskPool[index];
+			}
+
+			mask = inDevice->taskPoolFreeMask;
+
+		}
+
+		// The driver waits for a completion rather than allocating.
+		pthread_mutex_lock ( &inDevice->taskPoolLock );
+		__sync_fetch_and_add ( &inDevice->taskPoolWaiters, 1 );
+
+		if ( inDevice->taskPoolFreeMask == 0 )
+		{
+			pthread_cond_wait ( &inDevice->taskPoolCondition, &inDevice->taskPoolLock );
+		}
+
+		__sync_fetch_and_sub ( &inDevice->taskPoolWaiters, 1 );
+		pthread_mutex_unlock ( &inDevice->taskPoolLock );
+
+	}
+
+}
+
+
+static void
+PooledReleaseTask ( EmulatedDevice * inDevice, EmulatedTask * inTask )
+{
+
+	unsigned int	index;
+
+	for ( index = 0; index < kUFITaskPoolSize; index++ )
+	{
+
+		if ( inDevice->taskPool[index] == inTask )
+		{
+			break;
+		}
+
+	}
+
+	// ResetForNewTask
+	inTask->dataBuffer 		= NULL;
+	inTask->clientData 		= NULL;
+	inTask->autosenseValid	= false;
+	__sync_fetch_and_or ( &inDevice->taskPoolFreeMask, ( 1 << index ) );
+
+	if ( inDevice->taskPoolWaiters != 0 )
+	{
+
+		pthread_mutex_lock ( &inDevice->taskPoolLock );
+		pthread_cond_signal ( &inDevice->taskPoolCondition );
+		pthread_mutex_unlock ( &inDevice->taskPoolLock );
+
+	}
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	The emulated device
+//-----------------------------------------------------------------------------
+
+static bool
+BuildRead10 ( EmulatedTask * inTask, void * inBuffer, uint32_t inBlock, uint16_t inCount )
+{
+
+	// ResetForNewTask, then the READ_10 builder
+	memset ( inTask->cdb, 0, sizeof ( inTask->cdb ) );
+	inTask->realizedByteCount	= 0;
+	inTask->serviceResponse		= 0;
+	inTask->taskStatus			= 0;
+	inTask->autosenseValid		= false;
+
+	inTask->cdb[0] = 0x28;
+	inTask->cdb[2] = ( inBlock >> 24 ) & 0xFF;
+	inTask->cdb[3] = ( inBlock >> 16 ) & 0xFF;
+	inTask->cdb[4] = ( inBlock >> 8 ) & 0xFF;
+	inTask->cdb[5] = inBlock & 0xFF;
+	inTask->cdb[7] = ( inCount >> 8 ) & 0xFF;
+	inTask->cdb[8] = inCount & 0xFF;
+	inTask->cdbSize				= 10;
+	inTask->direction			= 1;
+	inTask->dataBuffer			= inBuffer;
+	inTask->requestedByteCount	= ( uint64_t ) inCount * kBlockSize;
+
+	return true;
+
+}
+
+
+static void
+SendCommand ( EmulatedDevice * inDevice, EmulatedTask * inTask )
+{
+
+	// The emulated device moves no data and completes at once.
+	inTask->realizedByteCount	= inTask->requestedByteCount;
+	inTask->serviceResponse		= 1;	// TASK_COMPLETE
+	inTask->taskStatus			= 0;	// GOOD
+	__sync_fetch_and_add ( &inDevice->commandsCompleted, 1 );
+
+}
+
+
+static void *
+BenchmarkThreadMain ( void * inArgument )
+{
+
+	BenchmarkThread *	thread 	= ( BenchmarkThread * ) inArgument;
+	EmulatedTask *		inFlight[kMaxDepth];
+	uint64_t			done	= 0;
+	unsigned int		index;
+
+	while ( done < thread->iterations )
+	{
+
+		for ( index = 0; index < thread->depth; index++ )
+		{
+
+			inFlight[index] = thread->getTask ( thread->device );
+			if ( inFlight[index] == NULL )
+			{
+
+				thread->failures++;
+				continue;
+
+			}
+
+			BuildRead10 ( inFlight[index], thread->device->buffer, ( uint32_t ) ( done + index ) * kBlocksPerIO, kBlocksPerIO );
+			SendCommand ( thread->device, inFlight[index] );
+
+		}
+
+		// AsyncReadWriteComplete, in completion order
+		for ( index = 0; index < thread->depth; index++ )
+		{
+
+			if ( inFlight[index] == NULL )
+			{
+				continue;
+			}
+
+			if ( ( inFlight[index]->serviceResponse != 1 ) || ( inFlight[index]->taskStatus != 0 ) )
+			{
+				thread->failures++;
+			}
+
+			thread->releaseTask ( thread->device, inFlight[index] );
+
+		}
+
+		done += thread->depth;
+
+	}
+
+	return NULL;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	Helpers
+//-----------------------------------------------------------------------------
+
+static double
+CurrentTime ( void )
+{
+
+	struct timeval	now;
+
+	gettimeofday ( &now, NULL );
+	return now.tv_sec + now.tv_usec / 1000000.0;
+
+}
+
+
+static double
+RunBenchmark ( const char *			inName,
+			   GetTaskFunction		inGetTask,
+			   ReleaseTaskFunction	inReleaseTask,
+			   uint64_t				inIterations,
+			   unsigned int			inThreads,
+			   unsigned int			inDepth )
+{
+
+	EmulatedDevice *	device		= NULL;
+	BenchmarkThread *	threads		= NULL;
+	uint64_t			failures	= 0;
+	double				start		= 0;
+	double				elapsed		= 0;
+	double				perIO		= 0;
+	unsigned int		index;
+
+	device	= ( EmulatedDevice * ) calloc ( 1, sizeof ( EmulatedDevice ) );
+	threads	= ( BenchmarkThread * ) calloc ( inThreads, sizeof ( BenchmarkThread ) );
+	if ( ( device == NULL ) || ( threads == NULL ) )
+	{
+
+		fprintf ( stderr, "Out of memory\n" );
+		exit ( 1 );
+
+	}
+
+	// AllocateTaskPool
+	for ( index = 0; index < kUFITaskPoolSize; index++ )
+	{
+		device->taskPool[index] = AllocatedGetTask ( device );
+	}
+
+	device->taskPoolFreeMask = ( kUFITaskPoolSize == 32 ) ? 0xFFFFFFFF : ( ( 1 << kUFITaskPoolSize ) - 1 );
+	pthread_mutex_init ( &device->taskPoolLock, NULL );
+	pthread_cond_init ( &device->taskPoolCondition, NULL );
+
+	start = CurrentTime ( );
+
+	for ( index = 0; index < inThreads; index++ )
+	{
+
+		threads[index].device		= device;
+		threads[index].getTask		= inGetTask;
+		threads[index].releaseTask	= inReleaseTask;
+		threads[index].iterations	= inIterations / inThreads;
+		threads[index].depth		= inDepth;
+		pthread_create ( &threads[index].thread, NULL, BenchmarkThreadMain, &threads[index] );
+
+	}
+
+	for ( index = 0; index < inThreads; index++ )
+	{
+
+		pthread_join ( threads[index].thread, NULL );
+		failures += threads[index].failures;
+
+	}
+
+	elapsed = CurrentTime ( ) - start;
+	perIO	= elapsed * 1000000000.0 / device->commandsCompleted;
+
+	printf ( "%-10s %12llu I/Os in %7.3f s, %7.1f ns per I/O, %llu failures\n",
+			 inName,
+			 ( unsigned long long ) device->commandsCompleted,
+			 elapsed,
+			 perIO,
+			 ( unsigned long long ) failures );
+
+	for ( index = 0; index < kUFITaskPoolSize; index++ )
+	{
+		free ( device->taskPool[index] );
+	}
+
+	pthread_cond_destroy ( &device->taskPoolCondition );
+	pthread_mutex_destroy ( &device->taskPoolLock );
+	free ( threads );
+	free ( device );
+
+	return perIO;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	Main
+//-----------------------------------------------------------------------------
+
+int
+main ( int argc, const char * argv[] )
+{
+
+	uint64_t		iterations	= kDefaultIterations;
+	unsigned int	threads		= kDefaultThreads;
+	unsigned int	depth		= kDefaultDepth;
+	double			allocated	= 0;
+	double			pooled		= 0;
+
+	if ( argc > 1 )
+	{
+		iterations = strtoull ( argv[1], NULL, 0 );
+	}
+
+	if ( argc > 2 )
+	{
+		threads = ( unsigned int ) strtoul ( argv[2], NULL, 0 );
+	}
+
+	if ( argc > 3 )
+	{
+		depth = ( unsigned int ) strtoul ( argv[3], NULL, 0 );
+	}
+
+	if ( ( iterations == 0 ) || ( threads == 0 ) || ( depth == 0 ) || ( depth > kMaxDepth ) )
+	{
+
+		fprintf ( stderr, "Usage: %s [iterations] [threads] [depth, 1 to %d]\n", argv[0], kMaxDepth );
+		return 1;
+
+	}
+
+	// Each thread completes its own I/Os, so a thread waiting on an empty pool
+	// would wait forever on tasks the other threads hold.
+	if ( ( threads * depth ) > kUFITaskPoolSize )
+	{
+
+		fprintf ( stderr, "threads * depth must be at most the %d task pool\n", kUFITaskPoolSize );
+		return 1;
+
+	}
+
+	printf ( "%u threads, %u I/Os outstanding per thread, %d task pool\n", threads, depth, kUFITaskPoolSize );
+
+	allocated	= RunBenchmark ( "allocated", AllocatedGetTask, AllocatedReleaseTask, iterations, threads, depth );
+	pooled		= RunBenchmark ( "pooled", PooledGetTask, PooledReleaseTask, iterations, threads, depth );
+
+	printf ( "The pool takes %.1f%% of the per-I/O time of allocating\n", pooled * 100.0 / allocated );
+
+	return 0;
+
+}
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2008-2009 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * "Portions Copyright (c) 1999 Apple Inc.  All Rights
+ * Reserved.  This file contains Original Code and/or Modifications of
+ * Original Code as defined in and that are subject to the Apple Public
+ * Source License Version 1.0 (the 'License').	You may not use this file
+ * except in compliance with the License.  Please obtain a copy of the
+ * License at http://www.apple.com/publicsource and read it before using
+ * this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE OR NON-INFRINGEMENT.  Please see the
+ * License for the specific language governing rights and limitations
+ * under the License."
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _UMC_CDB_SPECS_H_
+#define _UMC_CDB_SPECS_H_
+
+
+//-----------------------------------------------------------------------------
+//	Includes
+//-----------------------------------------------------------------------------
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+//-----------------------------------------------------------------------------
+//	Structures
+//-----------------------------------------------------------------------------
+
+#define kCDBMaxFields		12
+
+// A field of a CDB. The bytes at offset are read big-endian, then shifted right and masked
+// to bits when bits is non-zero. A field with no bytes ends the list.
+typedef struct CDBField
+{
+	const char *	name;
+	uint8_t			offset;
+	uint8_t			bytes;
+	uint8_t			shift;
+	uint8_t			bits;
+} CDBField;
+
+typedef struct CDBSpec
+{
+	uint8_t			operationCode;
+	uint8_t			serviceAction;		// kCDBAnyServiceAction unless byte 1 picks the command
+	const char *	name;
+	CDBField		fields [ kCDBMaxFields ];
+} CDBSpec;
+
+
+//-----------------------------------------------------------------------------
+//	Constants
+//-----------------------------------------------------------------------------
+
+#define kCDBAnyServiceAction			0xFF
+
+#define CDB_FIELD( name, offset, bytes )		{ name, offset, bytes, 0, 0 }
+#define CDB_BITS( name, offset, shift, bits )	{ name, offset, 1, shift, bits }
+
+#define CDB_RW_FLAGS( protect )		CDB_BITS ( protect, 1, 5, 3 ), CDB_BITS ( "DPO", 1, 4, 1 ), CDB_BITS ( "FUA", 1, 3, 1 )
+#define CDB_ATA_FLAGS				CDB_BITS ( "PROTOCOL", 1, 1, 4 ), CDB_BITS ( "T_DIR", 2, 3, 1 ), CDB_BITS ( "BYT_BLOK", 2, 2, 1 ), CDB_BITS ( "T_LENGTH", 2, 0, 2 )
+
+// The SPC, SBC, MMC and ATA pass-through commands USB storage devices see. A service action
+// entry must come before the kCDBAnyServiceAction entry for the same operation code.
+static const CDBSpec kCDBSpecs[] =
+{
+	
+	{ 0x00, kCDBAnyServiceAction, "TEST_UNIT_READY",				{ } },
+	{ 0x01, kCDBAnyServiceAction, "REZERO_UNIT",					{ } },
+	{ 0x03, kCDBAnyServiceAction, "REQUEST_SENSE",					{ CDB_BITS ( "DESC", 1, 0, 1 ), CDB_FIELD ( "ALLOCATION_LENGTH", 4, 1 ) } },
+	{ 0x04, kCDBAnyServiceAction, "FORMAT_UNIT",					{ CDB_BITS ( "FMTDATA", 1, 4, 1 ), CDB_BITS ( "DEFECT_LIST_FORMAT", 1, 0, 3 ) } },
+	{ 0x08, kCDBAnyServiceAction, "READ_6",							{ { "LBA", 1, 3, 0, 21 }, CDB_FIELD ( "TRANSFER_LENGTH", 4, 1 ) } },
+	{ 0x0A, kCDBAnyServiceAction, "WRITE_6",						{ { "LBA", 1, 3, 0, 21 }, CDB_FIELD ( "TRANSFER_LENGTH", 4, 1 ) } },
+	{ 0x0B, kCDBAnyServiceAction, "SEEK_6",							{ { "LBA", 1, 3, 0, 21 } } },
+	{ 0x12, kCDBAnyServiceAction, "INQUIRY",						{ CDB_BITS ( "EVPD", 1, 0, 1 ), CDB_FIELD ( "PAGE_CODE", 2, 1 ), CDB_FIELD ( "ALLOCATION_LENGTH", 3, 2 ) } },
+	{ 0x15, kCDBAnyServiceAction, "MODE_SELECT_6",					{ CDB_BITS ( "PF", 1, 4, 1 ), CDB_BITS ( "SP", 1, 0, 1 ), CDB_FIELD ( "PARAMETER_LIST_LENGTH", 4, 1 ) } },
+	{ 0x1A, kCDBAnyServiceAction, "MODE_SENSE_6",					{ CDB_BITS ( "DBD", 1, 3, 1 ), CDB_BITS ( "PC", 2, 6, 2 ), CDB_BITS ( "PAGE_CODE", 2, 0, 6 ), CDB_FIELD ( "SUBPAGE_CODE", 3, 1 ), CDB_FIELD ( "ALLOCATION_LENGTH", 4, 1 ) } },
+	{ 0x1B, kCDBAnyServiceAction, "START_STOP_UNIT",				{ CDB_BITS ( "IMMED", 1, 0, 1 ), CDB_BITS ( "POWER_CONDITION", 4, 4, 4 ), CDB_BITS ( "LOEJ", 4, 1, 1 ), CDB_BITS ( "START", 4, 0, 1 ) } },
+	{ 0x1D, kCDBAnyServiceAction, "SEND_DIAGNOSTIC",				{ CDB_BITS ( "SELF_TEST_CODE", 1, 5, 3 ), CDB_BITS ( "SELFTEST", 1, 2, 1 ), CDB_FIELD ( "PARAMETER_LIST_LENGTH", 3, 2 ) } },
+	{ 0x1E, kCDBAnyServiceAction, "PREVENT_ALLOW_MEDIUM_REMOVAL",	{ CDB_BITS ( "PREVENT", 4, 0, 2 ) } },
+	{ 0x23, kCDBAnyServiceAction, "READ_FORMAT_CAPACITIES",			{ CDB_FIELD ( "ALLOCATION_LENGTH", 7, 2 ) } },
+	{ 0x25, kCDBAnyServiceAction, "READ_CAPACITY",					{ CDB_FIELD ( "LBA", 2, 4 ), CDB_BITS ( "PMI", 8, 0, 1 ) } },
+	{ 0x28, kCDBAnyServiceAction, "READ_10",						{ CDB_RW_FLAGS ( "RDPROTECT" ), CDB_FIELD ( "LBA", 2, 4 ), CDB_BITS ( "GROUP_NUMBER", 6, 0, 5 ), CDB_FIELD ( "TRANSFER_LENGTH", 7, 2 ) } },
+	{ 0x2A, kCDBAnyServiceAction, "WRITE_10",						{ CDB_RW_FLAGS ( "WRPROTECT" ), CDB_FIELD ( "LBA", 2, 4 ), CDB_BITS ( "GROUP_NUMBER", 6, 0, 5 ), CDB_FIELD ( "TRANSFER_LENGTH", 7, 2 ) } },
+	{ 0x2B, kCDBAnyServiceAction, "SEEK_10",						{ CDB_FIELD ( "LBA", 2, 4 ) } },
+	{ 0x2E, kCDBAnyServiceAction, "WRITE_AND_VERIFY_10",			{ CDB_BITS ( "BYTCHK", 1, 1, 1 ), CDB_FIELD ( "LBA", 2, 4 ), CDB_FIELD ( "TRANSFER_LENGTH", 7, 2 ) } },
+	{ 0x2F, kCDBAnyServiceAction, "VERIFY_10",						{ CDB_BITS ( "BYTCHK", 1, 1, 1 ), CDB_FIELD ( "LBA", 2, 4 ), CDB_FIELD ( "VERIFICATION_LENGTH", 7, 2 ) } },
+	{ 0x35, kCDBAnyServiceAction, "SYNCHRONIZE_CACHE",				{ CDB_BITS ( "IMMED", 1, 1, 1 ), CDB_FIELD ( "LBA", 2, 4 ), CDB_FIELD ( "NUMBER_OF_BLOCKS", 7, 2 ) } },
+	{ 0x3B, kCDBAnyServiceAction, "WRITE_BUFFER",					{ CDB_BITS ( "MODE", 1, 0, 5 ), CDB_FIELD ( "BUFFER_ID", 2, 1 ), CDB_FIELD ( "BUFFER_OFFSET", 3, 3 ), CDB_FIELD ( "PARAMETER_LIST_LENGTH", 6, 3 ) } },
+	{ 0x3C, kCDBAnyServiceAction, "READ_BUFFER",					{ CDB_BITS ( "MODE", 1, 0, 5 ), CDB_FIELD ( "BUFFER_ID", 2, 1 ), CDB_FIELD ( "BUFFER_OFFSET", 3, 3 ), CDB_FIELD ( "ALLOCATION_LENGTH", 6, 3 ) } },
+	{ 0x41, kCDBAnyServiceAction, "WRITE_SAME_10",					{ CDB_BITS ( "UNMAP", 1, 3, 1 ), CDB_FIELD ( "LBA", 2, 4 ), CDB_FIELD ( "NUMBER_OF_BLOCKS", 7, 2 ) } },
+	{ 0x42, kCDBAnyServiceAction, "UNMAP",							{ CDB_BITS ( "ANCHOR", 1, 0, 1 ), CDB_BITS ( "GROUP_NUMBER", 6, 0, 5 ), CDB_FIELD ( "PARAMETER_LIST_LENGTH", 7, 2 ) } },
+	{ 0x43, kCDBAnyServiceAction, "READ_TOC_PMA_ATIP",				{ CDB_BITS ( "MSF", 1, 1, 1 ), CDB_BITS ( "FORMAT", 2, 0, 4 ), CDB_FIELD ( "TRACK_SESSION_NUMBER", 6, 1 ), CDB_FIELD ( "ALLOCATION_LENGTH", 7, 2 ) } },
+	{ 0x46, kCDBAnyServiceAction, "GET_CONFIGURATION",				{ CDB_BITS ( "RT", 1, 0, 2 ), CDB_FIELD ( "STARTING_FEATURE_NUMBER", 2, 2 ), CDB_FIELD ( "ALLOCATION_LENGTH", 7, 2 ) } },
+	{ 0x4A, kCDBAnyServiceAction, "GET_EVENT_STATUS_NOTIFICATION",	{ CDB_BITS ( "POLLED", 1, 0, 1 ), CDB_FIELD ( "NOTIFICATION_CLASS_REQUEST", 4, 1 ), CDB_FIELD ( "ALLOCATION_LENGTH", 7, 2 ) } },
+	{ 0x4D, kCDBAnyServiceAction, "LOG_SENSE",						{ CDB_BITS ( "PC", 2, 6, 2 ), CDB_BITS ( "PAGE_CODE", 2, 0, 6 ), CDB_FIELD ( "ALLOCATION_LENGTH", 7, 2 ) } },
+	{ 0x51, kCDBAnyServiceAction, "READ_DISC_INFORMATION",			{ CDB_BITS ( "DATA_TYPE", 1, 0, 3 ), CDB_FIELD ( "ALLOCATION_LENGTH", 7, 2 ) } },
+	{ 0x52, kCDBAnyServiceAction, "READ_TRACK_INFORMATION",			{ CDB_BITS ( "ADDRESS_TYPE", 1, 0, 2 ), CDB_FIELD ( "ADDRESS", 2, 4 ), CDB_FIELD ( "ALLOCATION_LENGTH", 7, 2 ) } },
+	{ 0x55, kCDBAnyServiceAction, "MODE_SELECT_10",					{ CDB_BITS ( "PF", 1, 4, 1 ), CDB_BITS ( "SP", 1, 0, 1 ), CDB_FIELD ( "PARAMETER_LIST_LENGTH", 7, 2 ) } },
+	{ 0x5A, kCDBAnyServiceAction, "MODE_SENSE_10",					{ CDB_BITS ( "LLBAA", 1, 4, 1 ), CDB_BITS ( "DBD", 1, 3, 1 ), CDB_BITS ( "PC", 2, 6, 2 ), CDB_BITS ( "PAGE_CODE", 2, 0, 6 ), CDB_FIELD ( "SUBPAGE_CODE", 3, 1 ), CDB_FIELD ( "ALLOCATION_LENGTH", 7, 2 ) } },
+	{ 0x85, kCDBAnyServiceAction, "ATA_PASS_THROUGH_16",			{ CDB_ATA_FLAGS, CDB_BITS ( "EXTEND", 1, 0, 1 ), CDB_FIELD ( "FEATURES", 3, 2 ), CDB_FIELD ( "SECTOR_COUNT", 5, 2 ), CDB_FIELD ( "LBA_LOW", 7, 2 ), CDB_FIELD ( "LBA_MID", 9, 2 ), CDB_FIELD ( "LBA_HIGH", 11, 2 ), CDB_FIELD ( "DEVICE", 13, 1 ), CDB_FIELD ( "ATA_COMMAND", 14, 1 ) } },
+	{ 0x88, kCDBAnyServiceAction, "READ_16",						{ CDB_RW_FLAGS ( "RDPROTECT" ), CDB_FIELD ( "LBA", 2, 8 ), CDB_FIELD ( "TRANSFER_LENGTH", 10, 4 ), CDB_BITS ( "GROUP_NUMBER", 14, 0, 5 ) } },
+	{ 0x8A, kCDBAnyServiceAction, "WRITE_16",						{ CDB_RW_FLAGS ( "WRPROTECT" ), CDB_FIELD ( "LBA", 2, 8 ), CDB_FIELD ( "TRANSFER_LENGTH", 10, 4 ), CDB_BITS ( "GROUP_NUMBER", 14, 0, 5 ) } },
+	{ 0x8F, kCDBAnyServiceAction, "VERIFY_16",						{ CDB_BITS ( "BYTCHK", 1, 1, 1 ), CDB_FIELD ( "LBA", 2, 8 ), CDB_FIELD ( "VERIFICATION_LENGTH", 10, 4 ) } },
+	{ 0x91, kCDBAnyServiceAction, "SYNCHRONIZE_CACHE_16",			{ CDB_BITS ( "IMMED", 1, 1, 1 ), CDB_FIELD ( "LBA", 2, 8 ), CDB_FIELD ( "NUMBER_OF_BLOCKS", 10, 4 ) } },
+	{ 0x93, kCDBAnyServiceAction, "WRITE_SAME_16",					{ CDB_BITS ( "UNMAP", 1, 3, 1 ), CDB_FIELD ( "LBA", 2, 8 ), CDB_FIELD ( "NUMBER_OF_BLOCKS", 10, 4 ) } },
+	{ 0x9E, 0x10,				  "READ_CAPACITY_16",				{ CDB_FIELD ( "LBA", 2, 8 ), CDB_FIELD ( "ALLOCATION_LENGTH", 10, 4 ), CDB_BITS ( "PMI", 14, 0, 1 ) } },
+	{ 0x9E, kCDBAnyServiceAction, "SERVICE_ACTION_IN_16",			{ CDB_BITS ( "SERVICE_ACTION", 1, 0, 5 ), CDB_FIELD ( "ALLOCATION_LENGTH", 10, 4 ) } },
+	{ 0xA0, kCDBAnyServiceAction, "REPORT_LUNS",					{ CDB_FIELD ( "SELECT_REPORT", 2, 1 ), CDB_FIELD ( "ALLOCATION_LENGTH", 6, 4 ) } },
+	{ 0xA1, kCDBAnyServiceAction, "ATA_PASS_THROUGH_12",			{ CDB_ATA_FLAGS, CDB_FIELD ( "FEATURES", 3, 1 ), CDB_FIELD ( "SECTOR_COUNT", 4, 1 ), CDB_FIELD ( "LBA_LOW", 5, 1 ), CDB_FIELD ( "LBA_MID", 6, 1 ), CDB_FIELD ( "LBA_HIGH", 7, 1 ), CDB_FIELD ( "DEVICE", 8, 1 ), CDB_FIELD ( "ATA_COMMAND", 9, 1 ) } },
+	{ 0xA2, kCDBAnyServiceAction, "SECURITY_PROTOCOL_IN",			{ CDB_FIELD ( "SECURITY_PROTOCOL", 1, 1 ), CDB_FIELD ( "SECURITY_PROTOCOL_SPECIFIC", 2, 2 ), CDB_FIELD ( "ALLOCATION_LENGTH", 6, 4 ) } },
+	{ 0xA8, kCDBAnyServiceAction, "READ_12",						{ CDB_RW_FLAGS ( "RDPROTECT" ), CDB_FIELD ( "LBA", 2, 4 ), CDB_FIELD ( "TRANSFER_LENGTH", 6, 4 ), CDB_BITS ( "GROUP_NUMBER", 10, 0, 5 ) } },
+	{ 0xAA, kCDBAnyServiceAction, "WRITE_12",						{ CDB_RW_FLAGS ( "WRPROTECT" ), CDB_FIELD ( "LBA", 2, 4 ), CDB_FIELD ( "TRANSFER_LENGTH", 6, 4 ), CDB_BITS ( "GROUP_NUMBER", 10, 0, 5 ) } },
+	{ 0xAF, kCDBAnyServiceAction, "VERIFY_12",						{ CDB_BITS ( "BYTCHK", 1, 1, 1 ), CDB_FIELD ( "LBA", 2, 4 ), CDB_FIELD ( "VERIFICATION_LENGTH", 6, 4 ) } },
+	{ 0xB5, kCDBAnyServiceAction, "SECURITY_PROTOCOL_OUT",			{ CDB_FIELD ( "SECURITY_PROTOCOL", 1, 1 ), CDB_FIELD ( "SECURITY_PROTOCOL_SPECIFIC", 2, 2 ), CDB_FIELD ( "TRANSFER_LENGTH", 6, 4 ) } },
+	{ 0xBB, kCDBAnyServiceAction, "SET_CD_SPEED",					{ CDB_FIELD ( "READ_SPEED", 2, 2 ), CDB_FIELD ( "WRITE_SPEED", 4, 2 ) } },
+	{ 0xBD, kCDBAnyServiceAction, "MECHANISM_STATUS",				{ CDB_FIELD ( "ALLOCATION_LENGTH", 8, 2 ) } },
+	{ 0xBE, kCDBAnyServiceAction, "READ_CD",						{ CDB_BITS ( "SECTOR_TYPE", 1, 2, 3 ), CDB_FIELD ( "LBA", 2, 4 ), CDB_FIELD ( "TRANSFER_LENGTH", 6, 3 ), CDB_FIELD ( "FLAGS", 9, 1 ) } }
+	
+};
+
+
+//-----------------------------------------------------------------------------
+//	FindCDBSpec - Without the CDB only entries for any service action match.
+//-----------------------------------------------------------------------------
+
+static inline const CDBSpec *
+FindCDBSpec ( unsigned int operationCode, const uint8_t * cdb, size_t cdbLength )
+{
+	
+	unsigned int	i;
+	
+	for ( i = 0; i < ( sizeof ( kCDBSpecs ) / sizeof ( kCDBSpecs[0] ) ); i++ )
+	{
+		
+		if ( operationCode != kCDBSpecs[i].operationCode )
+		{
+			continue;
+		}
+		
+		if ( kCDBSpecs[i].serviceAction == kCDBAnyServiceAction )
+		{
+			return &kCDBSpecs[i];
+		}
+		
+		if ( ( cdb != NULL ) && ( cdbLength > 1 ) && ( ( cdb[1] & 0x1F ) == kCDBSpecs[i].serviceAction ) )
+		{
+			return &kCDBSpecs[i];
+		}
+		
+	}
+	
+	return NULL;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	CDBFieldValue - The CDB must hold field->offset + field->bytes bytes.
+//-----------------------------------------------------------------------------
+
+static inline uint64_t
+CDBFieldValue ( const CDBField * field, const uint8_t * cdb )
+{
+	
+	uint64_t		value = 0;
+	unsigned int	i;
+	
+	for ( i = 0; i < field->bytes; i++ )
+	{
+		value = ( value << 8 ) | cdb [ field->offset + i ];
+	}
+	
+	value >>= field->shift;
+	if ( field->bits != 0 )
+	{
+		value &= ( 1ULL << field->bits ) - 1;
+	}
+	
+	return value;
+	
+}
+
+
+#endif	/* _UMC_CDB_SPECS_H_ */
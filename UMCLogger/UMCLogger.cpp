@@ -23,7 +23,7 @@
  */
 
 /*
-g++ -W -Wall -I/System/Library/Frameworks/System.framework/PrivateHeaders -I/System/Library/Frameworks/Kernel.framework/PrivateHeaders -lutil -DPRIVATE -D__APPLE_PRIVATE -O -arch ppc -arch i386 -arch x86_64 -o UMCLogger UMCLogger.cpp
+g++ -W -Wall -I/System/Library/Frameworks/System.framework/PrivateHeaders -I/System/Library/Frameworks/Kernel.framework/PrivateHeaders -lutil -DPRIVATE -D__APPLE_PRIVATE -O -arch ppc -arch i386 -arch x86_64 -o UMCLogger UMCLogger.cpp UMCTraceFile.cpp UMCTraceCompact.cpp
 */
 
 
@@ -63,6 +63,9 @@ g++ -W -Wall -I/System/Library/Frameworks/System.framework/PrivateHeaders -I/Sys
 #include <IOKit/scsi/SCSICommandOperationCodes.h>
 
 #include "../IOUSBMassStorageClassTimestamps.h"
+#include "UMCTraceFile.h"
+#include "UMCTraceCompact.h"
+#include "UMCCDBSpecs.h"
 
 #include <IOKit/usb/USB.h>
 
@@ -78,6 +81,12 @@ typedef struct ReturnCodeSpec
 	const char *	string;
 } ReturnCodeSpec;
 
+typedef struct TraceCategorySpec
+{
+	const char *	name;
+	uint32_t		category;
+} TraceCategorySpec;
+
 
 //-----------------------------------------------------------------------------
 //	Constants
@@ -112,11 +121,16 @@ enum
 	kDeviceInformationCode                  = UMC_TRACE ( kDeviceInformation ),
     kSuspendPortCode                        = UMC_TRACE ( kSuspendPort ),
     kSubclassUseCode                        = UMC_TRACE ( kSubclassUse ),
+	kSCSICommandCode						= UMC_TRACE ( kSCSICommand ),
+	kRecoveryJobStartedCode					= UMC_TRACE ( kRecoveryJobStarted ),
+	kRecoveryJobFinishedCode				= UMC_TRACE ( kRecoveryJobFinished ),
+	kUSBDeviceReconfiguredCode				= UMC_TRACE ( kUSBDeviceReconfigured ),
     
 	// CBI Specific							0x052D0400 - 0x052D07FF
 	kCBIProtocolDeviceDetectedCode			= UMC_TRACE ( kCBIProtocolDeviceDetected ),
 	kCBICommandAlreadyInProgressCode		= UMC_TRACE ( kCBICommandAlreadyInProgress ),
 	kCBISendSCSICommandReturnedCode			= UMC_TRACE ( kCBISendSCSICommandReturned ),
+	kCBICompletionCode						= UMC_TRACE ( kCBICompletion ),
 	
 	// UFI Specific							0x052D0800 - 0x052D0BFF
 
@@ -130,8 +144,25 @@ enum
 	kBOCBWBulkOutWriteResultCode			= UMC_TRACE ( kBOCBWBulkOutWriteResult ),
 	kBODoubleCompleteionCode				= UMC_TRACE ( kBODoubleCompleteion ),
 	kBOCompletionDuringTerminationCode		= UMC_TRACE ( kBOCompletionDuringTermination ),
-	kBOCompletionCode						= UMC_TRACE ( kBOCompletion )
+	kBOCompletionCode						= UMC_TRACE ( kBOCompletion ),
 	
+	// UAS Specific
+	kUASCommandIUCode						= UMC_TRACE ( kUASCommandIU ),
+	kUASStatusIUCode						= UMC_TRACE ( kUASStatusIU )
+	
+};
+
+enum
+{
+	kExportFormatNone						= 0,
+	kExportFormatJSONLines					= 1,	// One object per event
+	kExportFormatChrome						= 2		// Chrome/Perfetto trace event JSON
+};
+
+// kIOUSBMassStorageRecoveryJobClearStall, as traced by kRecoveryJobStarted and kRecoveryJobFinished.
+enum
+{
+	kRecoveryJobClearStall					= 1
 };
 
 
@@ -150,13 +181,141 @@ static const char * kBulkOnlyStateNames[] = {	" ",
 												"BulkOnlyClearBulkInCompleted",
 												"BulkOnlyClearBulkOutCompleted" };
 
+// The Bulk-Only and CBI state machines trace each state as it completes, which ends the phase
+// of the command it names. Indexed by state, NULL for states that end no phase of their own.
+static const char * kBulkOnlyPhaseNames[] = {	NULL,
+												"CBW",
+												"GetEndpointStatus",
+												"ClearEndpointStall",
+												"Data",
+												"GetEndpointStatus",
+												"ClearEndpointStall",
+												"GetEndpointStatus",
+												"ClearEndpointStall",
+												"CSW",
+												"CSW",
+												"BulkOnlyReset",
+												"ClearBulkIn",
+												"ClearBulkOut" };
+
+static const char * kCBIPhaseNames[] = {		NULL,
+												"Command",
+												NULL,
+												"Data",
+												"Status",
+												"GetEndpointStatus",
+												"ClearEndpointStall",
+												"GetEndpointStatus",
+												"ClearEndpointStall",
+												"CommandBlockReset",
+												"ClearBulkIn",
+												"ClearBulkOut" };
+
+// The event classes -e takes, as the kernel splits tracepoints up.
+static const TraceCategorySpec kTraceCategorySpecs[] =
+{
+	{ "general",		kUSBTraceCategoryGeneral },
+	{ "cdb",			kUSBTraceCategoryCDB },
+	{ "completion",		kUSBTraceCategoryCompletion },
+	{ "queue",			kUSBTraceCategoryQueue },
+	{ "recovery",		kUSBTraceCategoryRecovery },
+	{ "power",			kUSBTraceCategoryPower },
+	{ "cbi",			kUSBTraceCategoryCBI },
+	{ "bo",				kUSBTraceCategoryBO },
+	{ "uas",			kUSBTraceCategoryUAS },
+	{ "subclass",		kUSBTraceCategorySubclass },
+	{ "command",		kUSBTraceCategoryCommand },
+	{ "all",			kUSBTraceCategoryAll }
+};
+
 
 #define kTraceBufferSampleSize			60000
 #define kMicrosecondsPerSecond			1000000
 #define kMicrosecondsPerMillisecond		1000
 #define kFilePathMaxSize                256
-#define kInvalid						0xdeadbeef
-#define kDivisorEntry					0xfeedface
+
+#define kAnalyzerInFlightSlots			4096
+#define kAnalyzerProbeLimit				64
+#define kAnalyzerSubBuckets				32
+#define kAnalyzerBuckets				( 28 * kAnalyzerSubBuckets )
+#define kAnalyzerOpcodes				256
+#define kAnalyzerOutliers				5
+#define kAnalyzerDrivers				64
+#define kExportDrivers					64
+#define kExportTags						256
+#define kCaptureCommandSlots			4096
+#define kCaptureProbeLimit				64
+#define kCaptureTagKey					0x8000000000000000ULL
+#define kDrainIntervalMinUSecs			( 1 * kMicrosecondsPerMillisecond )
+#define kDrainIntervalDefaultUSecs		( 20 * kMicrosecondsPerMillisecond )
+#define kDrainIntervalMaxUSecs			( 100 * kMicrosecondsPerMillisecond )
+#define kDrainFillHighPercent			50
+#define kDrainFillLowPercent			10
+
+// A command the analyzer has seen start but not complete. The key is the tag for kSCSICommand
+// records, and the request for kCDBLog1 records.
+typedef struct AnalyzerInFlight
+{
+	uint64_t		driver;
+	uint64_t		key;
+	int64_t			startUSecs;
+	uint64_t		lba;
+	uint32_t		length;
+	uint8_t			opcode;
+	boolean_t		used;
+} AnalyzerInFlight;
+
+// Latencies are counted in a log-linear histogram: exact below 64 us, then 32 buckets for
+// each power of two, which keeps every percentile within about 3% of the true value.
+typedef struct AnalyzerOpcodeStats
+{
+	uint64_t		count;
+	uint64_t		bytes;
+	uint32_t		maxUSecs;
+	uint64_t		buckets [ kAnalyzerBuckets ];
+} AnalyzerOpcodeStats;
+
+typedef struct AnalyzerCompletion
+{
+	uint64_t		driver;
+	uint64_t		key;
+	uint64_t		lba;
+	uint32_t		length;
+	uint32_t		latencyUSecs;
+	uint8_t			opcode;
+} AnalyzerCompletion;
+
+typedef struct AnalyzerDriver
+{
+	uint64_t		driver;
+	uint64_t		commands;
+	uint64_t		bytes;
+	uint32_t		inFlight;
+} AnalyzerDriver;
+
+// A driver instance in the Chrome export. Commands are nested async slices keyed by tag, and
+// phaseStart is where the next phase slice of each tag begins. Bulk-Only and CBI state
+// completions carry no tag, they belong to currentTag since those run one command at a time.
+typedef struct ExportDriver
+{
+	uint64_t		driver;
+	uint32_t		currentTag;
+	boolean_t		commandOpen [ kExportTags ];
+	boolean_t		statusSeen [ kExportTags ];
+	uint8_t			opcode [ kExportTags ];
+	double			phaseStart [ kExportTags ];
+} ExportDriver;
+
+// Whether a command passed the -l and -o filters, so its later records follow its first one.
+// The key is the tag ORed with kCaptureTagKey for kSCSICommand records, and the request for
+// the raw CDB records.
+typedef struct CaptureCommand
+{
+	uint32_t		driver;
+	uint64_t		key;
+	boolean_t		accepted;
+	boolean_t		used;
+} CaptureCommand;
 
 
 //-----------------------------------------------------------------------------
@@ -171,11 +330,17 @@ boolean_t			gSetRemoveFlag				= TRUE;
 boolean_t			gEnableTraceOnly			= FALSE;
 const char *		gProgramName				= NULL;
 uint32_t			gSavedTraceMask				= 0;
+USBSysctlArgs		gSavedSettings;							/* Driver flags and trace filter at launch */
+boolean_t			gSavedSettingsValid			= FALSE;
+boolean_t			gTraceFilterChanged			= FALSE;
 boolean_t			gHideBusyRejectedCommands	= FALSE;
+boolean_t			gTraceFullCDB				= FALSE;
 
 boolean_t           gWriteToTraceFile           = FALSE;
 boolean_t           gReadTraceFile              = FALSE;
 FILE *              gTraceFileStream			= NULL;
+boolean_t			gCompactTraceFile			= FALSE;
+UMCCompactWriter *	gTraceFileWriter			= NULL;
 char				gTraceFilePath [ kFilePathMaxSize ] = { 0 };
 
 u_int8_t			fullCDB [ 16 ]				= { 0 };
@@ -183,6 +348,30 @@ int64_t 			current_usecs				= 0;
 int64_t 			prev_usecs					= 0;
 int64_t				delta_usecs					= 0;
 
+boolean_t			gAnalyze					= FALSE;
+int64_t				gAnalyzeIntervalUSecs		= 0;		/* 0 reports only at exit */
+boolean_t			gSawCommandRecords			= FALSE;	/* Pair kSCSICommand, not kCDBLog1 */
+int64_t				gAnalyzeWindowStartUSecs	= -1;
+int64_t				gAnalyzeLastUSecs			= 0;
+uint64_t			gAnalyzeUnmatched			= 0;
+AnalyzerInFlight	gAnalyzeInFlight [ kAnalyzerInFlightSlots ];
+AnalyzerOpcodeStats *	gAnalyzeOpcodes [ kAnalyzerOpcodes ]	= { NULL };
+AnalyzerCompletion	gAnalyzeOutliers [ kAnalyzerOutliers ];
+AnalyzerDriver		gAnalyzeDrivers [ kAnalyzerDrivers ];
+
+int					gExportFormat				= kExportFormatNone;
+boolean_t			gExportFirstEvent			= TRUE;
+ExportDriver		gExportDrivers [ kExportDrivers ];
+
+uint32_t			gCaptureCategories			= kUSBTraceCategoryAll;
+boolean_t			gCaptureFilterDriver		= FALSE;
+uint32_t			gCaptureDriver				= 0;		/* Compared on its low 32 bits */
+int					gCaptureLUN					= -1;		/* -1 keeps every LUN */
+int					gCaptureOpcode				= -1;		/* -1 keeps every operation code */
+CaptureCommand		gCaptureCommands [ kCaptureCommandSlots ];
+uint64_t			gCaptureWraps				= 0;
+uint64_t			gCaptureLastTimestamp		= 0;
+
 
 //-----------------------------------------------------------------------------
 //	Prototypes
@@ -191,18 +380,51 @@ int64_t				delta_usecs					= 0;
 static void
 EnableTraceBuffer ( int val );
 
-static void
+static int
 CollectTrace ( void );
 
+static useconds_t
+NextDrainInterval ( useconds_t interval, int fillPercent );
+
+static boolean_t
+CaptureFilterAccepts ( const kd_buf * inTracePoint );
+
+static CaptureCommand *
+CaptureFindCommand ( uint32_t driver, uint64_t key, boolean_t create );
+
+static uint32_t
+ParseTraceCategories ( const char * inList );
+
 static void
 CreateTraceOutputFile ( void );
 
+static void
+WriteTraceOutputFile ( const kd_buf * inTracePoint );
+
+static void
+CloseTraceOutputFile ( void );
+
 static void
 ParseTraceFile ( void );
 
+static void
+ParseTraceFileEntry ( const kd_buf * inTracePoint, void * inRefCon );
+
 static void
 ParseKernelTracePoint ( kd_buf inTracePoint );
 
+static void
+AnalyzeKernelTracePoint ( kd_buf inTracePoint );
+
+static void
+AnalyzerReport ( void );
+
+static void
+ExportKernelTracePoint ( kd_buf inTracePoint );
+
+static void
+ExportFinish ( void );
+
 static void
 SignalHandler ( int signal );
 
@@ -224,6 +446,9 @@ SetTraceBufferSize ( int nbufs );
 static void
 Quit ( const char * s );
 
+static void
+RestoreDriverSettings ( void );
+
 static void
 InitializeTraceBuffer ( void );
 
@@ -245,6 +470,13 @@ LoadUSBMassStorageExtension ( void );
 static const char * 
 StringFromReturnCode ( unsigned int returnCode );
 
+static const char *
+StringFromOperationCode ( unsigned int operationCode );
+
+
+static const char *
+StringFromTraceEvent ( unsigned int type );
+
 void
 ProcessSubclassTracePoint ( kd_buf inTracePoint );
 
@@ -264,6 +496,8 @@ main ( int argc, const char * argv[] )
 {
 	
 	USBSysctlArgs 	args;
+	useconds_t		drainInterval;
+	size_t			size;
 	int				error;
 	
 	gProgramName = argv[0];
@@ -288,15 +522,33 @@ main ( int argc, const char * argv[] )
 	ParseArguments ( argc, argv );
 	
 	bzero ( &args, sizeof ( args ) );
+	bzero ( &gSavedSettings, sizeof ( gSavedSettings ) );
 	
 	args.type = kUSBTypeDebug;
 	args.operation = kUSBOperationGetFlags;
 	
-	error = sysctlbyname ( USBMASS_SYSCTL, NULL, NULL, &args, sizeof ( args ) );
+	// Keep what the driver was doing, so it can be put back on the way out.
+	size = sizeof ( gSavedSettings );
+	error = sysctlbyname ( USBMASS_SYSCTL, &gSavedSettings, &size, &args, sizeof ( args ) );
 	if ( error != 0 )
 	{
 		fprintf ( stderr, "sysctlbyname failed to get old umctrace flags\n" );
 	}
+	else
+	{
+		
+		// A driver that predates the trace filter returns only the flags.
+		if ( size < sizeof ( gSavedSettings ) )
+		{
+			
+			gSavedSettings.traceCategories	= kUSBTraceCategoryDefault;
+			gSavedSettings.traceFilter		= kUSBTraceFilterNone;
+			
+		}
+		
+		gSavedSettingsValid = TRUE;
+		
+	}
 	
 	args.type = kUSBTypeDebug;
 	args.operation = kUSBOperationSetFlags;
@@ -316,6 +568,33 @@ main ( int argc, const char * argv[] )
 		
 	}
 	
+	// The kernel leaves the raw CDB tracepoints off by default, kSCSICommand has them decoded.
+	// Classes not asked for with -e are never emitted, so they cannot crowd the buffer.
+	if ( ( gTraceFullCDB == TRUE ) || ( gCaptureCategories != kUSBTraceCategoryAll ) )
+	{
+		
+		if ( gTraceFullCDB == TRUE )
+		{
+			gCaptureCategories |= kUSBTraceCategoryCDB;
+		}
+		
+		args.type				= kUSBTypeDebug;
+		args.operation			= kUSBOperationSetTraceFilter;
+		args.traceCategories	= gCaptureCategories;
+		args.traceFilter		= kUSBTraceFilterNone;
+		
+		error = sysctlbyname ( USBMASS_SYSCTL, NULL, NULL, &args, sizeof ( args ) );
+		if ( error != 0 )
+		{
+			fprintf ( stderr, "sysctlbyname failed to set the traced categories\n" );
+		}
+		else
+		{
+			gTraceFilterChanged = TRUE;
+		}
+		
+	}
+	
 #if DEBUG
 	printf ( "gSavedTraceMask = 0x%08X\n", gSavedTraceMask );
 	printf ( "gPrintfMask = 0x%08X\n", gPrintfMask );
@@ -356,12 +635,15 @@ main ( int argc, const char * argv[] )
         if ( gReadTraceFile == FALSE )
         {
             
-            // No, they want logging. Start main loop.
+            // No, they want logging. Start main loop, draining more often the fuller the
+            // kernel buffer was found.
+            drainInterval = kDrainIntervalDefaultUSecs;
+            
             while ( 1 )
             {
                 
-                usleep ( 20 * kMicrosecondsPerMillisecond );
-                CollectTrace ( );
+                usleep ( drainInterval );
+                drainInterval = NextDrainInterval ( drainInterval, CollectTrace ( ) );
                 
             }
             
@@ -372,6 +654,13 @@ main ( int argc, const char * argv[] )
             
             ParseTraceFile ( );
             
+            if ( gAnalyze == TRUE )
+            {
+                AnalyzerReport ( );
+            }
+            
+            ExportFinish ( );
+            
         }
 		
 	}
@@ -393,10 +682,19 @@ PrintUsage ( void )
 	
 	printf ( "Usage: %s\n\n", gProgramName );
     printf ( "\t-h help\n" );
+    printf ( "\t-a <seconds> report command latency and throughput instead of events, every <seconds> or at exit if 0\n" );
     printf ( "\t-b hide rejected SCSI tasks\n" );
+    printf ( "\t-c also trace the raw CDB and CBW of each command\n" );
     printf ( "\t-d disable\n" );
+    printf ( "\t-e <class,...> keep only these event classes: general, cdb, completion, queue, recovery,\n" );
+    printf ( "\t\tpower, cbi, bo, uas, subclass, command or all\n" );
+    printf ( "\t-D <driver> keep only the driver instance printed as [<driver>]\n" );
+    printf ( "\t-l <lun> keep only commands to this LUN\n" );
+    printf ( "\t-o <opcode> keep only commands with this operation code, in hex\n" );
     printf ( "\t-f <file_path> write traces out directly to a file.\n" );
+    printf ( "\t-z write the -f file in the compact format, -r reads either\n" );
     printf ( "\t-r <file_path> parses trace file\n" );
+    printf ( "\t-x <jsonl|chrome> print events as JSON Lines or as Chrome/Perfetto trace JSON instead of text\n" );
 				
 	printf ( "\n" );
 	
@@ -417,9 +715,17 @@ ParseArguments ( int argc, const char * argv[] )
     struct option 			long_options[] =
     {
         { "disable",        no_argument,        0, 'd' },
+        { "analyze",        required_argument,  0, 'a' },
         { "busy",           no_argument,        0, 'b' },
+        { "cdb",            no_argument,        0, 'c' },
+        { "events",         required_argument,  0, 'e' },
+        { "driver",         required_argument,  0, 'D' },
+        { "lun",            required_argument,  0, 'l' },
+        { "opcode",         required_argument,  0, 'o' },
         { "file",           required_argument,  0, 'f' },
+        { "compact",        no_argument,        0, 'z' },
         { "read",           required_argument,  0, 'r' },
+        { "export",         required_argument,  0, 'x' },
         { "help",           no_argument,        0, 'h' },
         { 0, 0, 0, 0 }
     };
@@ -430,7 +736,7 @@ ParseArguments ( int argc, const char * argv[] )
 		return;
 	}
 	
-    while ( ( c = getopt_long ( argc, ( char * const * ) argv , "dbf:r:h?", long_options, NULL  ) ) != -1 )
+    while ( ( c = getopt_long ( argc, ( char * const * ) argv , "da:bce:D:l:o:f:zr:x:h?", long_options, NULL  ) ) != -1 )
 	{
 		
         switch ( c )
@@ -441,11 +747,25 @@ ParseArguments ( int argc, const char * argv[] )
                 
                 gSavedTraceMask = 0;
                 gSetRemoveFlag = FALSE;
+                
+                // Nothing has been saved yet, so Quit ( ) leaves the driver's tracing off.
+                bzero ( &gSavedSettings, sizeof ( gSavedSettings ) );
+                gSavedSettingsValid = TRUE;
+                
                 Quit ( "Quit via user-specified trace disable\n" );
             
             }
             break;
                 
+            case 'a':
+            {
+                
+                gAnalyze = TRUE;
+                gAnalyzeIntervalUSecs = ( int64_t ) strtoul ( optarg, NULL, 0 ) * kMicrosecondsPerSecond;
+                break;
+                
+            }
+                
             case 'b':
             {
                 
@@ -454,6 +774,47 @@ ParseArguments ( int argc, const char * argv[] )
                 
             }
                 
+            case 'c':
+            {
+                
+                gTraceFullCDB = TRUE;
+                break;
+                
+            }
+                
+            case 'e':
+            {
+                
+                gCaptureCategories = ParseTraceCategories ( optarg );
+                break;
+                
+            }
+                
+            case 'D':
+            {
+                
+                gCaptureFilterDriver = TRUE;
+                gCaptureDriver = ( uint32_t ) strtoull ( optarg, NULL, 16 );
+                break;
+                
+            }
+                
+            case 'l':
+            {
+                
+                gCaptureLUN = ( int ) strtoul ( optarg, NULL, 0 ) & 0xF;
+                break;
+                
+            }
+                
+            case 'o':
+            {
+                
+                gCaptureOpcode = ( int ) strtoul ( optarg, NULL, 16 ) & 0xFF;
+                break;
+                
+            }
+                
             case 'f':
             {
                 
@@ -477,6 +838,14 @@ ParseArguments ( int argc, const char * argv[] )
             }
             break;
                 
+            case 'z':
+            {
+                
+                gCompactTraceFile = TRUE;
+                break;
+                
+            }
+                
             case 'r':
             {
                 
@@ -500,6 +869,27 @@ ParseArguments ( int argc, const char * argv[] )
             }
             break;
             
+            case 'x':
+            {
+                
+                if ( strcmp ( optarg, "jsonl" ) == 0 )
+                {
+                    gExportFormat = kExportFormatJSONLines;
+                }
+                
+                else if ( strcmp ( optarg, "chrome" ) == 0 )
+                {
+                    gExportFormat = kExportFormatChrome;
+                }
+                
+                else
+                {
+                    Quit ( "The -x argument must be jsonl or chrome\n" );
+                }
+                
+            }
+            break;
+            
             case 'h':
             {
                 PrintUsage ( );
@@ -577,8 +967,23 @@ SignalHandler ( int signal )
 
 #pragma unused ( signal )
 	
+	if ( gAnalyze == TRUE )
+	{
+		AnalyzerReport ( );
+	}
+	
+	ExportFinish ( );
+	
+	if ( gCaptureWraps != 0 )
+	{
+		fprintf ( stderr, "The trace buffer wrapped %llu times, events were lost\n", ( unsigned long long ) gCaptureWraps );
+	}
+	
+	CloseTraceOutputFile ( );
+	
 	EnableTraceBuffer ( 0 );
 	RemoveTraceBuffer ( );
+	RestoreDriverSettings ( );
 	exit ( 0 );
 	
 }
@@ -774,79 +1179,40 @@ static void
 PrintSCSICommand ( void )
 {
 	
-	switch ( fullCDB [0] )
+	const CDBSpec *		spec;
+	const CDBField *	field;
+	uint64_t			value;
+	unsigned int		i;
+	
+	spec = FindCDBSpec ( fullCDB [0], fullCDB, sizeof ( fullCDB ) );
+	if ( spec == NULL )
 	{
 		
-		case kSCSICmd_TEST_UNIT_READY:
-		{
-			
-			printf ( " kSCSICmd_TEST_UNIT_READY\n" );
-			
-		}
-		break;
-			
-		case kSCSICmd_REQUEST_SENSE:
-		{
-			
-			printf ( " kSCSICmd_REQUEST_SENSE\n" );
-			
-		}
-		break;
-			
-		case kSCSICmd_READ_10:
-		{
-			
-			u_int32_t	LOGICAL_BLOCK_ADDRESS	= 0;
-			u_int16_t	TRANSFER_LENGTH			= 0;
-			
-			LOGICAL_BLOCK_ADDRESS   = fullCDB [2];
-			LOGICAL_BLOCK_ADDRESS <<= 8;
-			LOGICAL_BLOCK_ADDRESS  |= fullCDB [3];
-			LOGICAL_BLOCK_ADDRESS <<= 8;
-			LOGICAL_BLOCK_ADDRESS  |= fullCDB [4];
-			LOGICAL_BLOCK_ADDRESS <<= 8;
-			LOGICAL_BLOCK_ADDRESS  |= fullCDB [5];
-			
-			TRANSFER_LENGTH   = fullCDB [7];
-			TRANSFER_LENGTH <<= 8;
-			TRANSFER_LENGTH  |= fullCDB [8];
-			
-			printf ( "kSCSICmd_READ_10, LBA = %p, length = %p\n", ( void * ) LOGICAL_BLOCK_ADDRESS, ( void * ) TRANSFER_LENGTH );
-			
-		}
-		break;
+		printf ( "Operation code 0x%02X has not yet been decoded\n", fullCDB [0] );
+		return;
 		
-		case kSCSICmd_WRITE_10:
-		{
-			
-			u_int32_t	LOGICAL_BLOCK_ADDRESS	= 0;
-			u_int16_t	TRANSFER_LENGTH			= 0;
-			
-			LOGICAL_BLOCK_ADDRESS   = fullCDB [2];
-			LOGICAL_BLOCK_ADDRESS <<= 8;
-			LOGICAL_BLOCK_ADDRESS  |= fullCDB [3];
-			LOGICAL_BLOCK_ADDRESS <<= 8;
-			LOGICAL_BLOCK_ADDRESS  |= fullCDB [4];
-			LOGICAL_BLOCK_ADDRESS <<= 8;
-			LOGICAL_BLOCK_ADDRESS  |= fullCDB [5];
-			
-			TRANSFER_LENGTH   = fullCDB [7];
-			TRANSFER_LENGTH <<= 8;
-			TRANSFER_LENGTH  |= fullCDB [8];
-			
-			printf ( "kSCSICmd_WRITE_10, LBA = %p, length = %p\n", ( void * ) LOGICAL_BLOCK_ADDRESS, ( void * ) TRANSFER_LENGTH );
-			
-		}
-		break;
-			
-		default:
+	}
+	
+	printf ( "%s", spec->name );
+	
+	for ( i = 0; ( i < kCDBMaxFields ) && ( spec->fields [ i ].bytes != 0 ); i++ )
+	{
+		
+		field = &spec->fields [ i ];
+		value = CDBFieldValue ( field, fullCDB );
+		
+		// Single bit flags are only worth printing when set.
+		if ( ( field->bits == 1 ) && ( value == 0 ) )
 		{
-			printf ( "This command has not yet been decoded\n" );
+			continue;
 		}
-		break;
+		
+		printf ( ", %s = 0x%llx", field->name, ( unsigned long long ) value );
 		
 	}
 	
+	printf ( "\n" );
+	
 }
 
 
@@ -889,10 +1255,10 @@ PrintTimeStamp ( void )
 }
 
 //-----------------------------------------------------------------------------
-//	CollectTrace
+//	CollectTrace - Returns how full, in percent, the kernel buffer was found.
 //-----------------------------------------------------------------------------
 
-static void
+static int
 CollectTrace ( void )
 {
 	
@@ -901,6 +1267,7 @@ CollectTrace ( void )
 	int				count;
 	size_t 			needed;
 	kbufinfo_t 		bufinfo = { 0, 0, 0, 0, 0 };
+	kd_buf			lost;
 	
 	/* Get kernel buffer information */
 	GetTraceBufferInfo ( &bufinfo );
@@ -924,70 +1291,379 @@ CollectTrace ( void )
 		EnableTraceBuffer ( 0 );
 		EnableTraceBuffer ( 1 );
 		
+		// The oldest events were overwritten before this drain, say where the hole is.
+		gCaptureWraps++;
+		
+		if ( count > 0 )
+		{
+			
+			bzero ( &lost, sizeof ( lost ) );
+			lost.debugid	= kLostEventsEntry;
+			lost.timestamp	= gTraceBuffer [ 0 ].timestamp & KDBG_TIMESTAMP_MASK;
+			lost.arg1		= gCaptureLastTimestamp;
+			
+			fprintf ( stderr, "Trace buffer wrapped, events between %lld and %lld us were lost\n",
+					  ( long long ) ( gCaptureLastTimestamp / gDivisor ), ( long long ) ( lost.timestamp / gDivisor ) );
+			
+			if ( gWriteToTraceFile == TRUE )
+			{
+				WriteTraceOutputFile ( &lost );
+			}
+			
+		}
+		
 	}
 	
 	for ( index = 0; index < count; index++ )
 	{
 		
+		// Filter before anything is decoded, formatted or written.
+		if ( CaptureFilterAccepts ( &gTraceBuffer [ index ] ) == FALSE )
+		{
+			continue;
+		}
+		
         // Print trace data to stdout.
         if ( gWriteToTraceFile == FALSE )
         {
             
-            int 				debugID;
-            int 				type;
+            if ( gAnalyze == TRUE )
+            {
+                AnalyzeKernelTracePoint ( gTraceBuffer [ index ] );
+            }
             
-            debugID = gTraceBuffer[index].debugid;
-            type	= debugID & ~( DBG_FUNC_START | DBG_FUNC_END );
+            else if ( gExportFormat != kExportFormatNone )
+            {
+                ExportKernelTracePoint ( gTraceBuffer [ index ] );
+            }
             
-            //printf ("type = 0x%x\n", UMC_TRACE ( 0x0 ), UMC_TRACE ( 0xFFF ) );
-            ParseKernelTracePoint ( gTraceBuffer [ index ] );
+            else
+            {
+                ParseKernelTracePoint ( gTraceBuffer [ index ] );
+            }
         }
         
-        // Save trace point data to a file.
+        // Save trace point data to a file, flushed once per drain below.
         else
         {
-            
-            int 				debugID;
-            int 				type;
-            
-            debugID = gTraceBuffer[index].debugid;
-            type	= debugID & ~( DBG_FUNC_START | DBG_FUNC_END );
-            
-            if ( ( type >= 0x05278800 ) && ( type <= 0x05278BFC ) )
-            {
-                
-                fwrite (    ( const void * ) & ( gTraceBuffer [ index ] ),
-                            sizeof ( kd_buf ),
-                            1,
-                            gTraceFileStream );
-                
-                fflush (    gTraceFileStream );
-                
-            }
-           
+            WriteTraceOutputFile ( &gTraceBuffer [ index ] );
         }
 		
 	}
 	
+	if ( count > 0 )
+	{
+		gCaptureLastTimestamp = gTraceBuffer [ count - 1 ].timestamp & KDBG_TIMESTAMP_MASK;
+	}
+	
 	fflush ( 0 );
 	
+	if ( ( bufinfo.flags & KDBG_WRAPPED ) || ( bufinfo.nkdbufs <= 0 ) )
+	{
+		return 100;
+	}
+	
+	return ( int ) ( ( ( int64_t ) count * 100 ) / bufinfo.nkdbufs );
+	
 }
 
 
+//-----------------------------------------------------------------------------
+//	NextDrainInterval - Halves the interval while the buffer is filling fast and
+//	drops straight to the minimum after a wrap, then backs off slowly once idle.
+//-----------------------------------------------------------------------------
+
+static useconds_t
+NextDrainInterval ( useconds_t interval, int fillPercent )
+{
+	
+	if ( fillPercent >= 100 )
+	{
+		interval = kDrainIntervalMinUSecs;
+	}
+	
+	else if ( fillPercent >= kDrainFillHighPercent )
+	{
+		interval /= 2;
+	}
+	
+	else if ( fillPercent < kDrainFillLowPercent )
+	{
+		interval += interval / 4;
+	}
+	
+	if ( interval < kDrainIntervalMinUSecs )
+	{
+		interval = kDrainIntervalMinUSecs;
+	}
+	
+	if ( interval > kDrainIntervalMaxUSecs )
+	{
+		interval = kDrainIntervalMaxUSecs;
+	}
+	
+	return interval;
+	
+}
 
 
 //-----------------------------------------------------------------------------
-//	CreateTraceOutputFile
+//	CaptureFilterAccepts - Applies -e, -D, -l and -o. Only UMC tracepoints are
+//	kept. The LUN and opcode are only in a command's first record, later ones
+//	get the same answer through gCaptureCommands; records that are not about
+//	one command are kept.
 //-----------------------------------------------------------------------------
 
-static void
-CreateTraceOutputFile ( void )
+static boolean_t
+CaptureFilterAccepts ( const kd_buf * inTracePoint )
 {
-    
-    char timestring [ 30 ];
-    time_t currentTime = time ( NULL );
-    
-    // Did the user not supply a preferred file path?
+	
+	CaptureCommand *	command;
+	uint32_t			type;
+	uint32_t			driver;
+	uint64_t			key;
+	int					lun;
+	int					opcode;
+	boolean_t			accepted;
+	
+	type = inTracePoint->debugid & ~( DBG_FUNC_START | DBG_FUNC_END );
+	
+	if ( ( type < UMC_TRACE ( 0 ) ) || ( type > UMC_TRACE ( 0xFF ) ) )
+	{
+		return FALSE;
+	}
+	
+	if ( ( gCaptureCategories & USBTraceCategory ( type ) ) == 0 )
+	{
+		return FALSE;
+	}
+	
+	// Subclass tracepoints carry the subclass in arg1, not the driver.
+	if ( type == kSubclassUseCode )
+	{
+		return TRUE;
+	}
+	
+	driver = ( uint32_t ) inTracePoint->arg1;
+	
+	if ( ( gCaptureFilterDriver == TRUE ) && ( driver != gCaptureDriver ) )
+	{
+		return FALSE;
+	}
+	
+	if ( ( gCaptureLUN < 0 ) && ( gCaptureOpcode < 0 ) )
+	{
+		return TRUE;
+	}
+	
+	switch ( type )
+	{
+		
+		case kSCSICommandCode:
+		{
+			
+			key = kCaptureTagKey | ( ( inTracePoint->arg4 >> 16 ) & 0xFFFF );
+			
+			if ( ( inTracePoint->debugid & DBG_FUNC_START ) == 0 )
+			{
+				break;
+			}
+			
+			lun		= ( inTracePoint->arg4 >> 8 ) & 0xF;
+			opcode	= inTracePoint->arg4 & 0xFF;
+			
+			accepted = ( ( gCaptureLUN < 0 ) || ( gCaptureLUN == lun ) ) &&
+					   ( ( gCaptureOpcode < 0 ) || ( gCaptureOpcode == opcode ) );
+			
+			command = CaptureFindCommand ( driver, key, TRUE );
+			command->accepted = accepted;
+			
+			return accepted;
+			
+		}
+		
+		// The raw CDB has no LUN, only -o applies to it.
+		case kCDBLog1Code:
+		{
+			
+			key		= inTracePoint->arg2;
+			opcode	= inTracePoint->arg3 & 0xFF;
+			
+			accepted = ( gCaptureOpcode < 0 ) || ( gCaptureOpcode == opcode );
+			
+			command = CaptureFindCommand ( driver, key, TRUE );
+			command->accepted = accepted;
+			
+			return accepted;
+			
+		}
+		
+		case kCDBLog2Code:
+		case kCompleteSCSICommandCode:
+		{
+			
+			key = inTracePoint->arg2;
+			
+		}
+		break;
+		
+		default:
+		{
+			return TRUE;
+		}
+		
+	}
+	
+	// A command whose first record was not seen is kept, the filter cannot tell.
+	command = CaptureFindCommand ( driver, key, FALSE );
+	if ( command == NULL )
+	{
+		return TRUE;
+	}
+	
+	accepted = command->accepted;
+	
+	if ( type != kCDBLog2Code )
+	{
+		command->used = FALSE;
+	}
+	
+	return accepted;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	CaptureFindCommand
+//-----------------------------------------------------------------------------
+
+static CaptureCommand *
+CaptureFindCommand ( uint32_t driver, uint64_t key, boolean_t create )
+{
+	
+	CaptureCommand *	entry	= NULL;
+	CaptureCommand *	empty	= NULL;
+	uint32_t			home;
+	unsigned int		i;
+	
+	home = ( uint32_t ) ( ( driver ^ ( key * 2654435761ULL ) ) % kCaptureCommandSlots );
+	
+	for ( i = 0; i < kCaptureProbeLimit; i++ )
+	{
+		
+		entry = &gCaptureCommands [ ( home + i ) % kCaptureCommandSlots ];
+		
+		if ( entry->used == TRUE )
+		{
+			
+			if ( ( entry->driver == driver ) && ( entry->key == key ) )
+			{
+				return entry;
+			}
+			
+		}
+		
+		else if ( empty == NULL )
+		{
+			empty = entry;
+		}
+		
+	}
+	
+	if ( create == FALSE )
+	{
+		return NULL;
+	}
+	
+	// Commands whose last record was lost pile up; make room by dropping one.
+	if ( empty == NULL )
+	{
+		empty = &gCaptureCommands [ home ];
+	}
+	
+	bzero ( empty, sizeof ( CaptureCommand ) );
+	empty->used		= TRUE;
+	empty->driver	= driver;
+	empty->key		= key;
+	
+	return empty;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	ParseTraceCategories - Turns the comma separated -e list into a mask.
+//-----------------------------------------------------------------------------
+
+static uint32_t
+ParseTraceCategories ( const char * inList )
+{
+	
+	char			list [ 256 ];
+	char *			cursor;
+	char *			name;
+	uint32_t		categories	= 0;
+	unsigned int	i;
+	
+	if ( strlcpy ( list, inList, sizeof ( list ) ) >= sizeof ( list ) )
+	{
+		Quit ( "The -e argument is too long\n" );
+	}
+	
+	cursor = list;
+	
+	while ( ( name = strsep ( &cursor, "," ) ) != NULL )
+	{
+		
+		if ( name[0] == 0 )
+		{
+			continue;
+		}
+		
+		for ( i = 0; i < ( sizeof ( kTraceCategorySpecs ) / sizeof ( kTraceCategorySpecs[0] ) ); i++ )
+		{
+			
+			if ( strcmp ( name, kTraceCategorySpecs[i].name ) == 0 )
+			{
+				
+				categories |= kTraceCategorySpecs[i].category;
+				break;
+				
+			}
+			
+		}
+		
+		if ( i == ( sizeof ( kTraceCategorySpecs ) / sizeof ( kTraceCategorySpecs[0] ) ) )
+		{
+			Quit ( "Unknown event class given with -e\n" );
+		}
+		
+	}
+	
+	if ( categories == 0 )
+	{
+		Quit ( "No event class given with -e\n" );
+	}
+	
+	return categories;
+	
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+//	CreateTraceOutputFile
+//-----------------------------------------------------------------------------
+
+static void
+CreateTraceOutputFile ( void )
+{
+    
+    char timestring [ 30 ];
+    time_t currentTime = time ( NULL );
+    
+    // Did the user not supply a preferred file path?
     if ( gTraceFilePath[0] == 0 )
     {
         
@@ -1001,150 +1677,243 @@ CreateTraceOutputFile ( void )
     }
     
     gTraceFileStream = fopen ( gTraceFilePath, "w+" );
+    if ( gTraceFileStream == NULL )
+    {
+        Quit ( "Could not create the trace file\n" );
+    }
+    
+    if ( gCompactTraceFile == TRUE )
+    {
+        
+        gTraceFileWriter = UMCCompactWriterCreate ( gTraceFileStream );
+        if ( gTraceFileWriter == NULL )
+        {
+            Quit ( "Could not write the compact trace file header\n" );
+        }
+        
+    }
     
 }
 
 
 //-----------------------------------------------------------------------------
-//	ParseTraceFile
+//	WriteTraceOutputFile
 //-----------------------------------------------------------------------------
 
 static void
-ParseTraceFile ( )
+WriteTraceOutputFile ( const kd_buf * inTracePoint )
 {
     
-    FILE * traceFile;
-    
-    traceFile = fopen ( gTraceFilePath, "r" );
-    kd_buf kp;
-	bzero( &kp, sizeof ( kd_buf ) );
-	
-	if ( traceFile )
-	{
+    if ( gTraceFileWriter != NULL )
+    {
         
-		while ( fread ( &kp, sizeof ( kd_buf ), 1, traceFile ) )
-		{
-            
-			kd_buf tracepoint;
-			bzero ( &tracepoint, sizeof ( kd_buf ) );
-			
-			if ( kp.debugid == kInvalid )
-			{
-                
-				printf ( "Found an invalid entry in raw file.\n" );
-				continue;
-                
-			}
-			
-			if ( kp.debugid == kDivisorEntry )
-			{
-                
-				gDivisor = ( double )( kp.timestamp );
-				printf ( "Found divisor %f as 0x%llx\n", gDivisor, kp.timestamp );
-                
-			}
-			else
-			{
-				
-				// send tracepoint to be processed
-				ParseKernelTracePoint ( kp );
-                
-			}
-            
-		}
-		
-		fclose ( traceFile );
+        // Compact entries go out a block at a time.
+        if ( UMCCompactWriterAppend ( gTraceFileWriter, inTracePoint, 1 ) != 0 )
+        {
+            Quit ( "Could not write to the compact trace file\n" );
+        }
         
-	}
+    }
     
-	else
+    else
     {
-        Quit ( "Could not open specified trace file :(\n" );
+        fwrite ( inTracePoint, sizeof ( kd_buf ), 1, gTraceFileStream );
     }
     
 }
 
 
 //-----------------------------------------------------------------------------
-//	StringFromReturnCode
+//	CloseTraceOutputFile - Writes out the last compact block.
 //-----------------------------------------------------------------------------
 
 static void
-ParseKernelTracePoint ( kd_buf inTracePoint )
+CloseTraceOutputFile ( void )
 {
     
+    UMCCompactWriter *	writer = gTraceFileWriter;
     
-    int 				debugID;
-    int 				type;
-    uint64_t 			now;
-    const char *		errorString;
-    
-    debugID = inTracePoint.debugid;
-    type	= debugID & ~( DBG_FUNC_START | DBG_FUNC_END );
-    
-    now = inTracePoint.timestamp & KDBG_TIMESTAMP_MASK;
-    current_usecs = ( int64_t )( now / gDivisor );
-    
-    
+    // Cleared first, Quit ( ) ends up here as well.
+    gTraceFileWriter = NULL;
     
-    if ( ( type >= 0x05278800 ) && ( type <= 0x05278BFC ) && ( type != kCDBLog2Code ) )
+    if ( ( writer != NULL ) && ( UMCCompactWriterClose ( writer ) != 0 ) )
     {
-        PrintTimeStamp ( );
+        fprintf ( stderr, "Could not write the end of the compact trace file\n" );
     }
     
-    switch ( type )
+    if ( gTraceFileStream != NULL )
     {
-            
-#pragma mark -
-#pragma mark *** Generic UMC Codes ***
-#pragma mark -
-			
-        case kAbortedTaskCode:
-        {
-            printf ( "[%10p] Task %p Aborted!!!\n", ( void * ) inTracePoint.arg1, ( void * ) inTracePoint.arg2 );
-        }
-        break;
-			
-        case kAbortCurrentSCSITaskCode:
-        {
-            printf ( "[%10p] Aborted currentTask %p DeviceAttached = %d ConsecutiveResetCount = %d\n",
-                    ( void * ) inTracePoint.arg1, ( void * ) inTracePoint.arg2,
-                    ( int ) inTracePoint.arg3, ( int ) inTracePoint.arg4 );
-        }
-        break;
-            
-        case kCompleteSCSICommandCode:
-        {
-            
-            printf ( "[%10p] Task %p Completed with serviceResponse = %d taskStatus = 0x%x\n",
-                    ( void * ) inTracePoint.arg1, ( void * ) inTracePoint.arg2,
-                    ( int ) inTracePoint.arg3, ( int ) inTracePoint.arg4 );
-            PrintTimeStamp ( );
-            printf ( "[%10p] -------------------------------------------------\n", ( void * ) inTracePoint.arg1 );
-            
-        }
-        break;
-			
-        case kCompletingCommandWithErrorCode:
-        {
-            printf ( "[%10p] !!!!! Hark !!!!! Completing command with an ERROR status!\n", ( void * ) inTracePoint.arg1 );
-        }
-        break;
-            
-        case kLUNConfigurationCompleteCode:
-        {
-            printf ( "[%10p] MaxLUN = %u\n", ( void * ) inTracePoint.arg1, ( unsigned int ) inTracePoint.arg2 );
-        }
-        break;
-			
-        case kNewCommandWhileTerminatingCode:
-        {
-            printf ( "[%10p] Task = %p received while terminating!!!\n", ( void * ) inTracePoint.arg1, ( void * ) inTracePoint.arg2 );
-        }
-        break;
-			
-        case kIOUMCStorageCharacDictFoundCode:
-        {
+        
+        fclose ( gTraceFileStream );
+        gTraceFileStream = NULL;
+        
+    }
+    
+}
+
+
+//-----------------------------------------------------------------------------
+//	ParseTraceFile
+//-----------------------------------------------------------------------------
+
+static void
+ParseTraceFile ( )
+{
+	
+	int		error;
+	
+	// Chunks of the file are sorted on every CPU, the entries come back here in order.
+	error = UMCParseTraceFile ( gTraceFilePath, gNumCPUs, ParseTraceFileEntry, NULL );
+	if ( error != 0 )
+	{
+		Quit ( "Could not read specified trace file :(\n" );
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	ParseTraceFileEntry
+//-----------------------------------------------------------------------------
+
+static void
+ParseTraceFileEntry ( const kd_buf * inTracePoint, void * inRefCon )
+{
+	
+	// Keep exported JSON clean.
+	FILE *	messages = ( gExportFormat != kExportFormatNone ) ? stderr : stdout;
+	
+	( void ) inRefCon;
+	
+	if ( inTracePoint->debugid == kInvalid )
+	{
+		
+		fprintf ( messages, "Found an invalid entry in raw file.\n" );
+		return;
+		
+	}
+	
+	if ( inTracePoint->debugid == kDivisorEntry )
+	{
+		
+		gDivisor = ( double ) ( inTracePoint->timestamp );
+		fprintf ( messages, "Found divisor %f as 0x%llx\n", gDivisor, inTracePoint->timestamp );
+		
+	}
+	
+	else if ( inTracePoint->debugid == kLostEventsEntry )
+	{
+		
+		fprintf ( messages, "Trace buffer wrapped during capture, events between %lld and %lld us were lost\n",
+				  ( long long ) ( inTracePoint->arg1 / gDivisor ), ( long long ) ( inTracePoint->timestamp / gDivisor ) );
+		
+	}
+	
+	// -e, -D, -l and -o work on raw files as well.
+	else if ( CaptureFilterAccepts ( inTracePoint ) == FALSE )
+	{
+		return;
+	}
+	
+	// send tracepoint to be processed
+	else if ( gAnalyze == TRUE )
+	{
+		AnalyzeKernelTracePoint ( *inTracePoint );
+	}
+	
+	else if ( gExportFormat != kExportFormatNone )
+	{
+		ExportKernelTracePoint ( *inTracePoint );
+	}
+	
+	else
+	{
+		ParseKernelTracePoint ( *inTracePoint );
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	StringFromReturnCode
+//-----------------------------------------------------------------------------
+
+static void
+ParseKernelTracePoint ( kd_buf inTracePoint )
+{
+    
+    
+    int 				debugID;
+    int 				type;
+    uint64_t 			now;
+    const char *		errorString;
+    
+    debugID = inTracePoint.debugid;
+    type	= debugID & ~( DBG_FUNC_START | DBG_FUNC_END );
+    
+    now = inTracePoint.timestamp & KDBG_TIMESTAMP_MASK;
+    current_usecs = ( int64_t )( now / gDivisor );
+    
+    
+    
+    if ( ( type >= 0x05278800 ) && ( type <= 0x05278BFC ) && ( type != kCDBLog2Code ) )
+    {
+        PrintTimeStamp ( );
+    }
+    
+    switch ( type )
+    {
+            
+#pragma mark -
+#pragma mark *** Generic UMC Codes ***
+#pragma mark -
+			
+        case kAbortedTaskCode:
+        {
+            printf ( "[%10p] Task %p Aborted!!!\n", ( void * ) inTracePoint.arg1, ( void * ) inTracePoint.arg2 );
+        }
+        break;
+			
+        case kAbortCurrentSCSITaskCode:
+        {
+            printf ( "[%10p] Aborted currentTask %p DeviceAttached = %d ConsecutiveResetCount = %d\n",
+                    ( void * ) inTracePoint.arg1, ( void * ) inTracePoint.arg2,
+                    ( int ) inTracePoint.arg3, ( int ) inTracePoint.arg4 );
+        }
+        break;
+            
+        case kCompleteSCSICommandCode:
+        {
+            
+            printf ( "[%10p] Task %p Completed with serviceResponse = %d taskStatus = 0x%x\n",
+                    ( void * ) inTracePoint.arg1, ( void * ) inTracePoint.arg2,
+                    ( int ) inTracePoint.arg3, ( int ) inTracePoint.arg4 );
+            PrintTimeStamp ( );
+            printf ( "[%10p] -------------------------------------------------\n", ( void * ) inTracePoint.arg1 );
+            
+        }
+        break;
+			
+        case kCompletingCommandWithErrorCode:
+        {
+            printf ( "[%10p] !!!!! Hark !!!!! Completing command with an ERROR status!\n", ( void * ) inTracePoint.arg1 );
+        }
+        break;
+            
+        case kLUNConfigurationCompleteCode:
+        {
+            printf ( "[%10p] MaxLUN = %u\n", ( void * ) inTracePoint.arg1, ( unsigned int ) inTracePoint.arg2 );
+        }
+        break;
+			
+        case kNewCommandWhileTerminatingCode:
+        {
+            printf ( "[%10p] Task = %p received while terminating!!!\n", ( void * ) inTracePoint.arg1, ( void * ) inTracePoint.arg2 );
+        }
+        break;
+			
+        case kIOUMCStorageCharacDictFoundCode:
+        {
             printf ( "[%10p] This device has a USB Characteristics Dictionary\n", ( void * ) inTracePoint.arg1 );
         }
         break;
@@ -1195,6 +1964,39 @@ ParseKernelTracePoint ( kd_buf inTracePoint )
         }
         break;
 			
+        case kSCSICommandCode:
+        {
+            
+            if ( ( debugID & DBG_FUNC_START ) != 0 )
+            {
+                
+                // LBA bits 32-35 are carried in arg4.
+                printf ( "[%10p] LUN %u Tag %u %s LBA 0x%llx Length %u\n",
+                        ( void * ) inTracePoint.arg1,
+                        ( unsigned int ) ( ( inTracePoint.arg4 >> 8 ) & 0xF ),
+                        ( unsigned int ) ( ( inTracePoint.arg4 >> 16 ) & 0xFFFF ),
+                        StringFromOperationCode ( inTracePoint.arg4 & 0xFF ),
+                        ( ( ( unsigned long long ) ( ( inTracePoint.arg4 >> 12 ) & 0xF ) ) << 32 ) | ( inTracePoint.arg2 & 0xFFFFFFFF ),
+                        ( unsigned int ) inTracePoint.arg3 );
+                
+            }
+            
+            else
+            {
+                
+                printf ( "[%10p] Tag %u done in %u us, %u bytes, serviceResponse = %d taskStatus = 0x%x\n",
+                        ( void * ) inTracePoint.arg1,
+                        ( unsigned int ) ( ( inTracePoint.arg4 >> 16 ) & 0xFFFF ),
+                        ( unsigned int ) inTracePoint.arg2,
+                        ( unsigned int ) inTracePoint.arg3,
+                        ( int ) ( ( inTracePoint.arg4 >> 8 ) & 0xFF ),
+                        ( unsigned int ) ( inTracePoint.arg4 & 0xFF ) );
+                
+            }
+            
+        }
+        break;
+			
         case kCDBLog1Code:
         {
             
@@ -1369,130 +2171,1075 @@ ParseKernelTracePoint ( kd_buf inTracePoint )
         }
         break;
 			
-        case kCBISendSCSICommandReturnedCode:
-        {
-            
-            errorString = StringFromReturnCode ( inTracePoint.arg3 );
-            printf ( "[%10p] CBI - SCSI Task %p was sent with status %s (0x%x)\n",
-                    ( void * ) inTracePoint.arg1, ( void * ) inTracePoint.arg2, errorString, ( unsigned int ) inTracePoint.arg3 );
-            
-        }
-        break;
+        case kCBISendSCSICommandReturnedCode:
+        {
+            
+            errorString = StringFromReturnCode ( inTracePoint.arg3 );
+            printf ( "[%10p] CBI - SCSI Task %p was sent with status %s (0x%x)\n",
+                    ( void * ) inTracePoint.arg1, ( void * ) inTracePoint.arg2, errorString, ( unsigned int ) inTracePoint.arg3 );
+            
+        }
+        break;
+			
+#pragma mark -
+#pragma mark *** Bulk-Only Protocol Codes ***
+#pragma mark -
+			
+        case kBODeviceDetectedCode:
+        {
+            
+            printf ( "[%10p] BULK-ONLY transport protocol device\n", ( void * ) inTracePoint.arg1 );
+            
+        }
+        break;
+			
+        case kBOCommandAlreadyInProgressCode:
+        {
+            
+            if ( gHideBusyRejectedCommands == FALSE )
+            {
+                
+                printf ( "[%10p] B0 - Unable to accept task %p, still working on previous request\n",
+                        ( void * ) inTracePoint.arg1, ( void * ) inTracePoint.arg2 );
+                
+            }
+            
+        }
+        break;
+			
+        case kBOSendSCSICommandReturnedCode:
+        {
+            
+            errorString = StringFromReturnCode ( inTracePoint.arg3 );
+            printf ( "[%10p] BO - SCSI Task %p was sent with status %s (0x%x)\n",
+                    ( void * ) inTracePoint.arg1, ( void * ) inTracePoint.arg2, errorString, ( unsigned int ) inTracePoint.arg3 );
+            
+        }
+        break;
+			
+        case kBOPreferredMaxLUNCode:
+        {
+            
+            printf ( "[%10p] BO - Preferred MaxLUN: %d\n",
+                    ( void * ) inTracePoint.arg1, (int) inTracePoint.arg2 );
+            
+        }
+        break;
+			
+        case kBOGetMaxLUNReturnedCode:
+        {
+            
+            errorString = StringFromReturnCode ( inTracePoint.arg2 );
+            printf ( "[%10p] BO - GetMaxLUN returned: %s (0x%x), triedReset=%u, MaxLun: %d\n",
+                    ( void * ) inTracePoint.arg1, errorString, ( unsigned int ) inTracePoint.arg2, ( unsigned int ) inTracePoint.arg4, ( unsigned int ) inTracePoint.arg3 );
+            
+        }
+        break;
+			
+        case kBOCBWDescriptionCode:
+        {
+            
+            printf ( "[%10p] BO - Request %p, LUN: %u, CBW Tag: %u (0x%x)\n",
+                    ( void * ) inTracePoint.arg1, ( void * ) inTracePoint.arg2, ( unsigned int ) inTracePoint.arg3, ( unsigned int ) inTracePoint.arg4, ( unsigned int ) inTracePoint.arg4 );
+            
+        }
+        break;
+			
+        case kBOCBWBulkOutWriteResultCode:
+        {
+            
+            errorString = StringFromReturnCode ( inTracePoint.arg2 );
+            printf ( "[%10p] BO - Request %p, LUN: %u, Bulk-Out Write Status: %s (0x%x)\n",
+                    ( void * ) inTracePoint.arg1, ( void * ) inTracePoint.arg4, ( unsigned int ) inTracePoint.arg3, errorString, ( unsigned int ) inTracePoint.arg2 );
+            
+        }
+        break;
+            
+        case kBODoubleCompleteionCode:
+        {
+            
+            printf ( "[%10p] BO - DOUBLE Completion\n", ( void * ) inTracePoint.arg1 );
+            
+        }
+        break;
+			
+        case kBOCompletionDuringTerminationCode:
+        {
+            
+            printf ( "[%10p] BO - Completion during termination\n", ( void * ) inTracePoint.arg1 );
+            
+        }
+        break;
+			
+        case kBOCompletionCode:
+        {
+            
+            errorString = StringFromReturnCode ( inTracePoint.arg2 );
+            printf ( "[%10p] BO - Completion, State: %s, Status: %s (0x%x), for Request: %p\n",
+                    ( void * ) inTracePoint.arg1, kBulkOnlyStateNames [ (int) inTracePoint.arg3 ],
+                    errorString, ( unsigned int ) inTracePoint.arg2, ( void * ) inTracePoint.arg4 );
+            
+        }
+        break;
+			
+        default:
+        {
+            
+            if ( ( type >= 0x05278800 ) && ( type <= 0x05278BFC ) )
+            {
+                printf ( "[%10p] ??? - UNEXPECTED USB TRACE POINT - %p\n", ( void * ) inTracePoint.arg1, ( void * ) type );
+            }
+            
+        }
+        break;
+			
+    }
+    
+}
+
+
+//-----------------------------------------------------------------------------
+//	AnalyzerBucketFromLatency
+//-----------------------------------------------------------------------------
+
+static uint32_t
+AnalyzerBucketFromLatency ( uint32_t latencyUSecs )
+{
+	
+	uint32_t	shift = 0;
+	
+	if ( latencyUSecs < ( 2 * kAnalyzerSubBuckets ) )
+	{
+		return latencyUSecs;
+	}
+	
+	while ( ( latencyUSecs >> shift ) >= ( 2 * kAnalyzerSubBuckets ) )
+	{
+		shift++;
+	}
+	
+	return ( ( shift + 1 ) * kAnalyzerSubBuckets ) + ( latencyUSecs >> shift ) - kAnalyzerSubBuckets;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	AnalyzerLatencyFromBucket - Returns the lowest latency in the bucket.
+//-----------------------------------------------------------------------------
+
+static uint32_t
+AnalyzerLatencyFromBucket ( uint32_t bucket )
+{
+	
+	uint32_t	shift;
+	
+	if ( bucket < ( 2 * kAnalyzerSubBuckets ) )
+	{
+		return bucket;
+	}
+	
+	shift = ( bucket / kAnalyzerSubBuckets ) - 1;
+	
+	return ( ( bucket % kAnalyzerSubBuckets ) + kAnalyzerSubBuckets ) << shift;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	AnalyzerPercentile - perMille is 500 for the median, 999 for p99.9.
+//-----------------------------------------------------------------------------
+
+static uint32_t
+AnalyzerPercentile ( AnalyzerOpcodeStats * stats, uint32_t perMille )
+{
+	
+	uint64_t	target;
+	uint64_t	seen	= 0;
+	uint32_t	bucket;
+	uint32_t	latency;
+	
+	target = ( ( stats->count * perMille ) + 999 ) / 1000;
+	
+	for ( bucket = 0; bucket < kAnalyzerBuckets; bucket++ )
+	{
+		
+		seen += stats->buckets [ bucket ];
+		if ( ( seen != 0 ) && ( seen >= target ) )
+		{
+			
+			latency = AnalyzerLatencyFromBucket ( bucket );
+			return ( latency < stats->maxUSecs ) ? latency : stats->maxUSecs;
+			
+		}
+		
+	}
+	
+	return stats->maxUSecs;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	AnalyzerDriverFor
+//-----------------------------------------------------------------------------
+
+static AnalyzerDriver *
+AnalyzerDriverFor ( uint64_t driver )
+{
+	
+	unsigned int	i;
+	
+	for ( i = 0; i < kAnalyzerDrivers; i++ )
+	{
+		
+		if ( gAnalyzeDrivers [ i ].driver == driver )
+		{
+			return &gAnalyzeDrivers [ i ];
+		}
+		
+		if ( gAnalyzeDrivers [ i ].driver == 0 )
+		{
+			
+			gAnalyzeDrivers [ i ].driver = driver;
+			return &gAnalyzeDrivers [ i ];
+			
+		}
+		
+	}
+	
+	// Any further drivers are lumped into the last entry.
+	return &gAnalyzeDrivers [ kAnalyzerDrivers - 1 ];
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	AnalyzerFindInFlight
+//-----------------------------------------------------------------------------
+
+static AnalyzerInFlight *
+AnalyzerFindInFlight ( uint64_t driver, uint64_t key, boolean_t create )
+{
+	
+	AnalyzerInFlight *	entry	= NULL;
+	AnalyzerInFlight *	empty	= NULL;
+	uint32_t			home;
+	unsigned int		i;
+	
+	home = ( uint32_t ) ( ( driver ^ ( key * 2654435761ULL ) ) % kAnalyzerInFlightSlots );
+	
+	for ( i = 0; i < kAnalyzerProbeLimit; i++ )
+	{
+		
+		entry = &gAnalyzeInFlight [ ( home + i ) % kAnalyzerInFlightSlots ];
+		
+		if ( entry->used == TRUE )
+		{
+			
+			if ( ( entry->driver == driver ) && ( entry->key == key ) )
+			{
+				return entry;
+			}
+			
+		}
+		
+		else if ( empty == NULL )
+		{
+			empty = entry;
+		}
+		
+	}
+	
+	if ( create == FALSE )
+	{
+		return NULL;
+	}
+	
+	// Commands whose completion was lost pile up; make room by dropping one.
+	if ( empty == NULL )
+	{
+		
+		empty = &gAnalyzeInFlight [ home ];
+		AnalyzerDriverFor ( empty->driver )->inFlight--;
+		
+	}
+	
+	bzero ( empty, sizeof ( AnalyzerInFlight ) );
+	empty->used		= TRUE;
+	empty->driver	= driver;
+	empty->key		= key;
+	
+	AnalyzerDriverFor ( driver )->inFlight++;
+	
+	return empty;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	AnalyzerComplete
+//-----------------------------------------------------------------------------
+
+static void
+AnalyzerComplete ( AnalyzerInFlight * entry, uint32_t latencyUSecs, uint32_t bytes )
+{
+	
+	AnalyzerOpcodeStats *	stats;
+	AnalyzerDriver *		driver;
+	unsigned int			fastest = 0;
+	unsigned int			i;
+	
+	entry->used = FALSE;
+	
+	driver = AnalyzerDriverFor ( entry->driver );
+	driver->commands++;
+	driver->bytes += bytes;
+	if ( driver->inFlight > 0 )
+	{
+		driver->inFlight--;
+	}
+	
+	stats = gAnalyzeOpcodes [ entry->opcode ];
+	if ( stats == NULL )
+	{
+		
+		stats = ( AnalyzerOpcodeStats * ) calloc ( 1, sizeof ( AnalyzerOpcodeStats ) );
+		if ( stats == NULL )
+		{
+			return;
+		}
+		
+		gAnalyzeOpcodes [ entry->opcode ] = stats;
+		
+	}
+	
+	stats->count++;
+	stats->bytes += bytes;
+	stats->buckets [ AnalyzerBucketFromLatency ( latencyUSecs ) ]++;
+	if ( latencyUSecs > stats->maxUSecs )
+	{
+		stats->maxUSecs = latencyUSecs;
+	}
+	
+	// Keep the slowest commands of the window.
+	for ( i = 1; i < kAnalyzerOutliers; i++ )
+	{
+		
+		if ( gAnalyzeOutliers [ i ].latencyUSecs < gAnalyzeOutliers [ fastest ].latencyUSecs )
+		{
+			fastest = i;
+		}
+		
+	}
+	
+	if ( latencyUSecs > gAnalyzeOutliers [ fastest ].latencyUSecs )
+	{
+		
+		gAnalyzeOutliers [ fastest ].driver			= entry->driver;
+		gAnalyzeOutliers [ fastest ].key			= entry->key;
+		gAnalyzeOutliers [ fastest ].lba			= entry->lba;
+		gAnalyzeOutliers [ fastest ].length			= entry->length;
+		gAnalyzeOutliers [ fastest ].latencyUSecs	= latencyUSecs;
+		gAnalyzeOutliers [ fastest ].opcode			= entry->opcode;
+		
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	AnalyzeKernelTracePoint - Pairs command starts with their completions. The
+//	kSCSICommand records are used when the trace has them, older traces fall
+//	back to kCDBLog1 and kCompleteSCSICommand.
+//-----------------------------------------------------------------------------
+
+static void
+AnalyzeKernelTracePoint ( kd_buf inTracePoint )
+{
+	
+	AnalyzerInFlight *	entry;
+	int 				debugID;
+	int 				type;
+	unsigned int		i;
+	
+	debugID = inTracePoint.debugid;
+	type	= debugID & ~( DBG_FUNC_START | DBG_FUNC_END );
+	
+	current_usecs = ( int64_t ) ( ( inTracePoint.timestamp & KDBG_TIMESTAMP_MASK ) / gDivisor );
+	
+	if ( gAnalyzeWindowStartUSecs < 0 )
+	{
+		gAnalyzeWindowStartUSecs = current_usecs;
+	}
+	
+	gAnalyzeLastUSecs = current_usecs;
+	
+	switch ( type )
+	{
+		
+		case kSCSICommandCode:
+		{
+			
+			// Drop anything started from kCDBLog1, its completion is no longer looked for.
+			if ( gSawCommandRecords == FALSE )
+			{
+				
+				gSawCommandRecords = TRUE;
+				bzero ( gAnalyzeInFlight, sizeof ( gAnalyzeInFlight ) );
+				
+				for ( i = 0; i < kAnalyzerDrivers; i++ )
+				{
+					gAnalyzeDrivers [ i ].inFlight = 0;
+				}
+				
+			}
+			
+			if ( ( debugID & DBG_FUNC_START ) != 0 )
+			{
+				
+				entry = AnalyzerFindInFlight ( inTracePoint.arg1, ( inTracePoint.arg4 >> 16 ) & 0xFFFF, TRUE );
+				
+				entry->startUSecs	= current_usecs;
+				entry->opcode		= inTracePoint.arg4 & 0xFF;
+				entry->lba			= ( ( ( uint64_t ) ( ( inTracePoint.arg4 >> 12 ) & 0xF ) ) << 32 ) | ( inTracePoint.arg2 & 0xFFFFFFFF );
+				entry->length		= ( uint32_t ) inTracePoint.arg3;
+				
+			}
+			
+			else
+			{
+				
+				entry = AnalyzerFindInFlight ( inTracePoint.arg1, ( inTracePoint.arg4 >> 16 ) & 0xFFFF, FALSE );
+				if ( entry != NULL )
+				{
+					AnalyzerComplete ( entry, ( uint32_t ) inTracePoint.arg2, ( uint32_t ) inTracePoint.arg3 );
+				}
+				
+				else
+				{
+					gAnalyzeUnmatched++;
+				}
+				
+			}
+			
+		}
+		break;
+		
+		case kCDBLog1Code:
+		{
+			
+			if ( gSawCommandRecords == FALSE )
+			{
+				
+				entry = AnalyzerFindInFlight ( inTracePoint.arg1, inTracePoint.arg2, TRUE );
+				
+				entry->startUSecs	= current_usecs;
+				entry->opcode		= inTracePoint.arg3 & 0xFF;
+				
+			}
+			
+		}
+		break;
+		
+		case kCompleteSCSICommandCode:
+		{
+			
+			if ( gSawCommandRecords == FALSE )
+			{
+				
+				entry = AnalyzerFindInFlight ( inTracePoint.arg1, inTracePoint.arg2, FALSE );
+				if ( entry != NULL )
+				{
+					AnalyzerComplete ( entry, ( uint32_t ) ( current_usecs - entry->startUSecs ), 0 );
+				}
+				
+				else
+				{
+					gAnalyzeUnmatched++;
+				}
+				
+			}
+			
+		}
+		break;
+		
+		default:
+			break;
+		
+	}
+	
+	if ( ( gAnalyzeIntervalUSecs != 0 ) && ( ( current_usecs - gAnalyzeWindowStartUSecs ) >= gAnalyzeIntervalUSecs ) )
+	{
+		AnalyzerReport ( );
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	AnalyzerReport - Prints the window and starts a new one.
+//-----------------------------------------------------------------------------
+
+static void
+AnalyzerReport ( void )
+{
+	
+	AnalyzerOpcodeStats *	stats;
+	AnalyzerCompletion		outlier;
+	uint64_t				commands	= 0;
+	uint64_t				bytes		= 0;
+	double					seconds;
+	unsigned int			i;
+	unsigned int			j;
+	
+	seconds = ( double ) ( gAnalyzeLastUSecs - gAnalyzeWindowStartUSecs ) / kMicrosecondsPerSecond;
+	
+	for ( i = 0; i < kAnalyzerOpcodes; i++ )
+	{
+		
+		if ( gAnalyzeOpcodes [ i ] != NULL )
+		{
+			
+			commands	+= gAnalyzeOpcodes [ i ]->count;
+			bytes		+= gAnalyzeOpcodes [ i ]->bytes;
+			
+		}
+		
+	}
+	
+	printf ( "\n==== %.1f s, %llu commands, %.1f commands/s, %.2f MB/s, %llu completions without a start ====\n",
+			 seconds, commands,
+			 ( seconds > 0 ) ? commands / seconds : 0.0,
+			 ( seconds > 0 ) ? bytes / ( 1024.0 * 1024.0 ) / seconds : 0.0,
+			 gAnalyzeUnmatched );
+	
+	printf ( "%-34s %10s %10s %10s %10s %10s %10s\n", "Opcode", "Count", "p50 us", "p99 us", "p99.9 us", "max us", "MB" );
+	
+	for ( i = 0; i < kAnalyzerOpcodes; i++ )
+	{
+		
+		stats = gAnalyzeOpcodes [ i ];
+		if ( ( stats == NULL ) || ( stats->count == 0 ) )
+		{
+			continue;
+		}
+		
+		printf ( "0x%02X %-29s %10llu %10u %10u %10u %10u %10.2f\n",
+				 i, StringFromOperationCode ( i ), stats->count,
+				 AnalyzerPercentile ( stats, 500 ),
+				 AnalyzerPercentile ( stats, 990 ),
+				 AnalyzerPercentile ( stats, 999 ),
+				 stats->maxUSecs,
+				 stats->bytes / ( 1024.0 * 1024.0 ) );
+		
+	}
+	
+	printf ( "\n%-18s %10s %10s %10s\n", "Driver", "Commands", "MB", "In flight" );
+	
+	for ( i = 0; ( i < kAnalyzerDrivers ) && ( gAnalyzeDrivers [ i ].driver != 0 ); i++ )
+	{
+		
+		printf ( "%-18p %10llu %10.2f %10u\n",
+				 ( void * ) gAnalyzeDrivers [ i ].driver,
+				 gAnalyzeDrivers [ i ].commands,
+				 gAnalyzeDrivers [ i ].bytes / ( 1024.0 * 1024.0 ),
+				 gAnalyzeDrivers [ i ].inFlight );
+		
+	}
+	
+	// Slowest first.
+	for ( i = 0; i < kAnalyzerOutliers; i++ )
+	{
+		
+		for ( j = i + 1; j < kAnalyzerOutliers; j++ )
+		{
+			
+			if ( gAnalyzeOutliers [ j ].latencyUSecs > gAnalyzeOutliers [ i ].latencyUSecs )
+			{
+				
+				outlier					= gAnalyzeOutliers [ i ];
+				gAnalyzeOutliers [ i ]	= gAnalyzeOutliers [ j ];
+				gAnalyzeOutliers [ j ]	= outlier;
+				
+			}
+			
+		}
+		
+	}
+	
+	printf ( "\nSlowest commands\n" );
+	
+	for ( i = 0; ( i < kAnalyzerOutliers ) && ( gAnalyzeOutliers [ i ].latencyUSecs != 0 ); i++ )
+	{
+		
+		printf ( "[%10p] Tag %llu %s LBA 0x%llx Length %u took %u us\n",
+				 ( void * ) gAnalyzeOutliers [ i ].driver,
+				 gAnalyzeOutliers [ i ].key,
+				 StringFromOperationCode ( gAnalyzeOutliers [ i ].opcode ),
+				 gAnalyzeOutliers [ i ].lba,
+				 gAnalyzeOutliers [ i ].length,
+				 gAnalyzeOutliers [ i ].latencyUSecs );
+		
+	}
+	
+	fflush ( stdout );
+	
+	// Start the next window. Commands in flight carry over.
+	for ( i = 0; i < kAnalyzerOpcodes; i++ )
+	{
+		
+		if ( gAnalyzeOpcodes [ i ] != NULL )
+		{
+			bzero ( gAnalyzeOpcodes [ i ], sizeof ( AnalyzerOpcodeStats ) );
+		}
+		
+	}
+	
+	for ( i = 0; i < kAnalyzerDrivers; i++ )
+	{
+		
+		gAnalyzeDrivers [ i ].commands	= 0;
+		gAnalyzeDrivers [ i ].bytes		= 0;
+		
+	}
+	
+	bzero ( gAnalyzeOutliers, sizeof ( gAnalyzeOutliers ) );
+	gAnalyzeUnmatched			= 0;
+	gAnalyzeWindowStartUSecs	= gAnalyzeLastUSecs;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	ExportOperationName
+//-----------------------------------------------------------------------------
+
+static const char *
+ExportOperationName ( unsigned int operationCode, char * buffer, size_t size )
+{
+	
+	const char *	string = StringFromOperationCode ( operationCode );
+	
+	if ( strcmp ( string, "UNKNOWN" ) == 0 )
+	{
+		
+		snprintf ( buffer, size, "0x%02X", operationCode );
+		string = buffer;
+		
+	}
+	
+	return string;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	ExportSeparator - Chrome trace JSON is one array of events.
+//-----------------------------------------------------------------------------
+
+static void
+ExportSeparator ( void )
+{
+	
+	if ( gExportFirstEvent == TRUE )
+	{
+		
+		printf ( "[\n" );
+		gExportFirstEvent = FALSE;
+		
+	}
+	
+	else
+	{
+		printf ( ",\n" );
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	ExportChromeEvent - Commands and their phases are nestable async events on
+//	tid 1 keyed by tag, recovery work is synchronous on tid 2. A tag below zero
+//	makes a synchronous event.
+//-----------------------------------------------------------------------------
+
+static void
+ExportChromeEvent ( unsigned int	pid,
+					unsigned int	tid,
+					char			phase,
+					const char *	name,
+					int64_t			tag,
+					double			timestamp,
+					const char *	args )
+{
+	
+	ExportSeparator ( );
+	
+	printf ( "{\"ph\":\"%c\",\"cat\":\"%s\",\"name\":\"%s\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f",
+			 phase, ( phase == 'M' ) ? "__metadata" : ( ( tag < 0 ) ? "recovery" : "command" ), name, pid, tid, timestamp );
+	
+	if ( tag >= 0 )
+	{
+		printf ( ",\"id2\":{\"local\":\"0x%llx\"}", ( unsigned long long ) tag );
+	}
+	
+	if ( phase == 'i' )
+	{
+		printf ( ",\"s\":\"t\"" );
+	}
+	
+	if ( args != NULL )
+	{
+		printf ( ",\"args\":{%s}", args );
+	}
+	
+	printf ( "}" );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	ExportDriverFor - Each driver instance is a process in the Chrome export.
+//-----------------------------------------------------------------------------
+
+static ExportDriver *
+ExportDriverFor ( uint64_t driver, unsigned int * pid )
+{
+	
+	char			args [ 64 ];
+	unsigned int	i;
+	
+	for ( i = 0; i < kExportDrivers; i++ )
+	{
+		
+		if ( gExportDrivers [ i ].driver == driver )
+		{
+			
+			*pid = i + 1;
+			return &gExportDrivers [ i ];
+			
+		}
+		
+		if ( gExportDrivers [ i ].driver == 0 )
+		{
+			
+			bzero ( &gExportDrivers [ i ], sizeof ( ExportDriver ) );
+			gExportDrivers [ i ].driver = driver;
+			*pid = i + 1;
+			
+			snprintf ( args, sizeof ( args ), "\"name\":\"IOUSBMassStorageClass 0x%llx\"", ( unsigned long long ) driver );
+			ExportChromeEvent ( *pid, 0, 'M', "process_name", -1, 0, args );
+			ExportChromeEvent ( *pid, 1, 'M', "thread_name", -1, 0, "\"name\":\"Commands\"" );
+			ExportChromeEvent ( *pid, 2, 'M', "thread_name", -1, 0, "\"name\":\"Recovery\"" );
+			
+			return &gExportDrivers [ i ];
+			
+		}
+		
+	}
+	
+	return NULL;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	ExportPhase - Ends the current phase slice of a command and starts the next.
+//-----------------------------------------------------------------------------
+
+static void
+ExportPhase ( ExportDriver * driver, unsigned int pid, uint32_t tag, const char * name, double timestamp )
+{
+	
+	uint32_t	slot = tag % kExportTags;
+	
+	if ( driver->commandOpen [ slot ] == FALSE )
+	{
+		return;
+	}
+	
+	if ( name != NULL )
+	{
+		
+		ExportChromeEvent ( pid, 1, 'b', name, tag, driver->phaseStart [ slot ], NULL );
+		ExportChromeEvent ( pid, 1, 'e', name, tag, timestamp, NULL );
+		
+	}
+	
+	driver->phaseStart [ slot ] = timestamp;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	ExportJSONLine
+//-----------------------------------------------------------------------------
+
+static void
+ExportJSONLine ( kd_buf inTracePoint, int type, double timestamp )
+{
+	
+	const char *	name;
+	char			opcodeName [ 8 ];
+	uint64_t		lba;
+	
+	name = StringFromTraceEvent ( type );
+	
+	printf ( "{\"ts\":%.3f,\"event\":\"%s\",\"code\":\"0x%08x\"", timestamp, ( name != NULL ) ? name : "Unknown", type );
+	
+	if ( ( inTracePoint.debugid & DBG_FUNC_START ) != 0 )
+	{
+		printf ( ",\"func\":\"start\"" );
+	}
+	
+	else if ( ( inTracePoint.debugid & DBG_FUNC_END ) != 0 )
+	{
+		printf ( ",\"func\":\"end\"" );
+	}
+	
+	printf ( ",\"driver\":\"0x%llx\",\"args\":[\"0x%llx\",\"0x%llx\",\"0x%llx\"]",
+			 ( unsigned long long ) inTracePoint.arg1,
+			 ( unsigned long long ) inTracePoint.arg2,
+			 ( unsigned long long ) inTracePoint.arg3,
+			 ( unsigned long long ) inTracePoint.arg4 );
+	
+	if ( ( type == kSCSICommandCode ) && ( ( inTracePoint.debugid & DBG_FUNC_START ) != 0 ) )
+	{
+		
+		lba = ( ( ( uint64_t ) ( ( inTracePoint.arg4 >> 12 ) & 0xF ) ) << 32 ) | ( inTracePoint.arg2 & 0xFFFFFFFF );
+		
+		printf ( ",\"command\":{\"opcode\":\"%s\",\"lun\":%u,\"lba\":%llu,\"length\":%u,\"tag\":%u}",
+				 ExportOperationName ( inTracePoint.arg4 & 0xFF, opcodeName, sizeof ( opcodeName ) ),
+				 ( unsigned int ) ( ( inTracePoint.arg4 >> 8 ) & 0xF ),
+				 ( unsigned long long ) lba,
+				 ( unsigned int ) inTracePoint.arg3,
+				 ( unsigned int ) ( ( inTracePoint.arg4 >> 16 ) & 0xFFFF ) );
+		
+	}
+	
+	else if ( type == kSCSICommandCode )
+	{
+		
+		printf ( ",\"command\":{\"tag\":%u,\"status\":%u,\"response\":%u,\"latencyUSecs\":%u,\"bytes\":%u}",
+				 ( unsigned int ) ( ( inTracePoint.arg4 >> 16 ) & 0xFFFF ),
+				 ( unsigned int ) ( inTracePoint.arg4 & 0xFF ),
+				 ( unsigned int ) ( ( inTracePoint.arg4 >> 8 ) & 0xFF ),
+				 ( unsigned int ) inTracePoint.arg2,
+				 ( unsigned int ) inTracePoint.arg3 );
+		
+	}
+	
+	else if ( ( type == kBOCompletionCode ) &&
+			  ( inTracePoint.arg3 < ( sizeof ( kBulkOnlyStateNames ) / sizeof ( kBulkOnlyStateNames[0] ) ) ) )
+	{
+		printf ( ",\"state\":\"%s\"", kBulkOnlyStateNames [ inTracePoint.arg3 ] );
+	}
+	
+	printf ( "}\n" );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	ExportKernelTracePoint
+//-----------------------------------------------------------------------------
+
+static void
+ExportKernelTracePoint ( kd_buf inTracePoint )
+{
+	
+	ExportDriver *	driver;
+	const char *	name		= NULL;
+	char			args [ 160 ];
+	char			opcodeName [ 8 ];
+	unsigned int	pid;
+	uint32_t		tag;
+	uint32_t		slot;
+	uint64_t		lba;
+	double			timestamp;
+	int 			debugID;
+	int 			type;
+	
+	debugID = inTracePoint.debugid;
+	type	= debugID & ~( DBG_FUNC_START | DBG_FUNC_END );
+	
+	if ( ( type < UMC_TRACE ( 0 ) ) || ( type > UMC_TRACE ( 0xFF ) ) )
+	{
+		return;
+	}
+	
+	timestamp = ( double ) ( inTracePoint.timestamp & KDBG_TIMESTAMP_MASK ) / gDivisor;
+	
+	if ( gExportFormat == kExportFormatJSONLines )
+	{
+		
+		ExportJSONLine ( inTracePoint, type, timestamp );
+		return;
+		
+	}
+	
+	driver = ExportDriverFor ( inTracePoint.arg1, &pid );
+	if ( driver == NULL )
+	{
+		return;
+	}
+	
+	switch ( type )
+	{
+		
+		case kSCSICommandCode:
+		{
+			
+			tag		= ( inTracePoint.arg4 >> 16 ) & 0xFFFF;
+			slot	= tag % kExportTags;
+			
+			if ( ( debugID & DBG_FUNC_START ) != 0 )
+			{
+				
+				driver->currentTag			= tag;
+				driver->commandOpen [ slot ]	= TRUE;
+				driver->statusSeen [ slot ]		= FALSE;
+				driver->opcode [ slot ]			= inTracePoint.arg4 & 0xFF;
+				driver->phaseStart [ slot ]		= timestamp;
+				
+				lba = ( ( ( uint64_t ) ( ( inTracePoint.arg4 >> 12 ) & 0xF ) ) << 32 ) | ( inTracePoint.arg2 & 0xFFFFFFFF );
+				
+				snprintf ( args, sizeof ( args ), "\"lun\":%u,\"lba\":%llu,\"length\":%u",
+						   ( unsigned int ) ( ( inTracePoint.arg4 >> 8 ) & 0xF ),
+						   ( unsigned long long ) lba,
+						   ( unsigned int ) inTracePoint.arg3 );
+				
+				ExportChromeEvent ( pid, 1, 'b',
+									ExportOperationName ( driver->opcode [ slot ], opcodeName, sizeof ( opcodeName ) ),
+									tag, timestamp, args );
+				
+			}
+			
+			else if ( driver->commandOpen [ slot ] == TRUE )
+			{
+				
+				if ( driver->statusSeen [ slot ] == TRUE )
+				{
+					ExportPhase ( driver, pid, tag, "Status", timestamp );
+				}
+				
+				snprintf ( args, sizeof ( args ), "\"status\":%u,\"response\":%u,\"latencyUSecs\":%u,\"bytes\":%u",
+						   ( unsigned int ) ( inTracePoint.arg4 & 0xFF ),
+						   ( unsigned int ) ( ( inTracePoint.arg4 >> 8 ) & 0xFF ),
+						   ( unsigned int ) inTracePoint.arg2,
+						   ( unsigned int ) inTracePoint.arg3 );
+				
+				ExportChromeEvent ( pid, 1, 'e',
+									ExportOperationName ( driver->opcode [ slot ], opcodeName, sizeof ( opcodeName ) ),
+									tag, timestamp, args );
+				
+				driver->commandOpen [ slot ] = FALSE;
+				
+			}
+			
+		}
+		break;
+		
+		case kBOCompletionCode:
+		{
+			
+			if ( inTracePoint.arg3 < ( sizeof ( kBulkOnlyPhaseNames ) / sizeof ( kBulkOnlyPhaseNames[0] ) ) )
+			{
+				name = kBulkOnlyPhaseNames [ inTracePoint.arg3 ];
+			}
 			
-#pragma mark -
-#pragma mark *** Bulk-Only Protocol Codes ***
-#pragma mark -
+			ExportPhase ( driver, pid, driver->currentTag, name, timestamp );
 			
-        case kBODeviceDetectedCode:
-        {
-            
-            printf ( "[%10p] BULK-ONLY transport protocol device\n", ( void * ) inTracePoint.arg1 );
-            
-        }
-        break;
+		}
+		break;
+		
+		case kCBICompletionCode:
+		{
 			
-        case kBOCommandAlreadyInProgressCode:
-        {
-            
-            if ( gHideBusyRejectedCommands == FALSE )
-            {
-                
-                printf ( "[%10p] B0 - Unable to accept task %p, still working on previous request\n",
-                        ( void * ) inTracePoint.arg1, ( void * ) inTracePoint.arg2 );
-                
-            }
-            
-        }
-        break;
+			if ( inTracePoint.arg3 < ( sizeof ( kCBIPhaseNames ) / sizeof ( kCBIPhaseNames[0] ) ) )
+			{
+				name = kCBIPhaseNames [ inTracePoint.arg3 ];
+			}
 			
-        case kBOSendSCSICommandReturnedCode:
-        {
-            
-            errorString = StringFromReturnCode ( inTracePoint.arg3 );
-            printf ( "[%10p] BO - SCSI Task %p was sent with status %s (0x%x)\n",
-                    ( void * ) inTracePoint.arg1, ( void * ) inTracePoint.arg2, errorString, ( unsigned int ) inTracePoint.arg3 );
-            
-        }
-        break;
+			ExportPhase ( driver, pid, driver->currentTag, name, timestamp );
 			
-        case kBOPreferredMaxLUNCode:
-        {
-            
-            printf ( "[%10p] BO - Preferred MaxLUN: %d\n",
-                    ( void * ) inTracePoint.arg1, (int) inTracePoint.arg2 );
-            
-        }
-        break;
+		}
+		break;
+		
+		case kUASStatusIUCode:
+		{
 			
-        case kBOGetMaxLUNReturnedCode:
-        {
-            
-            errorString = StringFromReturnCode ( inTracePoint.arg2 );
-            printf ( "[%10p] BO - GetMaxLUN returned: %s (0x%x), triedReset=%u, MaxLun: %d\n",
-                    ( void * ) inTracePoint.arg1, errorString, ( unsigned int ) inTracePoint.arg2, ( unsigned int ) inTracePoint.arg4, ( unsigned int ) inTracePoint.arg3 );
-            
-        }
-        break;
+			tag = ( uint32_t ) inTracePoint.arg3;
 			
-        case kBOCBWDescriptionCode:
-        {
-            
-            printf ( "[%10p] BO - Request %p, LUN: %u, CBW Tag: %u (0x%x)\n",
-                    ( void * ) inTracePoint.arg1, ( void * ) inTracePoint.arg2, ( unsigned int ) inTracePoint.arg3, ( unsigned int ) inTracePoint.arg4, ( unsigned int ) inTracePoint.arg4 );
-            
-        }
-        break;
+			ExportPhase ( driver, pid, tag, "Command", timestamp );
+			driver->statusSeen [ tag % kExportTags ] = TRUE;
 			
-        case kBOCBWBulkOutWriteResultCode:
-        {
-            
-            errorString = StringFromReturnCode ( inTracePoint.arg2 );
-            printf ( "[%10p] BO - Request %p, LUN: %u, Bulk-Out Write Status: %s (0x%x)\n",
-                    ( void * ) inTracePoint.arg1, ( void * ) inTracePoint.arg4, ( unsigned int ) inTracePoint.arg3, errorString, ( unsigned int ) inTracePoint.arg2 );
-            
-        }
-        break;
-            
-        case kBODoubleCompleteionCode:
-        {
-            
-            printf ( "[%10p] BO - DOUBLE Completion\n", ( void * ) inTracePoint.arg1 );
-            
-        }
-        break;
+		}
+		break;
+		
+		case kRecoveryJobStartedCode:
+		{
 			
-        case kBOCompletionDuringTerminationCode:
-        {
-            
-            printf ( "[%10p] BO - Completion during termination\n", ( void * ) inTracePoint.arg1 );
-            
-        }
-        break;
+			snprintf ( args, sizeof ( args ), "\"queuedUSecs\":%u", ( unsigned int ) inTracePoint.arg3 );
+			ExportChromeEvent ( pid, 2, 'B', ( inTracePoint.arg2 == kRecoveryJobClearStall ) ? "RecoveryClearStall" : "RecoveryResetDevice",
+								-1, timestamp, args );
 			
-        case kBOCompletionCode:
-        {
-            
-            errorString = StringFromReturnCode ( inTracePoint.arg2 );
-            printf ( "[%10p] BO - Completion, State: %s, Status: %s (0x%x), for Request: %p\n",
-                    ( void * ) inTracePoint.arg1, kBulkOnlyStateNames [ (int) inTracePoint.arg3 ],
-                    errorString, ( unsigned int ) inTracePoint.arg2, ( void * ) inTracePoint.arg4 );
-            
-        }
-        break;
+		}
+		break;
+		
+		case kRecoveryJobFinishedCode:
+		{
 			
-        default:
-        {
-            
-            if ( ( type >= 0x05278800 ) && ( type <= 0x05278BFC ) )
-            {
-                printf ( "[%10p] ??? - UNEXPECTED USB TRACE POINT - %p\n", ( void * ) inTracePoint.arg1, ( void * ) type );
-            }
-            
-        }
-        break;
+			ExportChromeEvent ( pid, 2, 'E', ( inTracePoint.arg2 == kRecoveryJobClearStall ) ? "RecoveryClearStall" : "RecoveryResetDevice",
+								-1, timestamp, NULL );
 			
-    }
-    
+		}
+		break;
+		
+		case kClearEndPointStallCode:
+		case kUSBDeviceResetReturnedCode:
+		case kUSBDeviceReconfiguredCode:
+		case kAbortCurrentSCSITaskCode:
+		{
+			
+			snprintf ( args, sizeof ( args ), "\"arg2\":\"0x%llx\",\"arg3\":\"0x%llx\"",
+					   ( unsigned long long ) inTracePoint.arg2,
+					   ( unsigned long long ) inTracePoint.arg3 );
+			ExportChromeEvent ( pid, 2, 'i', StringFromTraceEvent ( type ), -1, timestamp, args );
+			
+		}
+		break;
+		
+		default:
+			break;
+		
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	ExportFinish - Closes the Chrome trace array.
+//-----------------------------------------------------------------------------
+
+static void
+ExportFinish ( void )
+{
+	
+	if ( gExportFormat == kExportFormatChrome )
+	{
+		
+		if ( gExportFirstEvent == TRUE )
+		{
+			printf ( "[" );
+		}
+		
+		printf ( "\n]\n" );
+		
+	}
+	
+	fflush ( stdout );
+	
 }
 
 
@@ -1504,23 +3251,15 @@ static void
 Quit ( const char * s )
 {
 	
-	USBSysctlArgs	args;
-	int				error;
-	
 	if ( gTraceEnabled == TRUE )
 		EnableTraceBuffer ( 0 );
 	
 	if ( gSetRemoveFlag == TRUE )
 		RemoveTraceBuffer ( );
 	
-	args.type = kUSBTypeDebug;
-	args.debugFlags = 0;
+	CloseTraceOutputFile ( );
 	
-	error = sysctlbyname ( USBMASS_SYSCTL, NULL, NULL, &args, sizeof ( args ) );
-	if ( error != 0 )
-	{
-		fprintf ( stderr, "sysctlbyname failed to set old UMC trace flags back\n" );
-	}
+	RestoreDriverSettings ( );
 	
 	fprintf ( stderr, "%s: ", gProgramName );
 	if ( s != NULL )
@@ -1533,6 +3272,61 @@ Quit ( const char * s )
 }
 
 
+//-----------------------------------------------------------------------------
+//	RestoreDriverSettings - Puts back the trace filter and flags saved at launch.
+//	The trace filter is global, so leaving -e or -c in place would narrow every
+//	later trace.
+//-----------------------------------------------------------------------------
+
+static void
+RestoreDriverSettings ( void )
+{
+	
+	USBSysctlArgs	args;
+	int				error;
+	
+	if ( gSavedSettingsValid == FALSE )
+		return;
+	
+	if ( gTraceFilterChanged == TRUE )
+	{
+		
+		bzero ( &args, sizeof ( args ) );
+		
+		args.type				= kUSBTypeDebug;
+		args.operation			= kUSBOperationSetTraceFilter;
+		args.traceCategories	= gSavedSettings.traceCategories;
+		args.traceFilter		= gSavedSettings.traceFilter;
+		args.instance			= gSavedSettings.instance;
+		args.locationID			= gSavedSettings.locationID;
+		
+		error = sysctlbyname ( USBMASS_SYSCTL, NULL, NULL, &args, sizeof ( args ) );
+		if ( error != 0 )
+		{
+			fprintf ( stderr, "sysctlbyname failed to set the old trace filter back\n" );
+		}
+		
+		gTraceFilterChanged = FALSE;
+		
+	}
+	
+	bzero ( &args, sizeof ( args ) );
+	
+	args.type		= kUSBTypeDebug;
+	args.operation	= kUSBOperationSetFlags;
+	args.debugFlags	= gSavedSettings.debugFlags;
+	
+	error = sysctlbyname ( USBMASS_SYSCTL, NULL, NULL, &args, sizeof ( args ) );
+	if ( error != 0 )
+	{
+		fprintf ( stderr, "sysctlbyname failed to set old UMC trace flags back\n" );
+	}
+	
+	gSavedSettingsValid = FALSE;
+	
+}
+
+
 //-----------------------------------------------------------------------------
 //	GetDivisor
 //-----------------------------------------------------------------------------
@@ -1698,6 +3492,124 @@ StringFromReturnCode ( unsigned int returnCode )
 }
 
 
+//-----------------------------------------------------------------------------
+//	StringFromOperationCode
+//-----------------------------------------------------------------------------
+
+static const char * 
+StringFromOperationCode ( unsigned int operationCode )
+{
+	
+	const CDBSpec *		spec;
+	
+	spec = FindCDBSpec ( operationCode, NULL, 0 );
+	
+	return ( spec != NULL ) ? spec->name : "UNKNOWN";
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	StringFromTraceEvent - Returns NULL for codes this tool does not know of.
+//-----------------------------------------------------------------------------
+
+static const char * 
+StringFromTraceEvent ( unsigned int type )
+{
+	
+	const char *	string = NULL;
+	unsigned int	i;
+	
+	static ReturnCodeSpec	sTraceEventSpecs[] =
+	{
+		
+		//	Generic USB Storage
+		{ UMC_TRACE ( kAbortedTask ),				"AbortedTask" },
+		{ UMC_TRACE ( kCompleteSCSICommand ),		"CompleteSCSICommand" },
+		{ UMC_TRACE ( kNewCommandWhileTerminating ),	"NewCommandWhileTerminating" },
+		{ UMC_TRACE ( kLUNConfigurationComplete ),	"LUNConfigurationComplete" },
+		{ UMC_TRACE ( kIOUMCStorageCharacDictFound ),	"IOUMCStorageCharacDictFound" },
+		{ UMC_TRACE ( kNoProtocolForDevice ),		"NoProtocolForDevice" },
+		{ UMC_TRACE ( kIOUSBMassStorageClassStart ),	"IOUSBMassStorageClassStart" },
+		{ UMC_TRACE ( kIOUSBMassStorageClassStop ),	"IOUSBMassStorageClassStop" },
+		{ UMC_TRACE ( kAtUSBAddress ),				"AtUSBAddress" },
+		{ UMC_TRACE ( kMessagedCalled ),			"MessagedCalled" },
+		{ UMC_TRACE ( kWillTerminateCalled ),		"WillTerminateCalled" },
+		{ UMC_TRACE ( kDidTerminateCalled ),		"DidTerminateCalled" },
+		{ UMC_TRACE ( kCDBLog1 ),					"CDBLog1" },
+		{ UMC_TRACE ( kCDBLog2 ),					"CDBLog2" },
+		{ UMC_TRACE ( kClearEndPointStall ),		"ClearEndPointStall" },
+		{ UMC_TRACE ( kGetEndPointStatus ),			"GetEndPointStatus" },
+		{ UMC_TRACE ( kHandlePowerOnUSBReset ),		"HandlePowerOnUSBReset" },
+		{ UMC_TRACE ( kUSBDeviceResetWhileTerminating ),	"USBDeviceResetWhileTerminating" },
+		{ UMC_TRACE ( kUSBDeviceResetAfterDisconnect ),	"USBDeviceResetAfterDisconnect" },
+		{ UMC_TRACE ( kUSBDeviceResetReturned ),	"USBDeviceResetReturned" },
+		{ UMC_TRACE ( kAbortCurrentSCSITask ),		"AbortCurrentSCSITask" },
+		{ UMC_TRACE ( kCompletingCommandWithError ),	"CompletingCommandWithError" },
+		{ UMC_TRACE ( kDeviceInformation ),			"DeviceInformation" },
+		{ UMC_TRACE ( kSuspendPort ),				"SuspendPort" },
+		{ UMC_TRACE ( kSubclassUse ),				"SubclassUse" },
+		{ UMC_TRACE ( kSCSITaskQueued ),			"SCSITaskQueued" },
+		{ UMC_TRACE ( kSCSITaskDequeued ),			"SCSITaskDequeued" },
+		{ UMC_TRACE ( kSCSITaskQueueFull ),			"SCSITaskQueueFull" },
+		{ UMC_TRACE ( kRecoveryJobQueued ),			"RecoveryJobQueued" },
+		{ UMC_TRACE ( kRecoveryJobStarted ),		"RecoveryJobStarted" },
+		{ UMC_TRACE ( kRecoveryJobFinished ),		"RecoveryJobFinished" },
+		{ UMC_TRACE ( kUSBDeviceReconfigured ),		"USBDeviceReconfigured" },
+		{ UMC_TRACE ( kSCSICommand ),				"SCSICommand" },
+		
+		//	CBI
+		{ UMC_TRACE ( kCBIProtocolDeviceDetected ),	"CBIProtocolDeviceDetected" },
+		{ UMC_TRACE ( kCBICommandAlreadyInProgress ),	"CBICommandAlreadyInProgress" },
+		{ UMC_TRACE ( kCBISendSCSICommandReturned ),	"CBISendSCSICommandReturned" },
+		{ UMC_TRACE ( kCBICompletion ),				"CBICompletion" },
+		
+		//	Bulk-Only
+		{ UMC_TRACE ( kBODeviceDetected ),			"BODeviceDetected" },
+		{ UMC_TRACE ( kBOPreferredMaxLUN ),			"BOPreferredMaxLUN" },
+		{ UMC_TRACE ( kBOGetMaxLUNReturned ),		"BOGetMaxLUNReturned" },
+		{ UMC_TRACE ( kBOCommandAlreadyInProgress ),	"BOCommandAlreadyInProgress" },
+		{ UMC_TRACE ( kBOSendSCSICommandReturned ),	"BOSendSCSICommandReturned" },
+		{ UMC_TRACE ( kBOCBWDescription ),			"BOCBWDescription" },
+		{ UMC_TRACE ( kBOCBWBulkOutWriteResult ),	"BOCBWBulkOutWriteResult" },
+		{ UMC_TRACE ( kBODoubleCompleteion ),		"BODoubleCompleteion" },
+		{ UMC_TRACE ( kBOCompletionDuringTermination ),	"BOCompletionDuringTermination" },
+		{ UMC_TRACE ( kBOCompletion ),				"BOCompletion" },
+		{ UMC_TRACE ( kBOPostedCSW ),				"BOPostedCSW" },
+		{ UMC_TRACE ( kBOPostedCSWDiscarded ),		"BOPostedCSWDiscarded" },
+		
+		//	UAS
+		{ UMC_TRACE ( kUASDeviceDetected ),			"UASDeviceDetected" },
+		{ UMC_TRACE ( kUASConfigurationFailed ),	"UASConfigurationFailed" },
+		{ UMC_TRACE ( kUASCommandIU ),				"UASCommandIU" },
+		{ UMC_TRACE ( kUASSendSCSICommandReturned ),	"UASSendSCSICommandReturned" },
+		{ UMC_TRACE ( kUASStatusIU ),				"UASStatusIU" },
+		{ UMC_TRACE ( kUASCompletion ),				"UASCompletion" },
+		{ UMC_TRACE ( kUASTransportError ),			"UASTransportError" },
+		{ UMC_TRACE ( kUASAbortAllCommands ),		"UASAbortAllCommands" },
+		{ UMC_TRACE ( kUASTaskManagementIU ),		"UASTaskManagementIU" },
+		{ UMC_TRACE ( kUASTaskManagementResponse ),	"UASTaskManagementResponse" },
+		{ UMC_TRACE ( kUASReportLUNs ),				"UASReportLUNs" }
+	};
+	
+	for ( i = 0; i < ( sizeof ( sTraceEventSpecs ) / sizeof ( sTraceEventSpecs[0] ) ); i++ )
+	{
+		
+		if ( type == sTraceEventSpecs[i].returnCode )
+		{
+			
+			string = sTraceEventSpecs[i].string;
+			break;
+			
+		}
+		
+	}
+	
+	return string;
+	
+}
+
+
 //-----------------------------------------------------------------------------
 //	ProcessSubclassTracePoint
 //-----------------------------------------------------------------------------
@@ -0,0 +1,1077 @@
+/*
+ * Copyright (c) 2008-2009 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * "Portions Copyright (c) 1999 Apple Inc.  All Rights
+ * Reserved.  This file contains Original Code and/or Modifications of
+ * Original Code as defined in and that are subject to the Apple Public
+ * Source License Version 1.0 (the 'License').	You may not use this file
+ * except in compliance with the License.  Please obtain a copy of the
+ * License at http://www.apple.com/publicsource and read it before using
+ * this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE OR NON-INFRINGEMENT.  Please see the
+ * License for the specific language governing rights and limitations
+ * under the License."
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+Like the raw trace file reader this has no Mac OS X dependencies:
+g++ -W -Wall -O2 -pthread -c UMCTraceCompact.cpp
+*/
+
+
+//-----------------------------------------------------------------------------
+//	Includes
+//-----------------------------------------------------------------------------
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "UMCTraceCompact.h"
+
+
+//-----------------------------------------------------------------------------
+//	Constants
+//-----------------------------------------------------------------------------
+
+#define kCompactMaxThreads				64
+#define kCompactMagicLength				4
+#define kCompactMaxVarintLength			10
+#define kCompactMaxEntryLength			( 8 * kCompactMaxVarintLength + 1 )
+#define kCompactDictionaryMinCapacity	256
+
+
+//-----------------------------------------------------------------------------
+//	Structures
+//-----------------------------------------------------------------------------
+
+typedef struct CompactBuffer
+{
+	uint8_t *		bytes;
+	size_t			length;
+	size_t			capacity;
+} CompactBuffer;
+
+// Maps a debugid or thread to its index in the file's dictionary.
+typedef struct CompactDictionary
+{
+	uint64_t *		keys;
+	uint32_t *		slots;		// Index + 1, zero when the slot is empty
+	uint32_t		capacity;	// A power of two
+	uint32_t		count;
+} CompactDictionary;
+
+struct UMCCompactWriter
+{
+	FILE *				stream;
+	CompactDictionary	debugids;
+	CompactDictionary	threads;
+	CompactBuffer		newDebugids;
+	CompactBuffer		newThreads;
+	CompactBuffer		payload;
+	uint64_t			newDebugidCount;
+	uint64_t			newThreadCount;
+	uint64_t			entryCount;
+	uint64_t			timestamp;
+	uint64_t			args [ 4 ];
+};
+
+typedef struct CompactBlock
+{
+	const uint8_t *	payload;
+	uint64_t		payloadLength;
+	uint64_t		entryCount;
+	uint64_t		firstEntry;
+} CompactBlock;
+
+// The blocks one decoding thread owns, and what they decode against.
+typedef struct CompactDecodeJob
+{
+	const CompactBlock *	blocks;
+	uint64_t				blockCount;
+	const uint32_t *		debugids;
+	uint64_t				debugidCount;
+	const uint64_t *		threads;
+	uint64_t				threadCount;
+	kd_buf *				entries;
+	pthread_t				thread;
+	int						error;
+} CompactDecodeJob;
+
+
+//-----------------------------------------------------------------------------
+//	Prototypes
+//-----------------------------------------------------------------------------
+
+static size_t
+PutVarint ( uint8_t * outBytes, uint64_t inValue );
+
+static inline bool
+GetVarint ( const uint8_t ** ioCursor, const uint8_t * inEnd, uint64_t * outValue );
+
+static size_t
+VarintLength ( uint64_t inValue );
+
+static int
+ReserveCompactBuffer ( CompactBuffer * ioBuffer, size_t inLength );
+
+static int
+AppendVarint ( CompactBuffer * ioBuffer, uint64_t inValue );
+
+static int
+LookUpDictionary ( CompactDictionary * ioDictionary, uint64_t inKey, uint32_t * outIndex, bool * outAdded );
+
+static int
+WriteCompactBlock ( UMCCompactWriter * inWriter );
+
+static void *
+DecodeCompactBlocks ( void * inJob );
+
+
+//-----------------------------------------------------------------------------
+//	Zigzag encoding keeps small negative deltas small.
+//-----------------------------------------------------------------------------
+
+static inline uint64_t
+Zigzag ( uint64_t inDelta )
+{
+	return ( inDelta << 1 ) ^ ( uint64_t ) ( ( int64_t ) inDelta >> 63 );
+}
+
+static inline uint64_t
+Unzigzag ( uint64_t inValue )
+{
+	return ( inValue >> 1 ) ^ ( 0 - ( inValue & 1 ) );
+}
+
+
+//-----------------------------------------------------------------------------
+//	PutVarint - Writes at most kCompactMaxVarintLength bytes.
+//-----------------------------------------------------------------------------
+
+static size_t
+PutVarint ( uint8_t * outBytes, uint64_t inValue )
+{
+
+	size_t	length = 0;
+
+	while ( inValue >= 0x80 )
+	{
+
+		outBytes [ length++ ] = ( uint8_t ) ( inValue | 0x80 );
+		inValue >>= 7;
+
+	}
+
+	outBytes [ length++ ] = ( uint8_t ) inValue;
+
+	return length;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	GetVarint - Most values in a payload fit in a byte.
+//-----------------------------------------------------------------------------
+
+static inline bool
+GetVarint ( const uint8_t ** ioCursor, const uint8_t * inEnd, uint64_t * outValue )
+{
+
+	const uint8_t *	cursor	= *ioCursor;
+	uint64_t		value	= 0;
+	unsigned int	shift	= 0;
+
+	if ( ( cursor < inEnd ) && ( *cursor < 0x80 ) )
+	{
+
+		*outValue	= *cursor;
+		*ioCursor	= cursor + 1;
+		return true;
+
+	}
+
+	while ( cursor < inEnd )
+	{
+
+		value |= ( uint64_t ) ( *cursor & 0x7F ) << shift;
+
+		if ( ( *cursor++ & 0x80 ) == 0 )
+		{
+
+			*ioCursor	= cursor;
+			*outValue	= value;
+			return true;
+
+		}
+
+		shift += 7;
+		if ( shift >= 64 )
+		{
+			break;
+		}
+
+	}
+
+	return false;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	VarintLength
+//-----------------------------------------------------------------------------
+
+static size_t
+VarintLength ( uint64_t inValue )
+{
+
+	size_t	length = 1;
+
+	while ( inValue >= 0x80 )
+	{
+
+		inValue >>= 7;
+		length++;
+
+	}
+
+	return length;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	ReserveCompactBuffer - Makes room for inLength more bytes.
+//-----------------------------------------------------------------------------
+
+static int
+ReserveCompactBuffer ( CompactBuffer * ioBuffer, size_t inLength )
+{
+
+	uint8_t *	bytes		= NULL;
+	size_t		capacity	= 0;
+
+	if ( ioBuffer->length + inLength <= ioBuffer->capacity )
+	{
+		return 0;
+	}
+
+	capacity = ( ioBuffer->capacity == 0 ) ? 4096 : ioBuffer->capacity;
+	while ( capacity < ioBuffer->length + inLength )
+	{
+		capacity *= 2;
+	}
+
+	bytes = ( uint8_t * ) realloc ( ioBuffer->bytes, capacity );
+	if ( bytes == NULL )
+	{
+		return ENOMEM;
+	}
+
+	ioBuffer->bytes		= bytes;
+	ioBuffer->capacity	= capacity;
+
+	return 0;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	AppendVarint
+//-----------------------------------------------------------------------------
+
+static int
+AppendVarint ( CompactBuffer * ioBuffer, uint64_t inValue )
+{
+
+	int		error = 0;
+
+	error = ReserveCompactBuffer ( ioBuffer, kCompactMaxVarintLength );
+	if ( error == 0 )
+	{
+		ioBuffer->length += PutVarint ( ioBuffer->bytes + ioBuffer->length, inValue );
+	}
+
+	return error;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	LookUpDictionary - Returns the index of inKey, adding it when it is new.
+//-----------------------------------------------------------------------------
+
+static int
+LookUpDictionary ( CompactDictionary * ioDictionary, uint64_t inKey, uint32_t * outIndex, bool * outAdded )
+{
+
+	CompactDictionary	grown;
+	uint64_t			hash	= 0;
+	uint32_t			slot	= 0;
+	uint32_t			i		= 0;
+
+	*outAdded = false;
+
+	// Keep the table at most half full so probes stay short.
+	if ( ( ioDictionary->count + 1 ) * 2 > ioDictionary->capacity )
+	{
+
+		grown.capacity	= ( ioDictionary->capacity == 0 ) ? kCompactDictionaryMinCapacity : ioDictionary->capacity * 2;
+		grown.count		= ioDictionary->count;
+		grown.keys		= ( uint64_t * ) calloc ( grown.capacity, sizeof ( uint64_t ) );
+		grown.slots		= ( uint32_t * ) calloc ( grown.capacity, sizeof ( uint32_t ) );
+
+		if ( ( grown.keys == NULL ) || ( grown.slots == NULL ) )
+		{
+
+			free ( grown.keys );
+			free ( grown.slots );
+			return ENOMEM;
+
+		}
+
+		for ( i = 0; i < ioDictionary->capacity; i++ )
+		{
+
+			if ( ioDictionary->slots [ i ] == 0 )
+			{
+				continue;
+			}
+
+			hash = ioDictionary->keys [ i ] * 0x9E3779B97F4A7C15ULL;
+			slot = ( uint32_t ) ( hash >> 32 ) & ( grown.capacity - 1 );
+
+			while ( grown.slots [ slot ] != 0 )
+			{
+				slot = ( slot + 1 ) & ( grown.capacity - 1 );
+			}
+
+			grown.keys [ slot ]		= ioDictionary->keys [ i ];
+			grown.slots [ slot ]	= ioDictionary->slots [ i ];
+
+		}
+
+		free ( ioDictionary->keys );
+		free ( ioDictionary->slots );
+		*ioDictionary = grown;
+
+	}
+
+	hash = inKey * 0x9E3779B97F4A7C15ULL;
+	slot = ( uint32_t ) ( hash >> 32 ) & ( ioDictionary->capacity - 1 );
+
+	while ( ioDictionary->slots [ slot ] != 0 )
+	{
+
+		if ( ioDictionary->keys [ slot ] == inKey )
+		{
+
+			*outIndex = ioDictionary->slots [ slot ] - 1;
+			return 0;
+
+		}
+
+		slot = ( slot + 1 ) & ( ioDictionary->capacity - 1 );
+
+	}
+
+	ioDictionary->keys [ slot ]		= inKey;
+	ioDictionary->slots [ slot ]	= ++ioDictionary->count;
+
+	*outIndex	= ioDictionary->count - 1;
+	*outAdded	= true;
+
+	return 0;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	WriteCompactBlock - Writes out the current block and starts a new one.
+//-----------------------------------------------------------------------------
+
+static int
+WriteCompactBlock ( UMCCompactWriter * inWriter )
+{
+
+	uint8_t		header [ kCompactMagicLength + 4 * kCompactMaxVarintLength ];
+	size_t		length	= kCompactMagicLength;
+
+	if ( inWriter->entryCount == 0 )
+	{
+		return 0;
+	}
+
+	memcpy ( header, kCompactBlockMagic, kCompactMagicLength );
+	length += PutVarint ( header + length, inWriter->entryCount );
+	length += PutVarint ( header + length, inWriter->newDebugidCount );
+	length += PutVarint ( header + length, inWriter->newThreadCount );
+	length += PutVarint ( header + length, inWriter->payload.length );
+
+	if ( ( fwrite ( header, length, 1, inWriter->stream ) != 1 ) ||
+		 ( ( inWriter->newDebugids.length != 0 ) && ( fwrite ( inWriter->newDebugids.bytes, inWriter->newDebugids.length, 1, inWriter->stream ) != 1 ) ) ||
+		 ( ( inWriter->newThreads.length != 0 ) && ( fwrite ( inWriter->newThreads.bytes, inWriter->newThreads.length, 1, inWriter->stream ) != 1 ) ) ||
+		 ( fwrite ( inWriter->payload.bytes, inWriter->payload.length, 1, inWriter->stream ) != 1 ) )
+	{
+		return ( errno != 0 ) ? errno : EIO;
+	}
+
+	inWriter->newDebugids.length	= 0;
+	inWriter->newThreads.length		= 0;
+	inWriter->payload.length		= 0;
+	inWriter->newDebugidCount		= 0;
+	inWriter->newThreadCount		= 0;
+	inWriter->entryCount			= 0;
+	inWriter->timestamp				= 0;
+
+	bzero ( inWriter->args, sizeof ( inWriter->args ) );
+
+	return 0;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	UMCCompactWriterCreate
+//-----------------------------------------------------------------------------
+
+UMCCompactWriter *
+UMCCompactWriterCreate ( FILE * inStream )
+{
+
+	UMCCompactWriter *	writer	= NULL;
+	uint8_t				header [ kCompactMagicLength + kCompactMaxVarintLength ];
+	size_t				length	= kCompactMagicLength;
+
+	memcpy ( header, kCompactFileMagic, kCompactMagicLength );
+	length += PutVarint ( header + length, kCompactFileVersion );
+
+	if ( fwrite ( header, length, 1, inStream ) != 1 )
+	{
+		return NULL;
+	}
+
+	writer = ( UMCCompactWriter * ) calloc ( 1, sizeof ( UMCCompactWriter ) );
+	if ( writer != NULL )
+	{
+		writer->stream = inStream;
+	}
+
+	return writer;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	UMCCompactWriterAppend
+//-----------------------------------------------------------------------------
+
+int
+UMCCompactWriterAppend ( UMCCompactWriter *	inWriter,
+						 const kd_buf *		inEntries,
+						 size_t				inCount )
+{
+
+	const kd_buf *	entry		= NULL;
+	uint8_t *		cursor		= NULL;
+	uint8_t *		modes		= NULL;
+	uint64_t		args [ 4 ];
+	uint64_t		delta		= 0;
+	uint32_t		debugid		= 0;
+	uint32_t		thread		= 0;
+	bool			added		= false;
+	size_t			index		= 0;
+	unsigned int	i			= 0;
+	int				error		= 0;
+
+	for ( index = 0; index < inCount; index++ )
+	{
+
+		entry = &inEntries [ index ];
+
+		error = LookUpDictionary ( &inWriter->debugids, entry->debugid, &debugid, &added );
+		if ( ( error == 0 ) && added )
+		{
+
+			error = AppendVarint ( &inWriter->newDebugids, entry->debugid );
+			inWriter->newDebugidCount++;
+
+		}
+
+		if ( error == 0 )
+		{
+			error = LookUpDictionary ( &inWriter->threads, entry->arg5, &thread, &added );
+		}
+
+		if ( ( error == 0 ) && added )
+		{
+
+			error = AppendVarint ( &inWriter->newThreads, entry->arg5 );
+			inWriter->newThreadCount++;
+
+		}
+
+		if ( error == 0 )
+		{
+			error = ReserveCompactBuffer ( &inWriter->payload, kCompactMaxEntryLength );
+		}
+
+		if ( error != 0 )
+		{
+			break;
+		}
+
+		cursor = inWriter->payload.bytes + inWriter->payload.length;
+
+		cursor += PutVarint ( cursor, debugid );
+		cursor += PutVarint ( cursor, ( ( uint64_t ) thread << 1 ) | ( entry->unused != 0 ) );
+		cursor += PutVarint ( cursor, entry->cpuid );
+		cursor += PutVarint ( cursor, Zigzag ( entry->timestamp - inWriter->timestamp ) );
+
+		inWriter->timestamp = entry->timestamp;
+
+		args [ 0 ] = entry->arg1;
+		args [ 1 ] = entry->arg2;
+		args [ 2 ] = entry->arg3;
+		args [ 3 ] = entry->arg4;
+
+		modes	= cursor++;
+		*modes	= 0;
+
+		for ( i = 0; i < 4; i++ )
+		{
+
+			if ( args [ i ] == 0 )
+			{
+				*modes |= kCompactArgZero << ( 2 * i );
+			}
+
+			else if ( args [ i ] == inWriter->args [ i ] )
+			{
+				*modes |= kCompactArgSame << ( 2 * i );
+			}
+
+			else
+			{
+
+				// Sequential LBAs and nearby addresses are cheaper as deltas.
+				delta = Zigzag ( args [ i ] - inWriter->args [ i ] );
+
+				if ( VarintLength ( delta ) < VarintLength ( args [ i ] ) )
+				{
+
+					*modes |= kCompactArgDelta << ( 2 * i );
+					cursor += PutVarint ( cursor, delta );
+
+				}
+
+				else
+				{
+
+					*modes |= kCompactArgValue << ( 2 * i );
+					cursor += PutVarint ( cursor, args [ i ] );
+
+				}
+
+			}
+
+			inWriter->args [ i ] = args [ i ];
+
+		}
+
+		if ( entry->unused != 0 )
+		{
+			cursor += PutVarint ( cursor, entry->unused );
+		}
+
+		inWriter->payload.length = cursor - inWriter->payload.bytes;
+		inWriter->entryCount++;
+
+		if ( inWriter->entryCount == kCompactBlockEntries )
+		{
+
+			error = WriteCompactBlock ( inWriter );
+			if ( error != 0 )
+			{
+				break;
+			}
+
+		}
+
+	}
+
+	return error;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	UMCCompactWriterClose
+//-----------------------------------------------------------------------------
+
+int
+UMCCompactWriterClose ( UMCCompactWriter * inWriter )
+{
+
+	int		error = 0;
+
+	if ( inWriter == NULL )
+	{
+		return 0;
+	}
+
+	error = WriteCompactBlock ( inWriter );
+
+	free ( inWriter->debugids.keys );
+	free ( inWriter->debugids.slots );
+	free ( inWriter->threads.keys );
+	free ( inWriter->threads.slots );
+	free ( inWriter->newDebugids.bytes );
+	free ( inWriter->newThreads.bytes );
+	free ( inWriter->payload.bytes );
+	free ( inWriter );
+
+	return error;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	UMCIsCompactTraceFile
+//-----------------------------------------------------------------------------
+
+bool
+UMCIsCompactTraceFile ( const void * inData, size_t inLength )
+{
+
+	return ( inLength >= kCompactMagicLength ) &&
+		   ( memcmp ( inData, kCompactFileMagic, kCompactMagicLength ) == 0 );
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	DecodeCompactBlocks - Decodes a job's blocks. Runs on its own thread.
+//-----------------------------------------------------------------------------
+
+static void *
+DecodeCompactBlocks ( void * inJob )
+{
+
+	CompactDecodeJob *		job			= ( CompactDecodeJob * ) inJob;
+	const CompactBlock *	block		= NULL;
+	const uint8_t *			cursor		= NULL;
+	const uint8_t *			end			= NULL;
+	kd_buf *				entry		= NULL;
+	uint64_t				args [ 4 ];
+	uint64_t				timestamp	= 0;
+	uint64_t				value		= 0;
+	uint64_t				thread		= 0;
+	uint64_t				blockIndex	= 0;
+	uint64_t				index		= 0;
+	unsigned int			modes		= 0;
+	unsigned int			i			= 0;
+
+	for ( blockIndex = 0; blockIndex < job->blockCount; blockIndex++ )
+	{
+
+		block		= &job->blocks [ blockIndex ];
+		cursor		= block->payload;
+		end			= block->payload + block->payloadLength;
+		timestamp	= 0;
+
+		bzero ( args, sizeof ( args ) );
+
+		for ( index = 0; index < block->entryCount; index++ )
+		{
+
+			entry			= &job->entries [ block->firstEntry + index ];
+			entry->unused	= 0;
+
+			if ( ( GetVarint ( &cursor, end, &value ) == false ) || ( value >= job->debugidCount ) )
+			{
+				goto Corrupt;
+			}
+
+			entry->debugid = job->debugids [ value ];
+
+			if ( ( GetVarint ( &cursor, end, &thread ) == false ) || ( ( thread >> 1 ) >= job->threadCount ) )
+			{
+				goto Corrupt;
+			}
+
+			entry->arg5 = job->threads [ thread >> 1 ];
+
+			if ( GetVarint ( &cursor, end, &value ) == false )
+			{
+				goto Corrupt;
+			}
+
+			entry->cpuid = ( uint32_t ) value;
+
+			if ( GetVarint ( &cursor, end, &value ) == false )
+			{
+				goto Corrupt;
+			}
+
+			timestamp			+= Unzigzag ( value );
+			entry->timestamp	= timestamp;
+
+			if ( cursor == end )
+			{
+				goto Corrupt;
+			}
+
+			modes = *cursor++;
+
+			for ( i = 0; i < 4; i++ )
+			{
+
+				switch ( ( modes >> ( 2 * i ) ) & 3 )
+				{
+
+					case kCompactArgZero:
+						args [ i ] = 0;
+						break;
+
+					case kCompactArgSame:
+						break;
+
+					case kCompactArgValue:
+						if ( GetVarint ( &cursor, end, &args [ i ] ) == false )
+						{
+							goto Corrupt;
+						}
+						break;
+
+					case kCompactArgDelta:
+						if ( GetVarint ( &cursor, end, &value ) == false )
+						{
+							goto Corrupt;
+						}
+						args [ i ] += Unzigzag ( value );
+						break;
+
+				}
+
+			}
+
+			entry->arg1 = args [ 0 ];
+			entry->arg2 = args [ 1 ];
+			entry->arg3 = args [ 2 ];
+			entry->arg4 = args [ 3 ];
+
+			if ( ( thread & 1 ) != 0 )
+			{
+
+				if ( GetVarint ( &cursor, end, &value ) == false )
+				{
+					goto Corrupt;
+				}
+
+				entry->unused = value;
+
+			}
+
+		}
+
+		if ( cursor != end )
+		{
+			goto Corrupt;
+		}
+
+	}
+
+	return NULL;
+
+
+Corrupt:
+
+
+	job->error = EINVAL;
+	return NULL;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	UMCDecodeCompactTraceFile
+//-----------------------------------------------------------------------------
+
+int
+UMCDecodeCompactTraceFile ( const void *		inData,
+							size_t				inLength,
+							unsigned int		inThreads,
+							kd_buf **			outEntries,
+							uint64_t *			outCount )
+{
+
+	CompactDecodeJob	jobs [ kCompactMaxThreads ];
+	const uint8_t *		cursor			= ( const uint8_t * ) inData;
+	const uint8_t *		end				= cursor + inLength;
+	CompactBlock *		blocks			= NULL;
+	uint32_t *			debugids		= NULL;
+	uint64_t *			threads			= NULL;
+	kd_buf *			entries			= NULL;
+	void *				grown			= NULL;
+	uint64_t			blockCount		= 0;
+	uint64_t			blockCapacity	= 0;
+	uint64_t			debugidCount	= 0;
+	uint64_t			threadCount		= 0;
+	uint64_t			entryCount		= 0;
+	uint64_t			version			= 0;
+	uint64_t			blockEntries	= 0;
+	uint64_t			newDebugids		= 0;
+	uint64_t			newThreads		= 0;
+	uint64_t			payloadLength	= 0;
+	uint64_t			value			= 0;
+	uint64_t			i				= 0;
+	unsigned int		jobCount		= 0;
+	unsigned int		started			= 0;
+	unsigned int		job				= 0;
+	int					error			= 0;
+
+	*outEntries	= NULL;
+	*outCount	= 0;
+
+	bzero ( jobs, sizeof ( jobs ) );
+
+	if ( UMCIsCompactTraceFile ( inData, inLength ) == false )
+	{
+		return EINVAL;
+	}
+
+	cursor += kCompactMagicLength;
+
+	if ( ( GetVarint ( &cursor, end, &version ) == false ) || ( version != kCompactFileVersion ) )
+	{
+		return EINVAL;
+	}
+
+	// One pass over the block headers gathers the dictionaries and where each block's entries go.
+	while ( ( size_t ) ( end - cursor ) >= kCompactMagicLength )
+	{
+
+		if ( memcmp ( cursor, kCompactBlockMagic, kCompactMagicLength ) != 0 )
+		{
+
+			error = EINVAL;
+			goto Exit;
+
+		}
+
+		cursor += kCompactMagicLength;
+
+		if ( ( GetVarint ( &cursor, end, &blockEntries ) == false ) ||
+			 ( GetVarint ( &cursor, end, &newDebugids ) == false ) ||
+			 ( GetVarint ( &cursor, end, &newThreads ) == false ) ||
+			 ( GetVarint ( &cursor, end, &payloadLength ) == false ) )
+		{
+			break;
+		}
+
+		// Every dictionary entry takes at least a byte, which bounds the counts.
+		if ( ( newDebugids > ( uint64_t ) ( end - cursor ) ) || ( newThreads > ( uint64_t ) ( end - cursor ) ) )
+		{
+			break;
+		}
+
+		grown = realloc ( debugids, ( debugidCount + newDebugids + 1 ) * sizeof ( uint32_t ) );
+		if ( grown == NULL )
+		{
+
+			error = ENOMEM;
+			goto Exit;
+
+		}
+
+		debugids = ( uint32_t * ) grown;
+
+		grown = realloc ( threads, ( threadCount + newThreads + 1 ) * sizeof ( uint64_t ) );
+		if ( grown == NULL )
+		{
+
+			error = ENOMEM;
+			goto Exit;
+
+		}
+
+		threads = ( uint64_t * ) grown;
+
+		for ( i = 0; i < newDebugids; i++ )
+		{
+
+			if ( GetVarint ( &cursor, end, &value ) == false )
+			{
+				break;
+			}
+
+			debugids [ debugidCount + i ] = ( uint32_t ) value;
+
+		}
+
+		if ( i != newDebugids )
+		{
+			break;
+		}
+
+		for ( i = 0; i < newThreads; i++ )
+		{
+
+			if ( GetVarint ( &cursor, end, &threads [ threadCount + i ] ) == false )
+			{
+				break;
+			}
+
+		}
+
+		// A block the capture did not get to finish ends the file.
+		if ( ( i != newThreads ) || ( payloadLength > ( uint64_t ) ( end - cursor ) ) )
+		{
+			break;
+		}
+
+		// Every entry takes at least five bytes.
+		if ( blockEntries > payloadLength / 5 )
+		{
+
+			error = EINVAL;
+			goto Exit;
+
+		}
+
+		if ( blockCount == blockCapacity )
+		{
+
+			blockCapacity	= ( blockCapacity == 0 ) ? 256 : blockCapacity * 2;
+			grown			= realloc ( blocks, blockCapacity * sizeof ( CompactBlock ) );
+
+			if ( grown == NULL )
+			{
+
+				error = ENOMEM;
+				goto Exit;
+
+			}
+
+			blocks = ( CompactBlock * ) grown;
+
+		}
+
+		blocks [ blockCount ].payload		= cursor;
+		blocks [ blockCount ].payloadLength	= payloadLength;
+		blocks [ blockCount ].entryCount	= blockEntries;
+		blocks [ blockCount ].firstEntry	= entryCount;
+
+		blockCount++;
+		debugidCount	+= newDebugids;
+		threadCount		+= newThreads;
+		entryCount		+= blockEntries;
+		cursor			+= payloadLength;
+
+	}
+
+	if ( entryCount == 0 )
+	{
+		goto Exit;
+	}
+
+	entries = ( kd_buf * ) malloc ( entryCount * sizeof ( kd_buf ) );
+	if ( entries == NULL )
+	{
+
+		error = ENOMEM;
+		goto Exit;
+
+	}
+
+	if ( inThreads == 0 )
+	{
+		inThreads = ( unsigned int ) sysconf ( _SC_NPROCESSORS_ONLN );
+	}
+
+	jobCount = ( inThreads < blockCount ) ? inThreads : ( unsigned int ) blockCount;
+
+	if ( jobCount > kCompactMaxThreads )
+	{
+		jobCount = kCompactMaxThreads;
+	}
+
+	if ( jobCount == 0 )
+	{
+		jobCount = 1;
+	}
+
+	for ( job = 0; job < jobCount; job++ )
+	{
+
+		jobs [ job ].blocks			= &blocks [ ( blockCount * job ) / jobCount ];
+		jobs [ job ].blockCount		= ( ( blockCount * ( job + 1 ) ) / jobCount ) - ( ( blockCount * job ) / jobCount );
+		jobs [ job ].debugids		= debugids;
+		jobs [ job ].debugidCount	= debugidCount;
+		jobs [ job ].threads		= threads;
+		jobs [ job ].threadCount	= threadCount;
+		jobs [ job ].entries		= entries;
+
+	}
+
+	// The first job is decoded on this thread.
+	for ( job = 1; job < jobCount; job++ )
+	{
+
+		error = pthread_create ( &jobs [ job ].thread, NULL, DecodeCompactBlocks, &jobs [ job ] );
+		if ( error != 0 )
+		{
+			break;
+		}
+
+		started++;
+
+	}
+
+	DecodeCompactBlocks ( &jobs [ 0 ] );
+
+	for ( job = 1; job <= started; job++ )
+	{
+		pthread_join ( jobs [ job ].thread, NULL );
+	}
+
+	for ( job = 0; ( job < jobCount ) && ( error == 0 ); job++ )
+	{
+		error = jobs [ job ].error;
+	}
+
+	if ( error == 0 )
+	{
+
+		*outEntries	= entries;
+		*outCount	= entryCount;
+		entries		= NULL;
+
+	}
+
+
+Exit:
+
+
+	free ( entries );
+	free ( blocks );
+	free ( debugids );
+	free ( threads );
+
+	return error;
+
+}
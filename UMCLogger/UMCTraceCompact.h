@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2008-2009 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * "Portions Copyright (c) 1999 Apple Inc.  All Rights
+ * Reserved.  This file contains Original Code and/or Modifications of
+ * Original Code as defined in and that are subject to the Apple Public
+ * Source License Version 1.0 (the 'License').	You may not use this file
+ * except in compliance with the License.  Please obtain a copy of the
+ * License at http://www.apple.com/publicsource and read it before using
+ * this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE OR NON-INFRINGEMENT.  Please see the
+ * License for the specific language governing rights and limitations
+ * under the License."
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _UMC_TRACE_COMPACT_H_
+#define _UMC_TRACE_COMPACT_H_
+
+
+//-----------------------------------------------------------------------------
+//	Includes
+//-----------------------------------------------------------------------------
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "UMCTraceFile.h"
+
+
+//-----------------------------------------------------------------------------
+//	Constants
+//-----------------------------------------------------------------------------
+
+/*
+The compact trace file format, for captures too long to keep as raw kd_buf
+records. Every number is an unsigned LEB128 varint unless noted, so the file
+reads the same on any host.
+
+	File header		"UMCZ", version
+
+	Block			"UMCB", entry count, new debugids, new threads, payload bytes,
+					the new debugids, the new threads, then the payload
+
+The debugid and thread dictionaries belong to the file. A block only carries
+the entries it adds, so a reader collects all of them in one quick pass over
+the block headers and can then decode the payloads in parallel. Each payload
+starts over from a zero timestamp and zero arguments, and holds per entry
+
+	debugid index
+	thread index << 1, with bit 0 set when the unused field follows
+	cpuid
+	timestamp delta from the previous entry, zigzag encoded
+	one byte with two bits for each of arg1 to arg4, a kCompactArg mode
+	the arguments stored as a value or a delta, in order
+	unused, if present
+
+Entries keep file order and marker entries are stored like any other, so a
+file converted to compact and back is the same file.
+*/
+
+#define kCompactFileMagic				"UMCZ"
+#define kCompactBlockMagic				"UMCB"
+#define kCompactFileVersion				1
+#define kCompactBlockEntries			16384
+
+enum
+{
+	kCompactArgZero			= 0,
+	kCompactArgSame			= 1,	// As in the previous entry
+	kCompactArgValue		= 2,
+	kCompactArgDelta		= 3		// Zigzag delta from the previous entry
+};
+
+
+//-----------------------------------------------------------------------------
+//	Prototypes
+//-----------------------------------------------------------------------------
+
+typedef struct UMCCompactWriter UMCCompactWriter;
+
+// Writes the file header to inStream and returns a writer for it, or NULL.
+// The stream stays the caller's.
+
+UMCCompactWriter *
+UMCCompactWriterCreate ( FILE * inStream );
+
+// Adds entries to the current block, which is written out once it holds
+// kCompactBlockEntries. Returns 0 or an errno value.
+
+int
+UMCCompactWriterAppend ( UMCCompactWriter *	inWriter,
+						 const kd_buf *		inEntries,
+						 size_t				inCount );
+
+// Writes out the last block and frees the writer. Returns 0 or an errno value.
+
+int
+UMCCompactWriterClose ( UMCCompactWriter * inWriter );
+
+// True when the inLength bytes at inData start with a compact file header.
+
+bool
+UMCIsCompactTraceFile ( const void * inData, size_t inLength );
+
+// Decodes a whole compact file, on up to inThreads threads, into a malloc ( )
+// array of entries in file order which the caller frees. A block cut short at
+// the end of the file is ignored. Returns 0 or an errno value.
+
+int
+UMCDecodeCompactTraceFile ( const void *		inData,
+							size_t				inLength,
+							unsigned int		inThreads,
+							kd_buf **			outEntries,
+							uint64_t *			outCount );
+
+
+#endif	/* _UMC_TRACE_COMPACT_H_ */
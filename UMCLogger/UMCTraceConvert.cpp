@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2008-2009 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * "Portions Copyright (c) 1999 Apple Inc.  All Rights
+ * Reserved.  This file contains Original Code and/or Modifications of
+ * Original Code as defined in and that are subject to the Apple Public
+ * Source License Version 1.0 (the 'License').	You may not use this file
+ * except in compliance with the License.  Please obtain a copy of the
+ * License at http://www.apple.com/publicsource and read it before using
+ * this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE OR NON-INFRINGEMENT.  Please see the
+ * License for the specific language governing rights and limitations
+ * under the License."
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+Converts UMCLogger trace files between the raw and the compact format. Either
+kind of file is accepted as input, and needs no root or kernel to convert:
+g++ -W -Wall -O2 -pthread -o UMCTraceConvert UMCTraceConvert.cpp UMCTraceFile.cpp UMCTraceCompact.cpp
+./UMCTraceConvert <-z|-u> <source> <destination>
+*/
+
+
+//-----------------------------------------------------------------------------
+//	Includes
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <string.h>
+
+#include "UMCTraceFile.h"
+
+
+//-----------------------------------------------------------------------------
+//	Main
+//-----------------------------------------------------------------------------
+
+int
+main ( int argc, const char * argv[] )
+{
+
+	int		format	= kUMCTraceFileFormatRaw;
+	int		error	= 0;
+
+	if ( ( argc != 4 ) || ( ( strcmp ( argv[1], "-z" ) != 0 ) && ( strcmp ( argv[1], "-u" ) != 0 ) ) )
+	{
+
+		fprintf ( stderr, "Usage: %s <-z|-u> <source> <destination>\n\n", argv[0] );
+		fprintf ( stderr, "\t-z write the compact format\n" );
+		fprintf ( stderr, "\t-u write raw kd_buf records\n" );
+		return 1;
+
+	}
+
+	if ( strcmp ( argv[1], "-z" ) == 0 )
+	{
+		format = kUMCTraceFileFormatCompact;
+	}
+
+	error = UMCConvertTraceFile ( argv[2], argv[3], format );
+	if ( error != 0 )
+	{
+
+		fprintf ( stderr, "Could not convert %s, %s\n", argv[2], strerror ( error ) );
+		return 1;
+
+	}
+
+	return 0;
+
+}
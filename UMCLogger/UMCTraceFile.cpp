@@ -0,0 +1,722 @@
+/*
+ * Copyright (c) 2008-2009 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * "Portions Copyright (c) 1999 Apple Inc.  All Rights
+ * Reserved.  This file contains Original Code and/or Modifications of
+ * Original Code as defined in and that are subject to the Apple Public
+ * Source License Version 1.0 (the 'License').	You may not use this file
+ * except in compliance with the License.  Please obtain a copy of the
+ * License at http://www.apple.com/publicsource and read it before using
+ * this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE OR NON-INFRINGEMENT.  Please see the
+ * License for the specific language governing rights and limitations
+ * under the License."
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+The trace file reader has no Mac OS X dependencies so it also builds on Linux:
+g++ -W -Wall -O2 -pthread -c UMCTraceFile.cpp UMCTraceCompact.cpp
+*/
+
+
+//-----------------------------------------------------------------------------
+//	Includes
+//-----------------------------------------------------------------------------
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "UMCTraceFile.h"
+#include "UMCTraceCompact.h"
+
+
+//-----------------------------------------------------------------------------
+//	Constants
+//-----------------------------------------------------------------------------
+
+#define kTraceFileMaxThreads			64
+#define kTraceFileMinChunkEntries		65536
+#define kTraceFileMaxDisplacement		256
+
+
+//-----------------------------------------------------------------------------
+//	Structures
+//-----------------------------------------------------------------------------
+
+// Sort key for one entry. The index breaks timestamp ties so file order is kept.
+typedef struct TraceKey
+{
+	uint64_t		timestamp;
+	uint64_t		index;
+} TraceKey;
+
+// Entries of a chunk between two divisor entries, sorted by timestamp.
+typedef struct TraceRun
+{
+	TraceKey *		keys;
+	uint64_t		count;
+	uint64_t		position;
+	uint64_t		segment;
+} TraceRun;
+
+// The entries of an open trace file, mapped for a raw file and decoded for a compact one.
+typedef struct TraceFileContents
+{
+	void *			mapping;
+	size_t			length;
+	kd_buf *		decoded;
+	const kd_buf *	entries;
+	uint64_t		count;
+} TraceFileContents;
+
+typedef struct TraceChunk
+{
+	const kd_buf *	entries;
+	uint64_t		first;
+	uint64_t		last;
+	TraceKey *		keys;
+	TraceRun *		runs;
+	uint64_t		runCount;
+	uint64_t *		divisors;
+	uint64_t		divisorCount;
+	pthread_t		thread;
+	int				error;
+} TraceChunk;
+
+
+//-----------------------------------------------------------------------------
+//	Prototypes
+//-----------------------------------------------------------------------------
+
+static int
+OpenTraceFile ( const char * inPath, unsigned int inThreads, TraceFileContents * outContents );
+
+static void
+CloseTraceFile ( TraceFileContents * inContents );
+
+static int
+CompareTraceKeys ( const void * inLeft, const void * inRight );
+
+static bool
+InsertionSortTraceKeys ( TraceKey * ioKeys, uint64_t inCount );
+
+static void *
+SortTraceChunk ( void * inChunk );
+
+static void
+MergeTraceChunks ( TraceChunk *				inChunks,
+				   unsigned int				inChunkCount,
+				   UMCTraceFileCallback		inCallback,
+				   void *					inRefCon );
+
+
+//-----------------------------------------------------------------------------
+//	OpenTraceFile
+//-----------------------------------------------------------------------------
+
+static int
+OpenTraceFile ( const char * inPath, unsigned int inThreads, TraceFileContents * outContents )
+{
+
+	struct stat		fileInfo;
+	int				fd		= -1;
+	int				error	= 0;
+
+	bzero ( outContents, sizeof ( TraceFileContents ) );
+	outContents->mapping = MAP_FAILED;
+
+	fd = open ( inPath, O_RDONLY );
+	if ( fd < 0 )
+	{
+
+		error = errno;
+		goto Exit;
+
+	}
+
+	if ( fstat ( fd, &fileInfo ) != 0 )
+	{
+
+		error = errno;
+		goto Exit;
+
+	}
+
+	if ( fileInfo.st_size == 0 )
+	{
+		goto Exit;
+	}
+
+	outContents->length		= ( size_t ) fileInfo.st_size;
+	outContents->mapping	= mmap ( NULL, outContents->length, PROT_READ, MAP_PRIVATE, fd, 0 );
+
+	if ( outContents->mapping == MAP_FAILED )
+	{
+
+		error = errno;
+		goto Exit;
+
+	}
+
+	if ( UMCIsCompactTraceFile ( outContents->mapping, outContents->length ) == true )
+	{
+
+		error = UMCDecodeCompactTraceFile ( outContents->mapping,
+											outContents->length,
+											inThreads,
+											&outContents->decoded,
+											&outContents->count );
+
+		outContents->entries = outContents->decoded;
+
+	}
+
+	else
+	{
+
+		// A partial entry at the end of the file is ignored, as fread ( ) did.
+		outContents->entries	= ( const kd_buf * ) outContents->mapping;
+		outContents->count		= outContents->length / sizeof ( kd_buf );
+
+	}
+
+
+Exit:
+
+
+	if ( fd >= 0 )
+	{
+		close ( fd );
+	}
+
+	return error;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	CloseTraceFile
+//-----------------------------------------------------------------------------
+
+static void
+CloseTraceFile ( TraceFileContents * inContents )
+{
+
+	free ( inContents->decoded );
+
+	if ( inContents->mapping != MAP_FAILED )
+	{
+		munmap ( inContents->mapping, inContents->length );
+	}
+
+	bzero ( inContents, sizeof ( TraceFileContents ) );
+	inContents->mapping = MAP_FAILED;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	CompareTraceKeys
+//-----------------------------------------------------------------------------
+
+static int
+CompareTraceKeys ( const void * inLeft, const void * inRight )
+{
+
+	const TraceKey *	left	= ( const TraceKey * ) inLeft;
+	const TraceKey *	right	= ( const TraceKey * ) inRight;
+
+	if ( left->timestamp != right->timestamp )
+	{
+		return ( left->timestamp < right->timestamp ) ? -1 : 1;
+	}
+
+	if ( left->index != right->index )
+	{
+		return ( left->index < right->index ) ? -1 : 1;
+	}
+
+	return 0;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	InsertionSortTraceKeys - Entries from different CPUs are only ever a few
+//	places out of order, which an insertion sort fixes in close to linear
+//	time. Gives up and returns false once an entry is further out of place
+//	than that, leaving the keys permuted but intact.
+//-----------------------------------------------------------------------------
+
+static bool
+InsertionSortTraceKeys ( TraceKey * ioKeys, uint64_t inCount )
+{
+
+	TraceKey	key;
+	uint64_t	index	= 0;
+	uint64_t	slot	= 0;
+
+	for ( index = 1; index < inCount; index++ )
+	{
+
+		if ( ioKeys [ index ].timestamp >= ioKeys [ index - 1 ].timestamp )
+		{
+			continue;
+		}
+
+		key		= ioKeys [ index ];
+		slot	= index;
+
+		while ( ( slot > 0 ) && ( CompareTraceKeys ( &key, &ioKeys [ slot - 1 ] ) < 0 ) )
+		{
+			
+			if ( ( index - slot ) == kTraceFileMaxDisplacement )
+			{
+				
+				ioKeys [ slot ] = key;
+				return false;
+				
+			}
+			
+			ioKeys [ slot ] = ioKeys [ slot - 1 ];
+			slot--;
+			
+		}
+
+		ioKeys [ slot ] = key;
+
+	}
+
+	return true;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	SortTraceChunk - Splits a chunk into runs at its divisor entries and sorts
+//	each run. Runs on its own thread.
+//-----------------------------------------------------------------------------
+
+static void *
+SortTraceChunk ( void * inChunk )
+{
+
+	TraceChunk *	chunk	= ( TraceChunk * ) inChunk;
+	TraceRun *		run		= NULL;
+	uint64_t		index	= 0;
+	uint64_t		runIndex	= 0;
+	uint64_t		timestamp	= 0;
+
+	for ( index = chunk->first; index < chunk->last; index++ )
+	{
+
+		if ( chunk->entries [ index ].debugid == kDivisorEntry )
+		{
+			chunk->divisorCount++;
+		}
+
+	}
+
+	chunk->keys		= ( TraceKey * ) malloc ( ( chunk->last - chunk->first ) * sizeof ( TraceKey ) );
+	chunk->runs		= ( TraceRun * ) calloc ( chunk->divisorCount + 1, sizeof ( TraceRun ) );
+	chunk->divisors	= ( uint64_t * ) calloc ( chunk->divisorCount + 1, sizeof ( uint64_t ) );
+
+	if ( ( chunk->keys == NULL ) || ( chunk->runs == NULL ) || ( chunk->divisors == NULL ) )
+	{
+
+		chunk->error = ENOMEM;
+		return NULL;
+
+	}
+
+	chunk->runCount	= chunk->divisorCount + 1;
+	run				= &chunk->runs [ 0 ];
+	run->keys		= chunk->keys;
+
+	for ( index = chunk->first; index < chunk->last; index++ )
+	{
+
+		const kd_buf *	entry = &chunk->entries [ index ];
+
+		if ( entry->debugid == kDivisorEntry )
+		{
+
+			chunk->divisors [ runIndex ] = index;
+
+			runIndex++;
+			run			= &chunk->runs [ runIndex ];
+			run->keys	= chunk->runs [ runIndex - 1 ].keys + chunk->runs [ runIndex - 1 ].count;
+			timestamp	= 0;
+			continue;
+
+		}
+
+		// Invalid entries have no usable timestamp, keep them behind the entry they followed.
+		if ( entry->debugid != kInvalid )
+		{
+			timestamp = entry->timestamp & KDBG_TIMESTAMP_MASK;
+		}
+
+		run->keys [ run->count ].timestamp	= timestamp;
+		run->keys [ run->count ].index		= index;
+		run->count++;
+
+	}
+
+	for ( runIndex = 0; runIndex < chunk->runCount; runIndex++ )
+	{
+
+		run = &chunk->runs [ runIndex ];
+
+		if ( InsertionSortTraceKeys ( run->keys, run->count ) == false )
+		{
+			qsort ( run->keys, run->count, sizeof ( TraceKey ), CompareTraceKeys );
+		}
+
+	}
+
+	return NULL;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	MergeTraceChunks - Delivers the sorted runs of every chunk in timestamp
+//	order, one divisor range at a time.
+//-----------------------------------------------------------------------------
+
+static void
+MergeTraceChunks ( TraceChunk *				inChunks,
+				   unsigned int				inChunkCount,
+				   UMCTraceFileCallback		inCallback,
+				   void *					inRefCon )
+{
+
+	const kd_buf *	entries			= inChunks [ 0 ].entries;
+	TraceRun *		active [ kTraceFileMaxThreads ];
+	uint64_t		cursor [ kTraceFileMaxThreads ];
+	uint64_t		segmentCount	= 1;
+	uint64_t		segment			= 0;
+	unsigned int	activeCount		= 0;
+	unsigned int	chunk			= 0;
+	unsigned int	divisorChunk	= 0;
+	uint64_t		divisorIndex	= 0;
+	unsigned int	i				= 0;
+	unsigned int	lowest			= 0;
+
+	// Number the runs by the divisor range they fall in.
+	for ( chunk = 0; chunk < inChunkCount; chunk++ )
+	{
+
+		for ( i = 0; i < inChunks [ chunk ].runCount; i++ )
+		{
+			inChunks [ chunk ].runs [ i ].segment = segmentCount - 1 + i;
+		}
+
+		segmentCount += inChunks [ chunk ].divisorCount;
+		cursor [ chunk ] = 0;
+
+	}
+
+	for ( segment = 0; segment < segmentCount; segment++ )
+	{
+
+		if ( segment > 0 )
+		{
+
+			while ( divisorIndex >= inChunks [ divisorChunk ].divisorCount )
+			{
+
+				divisorChunk++;
+				divisorIndex = 0;
+
+			}
+
+			inCallback ( &entries [ inChunks [ divisorChunk ].divisors [ divisorIndex ] ], inRefCon );
+			divisorIndex++;
+
+		}
+
+		activeCount = 0;
+
+		for ( chunk = 0; chunk < inChunkCount; chunk++ )
+		{
+
+			if ( ( cursor [ chunk ] < inChunks [ chunk ].runCount ) &&
+				 ( inChunks [ chunk ].runs [ cursor [ chunk ] ].segment == segment ) )
+			{
+
+				active [ activeCount ] = &inChunks [ chunk ].runs [ cursor [ chunk ] ];
+				if ( active [ activeCount ]->count > 0 )
+				{
+					activeCount++;
+				}
+
+				cursor [ chunk ]++;
+
+			}
+
+		}
+
+		// There are only ever a handful of runs, a linear scan beats a heap here.
+		while ( activeCount > 0 )
+		{
+
+			lowest = 0;
+
+			for ( i = 1; i < activeCount; i++ )
+			{
+
+				if ( CompareTraceKeys ( &active [ i ]->keys [ active [ i ]->position ],
+										&active [ lowest ]->keys [ active [ lowest ]->position ] ) < 0 )
+				{
+					lowest = i;
+				}
+
+			}
+
+			inCallback ( &entries [ active [ lowest ]->keys [ active [ lowest ]->position ].index ], inRefCon );
+
+			active [ lowest ]->position++;
+			if ( active [ lowest ]->position == active [ lowest ]->count )
+			{
+
+				activeCount--;
+				active [ lowest ] = active [ activeCount ];
+
+			}
+
+		}
+
+	}
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	UMCParseTraceFile
+//-----------------------------------------------------------------------------
+
+int
+UMCParseTraceFile ( const char *			inPath,
+					unsigned int			inThreads,
+					UMCTraceFileCallback	inCallback,
+					void *					inRefCon )
+{
+
+	TraceChunk			chunks [ kTraceFileMaxThreads ];
+	TraceFileContents	contents;
+	uint64_t			count		= 0;
+	unsigned int		chunkCount	= 0;
+	unsigned int		started		= 0;
+	unsigned int		chunk		= 0;
+	int					error		= 0;
+
+	bzero ( chunks, sizeof ( chunks ) );
+
+	error = OpenTraceFile ( inPath, inThreads, &contents );
+	if ( error != 0 )
+	{
+		goto Exit;
+	}
+
+	count = contents.count;
+	if ( count == 0 )
+	{
+		goto Exit;
+	}
+
+	if ( inThreads == 0 )
+	{
+		inThreads = ( unsigned int ) sysconf ( _SC_NPROCESSORS_ONLN );
+	}
+
+	// Small files are not worth the threads.
+	chunkCount = ( unsigned int ) ( ( count + kTraceFileMinChunkEntries - 1 ) / kTraceFileMinChunkEntries );
+	if ( chunkCount > inThreads )
+	{
+		chunkCount = inThreads;
+	}
+
+	if ( chunkCount > kTraceFileMaxThreads )
+	{
+		chunkCount = kTraceFileMaxThreads;
+	}
+
+	if ( chunkCount == 0 )
+	{
+		chunkCount = 1;
+	}
+
+	for ( chunk = 0; chunk < chunkCount; chunk++ )
+	{
+
+		chunks [ chunk ].entries	= contents.entries;
+		chunks [ chunk ].first		= ( count * chunk ) / chunkCount;
+		chunks [ chunk ].last		= ( count * ( chunk + 1 ) ) / chunkCount;
+
+	}
+
+	// The first chunk is sorted on this thread.
+	for ( chunk = 1; chunk < chunkCount; chunk++ )
+	{
+
+		error = pthread_create ( &chunks [ chunk ].thread, NULL, SortTraceChunk, &chunks [ chunk ] );
+		if ( error != 0 )
+		{
+			break;
+		}
+
+		started++;
+
+	}
+
+	SortTraceChunk ( &chunks [ 0 ] );
+
+	for ( chunk = 1; chunk <= started; chunk++ )
+	{
+		pthread_join ( chunks [ chunk ].thread, NULL );
+	}
+
+	if ( error != 0 )
+	{
+		goto Exit;
+	}
+
+	for ( chunk = 0; chunk < chunkCount; chunk++ )
+	{
+
+		if ( chunks [ chunk ].error != 0 )
+		{
+
+			error = chunks [ chunk ].error;
+			goto Exit;
+
+		}
+
+	}
+
+	MergeTraceChunks ( chunks, chunkCount, inCallback, inRefCon );
+
+
+Exit:
+
+
+	for ( chunk = 0; chunk < chunkCount; chunk++ )
+	{
+
+		free ( chunks [ chunk ].keys );
+		free ( chunks [ chunk ].runs );
+		free ( chunks [ chunk ].divisors );
+
+	}
+
+	CloseTraceFile ( &contents );
+
+	return error;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	UMCConvertTraceFile
+//-----------------------------------------------------------------------------
+
+int
+UMCConvertTraceFile ( const char *	inSourcePath,
+					  const char *	inDestinationPath,
+					  int			inFormat )
+{
+
+	TraceFileContents	contents;
+	UMCCompactWriter *	writer		= NULL;
+	FILE *				destination	= NULL;
+	int					error		= 0;
+
+	error = OpenTraceFile ( inSourcePath, 0, &contents );
+	if ( error != 0 )
+	{
+		goto Exit;
+	}
+
+	destination = fopen ( inDestinationPath, "w" );
+	if ( destination == NULL )
+	{
+
+		error = errno;
+		goto Exit;
+
+	}
+
+	if ( inFormat == kUMCTraceFileFormatCompact )
+	{
+
+		writer = UMCCompactWriterCreate ( destination );
+		if ( writer == NULL )
+		{
+
+			error = ( errno != 0 ) ? errno : ENOMEM;
+			goto Exit;
+
+		}
+
+		error = UMCCompactWriterAppend ( writer, contents.entries, contents.count );
+		if ( error == 0 )
+		{
+			error = UMCCompactWriterClose ( writer );
+		}
+
+		else
+		{
+			UMCCompactWriterClose ( writer );
+		}
+
+	}
+
+	else if ( inFormat == kUMCTraceFileFormatRaw )
+	{
+
+		if ( ( contents.count != 0 ) && ( fwrite ( contents.entries, sizeof ( kd_buf ), contents.count, destination ) != contents.count ) )
+		{
+			error = ( errno != 0 ) ? errno : EIO;
+		}
+
+	}
+
+	else
+	{
+		error = EINVAL;
+	}
+
+
+Exit:
+
+
+	if ( ( destination != NULL ) && ( fclose ( destination ) != 0 ) && ( error == 0 ) )
+	{
+		error = errno;
+	}
+
+	CloseTraceFile ( &contents );
+
+	return error;
+
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2008-2009 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * "Portions Copyright (c) 1999 Apple Inc.  All Rights
+ * Reserved.  This file contains Original Code and/or Modifications of
+ * Original Code as defined in and that are subject to the Apple Public
+ * Source License Version 1.0 (the 'License').	You may not use this file
+ * except in compliance with the License.  Please obtain a copy of the
+ * License at http://www.apple.com/publicsource and read it before using
+ * this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE OR NON-INFRINGEMENT.  Please see the
+ * License for the specific language governing rights and limitations
+ * under the License."
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _UMC_TRACE_FILE_H_
+#define _UMC_TRACE_FILE_H_
+
+
+//-----------------------------------------------------------------------------
+//	Includes
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+
+#if defined(__APPLE__)
+
+#ifndef KERNEL_PRIVATE
+#define KERNEL_PRIVATE
+#include <sys/kdebug.h>
+#undef KERNEL_PRIVATE
+#else
+#include <sys/kdebug.h>
+#endif /*KERNEL_PRIVATE*/
+
+#else
+
+// The kd_buf layout UMCLogger -f writes, so raw files can be read off the Mac.
+typedef struct
+{
+	uint64_t		timestamp;
+	uintptr_t		arg1;
+	uintptr_t		arg2;
+	uintptr_t		arg3;
+	uintptr_t		arg4;
+	uintptr_t		arg5;
+	uint32_t		debugid;
+	uint32_t		cpuid;
+	uintptr_t		unused;
+} kd_buf;
+
+#define KDBG_TIMESTAMP_MASK			0x00ffffffffffffffULL
+
+#endif /* defined(__APPLE__) */
+
+
+//-----------------------------------------------------------------------------
+//	Constants
+//-----------------------------------------------------------------------------
+
+// Marker entries in a raw trace file.
+#define kInvalid						0xdeadbeef
+#define kDivisorEntry					0xfeedface
+
+// Written where the kernel buffer wrapped during capture. Its timestamp is the first entry kept
+// after the loss and arg1 the timestamp of the last entry before it.
+#define kLostEventsEntry				0xfeedbead
+
+// Trace file formats UMCConvertTraceFile writes.
+enum
+{
+	kUMCTraceFileFormatRaw			= 0,	// kd_buf records, as UMCLogger -f writes
+	kUMCTraceFileFormatCompact		= 1		// See UMCTraceCompact.h
+};
+
+
+//-----------------------------------------------------------------------------
+//	Prototypes
+//-----------------------------------------------------------------------------
+
+typedef void ( * UMCTraceFileCallback ) ( const kd_buf * inTracePoint, void * inRefCon );
+
+// Reads a trace file written by UMCLogger -f, raw or compact, and calls
+// inCallback for every entry, kInvalid and kDivisorEntry ones included. The
+// file is mapped, compact files are decoded, and the entries are split into
+// inThreads chunks (0 uses every online CPU) which are sorted in parallel and
+// merged in timestamp order. A kDivisorEntry is delivered ahead of all the
+// entries that follow it in the file, and a kInvalid entry, whose timestamp
+// means nothing, stays behind the entry it followed in the file. The callback
+// runs on the calling thread. Returns 0 or an errno value.
+
+int
+UMCParseTraceFile ( const char *			inPath,
+					unsigned int			inThreads,
+					UMCTraceFileCallback	inCallback,
+					void *					inRefCon );
+
+// Rewrites a raw or compact trace file in inFormat, keeping the entries in file
+// order. Returns 0 or an errno value.
+
+int
+UMCConvertTraceFile ( const char *	inSourcePath,
+					  const char *	inDestinationPath,
+					  int			inFormat );
+
+
+#endif	/* _UMC_TRACE_FILE_H_ */
@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2008-2009 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * "Portions Copyright (c) 1999 Apple Inc.  All Rights
+ * Reserved.  This file contains Original Code and/or Modifications of
+ * Original Code as defined in and that are subject to the Apple Public
+ * Source License Version 1.0 (the 'License').	You may not use this file
+ * except in compliance with the License.  Please obtain a copy of the
+ * License at http://www.apple.com/publicsource and read it before using
+ * this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE OR NON-INFRINGEMENT.  Please see the
+ * License for the specific language governing rights and limitations
+ * under the License."
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+Writes a synthetic raw trace and reports how many entries per second the raw
+trace file reader gets through, against the old one-fread-per-entry loop. Then
+converts it to the compact format and reports the compression ratio and how
+fast it encodes and decodes:
+g++ -W -Wall -O2 -pthread -o UMCTraceFileBenchmark UMCTraceFileBenchmark.cpp UMCTraceFile.cpp UMCTraceCompact.cpp
+./UMCTraceFileBenchmark [entries] [threads]
+*/
+
+
+//-----------------------------------------------------------------------------
+//	Includes
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "UMCTraceFile.h"
+#include "UMCTraceCompact.h"
+
+
+//-----------------------------------------------------------------------------
+//	Constants
+//-----------------------------------------------------------------------------
+
+#define kDefaultEntryCount				10000000
+#define kFirstUMCTraceCode				0x05278800
+#define kUMCTraceCodeCount				256
+#define kInvalidEntryInterval			100000
+
+
+//-----------------------------------------------------------------------------
+//	Structures
+//-----------------------------------------------------------------------------
+
+typedef struct BenchmarkState
+{
+	uint64_t		entries;
+	uint64_t		lastTimestamp;
+	uint64_t		outOfOrder;
+	uint64_t		checksum;
+} BenchmarkState;
+
+
+//-----------------------------------------------------------------------------
+//	Prototypes
+//-----------------------------------------------------------------------------
+
+static void
+CountTracePoint ( const kd_buf * inTracePoint, void * inRefCon );
+
+static int
+WriteSyntheticTrace ( const char * inPath, uint64_t inEntryCount );
+
+static double
+SecondsSince ( const struct timeval * inStart );
+
+static void
+Report ( const char * inName, const BenchmarkState * inState, double inSeconds );
+
+static long long
+FileSize ( const char * inPath );
+
+
+//-----------------------------------------------------------------------------
+//	Main
+//-----------------------------------------------------------------------------
+
+int
+main ( int argc, const char * argv[] )
+{
+
+	char				path [ ]	= "/tmp/UMCTraceFileBenchmark.XXXXXX";
+	char				compactPath [ sizeof ( path ) + 8 ];
+	char *				compact		= NULL;
+	kd_buf *			decoded		= NULL;
+	uint64_t			decodedCount	= 0;
+	long long			rawSize		= 0;
+	long long			compactSize	= 0;
+	double				seconds		= 0;
+	uint64_t			entryCount	= kDefaultEntryCount;
+	unsigned int		threads		= 0;
+	BenchmarkState		state;
+	struct timeval		start;
+	FILE *				traceFile;
+	kd_buf				entry;
+	int					fd;
+	int					error;
+
+	if ( argc > 1 )
+	{
+		entryCount = strtoull ( argv[1], NULL, 0 );
+	}
+
+	if ( argc > 2 )
+	{
+		threads = ( unsigned int ) strtoul ( argv[2], NULL, 0 );
+	}
+
+	fd = mkstemp ( path );
+	if ( fd < 0 )
+	{
+
+		perror ( "mkstemp" );
+		return 1;
+
+	}
+
+	close ( fd );
+
+	if ( WriteSyntheticTrace ( path, entryCount ) != 0 )
+	{
+
+		perror ( "write" );
+		unlink ( path );
+		return 1;
+
+	}
+
+	// The reader UMCLogger used before, one fread ( ) per entry.
+	bzero ( &state, sizeof ( state ) );
+	gettimeofday ( &start, NULL );
+
+	traceFile = fopen ( path, "r" );
+	if ( traceFile != NULL )
+	{
+
+		while ( fread ( &entry, sizeof ( kd_buf ), 1, traceFile ) )
+		{
+			CountTracePoint ( &entry, &state );
+		}
+
+		fclose ( traceFile );
+
+	}
+
+	Report ( "fread", &state, SecondsSince ( &start ) );
+
+	bzero ( &state, sizeof ( state ) );
+	gettimeofday ( &start, NULL );
+	error = UMCParseTraceFile ( path, 1, CountTracePoint, &state );
+	Report ( "mmap, 1 thread", &state, SecondsSince ( &start ) );
+
+	bzero ( &state, sizeof ( state ) );
+	gettimeofday ( &start, NULL );
+	error |= UMCParseTraceFile ( path, threads, CountTracePoint, &state );
+	Report ( "mmap, parallel", &state, SecondsSince ( &start ) );
+
+	snprintf ( compactPath, sizeof ( compactPath ), "%s.umcz", path );
+
+	gettimeofday ( &start, NULL );
+	error |= UMCConvertTraceFile ( path, compactPath, kUMCTraceFileFormatCompact );
+	seconds = SecondsSince ( &start );
+
+	rawSize		= FileSize ( path );
+	compactSize	= FileSize ( compactPath );
+
+	printf ( "%-16s %12lld bytes %8.3f s %14.0f entries/s %10.2f:1 (%.1f bytes per entry)\n",
+			 "compact encode",
+			 compactSize,
+			 seconds,
+			 ( seconds > 0 ) ? ( entryCount + 1 ) / seconds : 0.0,
+			 ( compactSize > 0 ) ? ( double ) rawSize / compactSize : 0.0,
+			 ( double ) compactSize / ( entryCount + 1 ) );
+
+	// Decoding alone, then decoding with the sort and merge on top.
+	compact		= ( char * ) malloc ( compactSize + 1 );
+	traceFile	= fopen ( compactPath, "r" );
+
+	if ( ( compact != NULL ) && ( traceFile != NULL ) && ( compactSize > 0 ) )
+	{
+
+		if ( fread ( compact, compactSize, 1, traceFile ) == 1 )
+		{
+
+			gettimeofday ( &start, NULL );
+			error |= UMCDecodeCompactTraceFile ( compact, compactSize, threads, &decoded, &decodedCount );
+			seconds = SecondsSince ( &start );
+
+			printf ( "%-16s %12llu entries %8.3f s %14.0f entries/s\n",
+					 "compact decode",
+					 ( unsigned long long ) decodedCount,
+					 seconds,
+					 ( seconds > 0 ) ? decodedCount / seconds : 0.0 );
+
+			free ( decoded );
+
+		}
+
+	}
+
+	if ( traceFile != NULL )
+	{
+		fclose ( traceFile );
+	}
+
+	free ( compact );
+
+	bzero ( &state, sizeof ( state ) );
+	gettimeofday ( &start, NULL );
+	error |= UMCParseTraceFile ( compactPath, threads, CountTracePoint, &state );
+	Report ( "compact, sorted", &state, SecondsSince ( &start ) );
+
+	unlink ( compactPath );
+	unlink ( path );
+
+	if ( error != 0 )
+	{
+
+		fprintf ( stderr, "Reading or converting the trace failed, error = %d\n", error );
+		return 1;
+
+	}
+
+	return 0;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	CountTracePoint
+//-----------------------------------------------------------------------------
+
+static void
+CountTracePoint ( const kd_buf * inTracePoint, void * inRefCon )
+{
+
+	BenchmarkState *	state = ( BenchmarkState * ) inRefCon;
+	uint64_t			timestamp;
+
+	state->entries++;
+	state->checksum += inTracePoint->debugid + inTracePoint->arg1 + inTracePoint->arg2;
+
+	if ( ( inTracePoint->debugid == kInvalid ) || ( inTracePoint->debugid == kDivisorEntry ) )
+	{
+		return;
+	}
+
+	timestamp = inTracePoint->timestamp & KDBG_TIMESTAMP_MASK;
+	if ( timestamp < state->lastTimestamp )
+	{
+		state->outOfOrder++;
+	}
+
+	state->lastTimestamp = timestamp;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	WriteSyntheticTrace - A divisor entry followed by UMC tracepoints whose
+//	timestamps jitter the way entries from several CPUs do, with the odd
+//	invalid entry.
+//-----------------------------------------------------------------------------
+
+static int
+WriteSyntheticTrace ( const char * inPath, uint64_t inEntryCount )
+{
+
+	FILE *		traceFile;
+	kd_buf		entry;
+	uint64_t	timestamp	= 1000000;
+	uint64_t	index		= 0;
+	int			error		= 0;
+
+	traceFile = fopen ( inPath, "w" );
+	if ( traceFile == NULL )
+	{
+		return -1;
+	}
+
+	srandom ( 1 );
+
+	bzero ( &entry, sizeof ( entry ) );
+	entry.debugid	= kDivisorEntry;
+	entry.timestamp	= 1000;
+	fwrite ( &entry, sizeof ( entry ), 1, traceFile );
+
+	for ( index = 0; index < inEntryCount; index++ )
+	{
+
+		bzero ( &entry, sizeof ( entry ) );
+
+		timestamp += 500 + ( random ( ) % 2000 );
+
+		if ( ( index % kInvalidEntryInterval ) == ( kInvalidEntryInterval - 1 ) )
+		{
+			entry.debugid = kInvalid;
+		}
+
+		else
+		{
+
+			entry.debugid	= kFirstUMCTraceCode + ( ( random ( ) % kUMCTraceCodeCount ) << 2 );
+			entry.timestamp	= timestamp - ( random ( ) % 1500 );
+			entry.arg1		= 0xFFFFFF8000100000ULL;
+			entry.arg2		= index;
+			entry.arg3		= random ( );
+			entry.arg4		= random ( );
+			entry.cpuid		= random ( ) % 4;
+
+		}
+
+		if ( fwrite ( &entry, sizeof ( entry ), 1, traceFile ) != 1 )
+		{
+
+			error = -1;
+			break;
+
+		}
+
+	}
+
+	if ( fclose ( traceFile ) != 0 )
+	{
+		error = -1;
+	}
+
+	return error;
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	SecondsSince
+//-----------------------------------------------------------------------------
+
+static double
+SecondsSince ( const struct timeval * inStart )
+{
+
+	struct timeval	now;
+
+	gettimeofday ( &now, NULL );
+
+	return ( double ) ( now.tv_sec - inStart->tv_sec ) + ( ( double ) ( now.tv_usec - inStart->tv_usec ) / 1000000.0 );
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	Report
+//-----------------------------------------------------------------------------
+
+static void
+Report ( const char * inName, const BenchmarkState * inState, double inSeconds )
+{
+
+	printf ( "%-16s %12llu entries %8.3f s %14.0f entries/s %10llu out of order (checksum 0x%llx)\n",
+			 inName,
+			 ( unsigned long long ) inState->entries,
+			 inSeconds,
+			 ( inSeconds > 0 ) ? inState->entries / inSeconds : 0.0,
+			 ( unsigned long long ) inState->outOfOrder,
+			 ( unsigned long long ) inState->checksum );
+
+}
+
+
+//-----------------------------------------------------------------------------
+//	FileSize
+//-----------------------------------------------------------------------------
+
+static long long
+FileSize ( const char * inPath )
+{
+
+	struct stat		fileInfo;
+
+	if ( stat ( inPath, &fileInfo ) != 0 )
+	{
+		return 0;
+	}
+
+	return ( long long ) fileInfo.st_size;
+
+}
@@ -32,6 +32,9 @@
 #include "IOUSBMassStorageClassTimestamps.h"
 #include "Debugging.h"
 
+// Kernel includes
+#include <kern/clock.h>
+
 
 //--------------------------------------------------------------------------------------------------
 //	Macros
@@ -73,9 +76,61 @@ IOReturn IOUSBMassStorageClass::AbortSCSICommandForBulkOnlyProtocol (
                                         SCSITaskIdentifier request )
 {
 
-	UNUSED ( request );
+	BulkOnlyRequestBlock *	boRequestBlock	= fBulkOnlyCurrentRequestBlock;
+	BulkOnlyRequestSlot *	slot			= NULL;
+	IOReturn				status			= kIOReturnNotFound;
+	
+	check ( fWorkLoop->inGate ( ) == true );
+	
+	require_quiet ( ( fBulkOnlyCommandStructInUse == true ), Exit );
+	require_quiet ( ( boRequestBlock != NULL ) && ( boRequestBlock->request == request ), Exit );
+	
+	slot = ( BulkOnlyRequestSlot * ) boRequestBlock;
+	status = kIOReturnSuccess;
+	
+	// Already being dropped.
+	require_quiet ( ( slot->abortRequested == false ), Exit );
+	
+	slot->abortRequested = true;
+	
+	STATUS_LOG ( ( 4, "%s[%p]: AbortSCSICommandForBulkOnlyProtocol request=%p currentState=%d", getName(), this, request, boRequestBlock->currentState ) );
+	
+	// While the CBW, data or CSW is on a bulk pipe, cancel it rather than wait out the
+	// command timeout. The completion then starts the Bulk-Only reset recovery. A command
+	// that is already recovering over the control pipe is left to finish, and is then
+	// completed as aborted.
+	switch ( boRequestBlock->currentState )
+	{
+		
+		case kBulkOnlyCommandSent:
+		case kBulkOnlyBulkIOComplete:
+		case kBulkOnlyStatusReceived:
+		case kBulkOnlyStatusReceived2ndTime:
+		{
+			
+			if ( GetBulkOutPipe() != NULL )
+			{
+				GetBulkOutPipe()->Abort ( );
+			}
+			
+			if ( GetBulkInPipe() != NULL )
+			{
+				GetBulkInPipe()->Abort ( );
+			}
+			
+		}
+		break;
+		
+		default:
+		break;
+		
+	}
 	
-	return kIOReturnError;
+	
+Exit:
+	
+	
+	return status;
 	
 }
 
@@ -90,13 +145,30 @@ IOReturn IOUSBMassStorageClass::SendSCSICommandForBulkOnlyProtocol (
                                          SCSITaskIdentifier request )
 {
 
+	// The completions, aborts and resets find the command through the current request
+	// block, so it only changes hands behind the command gate.
+	return fCommandGate->runAction ( OSMemberFunctionCast ( IOCommandGate::Action,
+															this,
+															&IOUSBMassStorageClass::GatedSendSCSICommandForBulkOnlyProtocol ),
+									 request );
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	GatedSendSCSICommandForBulkOnlyProtocol											 	 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageClass::GatedSendSCSICommandForBulkOnlyProtocol ( SCSITaskIdentifier request )
+{
+
 	IOReturn					status;
 	BulkOnlyRequestBlock *		theBulkOnlyRB;
 
-	theBulkOnlyRB = GetBulkOnlyRequestBlock();
-	
-	// Clear out the CBW	
-	bzero ( theBulkOnlyRB, sizeof ( BulkOnlyRequestBlock ) );
+	// Take a cleared request block, with its own CBW and CSW descriptors, from the pool.
+	theBulkOnlyRB = AllocateBulkOnlyRequestBlock();
+	require_action ( ( theBulkOnlyRB != NULL ), Exit, status = kIOReturnNoResources );
 
 	// Save the SCSI Task
 	theBulkOnlyRB->request = request; 	
@@ -109,7 +181,17 @@ IOReturn IOUSBMassStorageClass::SendSCSICommandForBulkOnlyProtocol (
    	STATUS_LOG ( ( 6, "%s[%p]: SendSCSICommandForBulkOnlyProtocol send CBW", getName(), this ) );
 	status = BulkOnlySendCBWPacket ( theBulkOnlyRB, kBulkOnlyCommandSent );
    	STATUS_LOG ( ( 5, "%s[%p]: SendSCSICommandForBulkOnlyProtocol send CBW returned %x", getName(), this, status ) );
-   	
+	
+	// The CBW never made it out, so the block will not see a completion.
+	if ( status != kIOReturnSuccess )
+	{
+		ReleaseBulkOnlyRequestBlock ( theBulkOnlyRB );
+	}
+	
+	
+Exit:
+	
+	
 	return status;
 	
 }
@@ -165,6 +247,10 @@ IOUSBMassStorageClass::BulkDeviceResetDevice (
 
 	// Set the next state to be executed
 	boRequestBlock->currentState = nextExecutionState;
+	
+	clock_get_uptime ( &fRecoveryStartTime );
+	fStatistics[kIOUSBMassStorageStatisticClassResets]++;
+	NoteFlightRecovery ( kUSBFlightRecoveryClassReset );
 
 	// Send the command over the control endpoint
 	status = GetInterfaceReference()->DeviceRequest ( &fUSBDeviceRequest, &boRequestBlock->boCompletion );
@@ -206,6 +292,30 @@ IOUSBMassStorageClass::BulkOnlyUSBCompletionAction (
 }
 
 
+//--------------------------------------------------------------------------------------------------
+//	BulkOnlyCSWCompletionAction															 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void 
+IOUSBMassStorageClass::BulkOnlyCSWCompletionAction (
+					                void *			target,
+					                void *			parameter,
+					                IOReturn		status,
+					                UInt32			bufferSizeRemaining)
+{
+
+	IOUSBMassStorageClass *		theMSC;
+	BulkOnlyRequestBlock *		boRequestBlock;
+	
+	theMSC 			= ( IOUSBMassStorageClass * ) target;
+	boRequestBlock 	= ( BulkOnlyRequestBlock * ) parameter;
+	theMSC->BulkOnlyPostedCSWCompletion ( 	boRequestBlock, 
+											status, 
+											bufferSizeRemaining );
+												
+}
+
+
 //--------------------------------------------------------------------------------------------------
 //	BulkOnlySendCBWPacket - Prepare the Command Block Wrapper packet for Bulk Only Protocol
 //																						 [PROTECTED]
@@ -221,8 +331,8 @@ IOUSBMassStorageClass::BulkOnlySendCBWPacket (
 
 	
     // Set our Bulk-Only phase descriptor.
-	require ( ( fBulkOnlyCBWMemoryDescriptor != NULL ), Exit );
-	boRequestBlock->boPhaseDesc = fBulkOnlyCBWMemoryDescriptor;
+	require ( ( ( ( BulkOnlyRequestSlot * ) boRequestBlock )->cbwDescriptor != NULL ), Exit );
+	boRequestBlock->boPhaseDesc = ( ( BulkOnlyRequestSlot * ) boRequestBlock )->cbwDescriptor;
 
 	boRequestBlock->boCBW.cbwSignature 			= kCommandBlockWrapperSignature;
 	boRequestBlock->boCBW.cbwTag 				= GetNextBulkOnlyCommandTag();
@@ -253,6 +363,8 @@ IOUSBMassStorageClass::BulkOnlySendCBWPacket (
 							( uintptr_t ) boRequestBlock->request, 
 							( unsigned int ) boRequestBlock->boCBW.cbwLUN, 
 							( unsigned int ) boRequestBlock->boCBW.cbwTag );
+	
+	RecordCommandStartTrace ( boRequestBlock->request, boRequestBlock->boCBW.cbwTag );
 
 	// Once timeouts are support, set the timeout value for the request 
 
@@ -312,8 +424,23 @@ IOUSBMassStorageClass::BulkOnlyTransferData (
     fRequiredMaxBusStall = 10000;
 #endif // EMBEDDED
     
+	// Large transfers are split into several outstanding segments. The CSW is not queued
+	// behind them; at that size the resubmit gap it saves is lost in the noise.
+	if ( UseSegmentedDataTransfer ( GetRequestedDataTransferCount ( boRequestBlock->request ) ) == true )
+	{
+		
+		status = StartSegmentedDataTransfer (	&( ( BulkOnlyRequestSlot * ) boRequestBlock )->segmentedData,
+												( GetDataTransferDirection ( boRequestBlock->request ) == kSCSIDataTransfer_FromTargetToInitiator ) ?
+													GetBulkInPipe() : GetBulkOutPipe(),
+												GetDataBuffer ( boRequestBlock->request ),
+												GetRequestedDataTransferCount ( boRequestBlock->request ),
+												GetTimeoutDuration ( boRequestBlock->request ),
+												&boRequestBlock->boCompletion );
+		
+	}
+	
 	// Start a bulk in or out transaction
-	if ( GetDataTransferDirection ( boRequestBlock->request ) == kSCSIDataTransfer_FromTargetToInitiator )
+	else if ( GetDataTransferDirection ( boRequestBlock->request ) == kSCSIDataTransfer_FromTargetToInitiator )
 	{
         
 		status = GetBulkInPipe()->Read(
@@ -322,6 +449,13 @@ IOUSBMassStorageClass::BulkOnlyTransferData (
 					GetTimeoutDuration( boRequestBlock->request ),
 					GetRequestedDataTransferCount( boRequestBlock->request ),
 					&boRequestBlock->boCompletion );
+		
+		// Queue the CSW read right behind the data so the host controller can pick up the
+		// status without waiting for us to resubmit. If it can't be queued we read it later.
+		if ( ( status == kIOReturnSuccess ) && ( fBulkOnlyPipelineCSW == true ) )
+		{
+			(void) BulkOnlyPostCSWWithData ( boRequestBlock );
+		}
 					
 	}
 	else if ( GetDataTransferDirection(boRequestBlock->request) == kSCSIDataTransfer_FromInitiatorToTarget )
@@ -369,8 +503,8 @@ IOUSBMassStorageClass::BulkOnlyReceiveCSWPacket (
 	IOReturn 			status = kIOReturnError;
 
 	// Set our Bulk-Only phase descriptor.
-	require ( ( fBulkOnlyCSWMemoryDescriptor != NULL ), Exit );
-	boRequestBlock->boPhaseDesc = fBulkOnlyCSWMemoryDescriptor;
+	require ( ( ( ( BulkOnlyRequestSlot * ) boRequestBlock )->cswDescriptor != NULL ), Exit );
+	boRequestBlock->boPhaseDesc = ( ( BulkOnlyRequestSlot * ) boRequestBlock )->cswDescriptor;
 	
 	// Set the next state to be executed
 	boRequestBlock->currentState = nextExecutionState;
@@ -391,6 +525,86 @@ Exit:
 }
 
 
+//--------------------------------------------------------------------------------------------------
+//	BulkOnlyPostCSWWithData - Queues the CSW read on the bulk in pipe behind a data in read that
+//							  has just been issued.										 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn 
+IOUSBMassStorageClass::BulkOnlyPostCSWWithData ( BulkOnlyRequestBlock * boRequestBlock )
+{
+
+	IOReturn 				status 	= kIOReturnError;
+	BulkOnlyRequestSlot *	slot	= ( BulkOnlyRequestSlot * ) boRequestBlock;
+
+	require ( ( slot->cswDescriptor != NULL ), Exit );
+	require_quiet ( ( slot->cswReadState == kBulkOnlyCSWReadIdle ), Exit );
+	
+	slot->cswCompletion.target 		= this;
+	slot->cswCompletion.action 		= &this->BulkOnlyCSWCompletionAction;
+	slot->cswCompletion.parameter 	= boRequestBlock;
+	
+	status = GetBulkInPipe()->Read (	slot->cswDescriptor,
+										GetTimeoutDuration( boRequestBlock->request ), // Use the client's timeout for both
+										GetTimeoutDuration( boRequestBlock->request ), 
+										&slot->cswCompletion );
+	
+	if ( status == kIOReturnSuccess )
+	{
+		slot->cswReadState = kBulkOnlyCSWReadPosted;
+	}
+	
+	RecordUSBTimeStamp (	UMC_TRACE ( kBOPostedCSW ), ( uintptr_t ) this, status, 
+							( unsigned int ) boRequestBlock->boCBW.cbwTag, ( uintptr_t ) boRequestBlock->request );
+	
+   	STATUS_LOG ( ( 5, "%s[%p]: BulkOnlyPostCSWWithData returned %x", getName(), this, status ) );
+	
+
+Exit:
+
+	return status;
+	
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	BulkOnlyDiscardPostedCSW - The data phase did not end cleanly, so the queued CSW read can't be
+//							   trusted. Pull it off the pipe before recovery issues its own.
+//																						 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void 
+IOUSBMassStorageClass::BulkOnlyDiscardPostedCSW ( BulkOnlyRequestBlock * boRequestBlock )
+{
+
+	BulkOnlyRequestSlot *	slot = ( BulkOnlyRequestSlot * ) boRequestBlock;
+
+	if ( slot->cswReadState == kBulkOnlyCSWReadCompleted )
+	{
+		
+		// Already back, just forget it.
+		slot->cswReadState = kBulkOnlyCSWReadIdle;
+		
+	}
+	else if ( slot->cswReadState == kBulkOnlyCSWReadPosted )
+	{
+		
+		RecordUSBTimeStamp (	UMC_TRACE ( kBOPostedCSWDiscarded ), ( uintptr_t ) this, 
+								( unsigned int ) boRequestBlock->boCBW.cbwTag, ( uintptr_t ) boRequestBlock->request, NULL );
+		
+		// The data read has completed, so the CSW read is the only request on the pipe.
+		// Its completion comes back with kIOReturnAborted and is ignored.
+		slot->cswReadState = kBulkOnlyCSWReadDiscarded;
+		if ( GetBulkInPipe() != NULL )
+		{
+			GetBulkInPipe()->Abort ( );
+		}
+		
+	}
+	
+}
+
+
 //--------------------------------------------------------------------------------------------------
 //	BulkOnlyExecuteCommandCompletion													 [PROTECTED]
 //--------------------------------------------------------------------------------------------------
@@ -402,9 +616,10 @@ IOUSBMassStorageClass::BulkOnlyExecuteCommandCompletion (
 		                UInt32					bufferSizeRemaining)
 {
 
-	IOReturn 		status = kIOReturnError;
-	bool			commandInProgress = false;
-	bool			abortCommand = false;
+	IOReturn 				status = kIOReturnError;
+	bool					commandInProgress = false;
+	bool					abortCommand = false;
+	BulkOnlyRequestSlot *	slot = NULL;
 
 
 	STATUS_LOG ( ( 4, "%s[%p]: BulkOnlyExecuteCommandCompletion Entered with boRequestBlock=%p currentState=%d resultingStatus=0x%x", getName(), this, boRequestBlock, boRequestBlock->currentState, resultingStatus ) );
@@ -437,6 +652,21 @@ IOUSBMassStorageClass::BulkOnlyExecuteCommandCompletion (
         // OR the command was aborted earlier, do nothing.
 		STATUS_LOG ( ( 4, "%s[%p]: boRequestBlock->request is NULL, returned %x", getName(), this, resultingStatus ) );
 		RecordUSBTimeStamp ( UMC_TRACE ( kBODoubleCompleteion ), ( uintptr_t ) this, NULL, NULL, NULL );
+		
+		// The command was aborted while its data segments were on the bus. Now that they are
+		// all back the slot can be returned to the pool.
+		slot = ( BulkOnlyRequestSlot * ) boRequestBlock;
+		if ( ( fBulkOnlyRequestPool != NULL ) &&
+			 ( slot >= fBulkOnlyRequestPool ) &&
+			 ( slot < &fBulkOnlyRequestPool[kIOUSBMassStorageRequestPoolSize] ) &&
+			 ( slot->releaseDeferred == true ) )
+		{
+			
+			slot->releaseDeferred = false;
+			ReleaseBulkOnlyRequestBlock ( boRequestBlock );
+			
+		}
+		
 		return;
 		
 	}
@@ -459,6 +689,31 @@ IOUSBMassStorageClass::BulkOnlyExecuteCommandCompletion (
 	RecordUSBTimeStamp (	UMC_TRACE ( kBOCompletion ), ( uintptr_t ) this, resultingStatus, 
 							( uintptr_t ) boRequestBlock->currentState, ( uintptr_t ) boRequestBlock->request );
 	
+	// The transfer cancelled by AbortSCSICommand is back. Run the Bulk-Only reset recovery so
+	// the device drops the command, then complete it as aborted from kBulkOnlyClearBulkOutCompleted.
+	slot = ( BulkOnlyRequestSlot * ) boRequestBlock;
+	if ( ( slot->abortRequested == true ) &&
+		 ( ( boRequestBlock->currentState == kBulkOnlyCommandSent ) ||
+		   ( boRequestBlock->currentState == kBulkOnlyBulkIOComplete ) ||
+		   ( boRequestBlock->currentState == kBulkOnlyStatusReceived ) ||
+		   ( boRequestBlock->currentState == kBulkOnlyStatusReceived2ndTime ) ) )
+	{
+		
+		STATUS_LOG ( ( 4, "%s[%p]: BulkOnlyExecuteCommandCompletion aborting request=%p", getName(), this, boRequestBlock->request ) );
+		
+		BulkOnlyDiscardPostedCSW ( boRequestBlock );
+		SetRealizedDataTransferCount ( boRequestBlock->request, 0 );
+		
+		status = BulkDeviceResetDevice ( boRequestBlock, kBulkOnlyResetCompleted );
+		if ( status == kIOReturnSuccess )
+		{
+			commandInProgress = true;
+		}
+		
+		goto Exit;
+		
+	}
+	
 	if ( ( resultingStatus == kIOReturnNotResponding ) || ( resultingStatus == kIOReturnAborted ) )
 	{
 	
@@ -473,6 +728,43 @@ IOUSBMassStorageClass::BulkOnlyExecuteCommandCompletion (
 		
 	}
 	
+	// Time the phase which just finished for the latency histograms.
+	switch ( boRequestBlock->currentState )
+	{
+		
+		case kBulkOnlyCommandSent:
+			fPhaseStartTime = RecordLatency ( kUSBLatencyPhaseBOCommand, fPhaseStartTime );
+			if ( CurrentFlightRecord ( ) != NULL )
+			{
+				CurrentFlightRecord ( )->tag = boRequestBlock->boCBW.cbwTag;
+			}
+			break;
+		
+		case kBulkOnlyBulkIOComplete:
+			fPhaseStartTime = RecordLatency ( kUSBLatencyPhaseBOData, fPhaseStartTime );
+			break;
+		
+		case kBulkOnlyStatusReceived:
+			fPhaseStartTime = RecordLatency ( kUSBLatencyPhaseBOStatus, fPhaseStartTime );
+			break;
+		
+		case kBulkOnlyClearCBWBulkStall:
+		case kBulkOnlyClearBulkStall:
+		case kBulkOnlyClearBulkStallPostCSW:
+		case kBulkOnlyClearBulkInCompleted:
+		case kBulkOnlyClearBulkOutCompleted:
+			RecordLatency ( kUSBLatencyPhaseClearStall, fRecoveryStartTime );
+			break;
+		
+		case kBulkOnlyResetCompleted:
+			RecordLatency ( kUSBLatencyPhaseClassReset, fRecoveryStartTime );
+			break;
+		
+		default:
+			break;
+		
+	}
+	
 	switch ( boRequestBlock->currentState )
 	{
 	
@@ -618,6 +910,12 @@ IOUSBMassStorageClass::BulkOnlyExecuteCommandCompletion (
 
    			STATUS_LOG ( ( 5, "%s[%p]: kBulkOnlyBulkIOComplete returned %x", getName(), this, resultingStatus ) );
 			
+			// A queued CSW read is out of step with a data phase that failed or overran.
+			if ( resultingStatus != kIOReturnSuccess )
+			{
+				BulkOnlyDiscardPostedCSW ( boRequestBlock );
+			}
+			
 			if ( ( resultingStatus == kIOUSBPipeStalled ) || ( resultingStatus == kIOReturnSuccess ) )
 			{
 				UInt64 realizedDataTransferCount = GetRequestedDataTransferCount ( boRequestBlock->request ) - bufferSizeRemaining;
@@ -631,11 +929,61 @@ IOUSBMassStorageClass::BulkOnlyExecuteCommandCompletion (
                     
 			if ( resultingStatus == kIOReturnSuccess )
 			{
-				// Bulk transfer is done, get the Command Status Wrapper from the device
-				status = BulkOnlyReceiveCSWPacket ( boRequestBlock, kBulkOnlyStatusReceived );
-				if ( status == kIOReturnSuccess )
+				
+				slot = ( BulkOnlyRequestSlot * ) boRequestBlock;
+				
+				// A segment queued behind a short one of a segmented data in phase received
+				// more data, most likely the CSW. Its status is never taken from the client's
+				// buffer: the host and the device disagree about the phase, so recover the way
+				// the Bulk-Only specification asks for a phase error.
+				if ( slot->segmentedData.spillLength != 0 )
 				{
+					
+					STATUS_LOG ( ( 4, "%s[%p]: kBulkOnlyBulkIOComplete %u bytes after a short packet", getName(), this, slot->segmentedData.spillLength ) );
+					
+					slot->segmentedData.spillLength = 0;
+					fStatistics[kIOUSBMassStorageStatisticCSWErrors]++;
+					
+					BulkOnlyDiscardPostedCSW ( boRequestBlock );
+					
+					status = BulkDeviceResetDevice ( boRequestBlock, kBulkOnlyResetCompleted );
+					if ( status == kIOReturnSuccess )
+					{
+						commandInProgress = true;
+					}
+					
+				}
+				else if ( slot->cswReadState == kBulkOnlyCSWReadPosted )
+				{
+					
+					// The CSW read was queued with the data. Its completion re-enters the state
+					// machine in the status received state.
+					boRequestBlock->currentState = kBulkOnlyStatusReceived;
+					commandInProgress = true;
+					
+				}
+				else if ( slot->cswReadState == kBulkOnlyCSWReadCompleted )
+				{
+					
+					// The CSW read came back first. Process it now.
+					slot->cswReadState = kBulkOnlyCSWReadIdle;
+					boRequestBlock->currentState = kBulkOnlyStatusReceived;
+					BulkOnlyExecuteCommandCompletion (	boRequestBlock,
+														slot->cswStatus,
+														slot->cswBufferSizeRemaining );
 					commandInProgress = true;
+					
+				}
+				else
+				{
+					
+					// Bulk transfer is done, get the Command Status Wrapper from the device
+					status = BulkOnlyReceiveCSWPacket ( boRequestBlock, kBulkOnlyStatusReceived );
+					if ( status == kIOReturnSuccess )
+					{
+						commandInProgress = true;
+					}
+					
 				}
 				
 			}
@@ -828,6 +1176,14 @@ IOUSBMassStorageClass::BulkOnlyExecuteCommandCompletion (
 			{
 				// Since the CBW and CSW tags match, process
 				// the CSW to determine the appropriate response.
+				if ( CurrentFlightRecord ( ) != NULL )
+				{
+					
+					CurrentFlightRecord ( )->cswStatus	= boRequestBlock->boCSW.cswStatus;
+					CurrentFlightRecord ( )->residue	= USBToHostLong ( boRequestBlock->boCSW.cswDataResidue );
+					
+				}
+				
 				switch( boRequestBlock->boCSW.cswStatus )
 				{
 					case kCSWCommandPassedError:
@@ -853,6 +1209,7 @@ IOUSBMassStorageClass::BulkOnlyExecuteCommandCompletion (
 						// The device reported a phase error on the command, perform the 
 						// bulk reset on the device.
 						STATUS_LOG ( ( 4, "%s[%p]: kBulkOnlyStatusReceived kCSWPhaseError", getName(), this ) );
+						fStatistics[kIOUSBMassStorageStatisticCSWErrors]++;
                         
 						status = BulkDeviceResetDevice( boRequestBlock, kBulkOnlyResetCompleted );
                         
@@ -868,6 +1225,7 @@ IOUSBMassStorageClass::BulkOnlyExecuteCommandCompletion (
 					{
 					
 						STATUS_LOG ( ( 4, "%s[%p]: kBulkOnlyStatusReceived default", getName(), this ) );
+						fStatistics[kIOUSBMassStorageStatisticCSWErrors]++;
 						// We received an unkown status, report an error to the client.
 						status = kIOReturnError;
 						
@@ -879,6 +1237,7 @@ IOUSBMassStorageClass::BulkOnlyExecuteCommandCompletion (
 			{
 			
 				STATUS_LOG ( ( 5, "%s[%p]: kBulkOnlyStatusReceived tag mismatch", getName(), this ) );
+				fStatistics[kIOUSBMassStorageStatisticCSWErrors]++;
 				// The only way to get to this point is if the command completes successfully,
 				// but the CBW and CSW tags do not match.  Report an error to the client.
 				status = kIOReturnError;
@@ -991,7 +1350,18 @@ Exit:
 	if ( commandInProgress == false )
 	{	
 		
-		if ( abortCommand == true )
+		if ( ( abortCommand == true ) && ( ( ( BulkOnlyRequestSlot * ) boRequestBlock )->abortRequested == true ) )
+		{
+			
+			// The recovery an abort asked for has finished. The device is usable again, so
+			// this does not count as a failed reset.
+			SCSITaskIdentifier	request = boRequestBlock->request;
+			
+			ReleaseBulkOnlyRequestBlock ( boRequestBlock );
+			CompleteAbortedSCSITask ( request );
+			
+		}
+		else if ( abortCommand == true )
 		{
 			
 			AbortCurrentSCSITask ( );
@@ -1000,13 +1370,92 @@ Exit:
 		else
 		{
 	
-			SCSITaskIdentifier	request = boRequestBlock->request;
+			SCSITaskIdentifier	request 		= boRequestBlock->request;
+			bool				abortRequested 	= ( ( BulkOnlyRequestSlot * ) boRequestBlock )->abortRequested;
 			
 			ReleaseBulkOnlyRequestBlock ( boRequestBlock );
-			CompleteSCSICommand ( request, status );
+			
+			// A command that finished cleanly despite the abort is reported as it finished.
+			if ( ( abortRequested == true ) && ( status != kIOReturnSuccess ) )
+			{
+				CompleteAbortedSCSITask ( request );
+			}
+			else
+			{
+				CompleteSCSICommand ( request, status );
+			}
 			
 		}
 		
 	}
 	STATUS_LOG ( ( 5, "%s[%p]: BulkOnlyExecuteCommandCompletion Returning with currentState=%d", getName(), this, boRequestBlock->currentState ) );
 }
+
+
+//--------------------------------------------------------------------------------------------------
+//	BulkOnlyPostedCSWCompletion - Completion for a CSW read queued behind the data in read.
+//																						 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void 
+IOUSBMassStorageClass::BulkOnlyPostedCSWCompletion (
+						BulkOnlyRequestBlock *	boRequestBlock,
+		                IOReturn				resultingStatus,
+		                UInt32					bufferSizeRemaining )
+{
+
+	BulkOnlyRequestSlot *	slot = ( BulkOnlyRequestSlot * ) boRequestBlock;
+
+#ifndef EMBEDDED
+	if ( reserved == NULL )
+	{
+
+		PANIC_NOW ( ( "IOUSBMassStorageClass::BulkOnlyPostedCSWCompletion callback after driver has been freed" ) );
+		return;
+	
+	}
+#endif // EMBEDDED
+
+	STATUS_LOG ( ( 5, "%s[%p]: BulkOnlyPostedCSWCompletion cswReadState=%d currentState=%d resultingStatus=0x%x", getName(), this, slot->cswReadState, boRequestBlock->currentState, resultingStatus ) );
+
+	if ( slot->cswReadState == kBulkOnlyCSWReadPosted )
+	{
+		
+		slot->cswStatus 				= resultingStatus;
+		slot->cswBufferSizeRemaining 	= bufferSizeRemaining;
+		slot->cswReadState 				= kBulkOnlyCSWReadCompleted;
+		
+	}
+	else
+	{
+		
+		// Discarded after a data phase error, recovery has taken over.
+		slot->cswReadState = kBulkOnlyCSWReadIdle;
+		
+	}
+	
+	// The command was completed or aborted while this read was outstanding.
+	if ( slot->releaseDeferred == true )
+	{
+		
+		slot->releaseDeferred 	= false;
+		slot->cswReadState 		= kBulkOnlyCSWReadIdle;
+		ReleaseBulkOnlyRequestBlock ( boRequestBlock );
+		return;
+		
+	}
+	
+	// Once the data phase has been processed the state machine waits for this read.
+	// Otherwise kBulkOnlyBulkIOComplete picks up the saved result.
+	if ( ( slot->cswReadState == kBulkOnlyCSWReadCompleted ) &&
+		 ( boRequestBlock->currentState == kBulkOnlyStatusReceived ) )
+	{
+		
+		slot->cswReadState = kBulkOnlyCSWReadIdle;
+		BulkOnlyExecuteCommandCompletion (	boRequestBlock, 
+											resultingStatus, 
+											bufferSizeRemaining );
+		
+	}
+	
+}
@@ -30,6 +30,9 @@
 #include "IOUSBMassStorageClassTimestamps.h"
 #include "Debugging.h"
 
+// Kernel includes
+#include <kern/clock.h>
+
 
 //--------------------------------------------------------------------------------------------------
 //	Macros
@@ -46,7 +49,19 @@ enum
 	kCBIGetStatusControlEndpointComplete,
 	kCBIClearControlEndpointComplete,
 	kCBIGetStatusBulkEndpointComplete,
-	kCBIClearBulkEndpointComplete
+	kCBIClearBulkEndpointComplete,
+	kCBICommandBlockResetComplete,		// Recovery after AbortSCSICommand
+	kCBIResetClearBulkInComplete,
+	kCBIResetClearBulkOutComplete
+};
+
+// Command Block Reset, sent as an ADSC in place of a command block (CBI 2.2).
+enum
+{
+	kCBICommandBlockResetByte0	= 0x1D,
+	kCBICommandBlockResetByte1	= 0x04,
+	kCBICommandBlockResetFill	= 0xFF,
+	kCBICommandBlockSize		= 12
 };
 
 #pragma mark -
@@ -63,9 +78,54 @@ IOUSBMassStorageClass::AbortSCSICommandForCBIProtocol (
 							SCSITaskIdentifier abortTask )
 {
 
-	UNUSED( abortTask );
+	CBIRequestBlock *	cbiRequestBlock	= fCBICurrentRequestBlock;
+	CBIRequestSlot *	slot			= NULL;
+	IOReturn			status			= kIOReturnNotFound;
+	
+	check ( fWorkLoop->inGate ( ) == true );
+	
+	require_quiet ( ( fCBICommandStructInUse == true ), Exit );
+	require_quiet ( ( cbiRequestBlock != NULL ) && ( cbiRequestBlock->request == abortTask ), Exit );
+	
+	slot = ( CBIRequestSlot * ) cbiRequestBlock;
+	status = kIOReturnSuccess;
+	
+	// Already being dropped.
+	require_quiet ( ( slot->abortRequested == false ), Exit );
+	
+	slot->abortRequested = true;
+	
+	STATUS_LOG ( ( 4, "%s[%p]: AbortSCSICommandForCBIProtocol request=%p currentState=%d", getName(), this, abortTask, cbiRequestBlock->currentState ) );
+	
+	// Cancel a data or interrupt phase rather than wait out the command timeout. The command
+	// block itself goes over the shared default pipe, which is left alone; its completion
+	// starts the recovery just the same.
+	if ( ( cbiRequestBlock->currentState == kCBIBulkIOComplete ) ||
+		 ( cbiRequestBlock->currentState == kCBIReadInterruptComplete ) )
+	{
+		
+		if ( GetBulkInPipe() != NULL )
+		{
+			GetBulkInPipe()->Abort ( );
+		}
+		
+		if ( GetBulkOutPipe() != NULL )
+		{
+			GetBulkOutPipe()->Abort ( );
+		}
+		
+		if ( GetInterruptPipe() != NULL )
+		{
+			GetInterruptPipe()->Abort ( );
+		}
+		
+	}
 	
-	return kIOReturnError;
+	
+Exit:
+	
+	
+	return status;
 	
 }
 
@@ -77,6 +137,23 @@ IOUSBMassStorageClass::AbortSCSICommandForCBIProtocol (
 
 IOReturn 
 IOUSBMassStorageClass::SendSCSICommandForCBIProtocol ( SCSITaskIdentifier request )
+{
+
+	// As with Bulk-Only, the current request block only changes hands behind the command gate.
+	return fCommandGate->runAction ( OSMemberFunctionCast ( IOCommandGate::Action,
+															this,
+															&IOUSBMassStorageClass::GatedSendSCSICommandForCBIProtocol ),
+									 request );
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	GatedSendSCSICommandForCBIProtocol													 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn 
+IOUSBMassStorageClass::GatedSendSCSICommandForCBIProtocol ( SCSITaskIdentifier request )
 {
 
 	IOReturn			status;
@@ -91,12 +168,13 @@ IOUSBMassStorageClass::SendSCSICommandForCBIProtocol ( SCSITaskIdentifier reques
 		
 	}
 
-	theCBIRequestBlock = GetCBIRequestBlock();
-
-	bzero ( theCBIRequestBlock, sizeof ( CBIRequestBlock ) );
-    
-    // After having bzero'd the struct we need reset the cbiPhaseDesc to fCBIMemoryDescriptor.
-    fCBICommandRequestBlock.cbiPhaseDesc = fCBIMemoryDescriptor;
+	// Take a cleared request block from the pool. Its cbiPhaseDesc already points at the
+	// slot's own status descriptor.
+	theCBIRequestBlock = AllocateCBIRequestBlock();
+	if ( theCBIRequestBlock == NULL )
+	{
+		return kIOReturnNoResources;
+	}
 
 	// Get a local copy of the callers cdb
 	GetCommandDescriptorBlock ( request, &theCBIRequestBlock->cbiCDB );
@@ -126,6 +204,12 @@ IOUSBMassStorageClass::SendSCSICommandForCBIProtocol ( SCSITaskIdentifier reques
 												GetTimeoutDuration( theCBIRequestBlock->request ),  // Use the client's timeout
 												&theCBIRequestBlock->cbiCompletion );
    	STATUS_LOG ( ( 5, "%s[%p]: SendSCSICommandForCBIProtocol DeviceRequest returned %x", getName(), this, status ) );
+	
+	// The command never made it out, so the block will not see a completion.
+	if ( status != kIOReturnSuccess )
+	{
+		ReleaseCBIRequestBlock ( theCBIRequestBlock );
+	}
    	
 	return status;
 	
@@ -176,8 +260,22 @@ IOUSBMassStorageClass::CBIProtocolTransferData (
 	// Set the next state to be executed
 	cbiRequestBlock->currentState = nextExecutionState;
 
+	// Large transfers are split into several outstanding segments.
+	if ( UseSegmentedDataTransfer ( GetRequestedDataTransferCount ( cbiRequestBlock->request ) ) == true )
+	{
+		
+		status = StartSegmentedDataTransfer (	&( ( CBIRequestSlot * ) cbiRequestBlock )->segmentedData,
+												( GetDataTransferDirection ( cbiRequestBlock->request ) == kSCSIDataTransfer_FromTargetToInitiator ) ?
+													GetBulkInPipe() : GetBulkOutPipe(),
+												GetDataBuffer ( cbiRequestBlock->request ),
+												GetRequestedDataTransferCount ( cbiRequestBlock->request ),
+												GetTimeoutDuration ( cbiRequestBlock->request ),
+												&cbiRequestBlock->cbiCompletion );
+		
+	}
+	
 	// Start a bulk in or out transaction
-	if ( GetDataTransferDirection ( cbiRequestBlock->request ) == kSCSIDataTransfer_FromTargetToInitiator )
+	else if ( GetDataTransferDirection ( cbiRequestBlock->request ) == kSCSIDataTransfer_FromTargetToInitiator )
 	{
 	
 		status = GetBulkInPipe()->Read ( 
@@ -309,6 +407,54 @@ ErrorExit:
 }
 
 
+//--------------------------------------------------------------------------------------------------
+//	CBIProtocolCommandBlockReset - Tells the device to drop the current command. The bulk
+//								   endpoints are halted by the reset and must be cleared
+//								   afterwards.											 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn 
+IOUSBMassStorageClass::CBIProtocolCommandBlockReset( 
+						CBIRequestBlock *		cbiRequestBlock,
+						UInt32					nextExecutionState )
+{
+
+	IOReturn 			status;
+	UInt8 *				commandBlock;
+	
+	
+	// The command block of the aborted command is no longer needed.
+	commandBlock = ( UInt8 * ) &cbiRequestBlock->cbiCDB;
+	memset ( commandBlock, kCBICommandBlockResetFill, kCBICommandBlockSize );
+	commandBlock[0] = kCBICommandBlockResetByte0;
+	commandBlock[1] = kCBICommandBlockResetByte1;
+	
+	// Set the next state to be executed
+	cbiRequestBlock->currentState = nextExecutionState;
+	
+	clock_get_uptime ( &fRecoveryStartTime );
+	fStatistics[kIOUSBMassStorageStatisticClassResets]++;
+	NoteFlightRecovery ( kUSBFlightRecoveryClassReset );
+	
+    cbiRequestBlock->cbiDevRequest.bmRequestType 	= USBmakebmRequestType ( kUSBOut, kUSBClass, kUSBInterface );	
+   	cbiRequestBlock->cbiDevRequest.bRequest 		= 0;
+   	cbiRequestBlock->cbiDevRequest.wValue			= 0;
+	cbiRequestBlock->cbiDevRequest.wIndex			= GetInterfaceReference()->GetInterfaceNumber();
+	cbiRequestBlock->cbiDevRequest.wLength			= kCBICommandBlockSize;
+   	cbiRequestBlock->cbiDevRequest.pData			= commandBlock;
+	
+	status = GetInterfaceReference()->GetDevice()->DeviceRequest ( 	
+												&cbiRequestBlock->cbiDevRequest, 
+												GetTimeoutDuration ( cbiRequestBlock->request ),
+												GetTimeoutDuration ( cbiRequestBlock->request ),
+												&cbiRequestBlock->cbiCompletion );
+   	STATUS_LOG ( ( 5, "%s[%p]: CBIProtocolCommandBlockReset returned %x", getName(), this, status ) );
+	
+	return status;
+	
+}
+
+
 //--------------------------------------------------------------------------------------------------
 //	CBIProtocolCommandCompletion														 [PROTECTED]
 //--------------------------------------------------------------------------------------------------
@@ -320,8 +466,9 @@ IOUSBMassStorageClass::CBIProtocolCommandCompletion(
 		                UInt32					bufferSizeRemaining )
 {
 
-	IOReturn 		status = kIOReturnError;
-	bool			commandInProgress = false;
+	IOReturn 			status = kIOReturnError;
+	bool				commandInProgress = false;
+	CBIRequestSlot *	slot = NULL;
 	
 	
 	// Check to see if our expansion data is still valid. If we've already passed through free() it'll be NULL and 
@@ -342,6 +489,21 @@ IOUSBMassStorageClass::CBIProtocolCommandCompletion(
 		// The request field is NULL, this appears to be a double callback, do nothing.
         // OR the command was aborted earlier, do nothing.
 		STATUS_LOG(( 4, "%s[%p]: cbiRequestBlock->request is NULL, returned %x", getName(), this, resultingStatus ));
+		
+		// The command was aborted while its data segments were on the bus. Now that they are
+		// all back the slot can be returned to the pool.
+		slot = ( CBIRequestSlot * ) cbiRequestBlock;
+		if ( ( fCBIRequestPool != NULL ) &&
+			 ( slot >= fCBIRequestPool ) &&
+			 ( slot < &fCBIRequestPool[kIOUSBMassStorageRequestPoolSize] ) &&
+			 ( slot->releaseDeferred == true ) )
+		{
+			
+			slot->releaseDeferred = false;
+			ReleaseCBIRequestBlock ( cbiRequestBlock );
+			
+		}
+		
 		return;
 		
 	}
@@ -358,6 +520,29 @@ IOUSBMassStorageClass::CBIProtocolCommandCompletion(
 	}
 	
     
+	// The phase AbortSCSICommand interrupted is back. Have the device drop the command, then
+	// complete it as aborted once the bulk endpoints are cleared.
+	slot = ( CBIRequestSlot * ) cbiRequestBlock;
+	if ( ( slot->abortRequested == true ) &&
+		 ( ( cbiRequestBlock->currentState == kCBIExecuteCommand ) ||
+		   ( cbiRequestBlock->currentState == kCBIBulkIOComplete ) ||
+		   ( cbiRequestBlock->currentState == kCBIReadInterruptComplete ) ) )
+	{
+		
+		STATUS_LOG ( ( 4, "%s[%p]: CBIProtocolCommandCompletion aborting request=%p", getName(), this, cbiRequestBlock->request ) );
+		
+		SetRealizedDataTransferCount ( cbiRequestBlock->request, 0 );
+		
+		status = CBIProtocolCommandBlockReset ( cbiRequestBlock, kCBICommandBlockResetComplete );
+		if ( status == kIOReturnSuccess )
+		{
+			commandInProgress = true;
+		}
+		
+		goto Exit;
+		
+	}
+	
     if ( ( resultingStatus == kIOReturnNotResponding ) || ( resultingStatus == kIOReturnAborted ) )
 	{
         
@@ -374,6 +559,38 @@ IOUSBMassStorageClass::CBIProtocolCommandCompletion(
 	RecordUSBTimeStamp (	UMC_TRACE ( kCBICompletion ), ( uintptr_t ) this, resultingStatus, 
 							( unsigned int ) cbiRequestBlock->currentState, ( uintptr_t ) cbiRequestBlock->request );
 	
+	// Time the phase which just finished for the latency histograms.
+	switch ( cbiRequestBlock->currentState )
+	{
+		
+		case kCBIExecuteCommand:
+			fPhaseStartTime = RecordLatency ( kUSBLatencyPhaseCBICommand, fPhaseStartTime );
+			break;
+		
+		case kCBIBulkIOComplete:
+			fPhaseStartTime = RecordLatency ( kUSBLatencyPhaseCBIData, fPhaseStartTime );
+			break;
+		
+		case kCBIReadInterruptComplete:
+			fPhaseStartTime = RecordLatency ( kUSBLatencyPhaseCBIStatus, fPhaseStartTime );
+			break;
+		
+		case kCBIClearControlEndpointComplete:
+		case kCBIClearBulkEndpointComplete:
+		case kCBIResetClearBulkInComplete:
+		case kCBIResetClearBulkOutComplete:
+			RecordLatency ( kUSBLatencyPhaseClearStall, fRecoveryStartTime );
+			break;
+		
+		case kCBICommandBlockResetComplete:
+			RecordLatency ( kUSBLatencyPhaseClassReset, fRecoveryStartTime );
+			break;
+		
+		default:
+			break;
+		
+	}
+	
 	switch ( cbiRequestBlock->currentState )
 	{
 	
@@ -566,7 +783,17 @@ IOUSBMassStorageClass::CBIProtocolCommandCompletion(
 					}
 					else
 					{
+						
 						status = kIOReturnError;
+						
+						// The interrupt data block holds the ASC and ASCQ. Let the UFI device
+						// check for a media change now instead of at its next poll.
+						if ( ( cbiRequestBlock->cbiGetStatusBuffer[0] == 0x28 ) ||
+							 ( cbiRequestBlock->cbiGetStatusBuffer[0] == 0x3A ) )
+						{
+							SendNotification_VerifyDeviceState ( );
+						}
+						
 					}
 					
 				}
@@ -805,6 +1032,56 @@ IOUSBMassStorageClass::CBIProtocolCommandCompletion(
 		}
 		break;
 		
+		case kCBICommandBlockResetComplete:
+		{
+		
+   			STATUS_LOG ( ( 5, "%s[%p]: kCBICommandBlockResetComplete status %x", getName(), this, resultingStatus ) );
+			
+			if ( resultingStatus != kIOReturnSuccess )
+			{
+				
+				// The device would not take the reset. Fall back on a USB device reset, which
+				// fails the command through AbortCurrentSCSITask().
+				ResetDeviceNow ( false );
+				commandInProgress = true;
+				break;
+				
+			}
+			
+			status = CBIClearFeatureEndpointStall ( GetBulkInPipe(), cbiRequestBlock, kCBIResetClearBulkInComplete );
+			if ( status == kIOReturnSuccess )
+			{
+				commandInProgress = true;
+			}
+			
+		}
+		break;
+		
+		case kCBIResetClearBulkInComplete:
+		{
+		
+   			STATUS_LOG ( ( 5, "%s[%p]: kCBIResetClearBulkInComplete status %x", getName(), this, resultingStatus ) );
+			
+			status = CBIClearFeatureEndpointStall ( GetBulkOutPipe(), cbiRequestBlock, kCBIResetClearBulkOutComplete );
+			if ( status == kIOReturnSuccess )
+			{
+				commandInProgress = true;
+			}
+			
+		}
+		break;
+		
+		case kCBIResetClearBulkOutComplete:
+		{
+		
+   			STATUS_LOG ( ( 5, "%s[%p]: kCBIResetClearBulkOutComplete status %x", getName(), this, resultingStatus ) );
+			
+			// Completed as aborted below.
+			status = kIOReturnAborted;
+			
+		}
+		break;
+		
 		default:
 		{
 		
@@ -826,10 +1103,20 @@ Exit:
 	if ( commandInProgress == false )
 	{
 	
-		SCSITaskIdentifier	request = cbiRequestBlock->request;
+		SCSITaskIdentifier	request 		= cbiRequestBlock->request;
+		bool				abortRequested 	= ( ( CBIRequestSlot * ) cbiRequestBlock )->abortRequested;
 		
 		ReleaseCBIRequestBlock ( cbiRequestBlock );
-		CompleteSCSICommand ( request, status );
+		
+		// A command that finished cleanly despite the abort is reported as it finished.
+		if ( ( abortRequested == true ) && ( status != kIOReturnSuccess ) )
+		{
+			CompleteAbortedSCSITask ( request );
+		}
+		else
+		{
+			CompleteSCSICommand ( request, status );
+		}
 		
 	}
 }
@@ -0,0 +1,1891 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//--------------------------------------------------------------------------------------------------
+//	Includes
+//--------------------------------------------------------------------------------------------------
+
+
+// This class' header file
+#include "IOUSBMassStorageClass.h"
+#include "IOUSBMassStorageClassTimestamps.h"
+#include "IOUSBMassStorageClassUAS.h"
+#include "Debugging.h"
+
+#include <IOKit/usb/IOUSBPipeV2.h>
+#include <IOKit/scsi/SCSICommandDefinitions.h>
+
+// Kernel includes
+#include <kern/clock.h>
+
+
+//--------------------------------------------------------------------------------------------------
+//	Macros
+//--------------------------------------------------------------------------------------------------
+
+#define fWorkLoop 	fIOSCSIProtocolInterfaceReserved->fWorkLoop
+
+
+// UAS Request Block Flags
+enum
+{
+
+	kUASStatusReceived			= 0x01,		// A Sense or Response IU has arrived for this tag.
+	kUASDataPhaseNeeded			= 0x02,		// Without streams, waiting on Read Ready or Write Ready.
+	kUASAborted					= 0x04,		// The task was failed back; waiting for USB to return the block.
+	kUASAbortRequested			= 0x08,		// An ABORT TASK for this tag is waiting on its response.
+	kUASReleaseTransport		= 0x10		// The task's transport claim goes with the block.
+
+};
+
+// REPORT LUNS runs before the device has any other command, on the start thread.
+enum
+{
+	kUASReportLUNsTimeout		= 5000
+};
+
+struct UASReportLUNsBuffer
+{
+	UInt8		commandIU[kUASCommandIUSize];
+	UInt8		data[kUASReportLUNsDataSize];
+	UInt8		statusIU[kUASMaxStatusIUSize];
+};
+
+
+#pragma mark -
+#pragma mark Protocol Services Methods
+#pragma mark -
+
+
+//--------------------------------------------------------------------------------------------------
+//	SendSCSICommandForUASProtocol - The SendSCSICommand helper method for USB Attached SCSI
+//									devices.											 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageClass::SendSCSICommandForUASProtocol ( SCSITaskIdentifier request )
+{
+
+	// Several commands may be outstanding and their completions run on the workloop, so
+	// tags, pipes and the shared status reader are only touched behind the command gate.
+	return fCommandGate->runAction ( OSMemberFunctionCast ( IOCommandGate::Action,
+															this,
+															&IOUSBMassStorageClass::GatedSendSCSICommandForUASProtocol ),
+									 request );
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	GatedSendSCSICommandForUASProtocol													 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageClass::GatedSendSCSICommandForUASProtocol ( SCSITaskIdentifier request )
+{
+
+	IOReturn				status 			= kIOReturnDeviceError;
+	UASRequestBlock *		uasRequestBlock	= NULL;
+	SCSICommandDescriptorBlock	cdb;
+	UInt32					timeout;
+
+	require ( ( fTerminating == false ), Exit );
+	require_nonzero ( fUASCommandPipe, Exit );
+
+	// A reset raced us between AcceptSCSITask and here. Put the task back at the head of its
+	// queue, where it would have been had it waited; it will be sent once the UAS alternate
+	// setting has been restored.
+	if ( fResetInProgress == true )
+	{
+
+		ReleaseTransport ( );
+		status = ( RequeueSCSITask ( request ) == true ) ? kIOReturnSuccess : kIOReturnBusy;
+		goto Exit;
+
+	}
+
+	// The Command IU has no room for a longer CDB, and it is refused rather than cut short.
+	require_action ( ( GetCommandDescriptorBlockSize ( request ) <= ( kUASCommandIUSize - kUASCommandIUCDBOffset ) ),
+					 Exit,
+					 status = kIOReturnBadArgument );
+
+	uasRequestBlock = AllocateUASRequestBlock ( );
+	require_action ( ( uasRequestBlock != NULL ), Exit, status = kIOReturnNoResources );
+
+	// Save the SCSI Task
+	uasRequestBlock->request = request;
+
+	// Set up the IOUSBCompletion structures, one per pipe the command can be outstanding on.
+	uasRequestBlock->uasCommandCompletion.target 	= this;
+	uasRequestBlock->uasCommandCompletion.action 	= &this->UASCommandCompletionAction;
+	uasRequestBlock->uasCommandCompletion.parameter = uasRequestBlock;
+
+	uasRequestBlock->uasDataCompletion.target 		= this;
+	uasRequestBlock->uasDataCompletion.action 		= &this->UASDataCompletionAction;
+	uasRequestBlock->uasDataCompletion.parameter 	= uasRequestBlock;
+
+	uasRequestBlock->uasStatusCompletion.target 	= this;
+	uasRequestBlock->uasStatusCompletion.action 	= &this->UASStatusCompletionAction;
+	uasRequestBlock->uasStatusCompletion.parameter 	= uasRequestBlock;
+
+	// Build the Command IU.
+	GetCommandDescriptorBlock ( request, &cdb );
+	UASBuildCommandIU ( ( UInt8 * ) &uasRequestBlock->uasCommandIU,
+						uasRequestBlock->uasTag,
+						GetLogicalUnitNumber ( request ),
+						cdb,
+						GetCommandDescriptorBlockSize ( request ) );
+
+	if ( ( GetDataTransferDirection ( request ) != kSCSIDataTransfer_NoDataTransfer ) &&
+		 ( GetRequestedDataTransferCount ( request ) != 0 ) &&
+		 ( fUASStreamsEnabled == false ) )
+	{
+		uasRequestBlock->uasFlags |= kUASDataPhaseNeeded;
+	}
+
+	RecordUSBTimeStamp (	UMC_TRACE ( kUASCommandIU ),
+							( uintptr_t ) this,
+							( uintptr_t ) request,
+							( unsigned int ) uasRequestBlock->uasTag,
+							( unsigned int ) GetLogicalUnitNumber ( request ) );
+
+	RecordCommandStartTrace ( request, uasRequestBlock->uasTag );
+
+	timeout = GetTimeoutDuration ( request );
+
+	// Send the Command IU to the device
+	status = fUASCommandPipe->Write (	( ( UASRequestSlot * ) uasRequestBlock )->commandDescriptor,
+										timeout,
+										timeout,
+										&uasRequestBlock->uasCommandCompletion );
+   	STATUS_LOG ( ( 5, "%s[%p]: GatedSendSCSICommandForUASProtocol Command IU tag=%u returned %x", getName(), this, uasRequestBlock->uasTag, status ) );
+
+	if ( status != kIOReturnSuccess )
+	{
+
+		// The command never made it out, so the block will not see a completion.
+		ReleaseUASRequestBlock ( uasRequestBlock );
+		goto Exit;
+
+	}
+
+	uasRequestBlock->uasPendingPhases++;
+
+	// From here on the command belongs to the device. Any failure to queue the remaining phases
+	// is handled by the same recovery as a failed transfer.
+	if ( fUASStreamsEnabled == true )
+	{
+
+		// With streams, the data and status phases are queued on the command's stream up front.
+		status = kIOReturnSuccess;
+		if ( ( GetDataTransferDirection ( request ) != kSCSIDataTransfer_NoDataTransfer ) &&
+			 ( GetRequestedDataTransferCount ( request ) != 0 ) )
+		{
+			status = UASTransferData ( uasRequestBlock );
+		}
+
+		if ( status == kIOReturnSuccess )
+		{
+			status = UASReceiveStatus ( uasRequestBlock );
+		}
+
+	}
+
+	else
+	{
+
+		// Without streams a single status read collects the IUs for every tag.
+		status = UASPostStatusReader ( );
+
+	}
+
+	if ( status != kIOReturnSuccess )
+	{
+
+		UASStartRecovery ( uasRequestBlock, status );
+		status = kIOReturnSuccess;
+
+	}
+
+
+Exit:
+
+
+	return status;
+
+}
+
+
+#pragma mark -
+#pragma mark USB Attached SCSI Configuration
+
+
+//--------------------------------------------------------------------------------------------------
+//	UASConfigureInterface - Selects the UAS alternate setting of our interface, finds its four
+//							pipes from their Pipe Usage descriptors and enables bulk streams
+//							where the device supports them.								 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageClass::UASConfigureInterface ( void )
+{
+
+	IOReturn								status				= kIOReturnUnsupported;
+	IOUSBInterface *						interfaceRef		= NULL;
+	IOUSBDevice *							deviceRef			= NULL;
+	const IOUSBConfigurationDescriptor *	configDesc			= NULL;
+	OSDictionary *							characterDict		= NULL;
+	IOUSBPipe *								pipe				= NULL;
+	IOUSBPipe *								dataInPipe			= NULL;
+	IOUSBPipe *								dataOutPipe			= NULL;
+	const UInt8 *							cursor				= NULL;
+	const UInt8 *							end					= NULL;
+	UInt8									commandEndpoint		= 0;
+	UInt8									statusEndpoint		= 0;
+	UInt8									dataInEndpoint		= 0;
+	UInt8									dataOutEndpoint		= 0;
+	UInt8									lastEndpoint		= 0;
+	UInt8									originalAltSetting	= 0;
+	UInt8									index				= 0;
+	bool									inUASSetting		= false;
+	bool									foundUASSetting		= false;
+	bool									doneParsing			= false;
+	UInt32									queueDepth			= kUASDefaultQueueDepth;
+
+	interfaceRef = GetInterfaceReference ( );
+	require_nonzero ( interfaceRef, Exit );
+
+	deviceRef = interfaceRef->GetDevice ( );
+	require_nonzero ( deviceRef, Exit );
+
+	// Personality overrides for devices with shallow UAS command queues.
+	characterDict = OSDynamicCast ( OSDictionary, getProperty ( kIOUSBMassStorageCharacteristics ) );
+	if ( characterDict != NULL )
+	{
+
+		OSNumber *	depth = NULL;
+
+		depth = OSDynamicCast ( OSNumber, characterDict->getObject ( kIOUSBMassStorageUASQueueDepth ) );
+		if ( depth != NULL )
+		{
+			queueDepth = depth->unsigned32BitValue ( );
+		}
+
+	}
+
+	if ( queueDepth == 0 )
+	{
+		queueDepth = 1;
+	}
+
+	if ( queueDepth > kUASMaxQueueDepth )
+	{
+		queueDepth = kUASMaxQueueDepth;
+	}
+
+	// After a reset the request pool already exists, and it can't grow.
+	if ( ( fRequestPoolSize != 0 ) && ( queueDepth > fRequestPoolSize ) )
+	{
+		queueDepth = fRequestPoolSize;
+	}
+
+	// Find the descriptors for the configuration our interface belongs to.
+	for ( index = 0; index < deviceRef->GetNumConfigurations ( ); index++ )
+	{
+
+		const IOUSBConfigurationDescriptor *	desc = deviceRef->GetFullConfigurationDescriptor ( index );
+
+		if ( ( desc != NULL ) && ( desc->bConfigurationValue == interfaceRef->GetConfigValue ( ) ) )
+		{
+
+			configDesc = desc;
+			break;
+
+		}
+
+	}
+
+	require_nonzero ( configDesc, Exit );
+
+	// Walk the configuration looking for a UAS alternate setting of our interface. Each of its
+	// endpoint descriptors is followed by a Pipe Usage descriptor naming the pipe's role.
+	cursor 	= ( const UInt8 * ) configDesc;
+	end 	= cursor + USBToHostWord ( configDesc->wTotalLength );
+
+	while ( ( doneParsing == false ) && ( ( cursor + 2 ) <= end ) && ( cursor[0] >= 2 ) && ( ( cursor + cursor[0] ) <= end ) )
+	{
+
+		switch ( cursor[1] )
+		{
+
+			case kUSBInterfaceDesc:
+			{
+
+				const IOUSBInterfaceDescriptor *	intfDesc = ( const IOUSBInterfaceDescriptor * ) cursor;
+
+				// The next interface descriptor ends the setting we are collecting.
+				if ( foundUASSetting == true )
+				{
+
+					doneParsing = true;
+					break;
+
+				}
+
+				inUASSetting = ( ( intfDesc->bInterfaceNumber == interfaceRef->GetInterfaceNumber ( ) ) &&
+								 ( intfDesc->bInterfaceClass == kUSBMassStorageInterfaceClass ) &&
+								 ( intfDesc->bInterfaceProtocol == kProtocolUSBAttachedSCSI ) &&
+								 ( intfDesc->bNumEndpoints >= 4 ) );
+
+				if ( inUASSetting == true )
+				{
+
+					foundUASSetting 		= true;
+					fUASAlternateSetting 	= intfDesc->bAlternateSetting;
+
+				}
+
+			}
+			break;
+
+			case kUSBEndpointDesc:
+			{
+				lastEndpoint = ( ( const IOUSBEndpointDescriptor * ) cursor )->bEndpointAddress;
+			}
+			break;
+
+			case kUASPipeUsageDescriptorType:
+			{
+
+				if ( ( inUASSetting == false ) || ( cursor[0] < 3 ) )
+				{
+					break;
+				}
+
+				switch ( cursor[2] )
+				{
+
+					case kUASCommandPipeID:		commandEndpoint = lastEndpoint;		break;
+					case kUASStatusPipeID:		statusEndpoint 	= lastEndpoint;		break;
+					case kUASDataInPipeID:		dataInEndpoint 	= lastEndpoint;		break;
+					case kUASDataOutPipeID:		dataOutEndpoint = lastEndpoint;		break;
+					default:														break;
+
+				}
+
+			}
+			break;
+
+			default:
+			break;
+
+		}
+
+		cursor += cursor[0];
+
+	}
+
+	require_quiet ( foundUASSetting, Exit );
+	require ( ( commandEndpoint != 0 ) && ( statusEndpoint != 0 ) &&
+			  ( dataInEndpoint != 0 ) && ( dataOutEndpoint != 0 ), Exit );
+
+	STATUS_LOG ( ( 6, "%s[%p]: UASConfigureInterface alternate setting %d, command=0x%x status=0x%x in=0x%x out=0x%x",
+				   getName(), this, fUASAlternateSetting, commandEndpoint, statusEndpoint, dataInEndpoint, dataOutEndpoint ) );
+
+	originalAltSetting = interfaceRef->GetAlternateSetting ( );
+	if ( originalAltSetting != fUASAlternateSetting )
+	{
+
+		status = interfaceRef->SetAlternateInterface ( this, fUASAlternateSetting );
+		require_success ( status, ErrorExit );
+
+	}
+
+	// Match the pipes of the new setting to the endpoints named by the Pipe Usage descriptors.
+	do
+	{
+
+		IOUSBFindEndpointRequest	request;
+		UInt8						address;
+
+		bzero ( &request, sizeof ( request ) );
+		request.type 		= kUSBBulk;
+		request.direction 	= kUSBAnyDirn;
+
+		pipe = interfaceRef->FindNextPipe ( pipe, &request, false );
+		if ( pipe == NULL )
+		{
+			break;
+		}
+
+		address = pipe->GetEndpointNumber ( ) | ( ( pipe->GetDirection ( ) == kUSBIn ) ? 0x80 : 0x00 );
+
+		if ( ( address == commandEndpoint ) && ( fUASCommandPipe == NULL ) )
+		{
+
+			pipe->retain ( );
+			fUASCommandPipe = pipe;
+
+		}
+
+		else if ( ( address == statusEndpoint ) && ( fUASStatusPipe == NULL ) )
+		{
+
+			pipe->retain ( );
+			fUASStatusPipe = pipe;
+
+		}
+
+		else if ( ( address == dataInEndpoint ) && ( dataInPipe == NULL ) )
+		{
+
+			pipe->retain ( );
+			dataInPipe = pipe;
+
+		}
+
+		else if ( ( address == dataOutEndpoint ) && ( dataOutPipe == NULL ) )
+		{
+
+			pipe->retain ( );
+			dataOutPipe = pipe;
+
+		}
+
+	} while ( pipe != NULL );
+
+	require_action ( ( fUASCommandPipe != NULL ) && ( fUASStatusPipe != NULL ) &&
+					 ( dataInPipe != NULL ) && ( dataOutPipe != NULL ), ErrorExit, status = kIOReturnNotFound );
+
+	// Bulk streams are only available on SuperSpeed. Each tag gets its own stream on the status and
+	// data pipes, plus one for task management. Fewer streams than that shrinks the queue depth.
+	fUASStreamsEnabled = false;
+	if ( deviceRef->GetSpeed ( ) >= kUSBDeviceSpeedSuper )
+	{
+
+		IOUSBPipeV2 *	statusPipeV2 	= OSDynamicCast ( IOUSBPipeV2, fUASStatusPipe );
+		IOUSBPipeV2 *	dataInPipeV2 	= OSDynamicCast ( IOUSBPipeV2, dataInPipe );
+		IOUSBPipeV2 *	dataOutPipeV2 	= OSDynamicCast ( IOUSBPipeV2, dataOutPipe );
+		UInt32			streams			= 0;
+
+		if ( ( statusPipeV2 != NULL ) && ( dataInPipeV2 != NULL ) && ( dataOutPipeV2 != NULL ) )
+		{
+
+			streams = statusPipeV2->SupportsStreams ( );
+			streams = min ( streams, dataInPipeV2->SupportsStreams ( ) );
+			streams = min ( streams, dataOutPipeV2->SupportsStreams ( ) );
+
+		}
+
+		if ( streams >= 2 )
+		{
+
+			if ( streams < ( queueDepth + 1 ) )
+			{
+				queueDepth = streams - 1;
+			}
+
+			status = statusPipeV2->CreateStreams ( queueDepth + 1 );
+			if ( status == kIOReturnSuccess )
+			{
+				status = dataInPipeV2->CreateStreams ( queueDepth + 1 );
+			}
+
+			if ( status == kIOReturnSuccess )
+			{
+				status = dataOutPipeV2->CreateStreams ( queueDepth + 1 );
+			}
+
+			if ( status == kIOReturnSuccess )
+			{
+				fUASStreamsEnabled = true;
+			}
+
+			else
+			{
+
+				// Fall back to the Read Ready / Write Ready sequence.
+				STATUS_LOG ( ( 2, "%s[%p]: UASConfigureInterface CreateStreams failed 0x%x", getName(), this, status ) );
+				statusPipeV2->CreateStreams ( 0 );
+				dataInPipeV2->CreateStreams ( 0 );
+				dataOutPipeV2->CreateStreams ( 0 );
+
+			}
+
+		}
+
+	}
+
+	fBulkInPipe 	= dataInPipe;
+	fBulkOutPipe 	= dataOutPipe;
+	fUASQueueDepth 	= queueDepth;
+
+	status = kIOReturnSuccess;
+	goto Exit;
+
+
+ErrorExit:
+
+
+	RecordUSBTimeStamp (	UMC_TRACE ( kUASConfigurationFailed ),
+							( uintptr_t ) this, status, fUASAlternateSetting, NULL );
+
+	if ( dataInPipe != NULL )
+	{
+		dataInPipe->release ( );
+	}
+
+	if ( dataOutPipe != NULL )
+	{
+		dataOutPipe->release ( );
+	}
+
+	UASReleasePipes ( );
+
+	// Leave the interface the way we found it so Bulk Only can still be used.
+	if ( interfaceRef->GetAlternateSetting ( ) != originalAltSetting )
+	{
+		interfaceRef->SetAlternateInterface ( this, originalAltSetting );
+	}
+
+
+Exit:
+
+
+	STATUS_LOG ( ( 5, "%s[%p]: UASConfigureInterface returning 0x%x streams=%d queueDepth=%u", getName(), this, status, fUASStreamsEnabled, fUASQueueDepth ) );
+
+	return status;
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	UASRestoreAfterReset - A USB device reset returns the interface to its default alternate
+//						   setting and discards any streams.							 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageClass::UASRestoreAfterReset ( void )
+{
+
+	if ( fBulkInPipe != NULL )
+	{
+
+		fBulkInPipe->release ( );
+		fBulkInPipe = NULL;
+
+	}
+
+	if ( fBulkOutPipe != NULL )
+	{
+
+		fBulkOutPipe->release ( );
+		fBulkOutPipe = NULL;
+
+	}
+
+	UASReleasePipes ( );
+
+	return UASConfigureInterface ( );
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	UASReleasePipes																		 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::UASReleasePipes ( void )
+{
+
+#ifndef EMBEDDED
+	require_nonzero ( reserved, Exit );
+#endif // EMBEDDED
+
+	if ( fUASCommandPipe != NULL )
+	{
+
+		fUASCommandPipe->release ( );
+		fUASCommandPipe = NULL;
+
+	}
+
+	if ( fUASStatusPipe != NULL )
+	{
+
+		fUASStatusPipe->release ( );
+		fUASStatusPipe = NULL;
+
+	}
+
+
+#ifndef EMBEDDED
+Exit:
+#endif // EMBEDDED
+
+
+	return;
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	UASReportLUNs - Asks the device which logical units it has with REPORT LUNS. Called from
+//					BeginProvidedServices() before anything else has been sent, so it takes the
+//					first tag and waits on each transfer in turn.						 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageClass::UASReportLUNs ( UInt8 * maxLUN )
+{
+
+	IOReturn				status			= kIOReturnNoMemory;
+	UASReportLUNsBuffer *	buffer			= NULL;
+	IOMemoryDescriptor *	commandDesc		= NULL;
+	IOMemoryDescriptor *	dataDesc		= NULL;
+	IOMemoryDescriptor *	statusDesc		= NULL;
+	IOUSBPipeV2 *			dataInPipeV2	= NULL;
+	IOUSBPipeV2 *			statusPipeV2	= NULL;
+	IOByteCount				dataLength		= 0;
+	IOByteCount				statusLength	= 0;
+	UInt16					tag				= UASTagForSlot ( 0 );
+	UASStatusIUInfo			info;
+	UInt8					cdb[kUASReportLUNsCDBSize];
+
+	*maxLUN = 0;
+
+	require_nonzero_action ( fUASCommandPipe, Exit, status = kIOReturnNotReady );
+
+	buffer = ( UASReportLUNsBuffer * ) IOMalloc ( sizeof ( UASReportLUNsBuffer ) );
+	require_nonzero ( buffer, Exit );
+	bzero ( buffer, sizeof ( UASReportLUNsBuffer ) );
+
+	commandDesc = IOMemoryDescriptor::withAddress ( buffer->commandIU, kUASCommandIUSize, kIODirectionOut );
+	require_nonzero ( commandDesc, Exit );
+
+	dataDesc = IOMemoryDescriptor::withAddress ( buffer->data, kUASReportLUNsDataSize, kIODirectionIn );
+	require_nonzero ( dataDesc, Exit );
+
+	statusDesc = IOMemoryDescriptor::withAddress ( buffer->statusIU, kUASMaxStatusIUSize, kIODirectionIn );
+	require_nonzero ( statusDesc, Exit );
+
+	UASBuildReportLUNsCDB ( cdb );
+	UASBuildCommandIU ( buffer->commandIU, tag, 0, cdb, sizeof ( cdb ) );
+
+	status = fUASCommandPipe->Write ( commandDesc, kUASReportLUNsTimeout, kUASReportLUNsTimeout, NULL );
+	require_success ( status, Exit );
+
+	if ( fUASStreamsEnabled == true )
+	{
+
+		dataInPipeV2 = OSDynamicCast ( IOUSBPipeV2, GetBulkInPipe ( ) );
+		statusPipeV2 = OSDynamicCast ( IOUSBPipeV2, fUASStatusPipe );
+		require_action ( ( dataInPipeV2 != NULL ) && ( statusPipeV2 != NULL ), Exit, status = kIOReturnError );
+
+		// The data comes first on the command's stream, then the status on its own.
+		status = dataInPipeV2->Read ( tag, dataDesc, kUASReportLUNsTimeout, kUASReportLUNsTimeout,
+									  kUASReportLUNsDataSize, NULL, &dataLength );
+		require ( ( status == kIOReturnSuccess ) || ( status == kIOReturnUnderrun ), Exit );
+
+		status = statusPipeV2->Read ( tag, statusDesc, kUASReportLUNsTimeout, kUASReportLUNsTimeout,
+									  kUASMaxStatusIUSize, NULL, &statusLength );
+		require_success ( status, Exit );
+
+	}
+
+	else
+	{
+
+		// Read Ready comes ahead of the data, unless the device fails the command outright.
+		status = fUASStatusPipe->Read ( statusDesc, kUASReportLUNsTimeout, kUASReportLUNsTimeout,
+										kUASMaxStatusIUSize, NULL, &statusLength );
+		require_success ( status, Exit );
+
+		if ( ( UASParseStatusIU ( buffer->statusIU, statusLength, &info ) == true ) &&
+			 ( info.iuID == kUASReadReadyIUID ) && ( info.tag == tag ) )
+		{
+
+			status = GetBulkInPipe ( )->Read ( dataDesc, kUASReportLUNsTimeout, kUASReportLUNsTimeout,
+											   kUASReportLUNsDataSize, NULL, &dataLength );
+			require ( ( status == kIOReturnSuccess ) || ( status == kIOReturnUnderrun ), Exit );
+
+			status = fUASStatusPipe->Read ( statusDesc, kUASReportLUNsTimeout, kUASReportLUNsTimeout,
+											kUASMaxStatusIUSize, NULL, &statusLength );
+			require_success ( status, Exit );
+
+		}
+
+	}
+
+	status = kIOReturnError;
+
+	require ( ( UASParseStatusIU ( buffer->statusIU, statusLength, &info ) == true ), Exit );
+	require ( ( info.iuID == kUASSenseIUID ) && ( info.tag == tag ), Exit );
+
+	// Devices with a single LUN are allowed to reject REPORT LUNS.
+	require_action_quiet ( ( info.taskStatus == kSCSITaskStatus_GOOD ), Exit, status = kIOReturnSuccess );
+
+	*maxLUN = UASParseReportLUNs ( buffer->data, dataLength, kIOUSBMassStorageMaxLogicalUnits - 1 );
+	status 	= kIOReturnSuccess;
+
+
+Exit:
+
+
+	RecordUSBTimeStamp (	UMC_TRACE ( kUASReportLUNs ),
+							( uintptr_t ) this, status, *maxLUN, ( unsigned int ) dataLength );
+
+	if ( statusDesc != NULL )
+	{
+		statusDesc->release ( );
+	}
+
+	if ( dataDesc != NULL )
+	{
+		dataDesc->release ( );
+	}
+
+	if ( commandDesc != NULL )
+	{
+		commandDesc->release ( );
+	}
+
+	if ( buffer != NULL )
+	{
+		IOFree ( buffer, sizeof ( UASReportLUNsBuffer ) );
+	}
+
+	STATUS_LOG ( ( 5, "%s[%p]: UASReportLUNs returning 0x%x maxLUN=%u", getName(), this, status, *maxLUN ) );
+
+	return status;
+
+}
+
+
+#pragma mark -
+#pragma mark USB Attached SCSI Phases
+
+
+//--------------------------------------------------------------------------------------------------
+//	UASTransferData																		 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageClass::UASTransferData ( UASRequestBlock * uasRequestBlock )
+{
+
+	IOReturn				status 	= kIOReturnError;
+	SCSITaskIdentifier		request = uasRequestBlock->request;
+	UInt32					timeout = GetTimeoutDuration ( request );
+
+	uasRequestBlock->uasFlags &= ~kUASDataPhaseNeeded;
+
+#ifndef EMBEDDED
+	// The bus stall requirement covers every data phase in flight.
+	if ( fUASActiveDataTransfers == 0 )
+	{
+
+		requireMaxBusStall ( 10000 );
+		fRequiredMaxBusStall = 10000;
+
+	}
+#endif // EMBEDDED
+
+	fUASActiveDataTransfers++;
+
+	if ( GetDataTransferDirection ( request ) == kSCSIDataTransfer_FromTargetToInitiator )
+	{
+
+		if ( fUASStreamsEnabled == true )
+		{
+
+			IOUSBPipeV2 *	pipeV2 = OSDynamicCast ( IOUSBPipeV2, GetBulkInPipe ( ) );
+
+			require_nonzero ( pipeV2, ErrorExit );
+			status = pipeV2->Read ( uasRequestBlock->uasTag,
+									GetDataBuffer ( request ),
+									timeout,
+									timeout,
+									GetRequestedDataTransferCount ( request ),
+									&uasRequestBlock->uasDataCompletion );
+
+		}
+
+		else
+		{
+
+			status = GetBulkInPipe ( )->Read (	GetDataBuffer ( request ),
+												timeout,
+												timeout,
+												GetRequestedDataTransferCount ( request ),
+												&uasRequestBlock->uasDataCompletion );
+
+		}
+
+	}
+
+	else if ( GetDataTransferDirection ( request ) == kSCSIDataTransfer_FromInitiatorToTarget )
+	{
+
+		if ( fUASStreamsEnabled == true )
+		{
+
+			IOUSBPipeV2 *	pipeV2 = OSDynamicCast ( IOUSBPipeV2, GetBulkOutPipe ( ) );
+
+			require_nonzero ( pipeV2, ErrorExit );
+			status = pipeV2->Write ( uasRequestBlock->uasTag,
+									 GetDataBuffer ( request ),
+									 timeout,
+									 timeout,
+									 GetRequestedDataTransferCount ( request ),
+									 &uasRequestBlock->uasDataCompletion );
+
+		}
+
+		else
+		{
+
+			status = GetBulkOutPipe ( )->Write (	GetDataBuffer ( request ),
+													timeout,
+													timeout,
+													GetRequestedDataTransferCount ( request ),
+													&uasRequestBlock->uasDataCompletion );
+
+		}
+
+	}
+
+
+ErrorExit:
+
+
+	if ( status == kIOReturnSuccess )
+	{
+		uasRequestBlock->uasPendingPhases++;
+	}
+
+	else
+	{
+
+		fUASActiveDataTransfers--;
+
+#ifndef EMBEDDED
+		if ( fUASActiveDataTransfers == 0 )
+		{
+
+			requireMaxBusStall ( 0 );
+			fRequiredMaxBusStall = 0;
+
+		}
+#endif // EMBEDDED
+
+	}
+
+   	STATUS_LOG ( ( 5, "%s[%p]: UASTransferData tag=%u returned %x", getName(), this, uasRequestBlock->uasTag, status ) );
+
+	return status;
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	UASReceiveStatus - Queues the status read on the command's own stream.				 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageClass::UASReceiveStatus ( UASRequestBlock * uasRequestBlock )
+{
+
+	IOReturn			status 	= kIOReturnError;
+	IOUSBPipeV2 *		pipeV2 	= OSDynamicCast ( IOUSBPipeV2, fUASStatusPipe );
+	UInt32				timeout = GetTimeoutDuration ( uasRequestBlock->request );
+
+	require_nonzero ( pipeV2, Exit );
+
+	status = pipeV2->Read ( uasRequestBlock->uasTag,
+							( ( UASRequestSlot * ) uasRequestBlock )->statusDescriptor,
+							timeout,
+							timeout,
+							kUASMaxStatusIUSize,
+							&uasRequestBlock->uasStatusCompletion );
+
+	if ( status == kIOReturnSuccess )
+	{
+		uasRequestBlock->uasPendingPhases++;
+	}
+
+
+Exit:
+
+
+   	STATUS_LOG ( ( 5, "%s[%p]: UASReceiveStatus tag=%u returned %x", getName(), this, uasRequestBlock->uasTag, status ) );
+
+	return status;
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	UASPostStatusReader - Without streams, keeps one status read outstanding for as long as any
+//						  command is. With streams, reads the response to a task management
+//						  IU on its own stream.											 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageClass::UASPostStatusReader ( void )
+{
+
+	IOReturn		status 	= kIOReturnSuccess;
+	UInt32			timeout	= 0;
+	UInt32			index;
+
+	require_nonzero_action ( fUASStatusReader, Exit, status = kIOReturnNoResources );
+	require_quiet ( ( fUASStatusReader->posted == false ), Exit );
+
+	fUASStatusReader->completion.target 	= this;
+	fUASStatusReader->completion.action 	= &this->UASStatusReaderCompletionAction;
+	fUASStatusReader->completion.parameter 	= fUASStatusReader;
+
+	if ( fUASStreamsEnabled == true )
+	{
+
+		IOUSBPipeV2 *	pipeV2 = OSDynamicCast ( IOUSBPipeV2, fUASStatusPipe );
+
+		// Every command reads its own status, so only a task management response is left.
+		require_quiet ( ( fUASStatusReader->taskManagementPending == true ), Exit );
+		require_nonzero_action ( pipeV2, Exit, status = kIOReturnError );
+
+		timeout = GetTimeoutDuration ( fUASStatusReader->taskManagementRequest );
+
+		status = pipeV2->Read ( UASTaskManagementTag ( fUASQueueDepth ),
+								fUASStatusReader->descriptor,
+								timeout,
+								timeout,
+								kUASMaxStatusIUSize,
+								&fUASStatusReader->completion );
+
+	}
+
+	else
+	{
+
+		// The read is shared by every outstanding command, so it uses the longest of their
+		// timeouts. A timeout of zero means wait forever, and wins.
+		for ( index = 0; index < fRequestPoolSize; index++ )
+		{
+
+			SCSITaskIdentifier	request = fUASRequestPool[index].block.request;
+			UInt32				commandTimeout;
+
+			if ( ( ( fRequestPoolFreeMask & ( 1 << index ) ) != 0 ) || ( request == NULL ) )
+			{
+				continue;
+			}
+
+			commandTimeout = GetTimeoutDuration ( request );
+			if ( commandTimeout == 0 )
+			{
+
+				timeout = 0;
+				break;
+
+			}
+
+			timeout = max ( timeout, commandTimeout );
+
+		}
+
+		status = fUASStatusPipe->Read (	fUASStatusReader->descriptor,
+										timeout,
+										timeout,
+										kUASMaxStatusIUSize,
+										&fUASStatusReader->completion );
+
+	}
+
+	if ( status == kIOReturnSuccess )
+	{
+		fUASStatusReader->posted = true;
+	}
+
+
+Exit:
+
+
+	return status;
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	UASProcessStatusIU - Handles a Sense or Response IU for the given command.			 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::UASProcessStatusIU (
+						UASRequestBlock *		uasRequestBlock,
+						UInt8 *					statusIU,
+						UInt32					length )
+{
+
+	UASStatusIUInfo		info;
+	bool				valid;
+
+	valid = UASParseStatusIU ( statusIU, length, &info );
+
+	RecordUSBTimeStamp (	UMC_TRACE ( kUASStatusIU ),
+							( uintptr_t ) this,
+							( unsigned int ) info.iuID,
+							( unsigned int ) uasRequestBlock->uasTag,
+							( unsigned int ) ( ( ( valid == true ) && ( info.iuID == kUASSenseIUID ) ) ? info.taskStatus : 0xFF ) );
+
+	// Status for a non-stream command lands in the shared reader; keep a copy with the command.
+	length = min ( length, ( UInt32 ) kUASMaxStatusIUSize );
+	if ( statusIU != uasRequestBlock->uasStatusIU )
+	{
+		bcopy ( statusIU, uasRequestBlock->uasStatusIU, length );
+	}
+
+	uasRequestBlock->uasStatusLength 	= length;
+	uasRequestBlock->uasFlags 			|= kUASStatusReceived;
+	uasRequestBlock->uasPhaseStartTime 	= RecordLatency ( kUSBLatencyPhaseUASStatus, uasRequestBlock->uasPhaseStartTime );
+
+	// A Response IU for a command means the device rejected it (invalid IU, overlapped tag, bad LUN).
+	if ( ( valid == false ) || ( info.iuID != kUASSenseIUID ) )
+	{
+		uasRequestBlock->uasTransportStatus = kIOReturnError;
+	}
+
+	UASCheckForCompletion ( uasRequestBlock );
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	UASCheckForCompletion - A command completes once USB has returned every request queued for it
+//							and its status has arrived.									 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::UASCheckForCompletion ( UASRequestBlock * uasRequestBlock )
+{
+
+	require_quiet ( ( uasRequestBlock->uasPendingPhases == 0 ), Exit );
+
+	// The task was already failed back to the SCSI layer; the block can be reused now, unless
+	// an ABORT TASK response naming its tag is still to come.
+	if ( ( uasRequestBlock->uasFlags & kUASAborted ) != 0 )
+	{
+
+		require_quiet ( ( ( uasRequestBlock->uasFlags & kUASAbortRequested ) == 0 ), Exit );
+
+		ReleaseUASRequestBlock ( uasRequestBlock );
+
+		// A queued task may have been waiting on the tag.
+		StartNextQueuedSCSITask ( );
+		goto Exit;
+
+	}
+
+	require_quiet ( ( ( uasRequestBlock->uasFlags & kUASStatusReceived ) != 0 ), Exit );
+
+	UASCompleteCommand ( uasRequestBlock );
+
+
+Exit:
+
+
+	return;
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	UASCompleteCommand																	 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::UASCompleteCommand ( UASRequestBlock * uasRequestBlock )
+{
+
+	SCSITaskIdentifier		request 		= uasRequestBlock->request;
+	SCSIServiceResponse		serviceResponse = kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+	SCSITaskStatus			taskStatus		= kSCSITaskStatus_DeliveryFailure;
+	UInt8 *					statusIU		= uasRequestBlock->uasStatusIU;
+	UASStatusIUInfo			info;
+	UInt64					now;
+
+	check ( fWorkLoop->inGate ( ) == true );
+
+	if ( ( uasRequestBlock->uasTransportStatus == kIOReturnSuccess ) &&
+		 ( UASParseStatusIU ( statusIU, uasRequestBlock->uasStatusLength, &info ) == true ) &&
+		 ( info.iuID == kUASSenseIUID ) )
+	{
+
+		serviceResponse = kSCSIServiceResponse_TASK_COMPLETE;
+		taskStatus		= ( SCSITaskStatus ) info.taskStatus;
+
+		// UAS always returns sense data with the status, so there is no REQUEST SENSE round trip.
+		if ( info.senseLength != 0 )
+		{
+
+			SetAutoSenseData (	request,
+								( SCSI_Sense_Data * ) &statusIU[kUASSenseIUHeaderSize],
+								info.senseLength );
+
+		}
+
+	}
+
+	SetRealizedDataTransferCount ( request, uasRequestBlock->uasBytesTransferred );
+
+	RecordUSBTimeStamp (	UMC_TRACE ( kUASCompletion ),
+							( uintptr_t ) this, ( uintptr_t ) request,
+							( unsigned int ) uasRequestBlock->uasTag, ( unsigned int ) uasRequestBlock->uasTransportStatus );
+
+	clock_get_uptime ( &now );
+
+	RecordLatencyUntil ( kUSBLatencyPhaseUASTotal, uasRequestBlock->uasStartTime, now );
+
+	AutoTuneRecordSample ( request, uasRequestBlock->uasStartTime, now, false );
+
+	RecordCommandEndTrace ( request, uasRequestBlock->uasStartTime, now, uasRequestBlock->uasTag, serviceResponse, taskStatus );
+
+	fStatistics[kIOUSBMassStorageStatisticOperations]++;
+	fStatistics[kIOUSBMassStorageStatisticBytesTransferred] += uasRequestBlock->uasBytesTransferred;
+	SchedulePublishStatistics ( );
+
+	// The command beat its ABORT TASK to the device. Its tag stays taken until the response.
+	if ( ( uasRequestBlock->uasFlags & kUASAbortRequested ) != 0 )
+	{
+
+		uasRequestBlock->request 	= NULL;
+		uasRequestBlock->uasFlags 	|= kUASAborted;
+
+	}
+
+	else
+	{
+		ReleaseUASRequestBlock ( uasRequestBlock );
+	}
+
+	ReleaseTransport ( );
+
+	//	Clear the count of consecutive I/Os which required a USB Device Reset.
+	fConsecutiveResetCount = 0;
+
+	STATUS_LOG ( ( 6, "%s[%p]: UASCompleteCommand request=%p serviceResponse=%d taskStatus=0x%02x", getName(), this, request, serviceResponse, taskStatus ) );
+
+	RecordUSBTimeStamp (	UMC_TRACE ( kCompleteSCSICommand ),
+							( uintptr_t ) this, ( uintptr_t ) request,
+							serviceResponse, taskStatus );
+
+	// The freed tag can go straight to the next queued task.
+	StartNextQueuedSCSITask ( );
+
+	CommandCompleted ( request, serviceResponse, taskStatus );
+
+	//	didTerminate() waits for every outstanding command, not just this one.
+	if ( fUASOutstandingCount == 0 )
+	{
+		CheckDeferredTermination ( );
+	}
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	UASAbortAllCommands - Fails every outstanding command after a device reset. Blocks which USB
+//						  still owns are released once their requests return.			 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::UASAbortAllCommands ( SCSITaskStatus taskStatus )
+{
+
+	UInt32		index;
+	UInt32		count = 0;
+	UInt64		now;
+
+	check ( fWorkLoop->inGate ( ) == true );
+
+	clock_get_uptime ( &now );
+
+	// A task management function in progress is discarded along with the commands.
+	if ( fUASStatusReader != NULL )
+	{
+
+		fUASStatusReader->taskManagementPending = false;
+		fUASStatusReader->taskManagementRequest = NULL;
+
+	}
+
+	for ( index = 0; index < fRequestPoolSize; index++ )
+	{
+
+		UASRequestBlock *	uasRequestBlock = &fUASRequestPool[index].block;
+		SCSITaskIdentifier	request			= uasRequestBlock->request;
+
+		if ( ( fRequestPoolFreeMask & ( 1 << index ) ) != 0 )
+		{
+			continue;
+		}
+
+		uasRequestBlock->uasFlags &= ~kUASAbortRequested;
+
+		// Already failed back, and possibly only kept for its ABORT TASK response.
+		if ( request == NULL )
+		{
+
+			if ( uasRequestBlock->uasPendingPhases == 0 )
+			{
+				ReleaseUASRequestBlock ( uasRequestBlock );
+			}
+
+			continue;
+
+		}
+
+		AutoTuneRecordSample ( request, uasRequestBlock->uasStartTime, now, true );
+
+		RecordCommandEndTrace ( request, uasRequestBlock->uasStartTime, now, uasRequestBlock->uasTag,
+								kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE, taskStatus );
+
+		uasRequestBlock->request 	= NULL;
+		uasRequestBlock->uasFlags 	|= kUASAborted;
+
+		if ( uasRequestBlock->uasPendingPhases == 0 )
+		{
+			ReleaseUASRequestBlock ( uasRequestBlock );
+		}
+
+		ReleaseTransport ( );
+		count++;
+
+		RecordUSBTimeStamp (	UMC_TRACE ( kCompleteSCSICommand ),
+								( uintptr_t ) this, ( uintptr_t ) request,
+								kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE, taskStatus );
+
+		CommandCompleted ( request, kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE, taskStatus );
+
+	}
+
+	RecordUSBTimeStamp (	UMC_TRACE ( kUASAbortAllCommands ),
+							( uintptr_t ) this, count, taskStatus, fUASOutstandingCount );
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	UASAbortTask - Sends an ABORT TASK for one outstanding command. The command is completed with
+//				   TASK_ABORTED once the device confirms it.							 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+IOReturn
+IOUSBMassStorageClass::UASAbortTask ( SCSITaskIdentifier abortTask )
+{
+
+	IOReturn				status 			= kIOReturnNotFound;
+	UASRequestBlock *		uasRequestBlock	= NULL;
+	UInt32					timeout;
+	UInt32					index;
+
+	check ( fWorkLoop->inGate ( ) == true );
+
+	require_nonzero_action ( fUASStatusReader, Exit, status = kIOReturnNoResources );
+	require_nonzero_action ( fUASCommandPipe, Exit, status = kIOReturnNotReady );
+
+	// A reset in progress fails the task anyway.
+	require_action_quiet ( ( fResetInProgress == false ), Exit, status = kIOReturnNotReady );
+
+	// There is a single tag for task management, so one function at a time.
+	require_action_quiet ( ( fUASStatusReader->taskManagementPending == false ), Exit, status = kIOReturnBusy );
+
+	for ( index = 0; index < fRequestPoolSize; index++ )
+	{
+
+		if ( ( ( fRequestPoolFreeMask & ( 1 << index ) ) == 0 ) &&
+			 ( fUASRequestPool[index].block.request == abortTask ) )
+		{
+
+			uasRequestBlock = &fUASRequestPool[index].block;
+			break;
+
+		}
+
+	}
+
+	require_quiet ( ( uasRequestBlock != NULL ), Exit );
+
+	UASBuildTaskManagementIU (	( UInt8 * ) &fUASStatusReader->taskManagementIU,
+								UASTaskManagementTag ( fUASQueueDepth ),
+								kUASTaskManagementAbortTask,
+								uasRequestBlock->uasTag,
+								GetLogicalUnitNumber ( abortTask ) );
+
+	fUASStatusReader->taskManagementCompletion.target 		= this;
+	fUASStatusReader->taskManagementCompletion.action 		= &this->UASTaskManagementCompletionAction;
+	fUASStatusReader->taskManagementCompletion.parameter 	= fUASStatusReader;
+
+	timeout = GetTimeoutDuration ( abortTask );
+
+	status = fUASCommandPipe->Write (	fUASStatusReader->taskManagementDescriptor,
+										timeout,
+										timeout,
+										&fUASStatusReader->taskManagementCompletion );
+	require_success ( status, Exit );
+
+	RecordUSBTimeStamp (	UMC_TRACE ( kUASTaskManagementIU ),
+							( uintptr_t ) this, ( uintptr_t ) abortTask,
+							kUASTaskManagementAbortTask, ( unsigned int ) uasRequestBlock->uasTag );
+
+	uasRequestBlock->uasFlags 				|= kUASAbortRequested;
+	fUASStatusReader->taskManagementPending = true;
+	fUASStatusReader->taskManagementTaskTag = uasRequestBlock->uasTag;
+	fUASStatusReader->taskManagementRequest = abortTask;
+
+	// Without streams the shared reader is already posted for the aborted command itself.
+	if ( UASPostStatusReader ( ) != kIOReturnSuccess )
+	{
+		UASStartRecovery ( uasRequestBlock, kIOReturnError );
+	}
+
+	status = kIOReturnSuccess;
+
+
+Exit:
+
+
+	return status;
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	UASProcessTaskManagementResponse - Completes an ABORT TASK. If the device could not abort the
+//									   task, resetting it is all that is left.		 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::UASProcessTaskManagementResponse ( const UASStatusIUInfo * info, bool valid )
+{
+
+	UASRequestBlock *		uasRequestBlock	= UASGetRequestBlockForTag ( fUASStatusReader->taskManagementTaskTag );
+	SCSITaskIdentifier		request 		= fUASStatusReader->taskManagementRequest;
+	UInt64					now;
+
+	check ( fWorkLoop->inGate ( ) == true );
+
+	fUASStatusReader->taskManagementPending = false;
+	fUASStatusReader->taskManagementRequest = NULL;
+
+	RecordUSBTimeStamp (	UMC_TRACE ( kUASTaskManagementResponse ),
+							( uintptr_t ) this, ( unsigned int ) info->iuID,
+							( unsigned int ) fUASStatusReader->taskManagementTaskTag,
+							( unsigned int ) info->responseCode );
+
+	// The block can't have been reused while the abort was outstanding.
+	require ( ( uasRequestBlock != NULL ) && ( ( uasRequestBlock->uasFlags & kUASAbortRequested ) != 0 ), Exit );
+
+	uasRequestBlock->uasFlags &= ~kUASAbortRequested;
+
+	if ( UASTaskManagementSucceeded ( info, valid ) == true )
+	{
+
+		// Unless it completed first, fail the task back now. USB returns any of its transfers
+		// still queued when they time out, and the tag is free again after that.
+		if ( ( uasRequestBlock->request == request ) && ( ( uasRequestBlock->uasFlags & kUASAborted ) == 0 ) )
+		{
+
+			clock_get_uptime ( &now );
+
+			AutoTuneRecordSample ( request, uasRequestBlock->uasStartTime, now, true );
+
+			RecordCommandEndTrace ( request, uasRequestBlock->uasStartTime, now, uasRequestBlock->uasTag,
+									kSCSIServiceResponse_TASK_COMPLETE, kSCSITaskStatus_TASK_ABORTED );
+
+			uasRequestBlock->request 	= NULL;
+			uasRequestBlock->uasFlags 	|= kUASAborted;
+
+			ReleaseTransport ( );
+
+			STATUS_LOG ( ( 4, "%s[%p]: UASProcessTaskManagementResponse aborted request=%p", getName(), this, request ) );
+
+			RecordUSBTimeStamp (	UMC_TRACE ( kCompleteSCSICommand ),
+									( uintptr_t ) this, ( uintptr_t ) request,
+									kSCSIServiceResponse_TASK_COMPLETE, kSCSITaskStatus_TASK_ABORTED );
+
+			CommandCompleted ( request, kSCSIServiceResponse_TASK_COMPLETE, kSCSITaskStatus_TASK_ABORTED );
+
+		}
+
+	}
+
+	else
+	{
+
+		STATUS_LOG ( ( 2, "%s[%p]: UASProcessTaskManagementResponse iuID=0x%x response=0x%x", getName(), this, info->iuID, info->responseCode ) );
+		UASStartRecovery ( uasRequestBlock, kIOReturnError );
+
+	}
+
+	UASCheckForCompletion ( uasRequestBlock );
+
+	if ( fUASOutstandingCount == 0 )
+	{
+		CheckDeferredTermination ( );
+	}
+
+
+Exit:
+
+
+	return;
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	UASGetFirstOutstandingTask															 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+SCSITaskIdentifier
+IOUSBMassStorageClass::UASGetFirstOutstandingTask ( void )
+{
+
+	UInt32		index;
+
+	for ( index = 0; index < fRequestPoolSize; index++ )
+	{
+
+		if ( ( ( fRequestPoolFreeMask & ( 1 << index ) ) == 0 ) && ( fUASRequestPool[index].block.request != NULL ) )
+		{
+			return fUASRequestPool[index].block.request;
+		}
+
+	}
+
+	return NULL;
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	UASGetRequestBlockForTag															 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+UASRequestBlock *
+IOUSBMassStorageClass::UASGetRequestBlockForTag ( UInt16 tag )
+{
+
+	UASRequestBlock *	uasRequestBlock = NULL;
+	int					slotIndex		= UASSlotForTag ( tag, fRequestPoolSize );
+
+	require_quiet ( ( slotIndex >= 0 ), Exit );
+	require_quiet ( ( ( fRequestPoolFreeMask & ( 1 << slotIndex ) ) == 0 ), Exit );
+
+	uasRequestBlock = &fUASRequestPool[slotIndex].block;
+
+
+Exit:
+
+
+	return uasRequestBlock;
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	UASStartRecovery - UAS has no way back from a failed transfer or a failed ABORT TASK short of
+//					   a reset. Reset the device, which fails every outstanding command through
+//					   AbortCurrentSCSITask().											 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::UASStartRecovery ( UASRequestBlock * uasRequestBlock, IOReturn status )
+{
+
+	RecordUSBTimeStamp (	UMC_TRACE ( kUASTransportError ),
+							( uintptr_t ) this,
+							( uasRequestBlock != NULL ) ? uasRequestBlock->uasTag : 0,
+							status, NULL );
+
+	if ( uasRequestBlock != NULL )
+	{
+		uasRequestBlock->uasTransportStatus = status;
+	}
+
+	require_quiet ( ( fTerminating == false ), Exit );
+	require_quiet ( ( fResetInProgress == false ), Exit );
+
+	STATUS_LOG ( ( 2, "%s[%p]: UASStartRecovery status=0x%x, resetting device", getName(), this, status ) );
+	ResetDeviceNow ( false );
+
+
+Exit:
+
+
+	return;
+
+}
+
+
+#pragma mark -
+#pragma mark USB Attached SCSI Completion Routines
+
+
+//--------------------------------------------------------------------------------------------------
+//	UASCommandCompletionAction															 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::UASCommandCompletionAction (
+					                void *			target,
+					                void *			parameter,
+					                IOReturn		status,
+					                UInt32			bufferSizeRemaining )
+{
+
+	IOUSBMassStorageClass *		theMSC 			= ( IOUSBMassStorageClass * ) target;
+	UASRequestBlock *			uasRequestBlock = ( UASRequestBlock * ) parameter;
+
+	UNUSED ( bufferSizeRemaining );
+
+	uasRequestBlock->uasPendingPhases--;
+
+	if ( ( uasRequestBlock->uasFlags & kUASAborted ) == 0 )
+	{
+
+		if ( status == kIOReturnSuccess )
+		{
+			uasRequestBlock->uasPhaseStartTime = theMSC->RecordLatency ( kUSBLatencyPhaseUASCommand, uasRequestBlock->uasPhaseStartTime );
+		}
+
+		else
+		{
+			theMSC->UASStartRecovery ( uasRequestBlock, status );
+		}
+
+	}
+
+	theMSC->UASCheckForCompletion ( uasRequestBlock );
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	UASDataCompletionAction																 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::UASDataCompletionAction (
+					                void *			target,
+					                void *			parameter,
+					                IOReturn		status,
+					                UInt32			bufferSizeRemaining )
+{
+
+	IOUSBMassStorageClass *		theMSC 			= ( IOUSBMassStorageClass * ) target;
+	UASRequestBlock *			uasRequestBlock = ( UASRequestBlock * ) parameter;
+
+	uasRequestBlock->uasPendingPhases--;
+	theMSC->fUASActiveDataTransfers--;
+
+#ifndef EMBEDDED
+	if ( theMSC->fUASActiveDataTransfers == 0 )
+	{
+
+		theMSC->requireMaxBusStall ( 0 );
+		theMSC->fRequiredMaxBusStall = 0;
+
+	}
+#endif // EMBEDDED
+
+	if ( ( uasRequestBlock->uasFlags & kUASAborted ) == 0 )
+	{
+
+		if ( ( status == kIOReturnSuccess ) || ( status == kIOReturnUnderrun ) )
+		{
+
+			uasRequestBlock->uasBytesTransferred =
+				theMSC->GetRequestedDataTransferCount ( uasRequestBlock->request ) - bufferSizeRemaining;
+			uasRequestBlock->uasPhaseStartTime = theMSC->RecordLatency ( kUSBLatencyPhaseUASData, uasRequestBlock->uasPhaseStartTime );
+
+		}
+
+		else
+		{
+			theMSC->UASStartRecovery ( uasRequestBlock, status );
+		}
+
+	}
+
+	theMSC->UASCheckForCompletion ( uasRequestBlock );
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	UASStatusCompletionAction - Status read on a command's own stream.					 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::UASStatusCompletionAction (
+					                void *			target,
+					                void *			parameter,
+					                IOReturn		status,
+					                UInt32			bufferSizeRemaining )
+{
+
+	IOUSBMassStorageClass *		theMSC 			= ( IOUSBMassStorageClass * ) target;
+	UASRequestBlock *			uasRequestBlock = ( UASRequestBlock * ) parameter;
+	UInt32						length			= kUASMaxStatusIUSize - bufferSizeRemaining;
+	UASStatusIUInfo				info;
+	bool						valid;
+
+	uasRequestBlock->uasPendingPhases--;
+
+	if ( ( uasRequestBlock->uasFlags & kUASAborted ) != 0 )
+	{
+
+		theMSC->UASCheckForCompletion ( uasRequestBlock );
+		return;
+
+	}
+
+	if ( status != kIOReturnSuccess )
+	{
+
+		theMSC->UASStartRecovery ( uasRequestBlock, status );
+		theMSC->UASCheckForCompletion ( uasRequestBlock );
+		return;
+
+	}
+
+	valid = UASParseStatusIU ( uasRequestBlock->uasStatusIU, length, &info );
+
+	if ( UASRouteStatusIU ( &info, valid, uasRequestBlock->uasTag, false, theMSC->fUASQueueDepth ) != kUASRouteStatus )
+	{
+
+		// The status of another command has no business on this stream.
+		STATUS_LOG ( ( 2, "%s[%p]: UASStatusCompletionAction tag=%u on stream %u", theMSC->getName(), theMSC, info.tag, uasRequestBlock->uasTag ) );
+		theMSC->UASStartRecovery ( uasRequestBlock, kIOReturnError );
+		theMSC->UASCheckForCompletion ( uasRequestBlock );
+		return;
+
+	}
+
+	theMSC->UASProcessStatusIU ( uasRequestBlock, uasRequestBlock->uasStatusIU, length );
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	UASTaskManagementCompletionAction - The task management IU went out. Its response comes
+//										through the status reader.					 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::UASTaskManagementCompletionAction (
+					                void *			target,
+					                void *			parameter,
+					                IOReturn		status,
+					                UInt32			bufferSizeRemaining )
+{
+
+	IOUSBMassStorageClass *		theMSC 			= ( IOUSBMassStorageClass * ) target;
+
+	UNUSED ( parameter );
+	UNUSED ( bufferSizeRemaining );
+
+	// An aborted write means a reset or termination already took the function with it.
+	if ( ( status != kIOReturnSuccess ) && ( status != kIOReturnAborted ) )
+	{
+		theMSC->UASStartRecovery ( NULL, status );
+	}
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	UASStatusReaderCompletionAction - Shared status read, used when streams are not, and for
+//									  task management responses.					 [PROTECTED]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::UASStatusReaderCompletionAction (
+					                void *			target,
+					                void *			parameter,
+					                IOReturn		status,
+					                UInt32			bufferSizeRemaining )
+{
+
+	IOUSBMassStorageClass *		theMSC 			= ( IOUSBMassStorageClass * ) target;
+	UASStatusReader *			reader 			= ( UASStatusReader * ) parameter;
+	UASRequestBlock *			uasRequestBlock	= NULL;
+	UInt32						length			= kUASMaxStatusIUSize - bufferSizeRemaining;
+	UASStatusIUInfo				info;
+	bool						valid;
+	UInt8						route;
+
+	reader->posted = false;
+
+	// An aborted read means a reset or termination is already failing the outstanding commands.
+	require_quiet ( ( status != kIOReturnAborted ), Exit );
+	require_quiet ( ( theMSC->fTerminating == false ), Exit );
+
+	if ( ( status != kIOReturnSuccess ) || ( length < sizeof ( UASStatusIUHeader ) ) )
+	{
+
+		theMSC->UASStartRecovery ( NULL, status );
+		goto Exit;
+
+	}
+
+	valid 	= UASParseStatusIU ( reader->buffer, length, &info );
+	route	= UASRouteStatusIU ( &info, valid, 0, reader->taskManagementPending, theMSC->fUASQueueDepth );
+
+	if ( route == kUASRouteTaskManagement )
+	{
+		theMSC->UASProcessTaskManagementResponse ( &info, valid );
+	}
+
+	else
+	{
+
+		if ( route != kUASRouteIgnore )
+		{
+			uasRequestBlock = theMSC->UASGetRequestBlockForTag ( info.tag );
+		}
+
+		if ( ( uasRequestBlock == NULL ) || ( ( uasRequestBlock->uasFlags & kUASAborted ) != 0 ) )
+		{
+
+			// Nothing is waiting on this tag any more.
+			RecordUSBTimeStamp (	UMC_TRACE ( kUASStatusIU ),
+									( uintptr_t ) theMSC, ( unsigned int ) info.iuID,
+									( unsigned int ) info.tag, 0xFF );
+
+		}
+
+		else if ( route == kUASRouteDataPhase )
+		{
+
+			// The device is ready to move the data for this tag. Only one data phase per
+			// direction is ever in progress without streams, and a second Ready IU or one
+			// for the other direction would start a transfer the command never asked for.
+			if ( ( UASReadyIUMatchesCommand (	info.iuID,
+												( ( uasRequestBlock->uasFlags & kUASDataPhaseNeeded ) != 0 ),
+												( theMSC->GetDataTransferDirection ( uasRequestBlock->request ) == kSCSIDataTransfer_FromTargetToInitiator ) ) == false ) ||
+				 ( theMSC->UASTransferData ( uasRequestBlock ) != kIOReturnSuccess ) )
+			{
+				theMSC->UASStartRecovery ( uasRequestBlock, kIOReturnError );
+			}
+
+		}
+
+		else
+		{
+			theMSC->UASProcessStatusIU ( uasRequestBlock, reader->buffer, length );
+		}
+
+	}
+
+	// Keep listening while any command is still waiting on its status, or an ABORT TASK on
+	// its response.
+	if ( ( theMSC->fResetInProgress == false ) &&
+		 ( ( ( theMSC->fUASStreamsEnabled == false ) && ( theMSC->UASGetFirstOutstandingTask ( ) != NULL ) ) ||
+		   ( reader->taskManagementPending == true ) ) )
+	{
+
+		if ( theMSC->UASPostStatusReader ( ) != kIOReturnSuccess )
+		{
+			theMSC->UASStartRecovery ( NULL, kIOReturnError );
+		}
+
+	}
+
+
+Exit:
+
+
+	return;
+
+}
+
+
+#pragma mark -
+#pragma mark USB Attached SCSI Request Blocks
+
+
+//--------------------------------------------------------------------------------------------------
+//	AllocateUASRequestBlock																   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+UASRequestBlock *
+IOUSBMassStorageClass::AllocateUASRequestBlock ( void )
+{
+
+	UASRequestSlot *	slot = NULL;
+	int					slotIndex;
+
+	require_nonzero ( fUASRequestPool, Exit );
+
+	slotIndex = AllocateRequestSlot ( );
+	require ( ( slotIndex >= 0 ), Exit );
+
+	slot = &fUASRequestPool[slotIndex];
+
+	bzero ( &slot->block, sizeof ( UASRequestBlock ) );
+
+	// Tags, and stream IDs, start at 1.
+	slot->block.uasTag = UASTagForSlot ( slotIndex );
+
+	clock_get_uptime ( &slot->block.uasStartTime );
+	slot->block.uasPhaseStartTime = slot->block.uasStartTime;
+
+
+Exit:
+
+
+	return ( slot != NULL ) ? &slot->block : NULL;
+
+}
+
+
+//--------------------------------------------------------------------------------------------------
+//	ReleaseUASRequestBlock																   [PRIVATE]
+//--------------------------------------------------------------------------------------------------
+
+void
+IOUSBMassStorageClass::ReleaseUASRequestBlock ( UASRequestBlock * uasRequestBlock )
+{
+
+	// Clear the request to avoid possible double callbacks.
+	uasRequestBlock->request = NULL;
+
+	ReleaseRequestSlot ( ( int ) ( ( UASRequestSlot * ) uasRequestBlock - fUASRequestPool ) );
+
+}